@@ -0,0 +1,239 @@
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <queue>
+#include <random>
+#include <thread>
+#include <vector>
+#include <gflags/gflags.h>
+
+#include "db/blocks/fixed_size_block.h"
+#include "util/loser_tree.h"
+#include "util/stopwatch.hpp"
+
+DEFINE_uint64(runs, 9, "Number of sorted inputs of a compaction, level 0 trees and the level 1 range");
+DEFINE_uint64(keys_per_run, 1000000, "Number of keys of each input");
+DEFINE_uint64(key_range, 0, "Keys are drawn from [0, key_range), 0 means runs * keys_per_run, smaller ranges give more duplicates");
+DEFINE_uint64(threads, 1, "Number of threads merging their own inputs, as sub compactions do");
+
+/**
+ * @brief compare the merge kernel of compaction with the binary heap it replaced.
+ * Inputs are 512B datablocks of big-endian keys as stored in psts, outputs are only counted,
+ * so the numbers are merged keys per second of one core without pm reads and writes.
+ *
+ */
+using Run = std::vector<PDataBlock>;
+
+std::vector<std::vector<Run>> thread_inputs;
+
+Run make_run(std::mt19937_64 &rng, uint64_t key_range)
+{
+    std::vector<uint64_t> keys(FLAGS_keys_per_run);
+    for (auto &k : keys)
+        k = rng() % key_range;
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    Run run((keys.size() + PDataBlock::MAX_ENTRIES - 1) / PDataBlock::MAX_ENTRIES);
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        auto &entry = run[i / PDataBlock::MAX_ENTRIES].entries[i % PDataBlock::MAX_ENTRIES];
+        entry.key = __builtin_bswap64(keys[i]);
+        entry.value = i;
+    }
+    // the last block is padded with its last key, like the pst builder does
+    size_t used = keys.size() % PDataBlock::MAX_ENTRIES;
+    for (size_t i = used ? used : PDataBlock::MAX_ENTRIES; i < PDataBlock::MAX_ENTRIES; i++)
+        run.back().entries[i] = run.back().entries[used - 1];
+    return run;
+}
+
+size_t block_entries(const Run &run, size_t b)
+{
+    if (b + 1 < run.size())
+        return PDataBlock::MAX_ENTRIES;
+    size_t n = 1;
+    while (n < PDataBlock::MAX_ENTRIES && run[b].entries[n].key != run[b].entries[n - 1].key)
+        n++;
+    return n;
+}
+
+struct Cursor
+{
+    const Run *run;
+    size_t block = 0, entry = 0, entries = 0;
+    bool Load(size_t b)
+    {
+        if (b >= run->size())
+            return false;
+        block = b;
+        entry = 0;
+        entries = block_entries(*run, b);
+        return true;
+    }
+    bool Next() { return ++entry < entries || Load(block + 1); }
+    const PDataBlock::Entry &Get() const { return (*run)[block].entries[entry]; }
+};
+
+/**
+ * @brief the former kernel: a heap of big-endian keys swapped on every comparison, one pop and push per key
+ */
+uint64_t merge_heap(const std::vector<Run> &inputs, size_t *merged)
+{
+    struct KeyWithRowId
+    {
+        uint64_t key;
+        int row_id;
+    };
+    auto cmp = [](const KeyWithRowId l, const KeyWithRowId r)
+    {
+        if (__builtin_bswap64(l.key) == __builtin_bswap64(r.key))
+            return l.row_id < r.row_id;
+        return __builtin_bswap64(l.key) > __builtin_bswap64(r.key);
+    };
+    std::priority_queue<KeyWithRowId, std::vector<KeyWithRowId>, decltype(cmp)> heap(cmp);
+    std::vector<Cursor> cursors(inputs.size());
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        cursors[i].run = &inputs[i];
+        if (cursors[i].Load(0))
+            heap.push({cursors[i].Get().key, (int)i});
+    }
+    uint64_t checksum = 0;
+    while (!heap.empty())
+    {
+        auto top = heap.top();
+        heap.pop();
+        while (!heap.empty() && heap.top().key == top.key)
+        {
+            if (cursors[top.row_id].Next())
+                heap.push({cursors[top.row_id].Get().key, top.row_id});
+            top = heap.top();
+            heap.pop();
+        }
+        auto &cursor = cursors[top.row_id];
+        checksum += cursor.Get().key ^ cursor.Get().value;
+        (*merged)++;
+        if (cursor.Next())
+            heap.push({cursor.Get().key, top.row_id});
+    }
+    return checksum;
+}
+
+/**
+ * @brief the loser tree kernel of CompactionJob::MergeInputs: native keys decoded once per block,
+ * the winner is drained up to the key of the runner-up
+ */
+uint64_t merge_loser_tree(const std::vector<Run> &inputs, size_t *merged)
+{
+    struct NativeCursor : Cursor
+    {
+        uint64_t native[PDataBlock::MAX_ENTRIES];
+        bool Load(size_t b)
+        {
+            if (!Cursor::Load(b))
+                return false;
+            for (size_t i = 0; i < entries; i++)
+                native[i] = __builtin_bswap64((*run)[b].entries[i].key);
+            return true;
+        }
+        bool Next() { return ++entry < entries || Load(block + 1); }
+        uint64_t Key() const { return native[entry]; }
+    };
+    std::vector<NativeCursor> cursors(inputs.size());
+    LoserTree tree(inputs.size());
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        cursors[i].run = &inputs[i];
+        if (cursors[i].Load(0))
+            tree.Set(i, cursors[i].Key());
+    }
+    tree.Build();
+    uint64_t checksum = 0;
+    bool has_last = false;
+    uint64_t last_key = 0;
+    while (!tree.Empty())
+    {
+        auto &cursor = cursors[tree.Top()];
+        if (has_last && tree.TopKey() == last_key)
+        {
+            if (cursor.Next())
+                tree.Replace(cursor.Key());
+            else
+                tree.Pop();
+            continue;
+        }
+        int runner_up = tree.RunnerUp();
+        while (true)
+        {
+            checksum += cursor.Get().key ^ cursor.Get().value;
+            (*merged)++;
+            has_last = true;
+            last_key = cursor.Key();
+            if (!cursor.Next())
+            {
+                tree.Pop();
+                break;
+            }
+            if (runner_up >= 0 && cursor.Key() >= tree.Key(runner_up))
+            {
+                tree.Replace(cursor.Key());
+                break;
+            }
+        }
+    }
+    return checksum;
+}
+
+template <typename MergeFunc>
+void run(const char *name, MergeFunc merge)
+{
+    std::vector<size_t> merged(FLAGS_threads, 0);
+    std::vector<uint64_t> checksums(FLAGS_threads, 0);
+    std::vector<float> us(FLAGS_threads, 0);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < FLAGS_threads; t++)
+    {
+        threads.emplace_back([&, t]()
+                             {
+            stopwatch_t sw;
+            sw.start();
+            checksums[t] = merge(thread_inputs[t], &merged[t]);
+            us[t] = sw.elapsed<std::chrono::microseconds>(); });
+    }
+    for (auto &th : threads)
+        th.join();
+    size_t total_merged = 0;
+    uint64_t checksum = 0;
+    double total_us = 0;
+    for (size_t t = 0; t < FLAGS_threads; t++)
+    {
+        total_merged += merged[t];
+        checksum += checksums[t];
+        total_us += us[t];
+    }
+    printf("%-11s %8.2f Mkeys/s per core, merged: %lu, checksum: %lu\n", name, total_merged / total_us, total_merged, checksum);
+}
+
+int main(int argc, char **argv)
+{
+    google::ParseCommandLineFlags(&argc, &argv, true);
+    if (FLAGS_runs == 0 || FLAGS_keys_per_run == 0 || FLAGS_threads == 0)
+    {
+        fprintf(stderr, "runs, keys_per_run and threads must be positive\n");
+        return 1;
+    }
+    uint64_t key_range = FLAGS_key_range ? FLAGS_key_range : FLAGS_runs * FLAGS_keys_per_run;
+    std::mt19937_64 rng(42);
+    thread_inputs.resize(FLAGS_threads);
+    for (auto &inputs : thread_inputs)
+    {
+        for (size_t i = 0; i < FLAGS_runs; i++)
+            inputs.push_back(make_run(rng, key_range));
+    }
+
+    printf("runs: %lu, keys per run: %lu, key range: %lu, threads: %lu\n", FLAGS_runs, FLAGS_keys_per_run, key_range, FLAGS_threads);
+    // both kernels keep the version of the smallest row, so merged counts and checksums must agree
+    run("heap", merge_heap);
+    run("loser_tree", merge_loser_tree);
+    return 0;
+}
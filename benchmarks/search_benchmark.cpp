@@ -0,0 +1,116 @@
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+#include <algorithm>
+#include <gflags/gflags.h>
+
+#include "db/blocks/fixed_size_block.h"
+#include "util/binary_search.h"
+#include "util/simd_search.h"
+#include "util/stopwatch.hpp"
+
+DEFINE_uint64(blocks, 16384, "Number of 512B data blocks to search, larger than the cache to include misses");
+DEFINE_uint64(num_ops, 20000000, "Number of searches for each kernel");
+DEFINE_double(hit_ratio, 0.5, "Ratio of searched keys that exist in the block");
+
+/**
+ * @brief compare the block search kernels of util/simd_search.h with the binary search they replaced
+ *
+ */
+struct Query
+{
+    uint32_t block;
+    uint64_t key; // big-endian, as stored
+};
+
+std::vector<PDataBlock> blocks;
+std::vector<Query> queries;
+
+template <typename SearchFunc>
+void run(const char *name, SearchFunc search)
+{
+    stopwatch_t sw;
+    uint64_t found = 0, checksum = 0;
+    sw.start();
+    for (auto &q : queries)
+    {
+        int index = search((char *)blocks[q.block].entries, q.key);
+        found += index >= 0;
+        checksum += index;
+    }
+    auto us = sw.elapsed<std::chrono::microseconds>();
+    printf("%-10s %8.2f ns/op, found: %lu, checksum: %lu\n", name, us * 1000.0 / queries.size(), found, checksum);
+}
+
+int main(int argc, char **argv)
+{
+    google::ParseCommandLineFlags(&argc, &argv, true);
+    std::mt19937_64 rng(42);
+    blocks.resize(FLAGS_blocks);
+    std::vector<std::vector<uint64_t>> sorted_keys(FLAGS_blocks);
+    for (size_t b = 0; b < FLAGS_blocks; b++)
+    {
+        auto &keys = sorted_keys[b];
+        // even keys only, so that odd keys are guaranteed misses
+        for (int i = 0; i < PDataBlock::MAX_ENTRIES; i++)
+            keys.push_back(rng() & ~1ULL);
+        std::sort(keys.begin(), keys.end());
+        for (int i = 0; i < PDataBlock::MAX_ENTRIES; i++)
+        {
+            blocks[b].entries[i].key = __builtin_bswap64(keys[i]);
+            blocks[b].entries[i].value = i;
+        }
+    }
+    queries.resize(FLAGS_num_ops);
+    std::uniform_real_distribution<double> coin(0, 1);
+    for (auto &q : queries)
+    {
+        q.block = rng() % FLAGS_blocks;
+        uint64_t k = coin(rng) < FLAGS_hit_ratio ? sorted_keys[q.block][rng() % PDataBlock::MAX_ENTRIES] : rng() | 1;
+        q.key = __builtin_bswap64(k);
+    }
+
+    // all kernels must agree with the binary search
+    auto binary = [](char *entries, uint64_t key)
+    { return binarysearch(entries, PDataBlock::MAX_ENTRIES, Slice(&key), sizeof(PDataBlock::Entry)); };
+    auto to_binary_result = [](char *entries, int lower_bound, uint64_t key)
+    {
+        if (lower_bound < PDataBlock::MAX_ENTRIES && ((PDataBlock::Entry *)entries)[lower_bound].key == key)
+            return lower_bound;
+        return -lower_bound - 1;
+    };
+    auto scalar = [&](char *entries, uint64_t key)
+    { return to_binary_result(entries, simd_search::CountScalar<false>(entries, PDataBlock::MAX_ENTRIES, key), key); };
+    auto avx2 = [&](char *entries, uint64_t key)
+    { return to_binary_result(entries, simd_search::CountAVX2<false>(entries, PDataBlock::MAX_ENTRIES, key), key); };
+    auto avx512 = [&](char *entries, uint64_t key)
+    { return to_binary_result(entries, simd_search::CountAVX512<false>(entries, PDataBlock::MAX_ENTRIES, key), key); };
+    auto dispatched = [&](char *entries, uint64_t key)
+    { return to_binary_result(entries, simd_search::LowerBound(entries, PDataBlock::MAX_ENTRIES, key), key); };
+
+    bool has_avx2 = simd_search::kernel >= simd_search::AVX2;
+    bool has_avx512 = simd_search::kernel >= simd_search::AVX512;
+    for (size_t i = 0; i < std::min<size_t>(queries.size(), 1000000); i++)
+    {
+        char *entries = (char *)blocks[queries[i].block].entries;
+        uint64_t key = queries[i].key;
+        int expect = binary(entries, key);
+        if (scalar(entries, key) != expect || (has_avx2 && avx2(entries, key) != expect) || (has_avx512 && avx512(entries, key) != expect))
+        {
+            fprintf(stderr, "kernel mismatch at query %lu\n", i);
+            return 1;
+        }
+    }
+
+    printf("blocks: %lu, ops: %lu, hit ratio: %.2f, runtime kernel: %d\n", FLAGS_blocks, FLAGS_num_ops, FLAGS_hit_ratio, simd_search::kernel);
+    run("binary", binary);
+    run("scalar", scalar);
+    if (has_avx2)
+        run("avx2", avx2);
+    if (has_avx512)
+        run("avx512", avx512);
+    run("dispatched", dispatched);
+    return 0;
+}
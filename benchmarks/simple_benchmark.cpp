@@ -9,8 +9,16 @@
 #include <gflags/gflags.h>
 
 #include "db.h"
+#include "db/log_writer.h"
+#include "db/pst_reader.h"
+#include "db/block_cache.h"
+#include "db/row_cache.h"
+#include "db/compaction/version.h"
 #include "util/stopwatch.hpp"
 #include "util/kgen.h"
+#include "util/alloc_counter.h"
+
+DEFINE_ALLOC_COUNTING_OPERATORS
 
 DEFINE_uint64(num, 20000000, "Total number of data");
 DEFINE_uint64(num_ops, 10000000, "Number of operations for each benchmark");
@@ -21,6 +29,14 @@ DEFINE_string(pool_path, "/mnt/pmem/pkbench/fluidkv", "Directory of target pmem"
 DEFINE_uint64(pool_size_GB, 40, "Total size of pmem pool");
 DEFINE_bool(recover, false, "Recover an existing db instead of recreating a new one");
 DEFINE_bool(skip_load, false, "Not load data");
+DEFINE_string(log_persist, "op", "op: persist each log entry, entries: every log_persist_entries entries, time: every log_persist_interval_us");
+DEFINE_uint64(log_persist_entries, 8, "Number of log entries between two persists with --log_persist=entries");
+DEFINE_uint64(log_persist_interval_us, 100, "Interval in microseconds between two persists with --log_persist=time");
+DEFINE_uint64(bloom_bits_per_key, 10, "Bits per key of pst and level0 tree bloom filters, 0 disables them");
+DEFINE_uint64(block_cache_mb, 64, "Size in MB of the DRAM pm block cache, 0 disables it");
+DEFINE_uint64(row_cache_mb, 0, "Size in MB of the key-value row cache, 0 disables it");
+DEFINE_string(row_cache_admission, "tinylfu", "all: admit every missed row, tinylfu: admit rows more frequent than the victim");
+DEFINE_bool(check_get_allocs, false, "Exit with an error if any Get of the read benchmark allocates heap memory");
 
 void print_dram_consuption()
 {
@@ -47,6 +63,102 @@ void print_dram_consuption()
     }
 }
 
+/**
+ * @brief print the log write amplification since the last call, counted by finished clients
+ *
+ */
+void print_log_stats()
+{
+    static uint64_t last_written = 0, last_flushed = 0;
+    uint64_t written, flushed;
+    LogWriter::GetStats(written, flushed);
+    if (written > last_written)
+    {
+        printf("log bytes written: %lu, PM bytes flushed: %lu, amplification: %.2f\n", written - last_written, flushed - last_flushed, (double)(flushed - last_flushed) / (written - last_written));
+    }
+    last_written = written;
+    last_flushed = flushed;
+}
+
+/**
+ * @brief print the bloom filter effect since the last call, counted by finished clients
+ *
+ */
+void print_filter_stats()
+{
+    static PSTReader::FilterStats last;
+    auto s = PSTReader::GetTotalFilterStats();
+    uint64_t checks = s.checks - last.checks, negatives = s.negatives - last.negatives, fp = s.false_positives - last.false_positives;
+    if (checks)
+    {
+        printf("filter checks: %lu, negatives: %lu, false positives: %lu, false positive rate: %.4f\n", checks, negatives, fp, fp + negatives ? (double)fp / (fp + negatives) : 0);
+    }
+    last = s;
+}
+
+/**
+ * @brief print the block cache hit ratio of each block type since the last call
+ *
+ */
+void print_block_cache_stats()
+{
+    static BlockCache::Stats last;
+    BlockCache *cache = BlockCache::Global();
+    if (cache == nullptr)
+        return;
+    auto s = cache->GetStats();
+    const char *names[] = {"pindex", "data"};
+    for (int t = 0; t < (int)CachedBlockType::NumTypes; t++)
+    {
+        uint64_t hits = s.hits[t] - last.hits[t], misses = s.misses[t] - last.misses[t];
+        if (hits + misses)
+        {
+            printf("block cache %s: hits: %lu, misses: %lu, hit ratio: %.4f\n", names[t], hits, misses, (double)hits / (hits + misses));
+        }
+    }
+    printf("block cache inserts: %lu, invalidations: %lu\n", s.inserts - last.inserts, s.invalidations - last.invalidations);
+    last = s;
+}
+
+/**
+ * @brief print the row cache hit ratio since the last call
+ *
+ */
+void print_row_cache_stats(DB *db)
+{
+    static RowCache::Stats last;
+    RowCache *cache = db->GetRowCache();
+    if (cache == nullptr)
+        return;
+    auto s = cache->GetStats();
+    uint64_t hits = s.hits - last.hits, misses = s.misses - last.misses;
+    if (hits + misses)
+    {
+        printf("row cache hits: %lu, misses: %lu, hit ratio: %.4f, inserts: %lu, rejects: %lu, invalidations: %lu, usage: %lu bytes\n",
+               hits, misses, (double)hits / (hits + misses), s.inserts - last.inserts, s.rejects - last.rejects, s.invalidations - last.invalidations, s.usage);
+    }
+    last = s;
+}
+
+std::atomic<uint64_t> get_allocations(0);
+
+/**
+ * @brief print the heap allocations made inside DBClient::Get since the last call,
+ * filling the row cache is the only allowed source
+ *
+ */
+void print_get_allocation_stats(DB *db)
+{
+    static uint64_t last = 0;
+    uint64_t allocs = get_allocations.load() - last;
+    last += allocs;
+    printf("heap allocations in get: %lu, per op: %.4f\n", allocs, (double)allocs / FLAGS_num_ops);
+    if (FLAGS_check_get_allocs && allocs && db->GetRowCache() == nullptr)
+    {
+        ERROR_EXIT("the get path allocated %lu times", allocs);
+    }
+}
+
 char value[1024] = "valuexxxxxx";
 
 void put_thread(DB *db, size_t start, size_t count)
@@ -85,11 +197,14 @@ void get_thread(DB *db, size_t start, size_t count)
     std::unique_ptr<DBClient> c = db->GetClient();
     char vbuf[1024];
     Slice valueout(vbuf);
+    uint64_t allocs = 0;
     for (size_t i = start; i < start + count; i++)
     {
         size_t key = utils::multiplicative_hash<uint64_t>(i + 1);
         keybuf = __builtin_bswap64(key);
+        uint64_t allocs_before = alloc_counter::ThreadAllocations();
         auto success = c->Get(k, valueout);
+        allocs += alloc_counter::ThreadAllocations() - allocs_before;
 
         if (!success)
         {
@@ -100,6 +215,7 @@ void get_thread(DB *db, size_t start, size_t count)
             printf("thread %d, %lu operations finished\n", c->thread_id_, i - start);
         }
     }
+    get_allocations.fetch_add(allocs);
     c.reset();
 }
 
@@ -167,6 +283,33 @@ std::cout << " number of thread: " << FLAGS_threads <<
     cfg.pm_pool_path = FLAGS_pool_path;
     cfg.pm_pool_size = FLAGS_pool_size_GB << 30ul;
     cfg.recover = FLAGS_recover;
+    if (FLAGS_log_persist == "entries")
+    {
+        cfg.log_persist_policy = PersistEveryEntries;
+    }
+    else if (FLAGS_log_persist == "time")
+    {
+        cfg.log_persist_policy = PersistEveryMicros;
+    }
+    else if (FLAGS_log_persist != "op")
+    {
+        fprintf(stderr, "unknown log persist policy '%s'\n", FLAGS_log_persist.c_str());
+        std::exit(1);
+    }
+    cfg.log_persist_entries = FLAGS_log_persist_entries;
+    cfg.log_persist_interval_us = FLAGS_log_persist_interval_us;
+    cfg.bloom_bits_per_key = FLAGS_bloom_bits_per_key;
+    cfg.block_cache_bytes = FLAGS_block_cache_mb << 20;
+    cfg.row_cache_bytes = FLAGS_row_cache_mb << 20;
+    if (FLAGS_row_cache_admission == "all")
+    {
+        cfg.row_cache_admission = RowCacheAdmitAll;
+    }
+    else if (FLAGS_row_cache_admission != "tinylfu")
+    {
+        fprintf(stderr, "unknown row cache admission policy '%s'\n", FLAGS_row_cache_admission.c_str());
+        std::exit(1);
+    }
     // if (!FLAGS_recover)
     // {
     //     auto ok = std::filesystem::remove(FLAGS_pool_path+"/*");
@@ -203,6 +346,8 @@ std::cout << " number of thread: " << FLAGS_threads <<
     db->EnableReadOptimizedMode();
     db->WaitForFlushAndCompaction();
     print_dram_consuption();
+    printf("L1 index: %d psts, %lu bytes\n", db->current_version_->GetLevelSize(1), db->current_version_->GetLevel1IndexMemoryUsage());
+    print_log_stats();
     // run benckmark
     for (auto &bench : benchmarks)
     {
@@ -227,6 +372,17 @@ std::cout << " number of thread: " << FLAGS_threads <<
         auto us = sw.elapsed<std::chrono::microseconds>();
         std::cout << "********************\ncount=" << FLAGS_num_ops << " thpt=" << FLAGS_num_ops / us << "MOPS, total time:" << us / 1000000 << "s\n********************" << std::endl;
         tlist.clear();
+        if (!bench)
+        {
+            print_log_stats();
+        }
+        else
+        {
+            print_filter_stats();
+            print_block_cache_stats();
+            print_row_cache_stats(db);
+            print_get_allocation_stats(db);
+        }
         db->WaitForFlushAndCompaction();
     }
     delete db;
@@ -1,6 +1,9 @@
 #pragma once
 
 #include "bitmap.h"
+#include "db/ssd_io.h"
+#include "util/aligned_buffer.h"
+#include <algorithm>
 #include <vector>
 #include <map>
 #include <assert.h>
@@ -8,6 +11,7 @@
 #include <sys/param.h>
 #include <queue>
 #include <libpmem.h>
+#include <unistd.h>
 
 
 
@@ -82,7 +86,8 @@ public:
         uint32_t segment_block_type : 6;
         uint32_t objects_tail_offset : 24;
         uint32_t magic : 32;
-        char reserve[56]; // for cacheline alignment of logging
+        uint64_t seal; // changes each time the segment is opened for logging, mixed into the entry checksums
+        char reserve[48]; // for cacheline alignment of logging
     };
     
 
@@ -103,6 +108,8 @@ public:
             header_.segment_status = StatusUsing;
             header_.segment_block_type = LOG;
             header_.objects_tail_offset = 0;
+            // entries left by an earlier use of the segment were sealed differently and do not validate
+            header_.seal = ((Header *)start_)->seal + 1;
             PersistHeader();
         }
     };
@@ -112,6 +119,10 @@ public:
         header_.segment_status = StatusAvailable;
         PersistHeader();
     }
+    /**
+     * @brief whether `size` more bytes fit before the segment end
+     */
+    bool HasRoom(size_t size) { return tail_ + size <= end_; }
     void Close()
     {
         header_.segment_status = StatusClosed;
@@ -140,6 +151,20 @@ public:
         return tail_ - start_ - size - sizeof(Header);
     }
 
+    /**
+     * @brief move the tail without writing, the caller is responsible for persisting the reserved space
+     *
+     * @param size
+     * @return int return offset, -1 represent overflow
+     */
+    int Reserve(size_t size)
+    {
+        if (tail_ + size > end_)
+            return -1;
+        tail_ += size;
+        return tail_ - start_ - size - sizeof(Header);
+    }
+
     void AlignTailTo64B()
     {
         if ((size_t)tail_ % 64 != 0)
@@ -148,6 +173,14 @@ public:
         }
     }
 
+    /**
+     * @brief bytes between the tail and the next `align`-byte boundary of the pool
+     */
+    size_t PaddingTo(size_t align)
+    {
+        return (align - (size_t)tail_ % align) % align;
+    }
+
     bool Free()
     {
         LOG("free log segment %lu at %lu(+%lu)", segment_id_, (uint64_t)start_, segment_id_ * SEGMENT_SIZE);
@@ -158,6 +191,8 @@ public:
         return true;
     }
 
+    uint64_t Seal() { return header_.seal; }
+
     Header GetHeader(){
         return header_;
     }
@@ -363,15 +398,23 @@ private:
     BitMap bitmap_;
     size_t file_id_;
     int fd_;
-    char *buf_;
+    // the header page, aligned for O_DIRECT
+    AlignedBuffer buf_;
+    // a writer allocates pages while deleters recycle pages of old psts
+    std::mutex mtx_;
+    // the header or the bitmap changed since they were written. State changes only mark it,
+    // they are written together at the next Sync or PersistBitmap, recovery derives the status from the bitmap
+    bool dirty_ = false;
+    // held while buf_ is being written
+    std::mutex persist_mtx_;
 
 public:
     /**
      * @brief Construct a new Sorted Segment object
      *
-     * @param segment_pool_addr pmem addr
-     * @param segment_id segment index
-     * @param type data block type. if exist = true, this will be disabled
+     * @param file_id id in the name of the segment file
+     * @param fd opened segment file
+     * @param page_size data block size
      * @param exist if exist, recover the header and bitmap from storage
      */
     SortedSegmentOnSSD(size_t file_id, int fd, int page_size, bool exist = 0)
@@ -380,21 +423,22 @@ public:
           PAGE_NUM(SEGMENT_SIZE / PAGE_SIZE - EXTRA_PAGE_NUM),
           bitmap_(PAGE_NUM), // need 1KB-2B for bitmap,use start_ for bitmap_ to align with 64B
           file_id_(file_id),
-          fd_(fd),
-          buf_(new char[PAGE_SIZE])
+          fd_(fd)
     {
         assert(fd_ > 0);
+        buf_.Alignment(PAGE_SIZE);
+        buf_.AllocateNewBuffer(PAGE_SIZE);
         if (exist)
         {
 
-            LOG("recover bitmap of pindex segment");
-            auto ret = pread(fd_, buf_, page_size, 0);
+            LOG("recover bitmap of ssd segment %lu", file_id_);
+            auto ret = pread(fd_, buf_.BufferStart(), page_size, 0);
             assert(ret > 0);
             // TODO: check header correctness
-            memcpy(&header_, buf_, sizeof(Header));
-            bitmap_.RecoverFrom(buf_ + sizeof(Header));
+            memcpy(&header_, buf_.BufferStart(), sizeof(Header));
+            bitmap_.RecoverFrom(buf_.BufferStart() + sizeof(Header));
             header_.segment_status = StatusUsing;
-            PersistHeader();
+            dirty_ = true;
         }
         else
         {
@@ -405,31 +449,35 @@ public:
     ~SortedSegmentOnSSD()
     {
         PersistHeader();
-        delete[] buf_;
     }
 
     SegmentStatus status() { return (SegmentStatus)header_.segment_status; }
     PBlockType type() { return (PBlockType)header_.segment_block_type; }
+    size_t file_id() { return file_id_; }
 
     FilePtr AllocatePage()
     {
+        std::lock_guard<std::mutex> lock(mtx_);
         size_t id = bitmap_.AllocateOne();
         if (id == ERROR_CODE)
         {
             return FilePtr::InvalidPtr();
         }
+        dirty_ = true;
         int offset = PAGE_SIZE + id * PAGE_SIZE;
-        return FilePtr{fd_, offset};
+        return FilePtr{(int)file_id_, offset};
     }
 
     FilePtr BatchAllocatePage(size_t num)
     {
         assert(num <= PAGE_NUM);
+        std::lock_guard<std::mutex> lock(mtx_);
         size_t id = bitmap_.AllocateMany(num);
         if (id == ERROR_CODE)
             return FilePtr::InvalidPtr();
+        dirty_ = true;
         int offset = PAGE_SIZE + id * PAGE_SIZE;
-        return FilePtr{fd_, offset};
+        return FilePtr{(int)file_id_, offset};
     }
 
     /**
@@ -441,40 +489,92 @@ public:
      */
     bool RecyclePage(size_t id)
     {
-        assert(id <= PAGE_NUM);
+        assert(id < PAGE_NUM);
+        std::lock_guard<std::mutex> lock(mtx_);
         bool ret = bitmap_.Free(id);
+        dirty_ = true;
         return ret;
     }
+    inline size_t TrasformOffsetToPageId(int offset)
+    {
+        return (offset - EXTRA_PAGE_NUM * PAGE_SIZE) / PAGE_SIZE;
+    };
     void Close()
     {
-        header_.segment_status = StatusClosed;
-        PersistHeader();
+        SetStatus(StatusClosed);
     }
     void Freeze()
     {
-        header_.segment_status = StatusAvailable;
-        PersistHeader();
+        SetStatus(StatusAvailable);
     }
     void Reuse()
     {
-        header_.segment_status = StatusUsing;
-        PersistHeader();
+        SetStatus(StatusUsing);
     }
     bool Full()
     {
+        std::lock_guard<std::mutex> lock(mtx_);
         return bitmap_.IsFull();
     }
     int get_fd()
     {
         return fd_;
     }
+    /**
+     * @brief make the written pages and the bitmap durable
+     */
+    void Sync()
+    {
+        PersistHeader();
+        fdatasync(fd_);
+    }
+    /**
+     * @brief write the bitmap after pages were recycled, the status is kept
+     */
+    void PersistBitmap()
+    {
+        PersistHeader();
+    }
+    /**
+     * @brief write the changed headers and bitmaps of segments in one batch
+     */
+    static void PersistHeaders(std::vector<SortedSegmentOnSSD *> segs)
+    {
+        // lock in file id order, concurrent batches may share segments
+        std::sort(segs.begin(), segs.end(), [](SortedSegmentOnSSD *a, SortedSegmentOnSSD *b)
+                  { return a->file_id_ < b->file_id_; });
+        segs.erase(std::unique(segs.begin(), segs.end()), segs.end());
+        std::vector<std::unique_lock<std::mutex>> locks;
+        std::vector<IORequest> reqs;
+        for (auto seg : segs)
+        {
+            locks.emplace_back(seg->persist_mtx_);
+            std::lock_guard<std::mutex> lock(seg->mtx_);
+            if (!seg->dirty_)
+                continue;
+            seg->dirty_ = false;
+            char *page = seg->buf_.BufferStart();
+            memcpy(page, &seg->header_, sizeof(Header));
+            seg->bitmap_.CopyTo(page + sizeof(Header));
+            reqs.emplace_back(seg->fd_, page, seg->PAGE_SIZE, 0, true);
+        }
+        SsdIO::Submit(reqs.data(), reqs.size());
+        for (auto &req : reqs)
+        {
+            if (req.res != (ssize_t)req.len)
+                ERROR_EXIT("write header of ssd segment failed: %zd", req.res);
+        }
+    }
 
 private:
     inline void PersistHeader()
     {
-        memcpy(buf_, &header_, sizeof(Header));
-        bitmap_.CopyTo(buf_ + sizeof(Header));
-        auto ret = pwrite(fd_, buf_, PAGE_SIZE, 0);
-        assert(ret > 0);
+        PersistHeaders({this});
+    }
+    inline void SetStatus(SegmentStatus status)
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        header_.segment_status = status;
+        dirty_ = true;
     }
 };
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "segment.h"
+#include "db/blocks/fixed_size_block.h"
 #include <filesystem>
 #include <unordered_map>
 #include <queue>
@@ -8,6 +9,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <cerrno>
 #include "util/atomic_vector.h"
 class SegmentAllocator
 {
@@ -15,6 +17,8 @@ private:
     std::string pool_path_;
     const size_t pool_size_;
     std::string ssd_path_;
+    // ssd segment files bypass the kernel page cache, hot ssd datablocks are kept by BlockCache::Ssd()
+    bool ssd_direct_io_;
     char *start_addr_;
     BitMap segment_bitmap_;     // persist in the tail of pm pool
     BitMap log_segment_bitmap_; // a backup bitmap of log segments for fast recovery, persisted after segment_bitmap
@@ -23,15 +27,20 @@ private:
     std::queue<SortedSegment *> data_segment_cache_;  // ditto
     std::atomic_int ssd_file_counter_;
     std::queue<SortedSegmentOnSSD *> ssd_segment_cache_;
+    // every ssd segment by file id, kept open while the db is open so that readers and deleters find it
+    std::vector<SortedSegmentOnSSD *> ssd_segments_;
     AtomicVector<uint64_t> log_segment_group_[MAX_MEMTABLE_NUM];
     int current_log_group_;
 
     SpinLock mtx_i, mtx_d, mtx_s; // lock the cache for poping element
+    // datablocks referenced by the index blocks of several psts -> number of referencing psts
+    std::unordered_map<uint64_t, uint32_t> shared_datablocks_;
+    SpinLock mtx_r;
 
 	std::atomic_uint64_t log_seg_num_=0,sort_seg_num_=0;
 
 public:
-    SegmentAllocator(std::string pool_path, size_t pool_size, std::string ssd_path = "", bool recover=false) : pool_path_(pool_path), pool_size_(pool_size), ssd_path_(ssd_path), start_addr_(nullptr), segment_bitmap_(pool_size_ / SEGMENT_SIZE, true), log_segment_bitmap_(pool_size_ / SEGMENT_SIZE, true), current_log_group_(0)
+    SegmentAllocator(std::string pool_path, size_t pool_size, std::string ssd_path = "", bool recover=false, bool ssd_direct_io = true) : pool_path_(pool_path), pool_size_(pool_size), ssd_path_(ssd_path), ssd_direct_io_(ssd_direct_io), start_addr_(nullptr), segment_bitmap_(pool_size_ / SEGMENT_SIZE, true), log_segment_bitmap_(pool_size_ / SEGMENT_SIZE, true), current_log_group_(0)
     {
         // TODO: When recovering, need to get the real pool size instead of using the paramater
         size_t mapped_len;
@@ -46,7 +55,7 @@ public:
             DEBUG("segment_bitmap_recover");
             segment_bitmap_.Recover();
             log_segment_bitmap_.Recover();
-            // TODO: recover ssd_file_counter_
+            RecoverSsdSegments();
         }
         else
         {
@@ -71,11 +80,18 @@ public:
             delete seg;
             data_segment_cache_.pop();
         }
-        while (!ssd_segment_cache_.empty())
+        std::vector<SortedSegmentOnSSD *> ssd_segments;
+        for (auto seg : ssd_segments_)
         {
-            auto &seg = ssd_segment_cache_.front();
+            if (seg)
+                ssd_segments.push_back(seg);
+        }
+        SortedSegmentOnSSD::PersistHeaders(ssd_segments);
+        for (auto seg : ssd_segments)
+        {
+            int fd = seg->get_fd();
             delete seg;
-            ssd_segment_cache_.pop();
+            close(fd);
         }
         segment_bitmap_.PersistToPM();
     };
@@ -188,28 +204,69 @@ public:
 
     SortedSegmentOnSSD *AllocSortedSegmentOnSSD(int page_size)
     {
+        std::lock_guard<SpinLock> lock(mtx_s);
+        if (!ssd_segment_cache_.empty())
         {
-            std::lock_guard<SpinLock> lock(mtx_s);
-            if (!ssd_segment_cache_.empty())
-            {
-                auto p = ssd_segment_cache_.front();
-                ssd_segment_cache_.pop();
-                p->Reuse();
-                return p;
-            }
+            auto p = ssd_segment_cache_.front();
+            ssd_segment_cache_.pop();
+            p->Reuse();
+            return p;
         }
         // alloc new segment
         int file_id = ssd_file_counter_.fetch_add(1);
         DEBUG("allocate ssd segment id=%d", file_id);
-        if (file_id == -1)
+        if (file_id == 0)
+            std::filesystem::create_directories(ssd_path_);
+        int fd = OpenSsdSegmentFile(GetSsdSegmentPath(file_id), O_RDWR | O_CREAT | O_TRUNC);
+        if (fd < 0)
         {
-            ERROR_EXIT("ssd segment allocation failed, space not enough!");
+            ERROR_EXIT("ssd segment allocation failed, cannot create %s", GetSsdSegmentPath(file_id).c_str());
         }
-        int fd = open((ssd_path_ + std::to_string(file_id) + ".seg").c_str(), O_RDWR | O_CREAT, 0777);
         SortedSegmentOnSSD *seg = new SortedSegmentOnSSD(file_id, fd, page_size);
+        ssd_segments_.push_back(seg);
         return seg;
     }
 
+    /**
+     * @brief descriptor of the ssd segment file a FilePtr refers to
+     */
+    int GetSsdFd(int file_id)
+    {
+        std::lock_guard<SpinLock> lock(mtx_s);
+        assert(file_id < (int)ssd_segments_.size() && ssd_segments_[file_id]);
+        return ssd_segments_[file_id]->get_fd();
+    }
+    /**
+     * @brief free the ssd page of a deleted pst, a segment closed as full becomes available again.
+     * The bitmap is written by PersistSsdSegments.
+     */
+    bool RecycleSsdPage(FilePtr fptr)
+    {
+        std::lock_guard<SpinLock> lock(mtx_s);
+        assert(fptr.file_id < (int)ssd_segments_.size() && ssd_segments_[fptr.file_id]);
+        SortedSegmentOnSSD *seg = ssd_segments_[fptr.file_id];
+        bool ret = seg->RecyclePage(seg->TrasformOffsetToPageId(fptr.offset));
+        if (seg->status() == StatusClosed)
+        {
+            seg->Freeze();
+            ssd_segment_cache_.emplace(seg);
+        }
+        return ret;
+    }
+    /**
+     * @brief write the bitmaps of ssd segments in one batch
+     */
+    void PersistSsdSegments(const std::vector<int> &file_ids)
+    {
+        std::vector<SortedSegmentOnSSD *> segs;
+        {
+            std::lock_guard<SpinLock> lock(mtx_s);
+            for (int file_id : file_ids)
+                segs.push_back(ssd_segments_[file_id]);
+        }
+        SortedSegmentOnSSD::PersistHeaders(segs);
+    }
+
     bool CloseSegment(LogSegment *&seg, bool avail = 0)
     {
         if (avail)
@@ -288,15 +345,17 @@ public:
 
     bool CloseSegment(SortedSegmentOnSSD *&seg)
     {
+        seg->Sync();
+        std::lock_guard<SpinLock> lock(mtx_s);
         if (!seg->Full())
         {
-            ssd_segment_cache_.emplace(seg);
             seg->Freeze();
-            return true;
+            ssd_segment_cache_.emplace(seg);
+        }
+        else
+        {
+            seg->Close();
         }
-        seg->Close();
-        close(seg->get_fd());
-        delete seg;
         seg = nullptr;
         return true;
     }
@@ -351,6 +410,57 @@ public:
     }
 
     char *GetStartAddr() { return start_addr_; };
+    std::string GetSsdSegmentPath(int file_id) { return ssd_path_ + "/" + std::to_string(file_id) + ".seg"; }
+    /**
+     * @brief open a segment file with O_DIRECT if enabled, so that every buffer, offset and length of its I/O is 4KB aligned.
+     * A file system without O_DIRECT support, e.g. tmpfs, gets buffered I/O
+     */
+    int OpenSsdSegmentFile(const std::string &path, int flags)
+    {
+        if (ssd_direct_io_)
+        {
+            int fd = open(path.c_str(), flags | O_DIRECT, 0666);
+            if (fd >= 0 || errno != EINVAL)
+                return fd;
+            INFO("%s does not support O_DIRECT, ssd segments use buffered I/O", ssd_path_.c_str());
+            ssd_direct_io_ = false;
+        }
+        return open(path.c_str(), flags, 0666);
+    }
+
+    /**
+     * @brief a datablock reused by compaction is referenced by the index blocks of several psts and is recycled
+     * with the last of them. Datablocks with a single owner are not recorded. DRAM-only, recovery recounts them.
+     */
+    void AddDataBlockRef(uint64_t datablock_offset)
+    {
+        std::lock_guard<SpinLock> lock(mtx_r);
+        auto it = shared_datablocks_.find(datablock_offset);
+        if (it == shared_datablocks_.end())
+            shared_datablocks_.emplace(datablock_offset, 2);
+        else
+            it->second++;
+    }
+    /**
+     * @brief drop the reference of a deleted pst
+     *
+     * @return true if no other pst references the datablock, so it can be recycled
+     */
+    bool ReleaseDataBlockRef(uint64_t datablock_offset)
+    {
+        std::lock_guard<SpinLock> lock(mtx_r);
+        auto it = shared_datablocks_.find(datablock_offset);
+        if (it == shared_datablocks_.end())
+            return true;
+        if (--it->second == 1)
+            shared_datablocks_.erase(it);
+        return false;
+    }
+    size_t GetSharedDataBlockNum()
+    {
+        std::lock_guard<SpinLock> lock(mtx_r);
+        return shared_datablocks_.size();
+    }
 
     void ClearLogGroup(int idx)
     {
@@ -372,4 +482,38 @@ public:
 	}
 
 private:
+    /**
+     * @brief reopen the segment files in ssd_path_, new files take the ids after them
+     */
+    void RecoverSsdSegments()
+    {
+        ssd_file_counter_ = 0;
+        std::error_code ec;
+        if (ssd_path_.empty() || !std::filesystem::is_directory(ssd_path_, ec))
+            return;
+        for (auto &entry : std::filesystem::directory_iterator(ssd_path_, ec))
+        {
+            if (entry.path().extension() != ".seg")
+                continue;
+            int file_id = std::atoi(entry.path().stem().c_str());
+            int fd = OpenSsdSegmentFile(entry.path(), O_RDWR);
+            if (fd < 0)
+                ERROR_EXIT("cannot open ssd segment %s", entry.path().c_str());
+            if (file_id >= (int)ssd_segments_.size())
+                ssd_segments_.resize(file_id + 1, nullptr);
+            SortedSegmentOnSSD *seg = new SortedSegmentOnSSD(file_id, fd, sizeof(PSSDBlock), true);
+            ssd_segments_[file_id] = seg;
+            if (seg->Full())
+            {
+                seg->Close();
+            }
+            else
+            {
+                seg->Freeze();
+                ssd_segment_cache_.emplace(seg);
+            }
+        }
+        ssd_file_counter_ = ssd_segments_.size();
+        DEBUG("recover %lu ssd segments", ssd_segments_.size());
+    }
 };
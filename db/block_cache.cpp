@@ -0,0 +1,200 @@
+#include "block_cache.h"
+
+#include <cstdlib>
+#include <cstring>
+
+BlockCache *BlockCache::global_ = nullptr;
+BlockCache *BlockCache::ssd_global_ = nullptr;
+
+BlockCache::BlockCache(size_t capacity_bytes, size_t block_size) : block_size_(block_size)
+{
+    num_shards_ = capacity_bytes / (WAYS * block_size_);
+    if (num_shards_ == 0)
+        num_shards_ = 1;
+    shards_ = new Shard[num_shards_];
+    for (size_t i = 0; i < num_shards_; i++)
+    {
+        Shard &shard = shards_[i];
+        for (size_t w = 0; w < WAYS; w++)
+        {
+            shard.tags[w].store(0, std::memory_order_relaxed);
+            shard.seqs[w].store(0, std::memory_order_relaxed);
+            shard.refs[w].store(0, std::memory_order_relaxed);
+        }
+        shard.invalidate_seq.store(0, std::memory_order_relaxed);
+        shard.locked.store(false, std::memory_order_relaxed);
+        shard.hand = 0;
+    }
+    data_ = (char *)aligned_alloc(64, num_shards_ * WAYS * block_size_);
+    if (data_ == nullptr)
+    {
+        ERROR_EXIT("block cache: cannot allocate %lu bytes", num_shards_ * WAYS * block_size_);
+    }
+    for (auto &c : counters_)
+    {
+        for (int t = 0; t < (int)CachedBlockType::NumTypes; t++)
+        {
+            c.hits[t].store(0, std::memory_order_relaxed);
+            c.misses[t].store(0, std::memory_order_relaxed);
+        }
+        c.inserts.store(0, std::memory_order_relaxed);
+        c.invalidations.store(0, std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    LOG("block cache: %lu shards, %lu bytes", num_shards_, Capacity());
+}
+
+BlockCache::~BlockCache()
+{
+    delete[] shards_;
+    free(data_);
+}
+
+void BlockCache::Open(size_t capacity_bytes)
+{
+    Close();
+    if (capacity_bytes)
+        global_ = new BlockCache(capacity_bytes);
+}
+
+void BlockCache::OpenSsd(size_t capacity_bytes)
+{
+    delete ssd_global_;
+    ssd_global_ = capacity_bytes ? new BlockCache(capacity_bytes, SSD_BLOCK_SIZE) : nullptr;
+}
+
+void BlockCache::Close()
+{
+    delete global_;
+    global_ = nullptr;
+    delete ssd_global_;
+    ssd_global_ = nullptr;
+}
+
+bool BlockCache::Lookup(uint64_t addr, CachedBlockType type, void *buf, uint64_t *fill_seq)
+{
+    Shard &shard = GetShard(addr);
+    *fill_seq = shard.invalidate_seq.load(std::memory_order_acquire);
+    const uint64_t tag = addr + 1;
+    for (size_t w = 0; w < WAYS; w++)
+    {
+        uint32_t seq = shard.seqs[w].load(std::memory_order_acquire);
+        if (shard.tags[w].load(std::memory_order_relaxed) != tag)
+            continue;
+        if (seq & 1)
+            break;
+        memcpy(buf, WayData(shard, w), block_size_);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (shard.seqs[w].load(std::memory_order_relaxed) != seq)
+            break;
+        // only write the reference bit when it changes, to keep the shard line clean on hot hits
+        if (shard.refs[w].load(std::memory_order_relaxed) == 0)
+            shard.refs[w].store(1, std::memory_order_relaxed);
+        LocalCounter().hits[(int)type].fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    LocalCounter().misses[(int)type].fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+void BlockCache::Insert(uint64_t addr, const void *buf, uint64_t fill_seq)
+{
+    Shard &shard = GetShard(addr);
+    bool expect = false;
+    if (!shard.locked.compare_exchange_strong(expect, true, std::memory_order_acquire, std::memory_order_relaxed))
+        return;
+    const uint64_t tag = addr + 1;
+    if (shard.invalidate_seq.load(std::memory_order_relaxed) != fill_seq)
+    {
+        shard.locked.store(false, std::memory_order_release);
+        return;
+    }
+    size_t victim = WAYS;
+    for (size_t w = 0; w < WAYS; w++)
+    {
+        uint64_t t = shard.tags[w].load(std::memory_order_relaxed);
+        if (t == tag)
+        {
+            // filled by another reader
+            shard.locked.store(false, std::memory_order_release);
+            return;
+        }
+        if (t == 0 && victim == WAYS)
+            victim = w;
+    }
+    if (victim == WAYS)
+    {
+        // CLOCK: give referenced ways a second chance
+        while (shard.refs[shard.hand].load(std::memory_order_relaxed))
+        {
+            shard.refs[shard.hand].store(0, std::memory_order_relaxed);
+            shard.hand = (shard.hand + 1) % WAYS;
+        }
+        victim = shard.hand;
+        shard.hand = (shard.hand + 1) % WAYS;
+    }
+
+    uint32_t seq = shard.seqs[victim].load(std::memory_order_relaxed);
+    shard.seqs[victim].store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    shard.tags[victim].store(tag, std::memory_order_relaxed);
+    memcpy(WayData(shard, victim), buf, block_size_);
+    shard.refs[victim].store(0, std::memory_order_relaxed);
+    shard.seqs[victim].store(seq + 2, std::memory_order_release);
+
+    shard.locked.store(false, std::memory_order_release);
+    LocalCounter().inserts.fetch_add(1, std::memory_order_relaxed);
+}
+
+void BlockCache::Invalidate(uint64_t addr)
+{
+    Shard &shard = GetShard(addr);
+    LockShard(shard);
+    shard.invalidate_seq.fetch_add(1, std::memory_order_relaxed);
+    const uint64_t tag = addr + 1;
+    for (size_t w = 0; w < WAYS; w++)
+    {
+        if (shard.tags[w].load(std::memory_order_relaxed) != tag)
+            continue;
+        uint32_t seq = shard.seqs[w].load(std::memory_order_relaxed);
+        shard.seqs[w].store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        shard.tags[w].store(0, std::memory_order_relaxed);
+        shard.refs[w].store(0, std::memory_order_relaxed);
+        shard.seqs[w].store(seq + 2, std::memory_order_release);
+        LocalCounter().invalidations.fetch_add(1, std::memory_order_relaxed);
+    }
+    shard.locked.store(false, std::memory_order_release);
+}
+
+BlockCache::Stats BlockCache::GetStats() const
+{
+    Stats stats;
+    for (auto &c : counters_)
+    {
+        for (int t = 0; t < (int)CachedBlockType::NumTypes; t++)
+        {
+            stats.hits[t] += c.hits[t].load(std::memory_order_relaxed);
+            stats.misses[t] += c.misses[t].load(std::memory_order_relaxed);
+        }
+        stats.inserts += c.inserts.load(std::memory_order_relaxed);
+        stats.invalidations += c.invalidations.load(std::memory_order_relaxed);
+    }
+    return stats;
+}
+
+BlockCache::Counter &BlockCache::LocalCounter()
+{
+    static std::atomic<size_t> next_stripe{0};
+    thread_local size_t stripe = next_stripe.fetch_add(1, std::memory_order_relaxed) % COUNTER_STRIPES;
+    return counters_[stripe];
+}
+
+void BlockCache::LockShard(Shard &shard)
+{
+    bool expect = false;
+    while (!shard.locked.compare_exchange_weak(expect, true, std::memory_order_acquire, std::memory_order_relaxed))
+    {
+        expect = false;
+    }
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include "blocks/fixed_size_block.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+enum class CachedBlockType : uint8_t
+{
+    PIndex = 0,
+    PData = 1,
+    SsdData = 2,
+    NumTypes
+};
+
+/**
+ * @brief Process-wide DRAM cache of 512B PM pindex/data block images, keyed by pm offset.
+ * A second instance with its own budget holds the 4KB datablocks of ssd segments keyed by their encoded FilePtr,
+ * the ssd files are opened with O_DIRECT so that it is their only cache in DRAM.
+ * The cache is split into 8-way shards selected by the offset hash; each shard evicts with its own CLOCK hand.
+ * Lookups are lock-free: every way is guarded by a seqlock and the image is copied out,
+ * so a reader never observes a block that is being replaced.
+ * Inserts/invalidations take a per-shard lock; an insert is skipped on contention.
+ *
+ */
+class BlockCache
+{
+public:
+    static constexpr size_t BLOCK_SIZE = 512;
+    static constexpr size_t SSD_BLOCK_SIZE = 4096;
+    static constexpr size_t WAYS = 8;
+    static_assert(sizeof(PIndexBlock) == BLOCK_SIZE && sizeof(PDataBlock) == BLOCK_SIZE, "block cache only holds 512B blocks");
+    static_assert(sizeof(PSSDBlock) == SSD_BLOCK_SIZE, "ssd page cache only holds 4KB blocks");
+
+    struct Stats
+    {
+        uint64_t hits[(int)CachedBlockType::NumTypes] = {0};
+        uint64_t misses[(int)CachedBlockType::NumTypes] = {0};
+        uint64_t inserts = 0;
+        uint64_t invalidations = 0;
+    };
+
+    BlockCache(size_t capacity_bytes, size_t block_size = BLOCK_SIZE);
+    ~BlockCache();
+
+    /**
+     * @brief the process-wide cache, nullptr if disabled
+     */
+    static BlockCache *Global() { return global_; }
+    /**
+     * @brief the process-wide cache of ssd datablocks, nullptr if disabled
+     */
+    static BlockCache *Ssd() { return ssd_global_; }
+    /**
+     * @brief create (or replace) the process-wide cache, capacity 0 disables it
+     */
+    static void Open(size_t capacity_bytes);
+    static void OpenSsd(size_t capacity_bytes);
+    /**
+     * @brief destroy both caches
+     */
+    static void Close();
+
+    /**
+     * @brief copy the cached image of addr into buf
+     *
+     * @param addr pm offset of a pm block, or encoded FilePtr of an ssd block
+     *
+     * @param fill_seq out: the shard sequence observed before lookup, pass it to Insert after reading from PM
+     * @return true if hit
+     */
+    bool Lookup(uint64_t addr, CachedBlockType type, void *buf, uint64_t *fill_seq);
+
+    /**
+     * @brief insert a block image read from PM.
+     * Dropped if the shard was invalidated since fill_seq was observed, so recycled pages never come back.
+     */
+    void Insert(uint64_t addr, const void *buf, uint64_t fill_seq);
+
+    /**
+     * @brief drop addr from the cache, called before the page is recycled
+     */
+    void Invalidate(uint64_t addr);
+
+    /**
+     * @brief the invalidation sequence of the shard of addr.
+     * A block image copied out by a reader is still current while the sequence observed before the copy is unchanged
+     */
+    uint64_t InvalidateSeq(uint64_t addr) { return GetShard(addr).invalidate_seq.load(std::memory_order_acquire); }
+
+    Stats GetStats() const;
+    size_t Capacity() const { return num_shards_ * WAYS * block_size_; }
+
+private:
+    struct alignas(64) Shard
+    {
+        // addr + 1 of each way, 0 means empty
+        std::atomic<uint64_t> tags[WAYS];
+        // odd while the way is being written
+        std::atomic<uint32_t> seqs[WAYS];
+        std::atomic<uint8_t> refs[WAYS];
+        // bumped by every invalidation of this shard
+        std::atomic<uint64_t> invalidate_seq;
+        std::atomic<bool> locked;
+        uint8_t hand;
+    };
+
+    // hit/miss counters are striped by thread to avoid a shared hot cache line
+    static constexpr size_t COUNTER_STRIPES = 64;
+    struct alignas(64) Counter
+    {
+        std::atomic<uint64_t> hits[(int)CachedBlockType::NumTypes];
+        std::atomic<uint64_t> misses[(int)CachedBlockType::NumTypes];
+        std::atomic<uint64_t> inserts;
+        std::atomic<uint64_t> invalidations;
+    };
+
+    static BlockCache *global_;
+    static BlockCache *ssd_global_;
+
+    const size_t block_size_;
+
+    Shard *shards_ = nullptr;
+    char *data_ = nullptr;
+    size_t num_shards_ = 0;
+    Counter counters_[COUNTER_STRIPES];
+
+    inline Shard &GetShard(uint64_t addr)
+    {
+        uint64_t h = (addr / block_size_) * 0x9e3779b97f4a7c15ULL;
+        return shards_[(size_t)(((h >> 32) * (uint64_t)num_shards_) >> 32)];
+    }
+    inline char *WayData(Shard &shard, size_t way)
+    {
+        return data_ + ((&shard - shards_) * WAYS + way) * block_size_;
+    }
+    Counter &LocalCounter();
+    void LockShard(Shard &shard);
+};
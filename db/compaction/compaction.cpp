@@ -3,30 +3,16 @@
 #include "version.h"
 #include "lib/ThreadPool/include/threadpool.h"
 #include "lib/ThreadPool/include/threadpool_imp.h"
-#include <queue>
+#include "util/loser_tree.h"
+#include "util/stopwatch.hpp"
+#include <numeric>
 
 size_t total_L1_num = 0;
 
-struct KeyWithRowId
-{
-	uint64_t key;
-	int row_id;
-};
-
-struct UintKeyComparator
-{
-	bool operator()(const KeyWithRowId l, const KeyWithRowId r) const
-	{
-		if (unlikely(__bswap_64(l.key) == __bswap_64(r.key)))
-		{
-			return l.row_id < r.row_id;
-		}
-		return __bswap_64(l.key) > __bswap_64(r.key);
-	}
-} cmp;
-
-CompactionJob::CompactionJob(SegmentAllocator *seg_alloc, Version *target_version, Manifest *manifest, PartitionInfo *partition_info, ThreadPoolImpl *thread_pool) : seg_allocater_(seg_alloc), version_(target_version), manifest_(manifest), pst_builder_(seg_allocater_), pst_deleter_(seg_allocater_), output_seq_no_(version_->GenerateL1Seq()), partition_info_(partition_info), compaction_thread_pool_(thread_pool)
+CompactionJob::CompactionJob(SegmentAllocator *seg_alloc, Version *target_version, Manifest *manifest, const PartitionInfo *partition_info, ThreadPoolImpl *thread_pool, int output_level) : seg_allocater_(seg_alloc), version_(target_version), manifest_(manifest), pst_builder_(seg_allocater_), output_level_(output_level), output_seq_no_(output_level == 2 ? version_->GenerateL2Seq() : version_->GenerateL1Seq()), compaction_thread_pool_(thread_pool)
 {
+	std::copy(partition_info, partition_info + RANGE_PARTITION_NUM, partition_info_);
+	pst_builder_.SetBloomBitsPerKey(version_->GetBloomBitsPerKey());
 }
 CompactionJob::~CompactionJob()
 {
@@ -44,178 +30,322 @@ bool CompactionJob::CheckPmRoomEnough()
 	// TODO
 	return true;
 }
-size_t CompactionJob::PickCompaction()
+int CompactionJob::PartitionOf(uint64_t native_key)
+{
+	int partition = 0;
+	while (partition + 1 < RANGE_PARTITION_NUM && native_key >= __bswap_64(partition_info_[partition + 1].min_key))
+		partition++;
+	return partition;
+}
+size_t CompactionJob::PickCompaction(bool all_partitions, int max_level0_trees)
 {
 	// iterate l0 meta
 	std::vector<TreeMeta> tree_metas;
-	version_->PickLevel0Trees(inputs_, tree_metas);
+	int unpicked_num = 0;
+	version_->PickLevel0Trees(inputs_, tree_metas, tree_idxs_, &unpicked_num);
 	size_t size = inputs_.size();
 	if (size == 0)
 		return 0;
 	LOG("pick %lu level 0 tree", size);
-	for (auto &tree_meta : tree_metas)
+	// level0 entries and native key range of each partition, psts of compacted partitions are not picked
+	uint64_t pending[RANGE_PARTITION_NUM] = {};
+	uint64_t range_min[RANGE_PARTITION_NUM], range_max[RANGE_PARTITION_NUM] = {};
+	std::fill(range_min, range_min + RANGE_PARTITION_NUM, MAX_UINT64);
+	uint64_t new_entries = 0;
+	// partitions covered by each pst crossing a boundary, flushed before the partitions were rebalanced
+	std::vector<uint32_t> crossing;
+	tree_partitions_.assign(size, 0);
+	for (size_t i = 0; i < size; i++)
 	{
-		if (__bswap_64(min_key_) > __bswap_64(tree_meta.min_key))
+		for (auto &pst : inputs_[i])
 		{
-			min_key_ = tree_meta.min_key;
+			uint64_t min = __bswap_64(pst.meta.min_key_), max = __bswap_64(pst.meta.max_key_);
+			int first = PartitionOf(min), last = PartitionOf(max);
+			uint32_t covered = (ALL_PARTITIONS >> (RANGE_PARTITION_NUM - 1 - last)) & ~((1u << first) - 1);
+			tree_partitions_[i] |= covered;
+			if (first != last)
+				crossing.push_back(covered);
+			pending[first] += pst.meta.entry_num_;
+			if ((int)i < unpicked_num)
+				new_entries += pst.meta.entry_num_;
+			range_min[first] = std::min(range_min[first], min);
+			range_max[last] = std::max(range_max[last], max);
+			for (int p = first; p < last; p++)
+			{
+				range_max[p] = __bswap_64(partition_info_[p].max_key);
+				range_min[p + 1] = __bswap_64(partition_info_[p + 1].min_key);
+			}
 		}
-		if (__bswap_64(max_key_) < __bswap_64(tree_meta.max_key))
+	}
+	uint32_t selected = 0;
+	for (int p = 0; p < RANGE_PARTITION_NUM; p++)
+	{
+		if (pending[p] && (all_partitions || pending[p] * RANGE_PARTITION_NUM * 2 >= new_entries))
+			selected |= 1u << p;
+	}
+	if ((int)size >= max_level0_trees)
+		selected |= tree_partitions_[size - 1];
+	if (selected == 0)
+	{
+		int hottest = std::max_element(pending, pending + RANGE_PARTITION_NUM) - pending;
+		if (pending[hottest])
+			selected = 1u << hottest;
+	}
+
+	inputs_.emplace_back(std::vector<TaggedPstMeta>());
+	auto &l1_inputs = inputs_[size];
+	while (true)
+	{
+		// a pst is compacted as a whole, all partitions it covers are compacted together
+		for (bool changed = true; changed;)
 		{
-			max_key_ = tree_meta.max_key;
+			changed = false;
+			for (uint32_t covered : crossing)
+			{
+				if ((selected & covered) && (selected & covered) != covered)
+				{
+					selected |= covered;
+					changed = true;
+				}
+			}
+		}
+		// level1 psts in the level0 range of each selected partition
+		l1_inputs.clear();
+		uint32_t l1_partitions = 0;
+		for (int p = 0; p < RANGE_PARTITION_NUM; p++)
+		{
+			if (!(selected >> p & 1) || range_min[p] > range_max[p])
+				continue;
+			std::vector<TaggedPstMeta> psts;
+			version_->PickOverlappedL1Tables(__bswap_64(range_min[p]), __bswap_64(range_max[p]), psts);
+			for (auto &pst : psts)
+			{
+				if (!l1_inputs.empty() && l1_inputs.back().meta.indexblock_ptr_ == pst.meta.indexblock_ptr_)
+					continue;
+				l1_inputs.push_back(pst);
+				l1_partitions |= 1u << PartitionOf(__bswap_64(pst.meta.min_key_));
+				l1_partitions |= 1u << PartitionOf(__bswap_64(pst.meta.max_key_));
+			}
 		}
-		LOG("min:%lu,max:%lu", __bswap_64(tree_meta.min_key), __bswap_64(tree_meta.max_key));
+		// a level1 pst is deleted as a whole too, its partitions must be merged
+		if ((l1_partitions & ~selected) == 0)
+			break;
+		selected |= l1_partitions;
 	}
-	LOG("l0 table range=%lu~%lu", __bswap_64(min_key_), __bswap_64(max_key_));
-	inputs_.emplace_back(std::vector<TaggedPstMeta>());
-	version_->PickOverlappedL1Tables(min_key_, max_key_, inputs_[size]);
-	if (inputs_[size].size())
+	compacted_partitions_ = selected;
+	for (int p = 0; p < RANGE_PARTITION_NUM; p++)
 	{
-		DEBUG("level1 tables:%lu %lu~%lu", inputs_[size].size(), __bswap_64(inputs_[size][0].meta.min_key_), __bswap_64(inputs_[size][inputs_[size].size() - 1].meta.max_key_));
+		if (selected >> p & 1)
+		{
+			min_key_ = std::min(min_key_, range_min[p]);
+			max_key_ = std::max(max_key_, range_max[p]);
+		}
+	}
+	LOG("compact partitions %x of %lu level0 entries, %lu new, l0 table range=%lu~%lu", selected, std::accumulate(pending, pending + RANGE_PARTITION_NUM, 0ul), new_entries, min_key_, max_key_);
+	if (l1_inputs.size())
+	{
+		DEBUG("level1 tables:%lu %lu~%lu", l1_inputs.size(), __bswap_64(l1_inputs[0].meta.min_key_), __bswap_64(l1_inputs[l1_inputs.size() - 1].meta.max_key_));
 	}
 
 	return size;
 }
-bool CompactionJob::RunCompaction()
+size_t CompactionJob::PickLevel2Compaction(size_t max_bytes, uint64_t *cursor)
 {
-	std::priority_queue<KeyWithRowId, std::vector<KeyWithRowId>, UintKeyComparator> key_heap(cmp);
+	inputs_.resize(2);
+	version_->PickLevel1TablesForLevel2(cursor, max_bytes, inputs_[0]);
+	if (inputs_[0].empty())
+		return 0;
+	uint64_t min = inputs_[0].front().meta.min_key_, max = inputs_[0].back().meta.max_key_;
+	version_->PickOverlappedL2Tables(min, max, inputs_[1]);
+	min_key_ = __bswap_64(min);
+	max_key_ = __bswap_64(max);
+	if (!inputs_[1].empty())
+	{
+		min_key_ = std::min(min_key_, (size_t)__bswap_64(inputs_[1].front().meta.min_key_));
+		max_key_ = std::max(max_key_, (size_t)__bswap_64(inputs_[1].back().meta.max_key_));
+	}
+	// the sub compactions of the partitions in the range split the psts at the boundaries
+	int first = PartitionOf(min_key_), last = PartitionOf(max_key_);
+	compacted_partitions_ = (ALL_PARTITIONS >> (RANGE_PARTITION_NUM - 1 - last)) & ~((1u << first) - 1);
+	DEBUG("L1->L2 compaction: %lu level1 psts, %lu level2 psts, range=%lu~%lu", inputs_[0].size(), inputs_[1].size(), min_key_, max_key_);
+	return inputs_[0].size();
+}
+size_t CompactionJob::EstimateLevel2OutputNum() const
+{
+	// a level2 pst indexes up to PIndexBlock::MAX_ENTRIES ssd datablocks, level1 entries are packed into them and
+	// level2 datablocks may be referenced as they are. Every partition in the range ends with a partly filled pst
+	size_t datablocks = 0;
+	for (auto &pst : inputs_[0])
+		datablocks += (pst.meta.entry_num_ + PSSDBlock::MAX_ENTRIES - 1) / PSSDBlock::MAX_ENTRIES;
+	for (auto &pst : inputs_[1])
+		datablocks += pst.meta.datablock_num_;
+	return datablocks / (PIndexBlock::MAX_ENTRIES - 1) + GetCompactedPartitionNum();
+}
+size_t CompactionJob::MergeInputs(PSTBuilder *pst_builder, std::vector<TaggedPstMeta> &outputs, uint64_t min_key, uint64_t max_key)
+{
+	// one reader serves all rows, iterators copy the entries they read
+	PSTReader reader(seg_allocater_);
 	std::vector<RowIterator> rows;
-	std::vector<PSTReader *> readers;
-	size_t marked_output = 0;
-	// initialize: init RowIter, add first key to heap, check overlapping for each first key
-	for (int i = 0; i < inputs_.size(); i++)
+	rows.reserve(inputs_.size());
+	for (auto &input : inputs_)
 	{
-		if (inputs_[i].empty())
-			continue;
-		auto pr = new PSTReader(seg_allocater_);
-		readers.push_back(pr);
-		rows.emplace_back(pr, inputs_[i]);
-		key_heap.push(KeyWithRowId{rows[i].GetCurrentKey(), i});
+		// rows skip the empty inputs, row ids keep the input order
+		if (!input.empty())
+			rows.emplace_back(&reader, input);
 	}
-	size_t count = 0;
-	KeyWithRowId current_max_key = {0, -1};
-	// Get key from heap and get the value from row
-	while (!key_heap.empty())
+	uint64_t native_max = __bswap_64(max_key);
+	// keys are compared in native order, equal keys are taken from the smallest row first
+	LoserTree tree(rows.size());
+	for (int i = 0; i < rows.size(); i++)
+	{
+		if (rows[i].SeekTo(min_key) && rows[i].GetCurrentNativeKey() <= native_max)
+			tree.Set(i, rows[i].GetCurrentNativeKey());
+	}
+	tree.Build();
+
+	auto add_entry = [&](uint64_t key, uint64_t value)
 	{
-		auto topkey = key_heap.top();
-		key_heap.pop();
-		LOG("now:%lu from row %d, top:%lu from row %d", __bswap_64(topkey.key), topkey.row_id, __bswap_64(key_heap.top().key), key_heap.top().row_id);
-		count++;
-		if (unlikely(__bswap_64(topkey.key) < __bswap_64(current_max_key.key)))
+		if (!pst_builder->AddEntry(Slice(&key), Slice(&value)))
 		{
-			ERROR_EXIT("Reverse order found in Compaction: %lu(%d)<%lu(%d)", __bswap_64(topkey.key), topkey.row_id, __bswap_64(current_max_key.key), current_max_key.row_id);
+			TaggedPstMeta tmeta;
+			tmeta.meta = pst_builder->Flush();
+			tmeta.filter = pst_builder->TakeFilter();
+			outputs.emplace_back(tmeta);
+			if (!pst_builder->AddEntry(Slice(&key), Slice(&value)))
+				ERROR_EXIT("cannot add pst entry in compaction");
 		}
-		current_max_key = topkey;
-		while (!key_heap.empty() && key_heap.top().key == topkey.key)
+	};
+	auto add_block = [&](uint64_t datablock_addr, const std::vector<std::pair<uint64_t, uint64_t>> &entries)
+	{
+		if (!pst_builder->AddDataBlock(datablock_addr, entries))
 		{
-			DEBUG("重合key %lu from row %d with row %d", __bswap_64(topkey.key), topkey.row_id, key_heap.top().row_id);
-			// 如果出现重合key，旧key直接next
-			if (rows[topkey.row_id].NextKey())
-			{
-				key_heap.push(KeyWithRowId{rows[topkey.row_id].GetCurrentKey(), topkey.row_id});
-			}
-			topkey = key_heap.top();
-			key_heap.pop();
+			TaggedPstMeta tmeta;
+			tmeta.meta = pst_builder->Flush();
+			tmeta.filter = pst_builder->TakeFilter();
+			outputs.emplace_back(tmeta);
+			if (!pst_builder->AddDataBlock(datablock_addr, entries))
+				ERROR_EXIT("cannot add pst datablock in compaction");
 		}
+	};
+	// put the winner row back with its next key in range
+	auto update_top = [&](RowIterator &row, bool valid)
+	{
+		if (valid && row.GetCurrentNativeKey() <= native_max)
+			tree.Replace(row.GetCurrentNativeKey());
+		else
+			tree.Pop();
+	};
 
-		RowIterator &row = rows[topkey.row_id];
-		bool is_overlapped = 0;
+	size_t count = 0;
+	size_t marked_output = 0;
+	size_t reused_blocks = 0;
+	bool has_last = false;
+	uint64_t last_key = 0;
+	while (!tree.Empty())
+	{
+		int row_id = tree.Top();
+		uint64_t key = tree.TopKey();
+		RowIterator &row = rows[row_id];
+		if (has_last && key <= last_key)
+		{
+			if (unlikely(key < last_key))
+				ERROR_EXIT("Reverse order found in Compaction %lu(%d)<%lu", key, row_id, last_key);
+			// 如果出现重合key，旧key直接next
+			DEBUG("重合key %lu from row %d", key, row_id);
+			update_top(row, row.NextKey());
+			continue;
+		}
 		if (row.pst_iter_ == nullptr)
 		{
 			// the key is the first key in a pst, now check if the pst is overlapped with other pst
-			uint64_t max = row.GetPst().meta.max_key_;
+			uint64_t max = __bswap_64(row.GetPst().meta.max_key_);
+			bool is_overlapped = false;
 			for (int i = 0; i < rows.size(); i++)
 			{
-				if (i == topkey.row_id)
-					continue;
-				if (!rows[i].Valid())
+				if (i == row_id || !rows[i].Valid())
 					continue;
-				if (__bswap_64(rows[i].GetCurrentKey()) < __bswap_64(max))
+				// a key equal to max overlaps too, the reused pst must not hide a newer version of it
+				if (rows[i].GetCurrentNativeKey() <= max)
 				{
-					is_overlapped = 1;
+					is_overlapped = true;
 					break;
 				}
 			}
-			if (!is_overlapped)
+			// a pst crossing the end of the range is split, the next partition takes its other part.
+			// Level2 keeps only psts with datablocks on ssd
+			if (!is_overlapped && max <= native_max && (output_level_ != 2 || row.GetPst().level == 2))
 			{
-				LOG("jump,topkey=%lu,max=%lu, is overlapped=%d", __bswap_64(topkey.key), __bswap_64(max), is_overlapped);
+				LOG("jump,topkey=%lu,max=%lu", key, max);
 				// not overlapped: directly use the pst as output
 				TaggedPstMeta tmeta;
-				tmeta.meta = pst_builder_.Flush();
-				outputs_.emplace_back(tmeta);
+				tmeta.meta = pst_builder->Flush();
+				tmeta.filter = pst_builder->TakeFilter();
+				outputs.emplace_back(tmeta);
 				TaggedPstMeta tmeta2 = row.GetPst();
 				row.MarkPst();
 				marked_output++;
-				outputs_.emplace_back(tmeta2);
-				if (row.NextPst())
-					key_heap.push(KeyWithRowId{row.GetCurrentKey(), topkey.row_id});
+				outputs.emplace_back(tmeta2);
+				has_last = true;
+				last_key = max;
+				update_top(row, row.NextPst());
 				continue;
 			}
+			// overlapped: read the pst, add entries to output pst
+			row.ResetPstIter();
+		}
+		// the winner keeps winning until it reaches the first key of the runner-up, take its entries
+		// without replaying the tree. The next pst of the row goes back to the tree since it may be reused as a whole.
+		int runner_up = tree.RunnerUp();
+		while (true)
+		{
+			PSTReader::Iterator &iter = *row.pst_iter_;
+			assert(iter.NativeKey() == key);
+			bool valid;
+			// a full datablock ending before the runner-up is referenced by the output instead of rewritten,
+			// partial ones are rewritten so that reuse does not pile them up. Datablocks on ssd are never shared
+			if (output_level_ != 2 && iter.current_record_index_ == 0 && iter.records_.size() == PDataBlock::MAX_ENTRIES &&
+				!FilePtr::IsFilePtr(iter.indexes_[iter.current_datablock_index_].second) && iter.native_keys_.back() <= native_max &&
+				(runner_up < 0 || iter.native_keys_.back() < tree.Key(runner_up)))
+			{
+				add_block(iter.indexes_[iter.current_datablock_index_].second, iter.records_);
+				reused_blocks++;
+				last_key = iter.native_keys_.back();
+				valid = row.NextDataBlock();
+			}
 			else
 			{
-				// overlapped: read the pst, add entry to output pst
-				row.ResetPstIter();
-				uint64_t key, value;
-				key = row.pst_iter_->Key();
-				// DEBUG("first key: %lu, topkey:%lu",__bswap_64(key),__bswap_64(topkey.key));
-				assert(key == topkey.key);
-				value = row.pst_iter_->Value();
-				auto success = pst_builder_.AddEntry(Slice(&key), Slice(&value));
-				if (!success)
-				{
-					auto meta = pst_builder_.Flush();
-					// add meta into manifest
-					TaggedPstMeta tmeta;
-					tmeta.meta = meta;
-					outputs_.emplace_back(tmeta);
-					if (!pst_builder_.AddEntry(Slice(&key), Slice(&value)))
-						ERROR_EXIT("cannot add pst entry in compaction");
-				}
+				add_entry(iter.Key(), iter.Value());
+				count++;
+				last_key = key;
+				valid = row.NextKey();
 			}
-		}
-		else
-		{
-			// not the first key in pst : add entry to output pst
-			uint64_t key, value;
-			key = row.pst_iter_->Key();
-			// DEBUG("key: %lu, topkey:%lu",__bswap_64(key),__bswap_64(topkey.key));
-			assert(key == topkey.key);
-			value = row.pst_iter_->Value();
-			auto success = pst_builder_.AddEntry(Slice(&key), Slice(&value));
-			if (!success)
+			has_last = true;
+			if (!valid)
 			{
-				auto meta = pst_builder_.Flush();
-				// add meta into manifest
-				TaggedPstMeta tmeta;
-				tmeta.meta = meta;
-				outputs_.emplace_back(tmeta);
-				if (!pst_builder_.AddEntry(Slice(&key), Slice(&value)))
-					ERROR_EXIT("cannot add pst entry in compaction");
+				tree.Pop();
+				break;
+			}
+			key = row.GetCurrentNativeKey();
+			if (row.pst_iter_ == nullptr || key > native_max || (runner_up >= 0 && key >= tree.Key(runner_up)))
+			{
+				update_top(row, true);
+				break;
 			}
-		}
-
-		if (row.NextKey())
-		{
-			// DEBUG("next key=%lu,row.pst_iter_=%lu",__bswap_64(row.GetCurrentKey()),(uint64_t)row.pst_iter_);
-			key_heap.push(KeyWithRowId{row.GetCurrentKey(), topkey.row_id});
 		}
 	}
-	auto meta = pst_builder_.Flush();
-	// add meta into manifest
 	TaggedPstMeta tmeta;
-	tmeta.meta = meta;
-	outputs_.emplace_back(tmeta);
-	DEBUG("output=%lu,marked=%lu,rewrite key num=%lu", outputs_.size(), marked_output, count);
-	// for(int i=0;i<inputs_.size();i++){
-	//     for(auto& pst:inputs_[i]){
-	//         DEBUG("input[%d]:level=%lu,min=%lu,max=%lu",i,pst.level,__bswap_64(pst.meta.min_key_), __bswap_64(pst.meta.max_key_));
-	//     }
-	// }
+	tmeta.meta = pst_builder->Flush();
+	tmeta.filter = pst_builder->TakeFilter();
+	outputs.emplace_back(tmeta);
+	DEBUG("output=%lu,marked=%lu,reused datablocks=%lu,rewrite key num=%lu", outputs.size(), marked_output, reused_blocks, count);
+	reused_blocks_.fetch_add(reused_blocks);
+	return count;
+}
+
+bool CompactionJob::RunCompaction()
+{
+	MergeInputs(&pst_builder_, outputs_, 0, MAX_UINT64);
 	pst_builder_.PersistCheckpoint();
-	rows.clear();
-	for (auto &pr : readers)
-	{
-		delete pr;
-	}
 	return true;
 }
 struct SubCompactionArgs
@@ -228,6 +358,8 @@ bool CompactionJob::RunSubCompactionParallel()
 {
 	for (int i = 0; i < RANGE_PARTITION_NUM; i++)
 	{
+		if (!(compacted_partitions_ >> i & 1))
+			continue;
 		SubCompactionArgs *sca = new SubCompactionArgs(this,i);
 		// printf("schedule %d\n",sca->partition_id_);
 		compaction_thread_pool_->Schedule(&CompactionJob::TriggerSubCompaction,sca,sca,nullptr);
@@ -239,153 +371,34 @@ bool CompactionJob::RunSubCompactionParallel()
 void CompactionJob::RunSubCompaction(int partition_id)
 {
 	// DEBUG2("sub compaction %d", partition_id);
-	PSTBuilder *pst_builder = partition_pst_builder_[partition_id] = new PSTBuilder(seg_allocater_);
-	std::priority_queue<KeyWithRowId, std::vector<KeyWithRowId>, UintKeyComparator> key_heap(cmp);
-	std::vector<RowIterator> rows;
-	std::vector<PSTReader *> readers;
-	size_t marked_output = 0;
+	stopwatch_t sw;
+	sw.start();
+	PSTBuilder *pst_builder = partition_pst_builder_[partition_id] = new PSTBuilder(seg_allocater_, output_level_ == 2);
+	pst_builder->SetBloomBitsPerKey(version_->GetBloomBitsPerKey());
 	PartitionInfo &partition = partition_info_[partition_id];
-	// initialize: init RowIter, add first key to heap, check overlapping for each first key
-	for (int i = 0; i < inputs_.size(); i++)
-	{
-		if (inputs_[i].empty())
-			continue;
-		auto pr = new PSTReader(seg_allocater_);
-		readers.push_back(pr);
-		rows.emplace_back(pr, inputs_[i]);
-		if (!rows[i].MoveTo(partition.min_key))
-			continue;
-		auto kwr = KeyWithRowId{rows[i].GetCurrentKey(), i};
-		if (__bswap_64(kwr.key) <= __bswap_64(partition.max_key))
-		{
-			key_heap.push(kwr);
-			// DEBUG2("input %d ok! %lx < %lx",i,__bswap_64(kwr.key),__bswap_64(partition.max_key));
-		}
-	}
-	size_t count = 0;
-	KeyWithRowId current_max_key = {0, -1};
-	// Get key from heap and get the value from row
-	while (!key_heap.empty())
-	{
-		auto topkey = key_heap.top();
-		key_heap.pop();
-		if (unlikely(__bswap_64(topkey.key) < __bswap_64(current_max_key.key)))
-		{
-			ERROR_EXIT("Reverse order found in Compaction %lu(%d)<%lu(%d)", __bswap_64(topkey.key), topkey.row_id, __bswap_64(current_max_key.key), current_max_key.row_id);
-		}
-		current_max_key = topkey;
-		// 如果出现重合key，旧key直接next
-		while (!key_heap.empty() && key_heap.top().key == topkey.key)
-		{
-			DEBUG("重合key %lu from row %d with row %d", __bswap_64(topkey.key), topkey.row_id, key_heap.top().row_id);
-
-			if (rows[topkey.row_id].NextKey())
-			{
-				auto kwr = KeyWithRowId{rows[topkey.row_id].GetCurrentKey(), topkey.row_id};
-				if (__bswap_64(kwr.key) <= __bswap_64(partition.max_key))
-					key_heap.push(kwr);
-			}
-			topkey = key_heap.top();
-			key_heap.pop();
-		}
-
-		RowIterator &row = rows[topkey.row_id];
-		bool is_overlapped = 0;
-		if (row.pst_iter_ == nullptr)
-		{
-			// the key is the first key in a pst, now check if the pst is overlapped with other pst
-			uint64_t max = row.GetPst().meta.max_key_;
-			for (int i = 0; i < rows.size(); i++)
-			{
-				if (i == topkey.row_id)
-					continue;
-				if (!rows[i].Valid())
-					continue;
-				if (__bswap_64(rows[i].GetCurrentKey()) < __bswap_64(max))
-				{
-					is_overlapped = 1;
-					break;
-				}
-			}
-			if (!is_overlapped)
-			{
-				LOG("jump,topkey=%lu,max=%lu, is overlapped=%d", __bswap_64(topkey.key), __bswap_64(max), is_overlapped);
-				// not overlapped: directly use the pst as output
-				TaggedPstMeta tmeta;
-				tmeta.meta = pst_builder->Flush();
-				partition_outputs_[partition_id].emplace_back(tmeta);
-				TaggedPstMeta tmeta2 = row.GetPst();
-				row.MarkPst();
-				marked_output++;
-				partition_outputs_[partition_id].emplace_back(tmeta2);
-				if (row.NextPst())
-				{
-					auto kwr = KeyWithRowId{rows[topkey.row_id].GetCurrentKey(), topkey.row_id};
-					if (__bswap_64(kwr.key) <= __bswap_64(partition.max_key))
-						key_heap.push(kwr);
-				}
-				continue;
-			}
-			else
-			{
-				// overlapped: read the pst, add entry to output pst
-				row.ResetPstIter();
-				uint64_t key, value;
-				key = row.pst_iter_->Key();
-				// DEBUG("first key: %lu, topkey:%lu",__bswap_64(key),__bswap_64(topkey.key));
-				assert(key == topkey.key);
-				value = row.pst_iter_->Value();
-				auto success = pst_builder->AddEntry(Slice(&key), Slice(&value));
-				if (!success)
-				{
-					auto meta = pst_builder->Flush();
-					// add meta into manifest
-					TaggedPstMeta tmeta;
-					tmeta.meta = meta;
-					partition_outputs_[partition_id].emplace_back(tmeta);
-					if (!pst_builder->AddEntry(Slice(&key), Slice(&value)))
-						ERROR_EXIT("cannot add pst entry in compaction");
-				}
-			}
-		}
-		else
-		{
-			// not the first key in pst : add entry to output pst
-			uint64_t key, value;
-			key = row.pst_iter_->Key();
-			assert(key == topkey.key);
-			value = row.pst_iter_->Value();
-			auto success = pst_builder->AddEntry(Slice(&key), Slice(&value));
-			if (!success)
-			{
-				auto meta = pst_builder->Flush();
-				// add meta into manifest
-				TaggedPstMeta tmeta;
-				tmeta.meta = meta;
-				partition_outputs_[partition_id].emplace_back(tmeta);
-				if (!pst_builder->AddEntry(Slice(&key), Slice(&value)))
-					ERROR_EXIT("cannot add pst entry in compaction");
-			}
-		}
+	size_t count = MergeInputs(pst_builder, partition_outputs_[partition_id], partition.min_key, partition.max_key);
+	uint64_t us = sw.elapsed<std::chrono::microseconds>();
+	partition_us_[partition_id] = us;
+	merged_keys_.fetch_add(count);
+	merge_us_.fetch_add(us);
+}
 
-		if (row.NextKey())
-		{
-			auto kwr = KeyWithRowId{rows[topkey.row_id].GetCurrentKey(), topkey.row_id};
-			if (__bswap_64(kwr.key) <= __bswap_64(partition.max_key))
-				key_heap.push(kwr);
-		}
-	}
-	auto meta = pst_builder->Flush();
-	// add meta into manifest
-	TaggedPstMeta tmeta;
-	tmeta.meta = meta;
-	partition_outputs_[partition_id].emplace_back(tmeta);
-	// pst_builder.PersistCheckpoint();
-	rows.clear();
-	for (auto &pr : readers)
+double CompactionJob::GetPartitionSkew()
+{
+	uint64_t max_us = 0, total_us = 0;
+	for (int i = 0; i < RANGE_PARTITION_NUM; i++)
 	{
-		delete pr;
+		max_us = std::max(max_us, partition_us_[i]);
+		total_us += partition_us_[i];
 	}
+	return total_us ? (double)max_us * GetCompactedPartitionNum() / total_us : 1;
+}
+
+void CompactionJob::DropInput(const TaggedPstMeta &pst, int level, std::vector<PSTMeta> &obsolete_psts)
+{
+	if (pst.level != NotOverlappedMark)
+		obsolete_psts.push_back(pst.meta);
+	manifest_->DeleteTable(pst.manifest_position, level);
 }
 
 void CompactionJob::CleanCompaction()
@@ -393,6 +406,9 @@ void CompactionJob::CleanCompaction()
 	// 1. add outputs to level 1 index
 	for (auto &pst : outputs_)
 	{
+		// flushing an empty builder gives an invalid pst
+		if (!pst.meta.Valid())
+			continue;
 		pst.meta.seq_no_ = output_seq_no_;
 		pst.level = 1;
 		pst.manifest_position = manifest_->AddTable(pst.meta, 1);
@@ -408,37 +424,24 @@ void CompactionJob::CleanCompaction()
 	// delete inputs[-1](except for .level=1) from level 1 index
 	for (auto &pst : inputs_[inputs_.size() - 1])
 	{
-		// recycle segment space, note that no need to recycle pst whose seq_no = output_seq_no_
-		version_->DeleteTableInL1(pst.meta);
+		// a reused pst is an output now, it was inserted again with the same max key
 		if (pst.level != NotOverlappedMark)
-		{
-			pst_deleter_.DeletePST(pst.meta);
-		}
+			version_->DeleteTableInL1(pst.meta);
 	}
-	pst_deleter_.PersistCheckpoint();
+	// readers switch to the new level 1 index before the input psts are recycled
+	version_->PublishLevel1Index();
+	std::vector<PSTMeta> obsolete_psts;
 	for (auto &pst : inputs_[inputs_.size() - 1])
-	{
-		manifest_->DeleteTable(pst.manifest_position, 1);
-	}
+		DropInput(pst, 1, obsolete_psts);
 	// delete level 0 trees;
 	for (int i = 0; i < tree_num; i++)
 	{
 		version_->FreeLevel0Tree();
 
 		for (auto &pst : inputs_[i])
-		{
-			// DEBUG("delete pst in inputs_[%d]",i);
-			// recycle segment space, note that no need to recycle pst whose seq_no = output_seq_no_
-			// Better to wait for the reader to finish reading
-			if (pst.level != NotOverlappedMark)
-			{
-				assert(pst.level == 0);
-				pst_deleter_.DeletePST(pst.meta);
-			}
-			manifest_->DeleteTable(pst.manifest_position, 0);
-		}
+			DropInput(pst, 0, obsolete_psts);
 	}
-	pst_deleter_.PersistCheckpoint();
+	version_->RetireInputPSTs(std::move(obsolete_psts));
 
 	total_L1_num = total_L1_num + outputs_.size() - inputs_[inputs_.size() - 1].size();
 	INFO("L1 add %lu pst, delete %lu pst, total %lu pst", outputs_.size(), inputs_[inputs_.size() - 1].size(), total_L1_num);
@@ -449,9 +452,13 @@ void CompactionJob::CleanCompactionWhenUsingSubCompaction()
 	// 1. add outputs to level 1 index
 	for (int i = 0; i < RANGE_PARTITION_NUM; i++)
 	{
+		if (!partition_pst_builder_[i])
+			continue;
 		auto outputs = partition_outputs_[i];
 		for (auto &pst : outputs)
 		{
+			if (!pst.meta.Valid())
+				continue;
 			pst.meta.seq_no_ = output_seq_no_;
 			pst.level = 1;
 			pst.manifest_position = manifest_->AddTable(pst.meta, 1);
@@ -464,43 +471,85 @@ void CompactionJob::CleanCompactionWhenUsingSubCompaction()
 	// 2. change version in manifest
 	manifest_->UpdateL1Version(output_seq_no_);
 	int tree_num = inputs_.size() - 1;
-	manifest_->UpdateL0Version(manifest_->GetL0Version() + tree_num);
 
 	// 3. delete obsolute PSTs
 	// delete inputs[-1](except for .level=1) from level 1 index
 	for (auto &pst : inputs_[inputs_.size() - 1])
 	{
-		// recycle segment space, note that no need to recycle pst whose seq_no = output_seq_no_
-		version_->DeleteTableInL1(pst.meta);
+		// a reused pst is an output now, it was inserted again with the same max key
 		if (pst.level != NotOverlappedMark)
-		{
-			pst_deleter_.DeletePST(pst.meta);
-		}
+			version_->DeleteTableInL1(pst.meta);
 	}
-	pst_deleter_.PersistCheckpoint();
+	// readers switch to the new level 1 index before the input psts are recycled
+	version_->PublishLevel1Index();
+	std::vector<PSTMeta> obsolete_psts;
 	for (auto &pst : inputs_[inputs_.size() - 1])
+		DropInput(pst, 1, obsolete_psts);
+	// level 0 trees skip the compacted partitions from now on. Their psts leave the manifest from the oldest tree on,
+	// a crash in between leaves newer versions to be merged again, never older ones
+	for (int i = tree_num - 1; i >= 0; i--)
 	{
-		manifest_->DeleteTable(pst.manifest_position, 1);
+		version_->MarkLevel0TreeCompacted(tree_idxs_[i], compacted_partitions_ | (ALL_PARTITIONS & ~tree_partitions_[i]), partition_info_);
+		for (auto &pst : inputs_[i])
+		{
+			if (compacted_partitions_ >> PartitionOf(__bswap_64(pst.meta.min_key_)) & 1)
+				DropInput(pst, 0, obsolete_psts);
+		}
 	}
-	// delete level 0 trees;
-	for (int i = 0; i < tree_num; i++)
+	// delete level 0 trees whose partitions are all compacted;
+	freed_trees_ = version_->FreeCompactedLevel0Trees();
+	manifest_->UpdateL0Version(manifest_->GetL0Version() + freed_trees_);
+	version_->RetireInputPSTs(std::move(obsolete_psts));
+}
+void CompactionJob::CleanLevel2Compaction()
+{
+	// 1. record the outputs, psts of level2 moved as they are keep their manifest records
+	std::vector<TaggedPstMeta> added;
+	for (int i = 0; i < RANGE_PARTITION_NUM; i++)
 	{
-		version_->FreeLevel0Tree();
-
-		for (auto &pst : inputs_[i])
+		if (!partition_pst_builder_[i])
+			continue;
+		for (auto &pst : partition_outputs_[i])
 		{
-			// DEBUG("delete pst in inputs_[%d]",i);
-			// recycle segment space, note that no need to recycle pst whose seq_no = output_seq_no_
-			// Better to wait for the reader to finish reading
-			if (pst.level != NotOverlappedMark)
+			if (!pst.meta.Valid())
+				continue;
+			if (pst.level != 2)
 			{
-				assert(pst.level == 0);
-				pst_deleter_.DeletePST(pst.meta);
+				pst.meta.seq_no_ = output_seq_no_;
+				pst.level = 2;
+				pst.manifest_position = manifest_->AddTable(pst.meta, 2);
 			}
-			manifest_->DeleteTable(pst.manifest_position, 0);
+			added.push_back(pst);
 		}
+		// datablocks on ssd are synced before the outputs become valid
+		partition_pst_builder_[i]->PersistCheckpoint();
+		delete partition_pst_builder_[i];
+		partition_pst_builder_[i] = nullptr;
 	}
-	pst_deleter_.PersistCheckpoint();
+	output_num_ = added.size();
+
+	// 2. change version in manifest, a crash from now on keeps the outputs
+	manifest_->UpdateL2Version(output_seq_no_);
+
+	// 3. readers find the keys in level2 before they leave level1
+	std::vector<TaggedPstMeta> deleted;
+	for (auto &pst : inputs_[1])
+	{
+		if (pst.level != NotOverlappedMark)
+			deleted.push_back(pst);
+	}
+	version_->ReplaceLevel2Tables(deleted, added);
+	for (auto &pst : inputs_[0])
+		version_->DeleteTableInL1(pst.meta);
+	version_->PublishLevel1Index();
+
+	// 4. delete obsolete psts, level1 ones left by a crash are newer versions of their keys and merged again
+	std::vector<PSTMeta> obsolete_psts;
+	for (auto &pst : inputs_[0])
+		DropInput(pst, 1, obsolete_psts);
+	for (auto &pst : deleted)
+		DropInput(pst, 2, obsolete_psts);
+	version_->RetireInputPSTs(std::move(obsolete_psts));
 }
 bool CompactionJob::RollbackCompaction()
 {
@@ -4,6 +4,7 @@
 #include "db/pst_builder.h"
 #include "db/pst_reader.h"
 #include "db/pst_deleter.h"
+#include <atomic>
 #include <vector>
 
 class Version;
@@ -16,33 +17,77 @@ private:
     Version *version_;
     Manifest *manifest_;
     PSTBuilder pst_builder_;
-    PSTDeleter pst_deleter_;
+    // 1: level0 trees are merged into level1 on pm, 2: level1 psts are merged into level2 on ssd
+    const int output_level_;
     const unsigned output_seq_no_;
 
     std::vector<std::vector<TaggedPstMeta>> inputs_;
     std::vector<TaggedPstMeta> outputs_;
+	// slot of the level0 tree of each input row, and the partitions it has psts in
+	std::vector<int> tree_idxs_;
+	std::vector<uint32_t> tree_partitions_;
+	// partitions merged by this job, the others stay in level0
+	uint32_t compacted_partitions_ = 0;
+	int freed_trees_ = 0;
+	// valid psts added to the output level by the clean step
+	size_t output_num_ = 0;
 	std::vector<TaggedPstMeta> partition_outputs_[RANGE_PARTITION_NUM];
 
-    // temp variables
+    // temp variables, native key range of the compacted level0 psts
     size_t min_key_ = MAX_UINT64;
     size_t max_key_ = 0;
 
 	//for sub compaction
-	PartitionInfo *partition_info_;
-    PSTBuilder* partition_pst_builder_[RANGE_PARTITION_NUM];
+	// copied at creation, the db may rebalance its partitions while the job runs
+	PartitionInfo partition_info_[RANGE_PARTITION_NUM];
+    PSTBuilder* partition_pst_builder_[RANGE_PARTITION_NUM] = {};
 	ThreadPoolImpl* compaction_thread_pool_;
+	std::atomic<size_t> merged_keys_{0};
+	std::atomic<uint64_t> merge_us_{0};
+	std::atomic<size_t> reused_blocks_{0};
+	uint64_t partition_us_[RANGE_PARTITION_NUM] = {};
+
+	/**
+	 * @brief merge the keys of inputs_ in [min_key, max_key] into pst_builder with a loser tree,
+	 * the newest version of a key wins. psts not overlapped with other inputs are moved to outputs as they are,
+	 * full datablocks not overlapped are referenced by the output psts.
+	 *
+	 * @return number of entries rewritten
+	 */
+	size_t MergeInputs(PSTBuilder *pst_builder, std::vector<TaggedPstMeta> &outputs, uint64_t min_key, uint64_t max_key);
+	int PartitionOf(uint64_t native_key);
+	/**
+	 * @brief delete the manifest record of an input pst, its pages go to obsolete_psts unless it was reused as an output
+	 */
+	void DropInput(const TaggedPstMeta &pst, int level, std::vector<PSTMeta> &obsolete_psts);
 
 public:
-    CompactionJob(SegmentAllocator *seg_alloc, Version *target_version, Manifest *manifest,PartitionInfo* partition_info,ThreadPoolImpl* thread_pool);
+    CompactionJob(SegmentAllocator *seg_alloc, Version *target_version, Manifest *manifest,const PartitionInfo* partition_info,ThreadPoolImpl* thread_pool, int output_level = 1);
     ~CompactionJob();
 
     bool CheckPmRoomEnough(); // with segment allocator
     /**
-     * @brief get all overlapped input psts from version_ to inputs_
-     * 
+     * @brief pick the partitions to compact and their input psts from version_ to inputs_.
+     * A partition is due once its level0 entries reach half of its even share of the entries flushed since the
+     * last compaction, so hot partitions are compacted every time and cold ones gather data over several.
+     *
+     * @param all_partitions compact every partition holding level0 data, freeing all picked trees
+     * @param max_level0_trees with this many trees, the partitions of the oldest tree are compacted to free it
      * @return L0 tree number in the compaction
      */
-    size_t PickCompaction();
+    size_t PickCompaction(bool all_partitions = true, int max_level0_trees = MAX_L0_TREE_NUM);
+	/**
+	 * @brief pick level1 psts holding max_bytes of pm from the cursor on, and the level2 psts they overlap.
+	 * Only for a job with output level 2, run it with RunSubCompactionParallel and CleanLevel2Compaction
+	 *
+	 * @param cursor native key where the next L1->L2 compaction starts, so that level1 is moved down round-robin
+	 * @return number of level1 psts picked
+	 */
+	size_t PickLevel2Compaction(size_t max_bytes, uint64_t *cursor);
+	/**
+	 * @brief upper estimate of the level2 psts written by the picked L1->L2 compaction
+	 */
+	size_t EstimateLevel2OutputNum() const;
     /**
      * @brief merge sorting inputs, writing all output psts to pm 
      *          currently, we persist manifests of outputs, but not persist data (for consistency check when recovery)
@@ -52,6 +97,21 @@ public:
     bool RunSubCompactionParallel();
 	void RunSubCompaction(int partition_id);
 	/**
+	 * @brief entries rewritten by the sub compactions and the time they spent, summed over the threads
+	 */
+	size_t GetMergedKeys() const { return merged_keys_.load(); }
+	uint64_t GetMergeMicros() const { return merge_us_.load(); }
+	/**
+	 * @brief datablocks of the inputs referenced by the outputs instead of rewritten
+	 */
+	size_t GetReusedDataBlocks() const { return reused_blocks_.load(); }
+	/**
+	 * @brief time of the slowest sub compaction over the average one, 1 when the compacted partitions carry equal work
+	 */
+	double GetPartitionSkew();
+	int GetCompactedPartitionNum() const { return __builtin_popcount(compacted_partitions_); }
+	int GetFreedTreeNum() const { return freed_trees_; }
+	/**
      * @brief persist data and metadata(manifest) of all output psts, and update L0 and L1 volatile indexes
      * 
      * @return true 
@@ -59,6 +119,12 @@ public:
      */
     void CleanCompaction();
 	void CleanCompactionWhenUsingSubCompaction();
+	/**
+	 * @brief record the level2 outputs, then delete the picked level1 psts and the replaced level2 psts
+	 */
+	void CleanLevel2Compaction();
+	size_t GetLevel2InputNum() const { return inputs_.size() == 2 ? inputs_[1].size() : 0; }
+	size_t GetOutputNum() const { return output_num_; }
     bool RollbackCompaction();
 
 	static void TriggerSubCompaction(void *arg);
@@ -1,7 +1,7 @@
 /**
  * @file flush.cpp
  * @author your name (you@domain.com)
- * @brief core steps: 1. iterate all items in the memtable index and copy them into a sorted array
+ * @brief core steps: 1. stream the items of the memtable index in key order, one range partition per thread
  *        2. get the address of log entries and arrange them to (new vindex? record-grained pindex? pst?)
  *        3. delete index
  *        4. release (or mark with oplog?) the participant log segments for crash-consistentcy
@@ -14,11 +14,17 @@
 #include "flush.h"
 #include "manifest.h"
 #include "version.h"
+#include "lib/ThreadPool/include/threadpool.h"
+#include "lib/ThreadPool/include/threadpool_imp.h"
+#include "db/merging_iterator.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
 #include <queue>
 
-inline void FlushJob::FlushPST()
+inline void FlushJob::FlushPST(PSTBuilder &pst_builder, int partition_id)
 {
-	auto meta = pst_builder_.Flush();
+	auto meta = pst_builder.Flush();
 	meta.seq_no_ = tree_seq_no_;
 	if (meta.Valid())
 	{
@@ -27,84 +33,94 @@ inline void FlushJob::FlushPST()
 		tmeta.meta = meta;
 		tmeta.level = 0;
 		tmeta.manifest_position = manifest_->AddTable(meta, 0);
-		version_->InsertTableToL0(tmeta, tree_idx_);
-		output_pst_list_.push_back(tmeta);
+		tmeta.filter = pst_builder.TakeFilter();
+		partition_outputs_[partition_id].push_back(tmeta);
 	}
 }
 
-bool FlushJob::run()
+size_t FlushJob::RunSubFlush(int partition_id, BlockedBloomFilter *tree_filter)
 {
-	// iterate index to get kv list
-	LOG("iterate index(scan2)");
-	std::vector<uint64_t> keys, values; // TODO: try to avoid memory allocate/free overhead
-	memtable_index_->Scan2(0, MAX_INT32, keys, values);
-	LOG("scan2 result: size= %lu", keys.size());
-	// build psts and version
-	LOG("add level0 tree");
-	tree_seq_no_ = version_->GetCurrentL0TreeSeq();
-	tree_idx_ = version_->AddLevel0Tree();
-	while (tree_idx_ == -1)
-	{
-		INFO("can't addlevel0tree, waiting...");
-		usleep(100000);
-		tree_idx_ = version_->AddLevel0Tree();
-	}
-	LOG("tree_idx=%d, read log and build psts", tree_idx_);
-	PSTMeta meta;
+	PSTBuilder pst_builder(seg_allocater_);
+	pst_builder.SetBloomBitsPerKey(version_->GetBloomBitsPerKey());
+#if (defined INDEX_LOG_MEMTABLE) && !(defined KV_SEPARATE)
+	LogReader log_reader(seg_allocater_);
 	ValuePtr vptr;
+#endif
 	Slice key;
 	Slice value;
 	uint64_t k = 0, v = 0;
 	key = Slice(&k);
 	value = Slice(&v);
-	DEBUG("will flush %lu keys,key = %lu~%lu,", keys.size(), __bswap_64(keys[0]), __bswap_64(keys[keys.size() - 1]));
-
-	int cur_partition = 0;
-	Slice partition_max_key = Slice(&(partition_info_[cur_partition].max_key));
-
-	for (size_t i = 0; i < keys.size(); i++)
+	size_t count = 0;
+	uint64_t max_key = __bswap_64(partition_info_[partition_id].max_key);
+	// the memtable is frozen, the cursor copies a bounded batch at a time
+	MemtableRunIterator iter(memtable_index_, SCAN_BATCH_SIZE);
+	for (iter.Seek(__bswap_64(partition_info_[partition_id].min_key)); iter.Valid() && iter.Key() <= max_key; iter.Next())
 	{
-		k = keys[i];
-		// DEBUG("aa:%lu", __bswap_64(k));
+		k = __bswap_64(iter.Key());
+		if (tree_filter)
+			tree_filter->AddConcurrently(BlockedBloomFilter::Hash(k));
 #if (defined INDEX_LOG_MEMTABLE) && !(defined KV_SEPARATE)
-		vptr.data_ = values[i];
-		value = log_reader_.ReadLogForValue(key, vptr);
+		vptr.data_ = iter.Value();
+		value = log_reader.ReadLogForValue(key, vptr);
 #else
-		v = values[i];
+		v = iter.Value();
 #endif
-		while (unlikely(key.compare(partition_max_key) > 0))
-		{
-			FlushPST();
-			cur_partition++;
-			if(unlikely(cur_partition >= RANGE_PARTITION_NUM))ERROR_EXIT("key > max_key in the largest partition");
-			partition_max_key = Slice(&(partition_info_[cur_partition].max_key));
-		}
-
-		bool success = pst_builder_.AddEntry(key, value);
+		bool success = pst_builder.AddEntry(key, value);
 		if (!success)
 		{
-			FlushPST();
-			if (!pst_builder_.AddEntry(key, value))
+			FlushPST(pst_builder, partition_id);
+			if (!pst_builder.AddEntry(key, value))
 				ERROR_EXIT("cannot add pst entry in flush");
 		}
+		count++;
 	}
-	FlushPST();
+	FlushPST(pst_builder, partition_id);
+	return count;
+}
 
-	/** just for validation
-	RowIterator *row = new RowIterator(&pst_reader_, output_pst_list_);
-	size_t cmax = row->GetCurrentKey();
-	size_t kk;
-	while (kk = row->NextKey())
+bool FlushJob::run()
+{
+	LOG("tree_idx=%d, stream the memtable and build psts", tree_idx_);
+	// filter of the whole tree, checked before searching the tree
+	std::shared_ptr<BlockedBloomFilter> tree_filter;
+	if (version_->GetBloomBitsPerKey())
+		tree_filter = std::make_shared<BlockedBloomFilter>(memtable_entries_, version_->GetBloomBitsPerKey());
+
+	// sub flushes of the partitions, the last one on this thread
+	std::mutex done_mutex;
+	std::condition_variable done_cv;
+	int pending = RANGE_PARTITION_NUM - 1;
+	std::atomic<size_t> count{0};
+	for (int i = 0; i < RANGE_PARTITION_NUM - 1; i++)
 	{
-		if (__bswap_64(k) < __bswap_64(cmax))
-			ERROR_EXIT("error sequence");
-		cmax = k;
+		sub_flush_thread_pool_->SubmitJob([&, i]()
+										  {
+											  count += RunSubFlush(i, tree_filter.get());
+											  std::lock_guard<std::mutex> lock(done_mutex);
+											  if (--pending == 0)
+												  done_cv.notify_one(); });
 	}
-	delete row;
-	**/
+	count += RunSubFlush(RANGE_PARTITION_NUM - 1, tree_filter.get());
+	{
+		std::unique_lock<std::mutex> lock(done_mutex);
+		done_cv.wait(lock, [&pending]()
+					 { return pending == 0; });
+	}
+	LOG("flushed %lu entries, estimated %lu", count.load(), memtable_entries_);
+	for (auto &outputs : partition_outputs_)
+	{
+		for (auto &tmeta : outputs)
+			version_->InsertTableToL0(tmeta, tree_idx_);
+	}
+	// readable once installed
+	version_->SetLevel0TreeFilter(tree_idx_, tree_filter);
+	return true;
+}
 
-	// now the new tree can be read
-	version_->UpdateLevel0ReadTail();
+void FlushJob::Install()
+{
+	version_->PublishLevel0Tree(tree_idx_);
 	// delete obsolute index and log segments
 	std::vector<uint64_t> segment_list;
 	seg_allocater_->GetElementsFromLogGroup(seg_group_id_, &segment_list);
@@ -133,5 +149,4 @@ bool FlushJob::run()
 #ifndef KV_SEPARATE
 	manifest_->ClearFlushLog();
 #endif
-	return true;
 }
@@ -3,36 +3,61 @@
 #include "db/log_reader.h"
 #include "db/pst_builder.h"
 #include "db/pst_reader.h"
+#include <algorithm>
+#include <memory>
 #include <vector>
 
 class Version;
 class Manifest;
+class ThreadPoolImpl;
 class FlushJob
 {
 private:
+	// entries each sub flush copies from the memtable at a time
+	static constexpr int SCAN_BATCH_SIZE = 4096;
 	// input
-    Index *memtable_index_;
+    std::shared_ptr<Index> memtable_index_;
+    // estimated entries of the memtable, sizes the filter of the level0 tree
+    size_t memtable_entries_;
     int seg_group_id_;
     SegmentAllocator *seg_allocater_;
     Version *version_;
-    LogReader log_reader_;
-    PSTBuilder pst_builder_;
-    PSTReader pst_reader_;
     Manifest *manifest_;
-	PartitionInfo *partition_info_;
+	// copied at creation, the db may rebalance its partitions while the job runs
+	PartitionInfo partition_info_[RANGE_PARTITION_NUM];
+	// runs the sub flushes of all partitions but the last one, which runs on the calling thread
+	ThreadPoolImpl *sub_flush_thread_pool_;
 	// temp
 	uint32_t tree_seq_no_;
-	std::vector<TaggedPstMeta> output_pst_list_;
+	// psts of each range partition, inserted into the level0 tree in partition order after all sub flushes
+	std::vector<TaggedPstMeta> partition_outputs_[RANGE_PARTITION_NUM];
 	int tree_idx_;
 
 public:
-    FlushJob(Index *index, int seg_group_id, SegmentAllocator *seg_alloc, Version *target_version, Manifest *manifest, PartitionInfo* partition_info) : memtable_index_(index), seg_group_id_(seg_group_id), seg_allocater_(seg_alloc), version_(target_version), log_reader_(seg_allocater_), pst_builder_(seg_allocater_),pst_reader_(seg_allocater_), manifest_(manifest),partition_info_(partition_info)
-    {	
+    /**
+     * @param tree_idx level0 tree reserved by Version::AddLevel0Tree for this memtable
+     * @param tree_seq_no sequence number of that tree, newer memtables get larger ones
+     */
+    FlushJob(std::shared_ptr<Index> index, size_t memtable_entries, int seg_group_id, int tree_idx, uint32_t tree_seq_no, SegmentAllocator *seg_alloc, Version *target_version, Manifest *manifest, const PartitionInfo* partition_info, ThreadPoolImpl *sub_flush_thread_pool) : memtable_index_(std::move(index)), memtable_entries_(memtable_entries), seg_group_id_(seg_group_id), seg_allocater_(seg_alloc), version_(target_version), manifest_(manifest), sub_flush_thread_pool_(sub_flush_thread_pool), tree_seq_no_(tree_seq_no), tree_idx_(tree_idx)
+    {
+		std::copy(partition_info, partition_info + RANGE_PARTITION_NUM, partition_info_);
     }
     ~FlushJob(){};
 
     //use index to build persistent index blocks
     bool run();
+    /**
+     * @brief make the level0 tree readable and release the log segments of the memtable.
+     * Jobs may run in parallel, but Install must be called one at a time and in the order the trees were reserved.
+     */
+    void Install();
 private:
-	inline void FlushPST();
+	/**
+	 * @brief stream the memtable entries of one range partition into psts with its own PSTBuilder
+	 *
+	 * @param tree_filter if not null, gets the keys of the partition
+	 * @return entries flushed
+	 */
+	size_t RunSubFlush(int partition_id, BlockedBloomFilter *tree_filter);
+	inline void FlushPST(PSTBuilder &pst_builder, int partition_id);
 };
@@ -0,0 +1,44 @@
+#include "level1_index.h"
+#include "slice.h"
+
+Level1Index::Level1Index(std::vector<uint64_t> &&keys, std::vector<uint32_t> &&slots) : size_(keys.size()), slots_(std::move(slots))
+{
+    levels_.emplace_back(std::move(keys));
+    while (true)
+    {
+        auto &level = levels_.back();
+        level.resize((level.size() + FANOUT - 1) / FANOUT * FANOUT, MAX_UINT64);
+        if (level.size() <= FANOUT)
+            break;
+        std::vector<uint64_t> upper;
+        upper.reserve(level.size() / FANOUT);
+        for (size_t i = FANOUT - 1; i < level.size(); i += FANOUT)
+            upper.push_back(level[i]);
+        levels_.emplace_back(std::move(upper));
+    }
+}
+
+size_t Level1Index::LowerBound(uint64_t key) const
+{
+    if (size_ == 0)
+        return 0;
+    // descend from the root node, the child of a node is the first one whose last key >= key
+    size_t node = 0;
+    for (size_t level = levels_.size() - 1; level > 0; level--)
+    {
+        size_t child = node * FANOUT + CountLess(levels_[level].data() + node * FANOUT, key);
+        if (child * FANOUT >= levels_[level - 1].size())
+            return size_;
+        node = child;
+    }
+    size_t pos = node * FANOUT + CountLess(levels_[0].data() + node * FANOUT, key);
+    return pos < size_ ? pos : size_;
+}
+
+size_t Level1Index::MemoryUsage() const
+{
+    size_t bytes = slots_.capacity() * sizeof(uint32_t);
+    for (auto &level : levels_)
+        bytes += level.capacity() * sizeof(uint64_t);
+    return bytes;
+}
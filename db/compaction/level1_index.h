@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+/**
+ * @brief Immutable fence index of level 1: the max keys of all L1 psts in ascending order,
+ * each mapped to the slot of the pst in Version::level1_tables_.
+ * Keys are stored byte-swapped (native order) so that they compare as integers.
+ * A static 16-ary search tree over the sorted array (like a CSS-tree) finds the lower bound
+ * in log16(n) node visits without any allocation.
+ * It is never modified after Build; compaction publishes a new one instead.
+ *
+ */
+class Level1Index
+{
+public:
+    static constexpr size_t FANOUT = 16;
+
+    /**
+     * @param keys native-order max keys in ascending order
+     * @param slots slot of each key
+     */
+    Level1Index(std::vector<uint64_t> &&keys, std::vector<uint32_t> &&slots);
+    ~Level1Index() {}
+
+    size_t Size() const { return size_; }
+    uint64_t KeyAt(size_t pos) const { return levels_[0][pos]; }
+    uint32_t SlotAt(size_t pos) const { return slots_[pos]; }
+
+    /**
+     * @brief position of the first max key >= key, Size() if none
+     */
+    size_t LowerBound(uint64_t key) const;
+
+    /**
+     * @brief slot of the only pst which may contain key, -1 if key is larger than all max keys
+     */
+    int64_t Find(uint64_t key) const
+    {
+        size_t pos = LowerBound(key);
+        return pos < size_ ? (int64_t)slots_[pos] : -1;
+    }
+
+    /**
+     * @brief slot of the pst whose max key is exactly key, -1 if none
+     */
+    int64_t FindExact(uint64_t key) const
+    {
+        size_t pos = LowerBound(key);
+        return pos < size_ && levels_[0][pos] == key ? (int64_t)slots_[pos] : -1;
+    }
+
+    size_t MemoryUsage() const;
+
+private:
+    size_t size_;
+    std::vector<uint32_t> slots_;
+    // levels_[0] is the sorted key array, levels_[i] holds the last key of each node of levels_[i-1].
+    // Every level is padded with MAX_UINT64 to whole nodes.
+    std::vector<std::vector<uint64_t>> levels_;
+
+    static inline size_t CountLess(const uint64_t *node, uint64_t key)
+    {
+        size_t count = 0;
+        for (size_t i = 0; i < FANOUT; i++)
+            count += node[i] < key;
+        return count;
+    }
+};
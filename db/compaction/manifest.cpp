@@ -7,10 +7,16 @@
 #include "db/pst_deleter.h"
 #include <libpmem.h>
 #include <set>
+#include <unordered_set>
+#include <thread>
 
-Manifest::Manifest(char *pmem_addr, bool recover) : start_(pmem_addr), l0_start_(start_ + sizeof(ManifestSuperMeta)), l1_start_(l0_start_ + L0MetaSize), flush_log_start_(l1_start_ + L1MetaSize), end_(start_ + ManifestSize)
+Manifest::Manifest(char *pmem_addr, size_t mapped_len, size_t l2_slots, bool recover) : start_(pmem_addr), l0_start_(start_ + sizeof(ManifestSuperMeta)), l1_start_(l0_start_ + L0MetaSize), flush_log_start_(l1_start_ + L1MetaSize), l2_start_(flush_log_start_ + OpLogSize + PartitionMetaSize + sizeof(ManifestL2Meta)), end_(start_ + mapped_len)
 {
+    if (mapped_len < ManifestSize(0))
+        ERROR_EXIT("Manifest size %lu is below %lu, it was written in another manifest format", mapped_len, (size_t)ManifestSize(0));
     super_ = (ManifestSuperMeta *)pmem_addr;
+    partitions_ = (ManifestPartitionMeta *)(flush_log_start_ + OpLogSize);
+    l2_super_ = (ManifestL2Meta *)(flush_log_start_ + OpLogSize + PartitionMetaSize);
 
     if (!recover)
     {
@@ -20,19 +26,59 @@ Manifest::Manifest(char *pmem_addr, bool recover) : start_(pmem_addr), l0_start_
         super_->l0_min_valid_seq_no = 0;
         super_->l1_current_seq_no = 0;
         pmem_persist(super_, sizeof(ManifestSuperMeta));
+        partitions_->current = 0;
+        pmem_persist(&partitions_->current, sizeof(uint64_t));
+        l2_super_->l2_tail = 0;
+        l2_super_->l2_current_seq_no = 0;
+        l2_super_->l2_slots = l2_slots;
+        pmem_persist(l2_super_, sizeof(ManifestL2Meta));
+        // written last, a manifest is only recognized once the areas above are initialized
+        super_->magic = ManifestMagic;
+        super_->format_version = ManifestFormatVersion;
+        pmem_persist(&super_->magic, 2 * sizeof(uint32_t));
     }
     else
     {
         printf("recover mode\n");
+        if (super_->magic != ManifestMagic || super_->format_version != ManifestFormatVersion)
+            ERROR_EXIT("unsupported manifest format %u (magic %x), this build reads format %u. Rebuild the db from scratch",
+                       super_->format_version, super_->magic, ManifestFormatVersion);
     }
+    if (mapped_len != ManifestSize(l2_super_->l2_slots))
+        ERROR_EXIT("Manifest size %lu does not match %lu of %lu level2 slots", mapped_len, (size_t)ManifestSize(l2_super_->l2_slots), l2_super_->l2_slots);
     DEBUG("start=%lu, l0=%lu,l1=%lu,flush_log=%lu", (size_t)start_, (size_t)l0_start_, (size_t)l1_start_, (size_t)flush_log_start_);
-    INFO("MANIFEST:l0tail=%lu,l1tail=%lu", super_->l0_tail, super_->l1_tail);
+    INFO("MANIFEST:l0tail=%lu,l1tail=%lu,l2tail=%lu,l2slots=%lu", super_->l0_tail, super_->l1_tail, l2_super_->l2_tail, l2_super_->l2_slots);
 }
 Manifest::~Manifest() {}
 
 Version *Manifest::RecoverVersion(Version *version, SegmentAllocator *allocator)
 {
     PSTDeleter pst_deleter(allocator);
+    // datablocks reused by compaction are shared by several psts, count the references of all recorded psts
+    // before the invalid ones are deleted
+    {
+        PIndexReader index_reader(allocator);
+        std::vector<std::pair<uint64_t, uint64_t>> indexlist;
+        std::unordered_set<uint64_t> referenced;
+        for (int level = 0; level < 2; level++)
+        {
+            size_t level_tail = level ? super_->l1_tail : super_->l0_tail;
+            for (size_t i = 0; i < level_tail; i++)
+            {
+                PSTMeta *meta = (PSTMeta *)GetAddr(i, level);
+                if (meta->indexblock_ptr_ == 0)
+                    continue;
+                indexlist.clear();
+                index_reader.ReadPIndexBlock(meta->indexblock_ptr_, indexlist);
+                for (auto &datablock : indexlist)
+                {
+                    if (!referenced.insert(datablock.second).second)
+                        allocator->AddDataBlockRef(datablock.second);
+                }
+            }
+        }
+        DEBUG("%lu datablocks, %lu shared", referenced.size(), allocator->GetSharedDataBlockNum());
+    }
     // recover level0
     size_t tail = super_->l0_tail;
     PSTMeta *meta;
@@ -58,7 +104,8 @@ Version *Manifest::RecoverVersion(Version *version, SegmentAllocator *allocator)
                 TaggedPstMeta tmeta{
                     .meta = *meta,
                     .level = 0,
-                    .manifest_position = i};
+                    .manifest_position = i,
+                    .filter = nullptr};
                 version->InsertTableToL0(tmeta, meta->seq_no_ - min_tree_seq);
                 // DEBUG("add pst %lu-%lu at L0 tree %u",__bswap_64(meta->min_key_),__bswap_64(meta->max_key_),meta->seq_no_);
             }
@@ -74,9 +121,10 @@ Version *Manifest::RecoverVersion(Version *version, SegmentAllocator *allocator)
     version->UpdateLevel0ReadTail();
 
     // recover level1
-    // tail = super_->l1_tail;
+    tail = super_->l1_tail;
     unsigned current_L1_version = super_->l1_current_seq_no;
     DEBUG("l1_version=%u", current_L1_version);
+    PIndexReader index_reader(allocator);
     for (size_t i = 0; i < tail; i++)
     {
         meta = (PSTMeta *)GetAddr(i, 1);
@@ -93,7 +141,10 @@ Version *Manifest::RecoverVersion(Version *version, SegmentAllocator *allocator)
                 TaggedPstMeta tmeta{
                     .meta = *meta,
                     .level = 1,
-                    .manifest_position = i};
+                    .manifest_position = i,
+                    .filter = nullptr};
+                // all datablocks of a level1 pst are on the same medium
+                tmeta.data_on_ssd = meta->datablock_num_ && FilePtr::IsFilePtr(index_reader.ReadPIndexBlock512(meta->indexblock_ptr_)->entries[0].leafptr);
                 version->InsertTableToL1(tmeta);
             }
         }
@@ -102,6 +153,42 @@ Version *Manifest::RecoverVersion(Version *version, SegmentAllocator *allocator)
 
     // clean overlapped old PSTs in L1 tree which was not been cleaned in an unfinished comapction due to crash
     version->L1TreeConsistencyCheckAndFix(&pst_deleter, this);
+    version->SetL1Seq(current_L1_version + 1);
+    // no reader yet, free slots of replaced psts at once
+    version->ReleaseRetired(true);
+
+    // recover level2
+    tail = l2_super_->l2_tail;
+    unsigned current_L2_version = l2_super_->l2_current_seq_no;
+    DEBUG("l2_version=%u", current_L2_version);
+    for (size_t i = 0; i < tail; i++)
+    {
+        meta = (PSTMeta *)GetAddr(i, 2);
+        if (meta->indexblock_ptr_ != 0)
+        {
+            if (meta->seq_no_ > current_L2_version)
+            {
+                pst_deleter.DeletePST(*meta);
+            }
+            else
+            {
+                TaggedPstMeta tmeta{
+                    .meta = *meta,
+                    .level = 2,
+                    .manifest_position = i,
+                    .filter = nullptr};
+                version->InsertTableToL2(tmeta);
+            }
+        }
+    }
+    pst_deleter.PersistCheckpoint();
+    // L1 psts of an unfinished L1->L2 compaction may overlap their L2 outputs, they are newer and kept.
+    // Old L2 psts overlapped by the outputs are cleaned here
+    version->L2TreeConsistencyCheckAndFix(&pst_deleter, this);
+    version->SetL2Seq(current_L2_version + 1);
+
+    // bloom filters are DRAM-only, rebuild them from the psts
+    version->BuildFilters(allocator, std::thread::hardware_concurrency());
     return version;
 }
 
@@ -111,6 +198,7 @@ void Manifest::PrintL1Info() {
 
 int Manifest::AddTable(PSTMeta meta, int level)
 {
+    std::lock_guard<SpinLock> lock(table_lock_);
     int idx = -1;
     switch (level)
     {
@@ -147,16 +235,35 @@ int Manifest::AddTable(PSTMeta meta, int level)
             super_->l1_tail++;
         }
         break;
+    case 2:
+        if (!l2_freelist_.empty())
+        {
+            idx = l2_freelist_.front();
+            l2_freelist_.pop();
+        }
+        else
+        {
+            idx = l2_super_->l2_tail;
+            // DB::BGCompactLevel2 only runs the jobs whose outputs fit
+            if ((size_t)idx >= l2_super_->l2_slots)
+                ERROR_EXIT("Manifest L2 is full, idx=%d!", idx);
+            l2_super_->l2_tail++;
+        }
+        break;
     }
     const char *ad = GetAddr(idx, level);
     pmem_memcpy_persist((void *)ad, &meta, sizeof(PSTMeta));
-    pmem_persist(start_, sizeof(ManifestSuperMeta));
+    if (level == 2)
+        pmem_persist(l2_super_, sizeof(ManifestL2Meta));
+    else
+        pmem_persist(start_, sizeof(ManifestSuperMeta));
     return idx;
 }
 
 void Manifest::DeleteTable(int idx, int level)
 {
     // DEBUG("delete table idx=%d,level=%d",idx,level);
+    std::lock_guard<SpinLock> lock(table_lock_);
     auto temp = PSTMeta::InvalidTable();
     const char *ad = GetAddr(idx, level);
     pmem_memcpy_persist((void *)ad, &temp, sizeof(PSTMeta));
@@ -169,6 +276,9 @@ void Manifest::DeleteTable(int idx, int level)
     case 1:
         l1_freelist_.push(idx);
         break;
+    case 2:
+        l2_freelist_.push(idx);
+        break;
     }
 }
 
@@ -201,6 +311,40 @@ bool Manifest::GetFlushLog(std::vector<uint64_t> &deleted_log_segment_ids)
     return true;
 }
 
+void Manifest::UpdatePartitions(const PartitionInfo *partitions)
+{
+    // fill the slot not in use, then switch to it
+    int slot = partitions_->current == 1 ? 1 : 0;
+    for (int i = 0; i < RANGE_PARTITION_NUM; i++)
+    {
+        partitions_->min_keys[slot][i] = partitions[i].min_key;
+    }
+    pmem_persist(partitions_->min_keys[slot], sizeof(partitions_->min_keys[slot]));
+    partitions_->current = slot + 1;
+    pmem_persist(&partitions_->current, sizeof(uint64_t));
+}
+
+bool Manifest::GetPartitions(PartitionInfo *partitions)
+{
+    uint64_t current = partitions_->current;
+    if (current != 1 && current != 2)
+        return false;
+    const uint64_t *min_keys = partitions_->min_keys[current - 1];
+    if (min_keys[0] != 0)
+        return false;
+    for (int i = 1; i < RANGE_PARTITION_NUM; i++)
+    {
+        if (__bswap_64(min_keys[i]) <= __bswap_64(min_keys[i - 1]))
+            return false;
+    }
+    for (int i = 0; i < RANGE_PARTITION_NUM; i++)
+    {
+        partitions[i].min_key = min_keys[i];
+        partitions[i].max_key = i + 1 < RANGE_PARTITION_NUM ? __bswap_64(__bswap_64(min_keys[i + 1]) - 1) : MAX_UINT64;
+    }
+    return true;
+}
+
 inline const char *Manifest::GetAddr(int idx, int level)
 {
     const char *start;
@@ -212,6 +356,9 @@ inline const char *Manifest::GetAddr(int idx, int level)
     case 1:
         start = l1_start_;
         break;
+    case 2:
+        start = l2_start_;
+        break;
     default:
         ERROR_EXIT("invalid level");
     }
@@ -232,6 +379,18 @@ void Manifest::UpdateL1Version(unsigned current_seq_no)
     pmem_persist(super_, sizeof(ManifestSuperMeta));
 }
 
+size_t Manifest::GetFreeL2Slots()
+{
+    std::lock_guard<SpinLock> lock(table_lock_);
+    return l2_freelist_.size() + l2_super_->l2_slots - l2_super_->l2_tail;
+}
+
+void Manifest::UpdateL2Version(unsigned current_seq_no)
+{
+    l2_super_->l2_current_seq_no = current_seq_no;
+    pmem_persist(l2_super_, sizeof(ManifestL2Meta));
+}
+
 unsigned Manifest::GetL0Version()
 {
     return super_->l0_min_valid_seq_no;
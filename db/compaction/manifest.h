@@ -5,8 +5,9 @@
  *        Manifest is used to recover Version (including all Index) after crash.
  *
  *      On PM, Manifest occupies a separate address space and allocates this space to metadata for each level.
- *      | SuperMeta | L0Meta:[meta1 meta2 meta3 ...] [padding] | L1Meta:[meta1 meta2 meta3 ...] [padding] | L2Meta:[meta1 meta2 meta3 ...]
- *      | 32B | 32B * MAX_L0_TREE_NUM * MAX_MEMTABLE_ENTRIES/1024 =51200000 | 10 * SIZEOF(L0Meta) |
+ *      | SuperMeta | L0Meta:[meta1 meta2 meta3 ...] [padding] | L1Meta:[meta1 meta2 meta3 ...] [padding] | OpLog | PartitionMeta | L2Meta:[L2SuperMeta meta1 meta2 ...]
+ *      | 40B | 32B * MAX_L0_TREE_NUM * MAX_MEMTABLE_ENTRIES/1024 =51200000 | 10 * SIZEOF(L0Meta) | | 256B | 24B + 24B * l2_slots
+ *      The level2 area holds l2_slots pst metas, fixed when the manifest is created (see DBConfig::l2_ssd_bytes).
  *
  *
  * @version 0.1
@@ -17,12 +18,21 @@
  */
 
 #include "db/table.h"
+#include "db/blocks/fixed_size_block.h"
+#include "util/lock.h"
 #include <queue>
 #define L0MetaSize 51200000
 #define L1MetaSize 512000000
 // Each log group can cotain MAX_USER_THREAD_NUM * 8 log segments, which have an 4-byte id
 #define OpLogSize (4 * MAX_MEMTABLE_NUM * MAX_USER_THREAD_NUM * 32)
-#define ManifestSize (32 + L0MetaSize + L1MetaSize + OpLogSize)
+#define PartitionMetaSize 256
+// a level2 pst has up to PIndexBlock::MAX_ENTRIES datablocks on ssd, the level2 area is sized for half-full psts
+#define L2MetaPstBytes (PIndexBlock::MAX_ENTRIES * sizeof(PSSDBlock) / 2)
+#define L2MetaSize(l2_slots) (sizeof(ManifestL2Meta) + (l2_slots) * sizeof(PSTMeta))
+// bumped whenever the layout below changes, a manifest of another format is refused on recovery
+#define ManifestMagic 0x464c4d46U
+#define ManifestFormatVersion 2
+#define ManifestSize(l2_slots) (sizeof(ManifestSuperMeta) + L0MetaSize + L1MetaSize + OpLogSize + PartitionMetaSize + L2MetaSize(l2_slots))
 
 class Version;
 struct ManifestSuperMeta
@@ -36,7 +46,33 @@ struct ManifestSuperMeta
         uint64_t is_valid : 1;
         uint64_t length : 63;
     } flush_log;
+    uint32_t magic = 0;
+    uint32_t format_version = 0;
 };
+/**
+ * @brief range partition boundaries chosen by the db, two slots so that an update is switched in by one 8-byte store
+ *
+ */
+struct ManifestPartitionMeta
+{
+    // 0: none persisted, fixed boundaries are used. otherwise 1 + the slot in use
+    uint64_t current = 0;
+    // big-endian min key of each partition
+    uint64_t min_keys[2][RANGE_PARTITION_NUM];
+};
+static_assert(sizeof(ManifestPartitionMeta) <= PartitionMetaSize, "partition meta exceeds its manifest area");
+/**
+ * @brief head of the level2 area, kept apart from ManifestSuperMeta so that the layout of the upper levels does not change
+ *
+ */
+struct ManifestL2Meta
+{
+    uint32_t l2_current_seq_no = 0;
+    size_t l2_tail = 0;
+    // pst metas the level2 area holds
+    size_t l2_slots = 0;
+};
+
 class Manifest
 {
 private:
@@ -44,13 +80,23 @@ private:
     const char *l0_start_;
     const char *l1_start_;
     const char *flush_log_start_;
+    const char *l2_start_;
     std::queue<int> l0_freelist_;
     std::queue<int> l1_freelist_;
+    std::queue<int> l2_freelist_;
+    // parallel flushes add level0 tables while compaction deletes them
+    SpinLock table_lock_;
     ManifestSuperMeta *super_;
+    ManifestPartitionMeta *partitions_;
+    ManifestL2Meta *l2_super_;
     const char *end_;
 
 public:
-    Manifest(char *pmem_addr, bool recover);
+    /**
+     * @param mapped_len length of the manifest file, ManifestSize(l2_slots) of the manifest
+     * @param l2_slots pst metas of the level2 area, a recovered manifest keeps the number it was created with
+     */
+    Manifest(char *pmem_addr, size_t mapped_len, size_t l2_slots, bool recover);
     ~Manifest();
     /**
      * @brief persist new pst in manifest
@@ -67,6 +113,16 @@ public:
 
     void UpdateL1Version(unsigned current_seq_no);
 
+    /**
+     * @brief level2 psts with a larger seq_no are dropped in recovery, call it after the outputs of an L1->L2 compaction are recorded
+     */
+    void UpdateL2Version(unsigned current_seq_no);
+
+    /**
+     * @brief level2 psts that can still be added
+     */
+    size_t GetFreeL2Slots();
+
     unsigned GetL0Version();
 
     void L0GC();
@@ -77,6 +133,15 @@ public:
 
     bool GetFlushLog(std::vector<uint64_t>& deleted_log_segment_ids);
 
+    /**
+     * @brief persist the range partition boundaries, partitions cover the key space in order
+     */
+    void UpdatePartitions(const PartitionInfo *partitions);
+    /**
+     * @return false if no boundaries were persisted or they are not valid
+     */
+    bool GetPartitions(PartitionInfo *partitions);
+
     Version *RecoverVersion(Version *source,SegmentAllocator* allocator);
 
 	void PrintL1Info();
@@ -0,0 +1,95 @@
+#include "migration.h"
+#include "manifest.h"
+#include "version.h"
+
+MigrationJob::MigrationJob(SegmentAllocator *seg_alloc, Version *target_version, Manifest *manifest)
+	: seg_allocater_(seg_alloc), version_(target_version), manifest_(manifest), ssd_builder_(seg_alloc, true), pm_builder_(seg_alloc), output_seq_no_(version_->GenerateL1Seq())
+{
+	ssd_builder_.SetBloomBitsPerKey(version_->GetBloomBitsPerKey());
+	pm_builder_.SetBloomBitsPerKey(version_->GetBloomBitsPerKey());
+}
+
+size_t MigrationJob::PickMigration(size_t pm_target, size_t max_bytes)
+{
+	version_->PickLevel1TablesForMigration(pm_target, max_bytes, to_ssd_, to_pm_);
+	return to_ssd_.size() + to_pm_.size();
+}
+
+void MigrationJob::Rewrite(const TaggedPstMeta &input, PSTBuilder &pst_builder, bool data_on_ssd)
+{
+	auto flush = [&]()
+	{
+		TaggedPstMeta tmeta;
+		tmeta.meta = pst_builder.Flush();
+		tmeta.filter = pst_builder.TakeFilter();
+		tmeta.data_on_ssd = data_on_ssd;
+		if (tmeta.meta.Valid())
+			outputs_.emplace_back(tmeta);
+	};
+	PSTReader reader(seg_allocater_);
+	PSTReader::Iterator *iter = reader.GetIterator(input.meta.indexblock_ptr_);
+	if (!iter->records_.empty())
+	{
+		do
+		{
+			uint64_t key = iter->Key(), value = iter->Value();
+			if (!pst_builder.AddEntry(Slice(&key), Slice(&value)))
+			{
+				// a pst on ssd holds more entries than one on pm
+				flush();
+				if (!pst_builder.AddEntry(Slice(&key), Slice(&value)))
+					ERROR_EXIT("cannot add pst entry in migration");
+			}
+		} while (iter->Next());
+	}
+	delete iter;
+	// the last output has the max key of the input and takes its slot
+	flush();
+	moved_bytes_ += Version::PmDataBytesOf(input);
+}
+
+void MigrationJob::Run()
+{
+	for (auto &pst : to_ssd_)
+		Rewrite(pst, ssd_builder_, true);
+	for (auto &pst : to_pm_)
+		Rewrite(pst, pm_builder_, false);
+}
+
+void MigrationJob::Clean()
+{
+	// 1. record the outputs, datablocks on ssd are synced before they become valid
+	for (auto &pst : outputs_)
+	{
+		pst.meta.seq_no_ = output_seq_no_;
+		pst.level = 1;
+		pst.manifest_position = manifest_->AddTable(pst.meta, 1);
+	}
+	ssd_builder_.PersistCheckpoint();
+	pm_builder_.PersistCheckpoint();
+
+	// 2. change version in manifest, a crash from now on keeps the outputs and drops the inputs they overlap
+	manifest_->UpdateL1Version(output_seq_no_);
+
+	// 3. an output replaces the input with the same max key, readers switch to them at once
+	for (auto &pst : outputs_)
+		version_->InsertTableToL1(pst);
+	for (auto *inputs : {&to_ssd_, &to_pm_})
+	{
+		for (auto &pst : *inputs)
+			version_->DeleteTableInL1(pst.meta);
+	}
+	version_->PublishLevel1Index();
+
+	// 4. delete the inputs
+	std::vector<PSTMeta> obsolete_psts;
+	for (auto *inputs : {&to_ssd_, &to_pm_})
+	{
+		for (auto &pst : *inputs)
+		{
+			manifest_->DeleteTable(pst.manifest_position, 1);
+			obsolete_psts.push_back(pst.meta);
+		}
+	}
+	version_->RetireInputPSTs(std::move(obsolete_psts));
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include "db_common.h"
+#include "db/allocator/segment_allocator.h"
+#include "db/pst_builder.h"
+#include "db/pst_reader.h"
+#include <vector>
+
+class Version;
+class Manifest;
+/**
+ * @brief moves the datablocks of level1 psts between pm and ssd by their heat, the index blocks stay on pm.
+ * Each picked pst is rewritten with the same keys and replaces the old one in level1 by its max key,
+ * so it runs on the compaction thread between compactions.
+ *
+ */
+class MigrationJob
+{
+private:
+    SegmentAllocator *seg_allocater_;
+    Version *version_;
+    Manifest *manifest_;
+    PSTBuilder ssd_builder_;
+    PSTBuilder pm_builder_;
+    // the outputs get a new level1 version, so that recovery keeps either the inputs or the outputs
+    const unsigned output_seq_no_;
+
+    std::vector<TaggedPstMeta> to_ssd_;
+    std::vector<TaggedPstMeta> to_pm_;
+    std::vector<TaggedPstMeta> outputs_;
+    size_t moved_bytes_ = 0;
+
+    void Rewrite(const TaggedPstMeta &input, PSTBuilder &pst_builder, bool data_on_ssd);
+
+public:
+    MigrationJob(SegmentAllocator *seg_alloc, Version *target_version, Manifest *manifest);
+    ~MigrationJob() {}
+
+    /**
+     * @param pm_target pm bytes level1 should fit in
+     * @param max_bytes datablock bytes rewritten at most
+     * @return number of psts picked
+     */
+    size_t PickMigration(size_t pm_target, size_t max_bytes);
+    void Run();
+    /**
+     * @brief publish the outputs in level1 and manifest, and recycle the inputs once no reader can reach them
+     */
+    void Clean();
+
+    size_t GetToSsdNum() { return to_ssd_.size(); }
+    size_t GetToPmNum() { return to_pm_.size(); }
+    size_t GetMovedBytes() { return moved_bytes_; }
+};
@@ -5,28 +5,24 @@
 #include "lib/index_hot.h"
 #endif
 #include <algorithm>
-Version::Version(SegmentAllocator *seg_allocator) : pst_reader_(seg_allocator)
+#include <thread>
+Version::Version(SegmentAllocator *seg_allocator, EpochManager *epoch) : level1_heat_(new std::atomic<uint8_t>[L1_MAX_SLOTS]()), pst_reader_(seg_allocator), seg_allocator_(seg_allocator), epoch_(epoch)
 {
     level0_table_lists_.resize(MAX_L0_TREE_NUM);
     for (int i = 0; i < MAX_L0_TREE_NUM; i++)
     {
         level0_trees_[i] = nullptr;
     }
-    level1_tables_.reserve(6553600); // reserve for at most 6400M records
-
-#ifdef MASSTREE_L1
-    level1_tree_ = new MasstreeIndex();
-#endif
-#ifdef HOT_L1
-    level1_tree_ = new HOTIndex(MAX_PST_L1);
-#endif
+    level1_tables_.reserve(L1_MAX_SLOTS); // reserve for at most 6400M records
+    level1_index_.store(new Level1Index({}, {}));
+    level2_tables_.store(new std::vector<TaggedPstMeta>());
 }
 
 Version::~Version()
 {
-
-    if (level1_tree_)
-        delete level1_tree_;
+    ReleaseRetired(true);
+    delete level1_index_.load();
+    delete level2_tables_.load();
 
     // TODO: maybe save some metadata?
 }
@@ -79,19 +75,31 @@ int Version::InsertTableToL1(TaggedPstMeta tmeta)
     {
         idx = level1_free_list_.back();
         level1_free_list_.pop_back();
+        // a reader may still check the filter of the old pst in this slot
+        if (level1_tables_[idx].filter)
+            retiring_.filters.push_back(std::move(level1_tables_[idx].filter));
         level1_tables_[idx] = tmeta;
     }
 
     assert(level1_tables_.size() > idx);
-    // update index
-    ValueHelper lh((uint64_t)idx);
-    size_t tempk = table.max_key_;
-    level1_tree_->Put(tempk, lh);
+    // update index, visible to readers after PublishLevel1Index
+    uint64_t max_key = __bswap_64(table.max_key_);
+    int64_t old_idx = FindLevel1SlotForUpdate(max_key);
+    level1_delta_[max_key] = idx;
+    level1_bytes_.fetch_add(PmBytesOf(tmeta), std::memory_order_relaxed);
+    // a pst replacing one with the same max key holds the same keys, e.g. after a migration. New ones on pm are taken as hot
+    // until they are found cold, those on ssd the other way round
+    if ((size_t)idx < L1_MAX_SLOTS)
+    {
+        uint8_t heat = old_idx != L1_DELETED_SLOT && (size_t)old_idx < L1_MAX_SLOTS ? level1_heat_[old_idx].load(std::memory_order_relaxed) : tmeta.data_on_ssd ? 0 : PST_HEAT_HOT;
+        level1_heat_[idx].store(heat, std::memory_order_relaxed);
+    }
     // 对重复key要判别，value相同则忽略.value不同要防删,被替换的pst要在levels_[level_id]中删除(放入free list)。
-    if (lh.old_val != INVALID_VALUE)
+    if (old_idx != L1_DELETED_SLOT && old_idx != idx)
     {
-        LOG("replace idx=%lu", lh.old_val);
-        level1_free_list_.push_back(lh.old_val);
+        LOG("replace idx=%ld", old_idx);
+        level1_bytes_.fetch_sub(PmBytesOf(level1_tables_[old_idx]), std::memory_order_relaxed);
+        retiring_.slots.push_back(old_idx);
     }
     return idx;
 }
@@ -100,9 +108,12 @@ int Version::InsertTableToL1(TaggedPstMeta tmeta)
 bool Version::DeleteTableInL1(PSTMeta table)
 {
     // find vector index by searching tree
-    uint64_t idx = level1_tree_->Get(table.max_key_);
+    uint64_t max_key = __bswap_64(table.max_key_);
+    int64_t idx = FindLevel1SlotForUpdate(max_key);
     // check if table.indexblock_ptr = levels_[level_id][idx].indexblock_ptr, if yes,continue, if no,return
-    assert(idx != INVALID_PTR);
+    assert(idx != L1_DELETED_SLOT);
+    if (idx == L1_DELETED_SLOT)
+        return false;
     PSTMeta &old = level1_tables_[idx].meta;
     if (table.indexblock_ptr_ != old.indexblock_ptr_)
     {
@@ -110,9 +121,10 @@ bool Version::DeleteTableInL1(PSTMeta table)
         return false;
     }
     // erase table key in the tree
-    level1_tree_->Delete(table.max_key_);
-    // append vector idx to the freelist
-    level1_free_list_.push_back(idx);
+    level1_delta_[max_key] = L1_DELETED_SLOT;
+    level1_bytes_.fetch_sub(PmBytesOf(level1_tables_[idx]), std::memory_order_relaxed);
+    // append vector idx to the freelist once no reader can reach it
+    retiring_.slots.push_back(idx);
 
     // recycle segment space
 
@@ -136,13 +148,13 @@ int FindTableByIndex(size_t key, Index *level_index)
 {
     int idx = -1;
 #ifdef MASSTREE_L1
-    std::vector<uint64_t> temp;
-    level_index->Scan(key, 1, temp);
-    if (temp.empty())
+    KeyType max_key;
+    ValueType slot;
+    if (!level_index->Seek(key, max_key, slot))
     {
         return -1;
     }
-    idx = temp[0];
+    idx = slot;
 #endif
 #ifdef HOT_L1
     auto iter = reinterpret_cast<HOTIndex *>(level_index)->Seek(key);
@@ -154,52 +166,87 @@ int FindTableByIndex(size_t key, Index *level_index)
 #endif
     return idx;
 }
-int FindTableByIndex2(size_t key, Index *level_index)
+
+/**
+ * @brief check the filter before reading a pst, and count the filter effect in pst_reader
+ *
+ * @return false if the key is surely not in the filter
+ */
+static inline bool FilterMayContain(const BlockedBloomFilter *filter, uint64_t key_hash, PSTReader *pst_reader)
 {
-    int idx = -1;
-#ifdef MASSTREE_L1
-    std::vector<uint64_t> temp;
-    level_index->Scan(key, 2, temp);
-    if (temp.size() != 2)
-    {
-        return -1;
-    }
-    idx = temp[1];
-#endif
-#ifdef HOT_L1
-    auto iter = reinterpret_cast<HOTIndex *>(level_index)->Seek(key);
-    iter.Next();
-    idx = iter.Value();
-    if (idx == INVALID_PTR)
-    {
-        return -1;
-    }
-#endif
-    return idx;
+    if (filter == nullptr)
+        return true;
+    pst_reader->filter_stats_.checks++;
+    if (filter->MayContain(key_hash))
+        return true;
+    pst_reader->filter_stats_.negatives++;
+    return false;
 }
-inline void ScanIndexForTables(size_t key, Index *level_index, size_t table_num, std::vector<size_t> &output_table_ids)
+
+/**
+ * @brief point query on a pst that may hold the key, i.e. its max key >= key
+ */
+static inline bool PointQueryTable(const TaggedPstMeta &table, Slice key, uint64_t key_hash, const char *value_out, int *value_size, PSTReader *pst_reader)
 {
-#ifdef MASSTREE_L1
-    std::vector<uint64_t> temp;
-    level_index->Scan(key, table_num, output_table_ids);
-#endif
+    if (!table.meta.Valid())
+        return false;
+    if (table.meta.min_key_ != MAX_UINT64 && __bswap_64(table.meta.min_key_) > key.ToUint64Bswap())
+        return false;
+    if (!FilterMayContain(table.filter.get(), key_hash, pst_reader))
+        return false;
+    if (pst_reader->PointQuery(table.meta.indexblock_ptr_, key, value_out, value_size, table.meta.datablock_num_))
+        return true;
+    if (table.filter)
+        pst_reader->filter_stats_.false_positives++;
+    return false;
+}
+
+/**
+ * @brief point query on a run of psts sorted by key and not overlapped
+ */
+static inline bool GetFromRun(const std::vector<TaggedPstMeta> &run, Slice key, uint64_t key_hash, const char *value_out, int *value_size, PSTReader *pst_reader)
+{
+    // the first pst whose max key >= key
+    auto table = std::lower_bound(run.begin(), run.end(), key.ToUint64Bswap(), [](const TaggedPstMeta &t, uint64_t k)
+                                  { return __bswap_64(t.meta.max_key_) < k; });
+    if (table == run.end())
+        return false;
+    return PointQueryTable(*table, key, key_hash, value_out, value_size, pst_reader);
+}
+
+inline void Version::SampleLevel1Access(int64_t slot)
+{
+    static thread_local uint32_t lookups = 0;
+    if ((++lookups & ((1u << PST_HEAT_SAMPLE_SHIFT) - 1)) != 0 || (size_t)slot >= L1_MAX_SLOTS)
+        return;
+    // increments lost to concurrent readers do not matter
+    uint8_t heat = level1_heat_[slot].load(std::memory_order_relaxed);
+    if (heat < UINT8_MAX)
+        level1_heat_[slot].store(heat + 1, std::memory_order_relaxed);
 }
 
 bool Version::Get(Slice key, const char *value_out, int *value_size, PSTReader *pst_reader)
 {
-    TaggedPstMeta table;
+    uint64_t key_hash = BlockedBloomFilter::Hash(key.ToUint64());
     // DEBUG("read key=%lu,l0head=%d,l0_read_tail=%d",key.ToUint64Bswap(),l0_head_,l0_read_tail_);
-    // search level0
-    for (int tree_idx = l0_head_; tree_idx != l0_read_tail_; tree_idx = (tree_idx + 1) % MAX_L0_TREE_NUM)
+    // search level0 from the newest tree, a key may be in several trees.
+    // trees in [head, tail) are not reclaimed before this operation finishes
+    int head = l0_head_;
+    for (int tree_idx = l0_read_tail_; tree_idx != head;)
     {
+        tree_idx = (tree_idx - 1 + MAX_L0_TREE_NUM) % MAX_L0_TREE_NUM;
+        if (level0_tree_meta_[tree_idx].IsCompacted(key.ToUint64Bswap()))
+            continue;
+        if (!FilterMayContain(level0_tree_meta_[tree_idx].filter.get(), key_hash, pst_reader))
+            continue;
         Index *tree = level0_trees_[tree_idx];
         // DEBUG("1");
         int idx = FindTableByIndex(key.ToUint64(), tree);
         if (idx == -1)
             continue;
         // DEBUG("2");
-        table = level0_table_lists_[tree_idx][idx];
-        if (!table.Valid())
+        const TaggedPstMeta &table = level0_table_lists_[tree_idx][idx];
+        if (!table.meta.Valid())
         {
             continue;
         }
@@ -209,55 +256,115 @@ bool Version::Get(Slice key, const char *value_out, int *value_size, PSTReader *
             continue;
         }
         // DEBUG("4");
+        if (!FilterMayContain(table.filter.get(), key_hash, pst_reader))
+            continue;
         bool ret = pst_reader->PointQuery(table.meta.indexblock_ptr_, key, value_out, value_size, table.meta.datablock_num_);
         if (ret)
             return true;
+        if (table.filter)
+            pst_reader->filter_stats_.false_positives++;
     }
     // searchlevel1
-    Index *tree = level1_tree_;
-    int idx = FindTableByIndex(key.ToUint64(), tree);
-
-    if (idx == -1)
-    {
-        DEBUG("5");
-        return false;
-    }
-    table = level1_tables_.at(idx);
-    if (!table.Valid())
+    Level1Index *l1_index = level1_index_.load(std::memory_order_acquire);
+    int64_t idx = l1_index->Find(key.ToUint64Bswap());
+    if (idx != -1)
     {
-        DEBUG("6");
-        return false;
+        SampleLevel1Access(idx);
+        if (PointQueryTable(level1_tables_.at(idx), key, key_hash, value_out, value_size, pst_reader))
+            return true;
     }
+    // search level2, older than level1
+    return GetFromRun(*level2_tables_.load(std::memory_order_acquire), key, key_hash, value_out, value_size, pst_reader);
+}
 
+/**
+ * @brief add the datablock on ssd a point query on table would read, see PointQueryTable
+ */
+static inline void CollectSsdDataBlock(const TaggedPstMeta &table, Slice key, uint64_t key_hash, PSTReader *pst_reader, std::vector<uint64_t> &ptrs)
+{
+    if (!table.meta.Valid())
+        return;
     if (table.meta.min_key_ != MAX_UINT64 && __bswap_64(table.meta.min_key_) > key.ToUint64Bswap())
+        return;
+    if (table.filter && !table.filter->MayContain(key_hash))
+        return;
+    uint64_t ptr = pst_reader->FindDataBlock(table.meta.indexblock_ptr_, key, table.meta.datablock_num_);
+    if (FilePtr::IsFilePtr(ptr))
+        ptrs.push_back(ptr);
+}
+
+void Version::PrefetchSsdDataBlocks(const std::vector<Slice> &keys, PSTReader *pst_reader)
+{
+    // level0 is on pm. The level2 block of a key is read along even if level1 holds the key, so that one batch serves all keys
+    std::vector<uint64_t> ptrs;
+    Level1Index *l1_index = level1_index_.load(std::memory_order_acquire);
+    const std::vector<TaggedPstMeta> &level2 = *level2_tables_.load(std::memory_order_acquire);
+    for (auto &key : keys)
     {
-        DEBUG("7, key=%lu at %lu (%lu~%lu)", key.ToUint64Bswap(), table.meta.indexblock_ptr_, __bswap_64(table.meta.min_key_), __bswap_64(table.meta.max_key_));
-        return false;
+        uint64_t key_hash = BlockedBloomFilter::Hash(key.ToUint64());
+        int64_t idx = l1_index->Find(key.ToUint64Bswap());
+        if (idx != -1 && level1_tables_.at(idx).data_on_ssd)
+            CollectSsdDataBlock(level1_tables_.at(idx), key, key_hash, pst_reader, ptrs);
+        auto table = std::lower_bound(level2.begin(), level2.end(), key.ToUint64Bswap(), [](const TaggedPstMeta &t, uint64_t k)
+                                      { return __bswap_64(t.meta.max_key_) < k; });
+        if (table != level2.end())
+            CollectSsdDataBlock(*table, key, key_hash, pst_reader, ptrs);
     }
-    bool ret = pst_reader->PointQuery(table.meta.indexblock_ptr_, key, value_out, value_size, table.meta.datablock_num_);
-    return ret;
-    // TODO: if l>2 exists, add them
+    pst_reader->PrefetchDataBlocks(ptrs, true);
 }
 
 RowIterator *Version::GetLevel1Iter(Slice key, PSTReader *pst_reader, std::vector<TaggedPstMeta> &table_metas)
 {
-    std::vector<size_t> table_ids;
-    ScanIndexForTables(key.ToUint64(), level1_tree_, 2, table_ids);
-    for (auto id : table_ids)
+    Level1Index *l1_index = level1_index_.load(std::memory_order_acquire);
+    for (size_t pos = l1_index->LowerBound(key.ToUint64Bswap()); pos < l1_index->Size() && table_metas.size() < 2; pos++)
     {
-        table_metas.push_back(level1_tables_[id]);
+        table_metas.push_back(level1_tables_[l1_index->SlotAt(pos)]);
     }
     return new RowIterator(pst_reader, table_metas);
 }
 
+void Version::GetSortedRuns(std::vector<std::vector<TaggedPstMeta>> &runs)
+{
+    auto by_max_key = [](const TaggedPstMeta &a, const TaggedPstMeta &b)
+    { return __bswap_64(a.meta.max_key_) < __bswap_64(b.meta.max_key_); };
+    int head = l0_head_;
+    for (int tree_idx = l0_read_tail_; tree_idx != head;)
+    {
+        tree_idx = (tree_idx - 1 + MAX_L0_TREE_NUM) % MAX_L0_TREE_NUM;
+        runs.emplace_back();
+        const TreeMeta &tree_meta = level0_tree_meta_[tree_idx];
+        for (auto &table : level0_table_lists_[tree_idx])
+        {
+            // a pst lies in compacted partitions as a whole, its min key tells
+            if (table.meta.Valid() && !tree_meta.IsCompacted(__bswap_64(table.meta.min_key_)))
+                runs.back().push_back(table);
+        }
+        std::sort(runs.back().begin(), runs.back().end(), by_max_key);
+    }
+}
+
+bool Version::GetFromSortedRuns(const std::vector<std::vector<TaggedPstMeta>> &runs, const PstRun &level1, const std::vector<TaggedPstMeta> *level2, Slice key, const char *value_out, int *value_size, PSTReader *pst_reader)
+{
+    uint64_t key_hash = BlockedBloomFilter::Hash(key.ToUint64());
+    for (auto &run : runs)
+    {
+        if (GetFromRun(run, key, key_hash, value_out, value_size, pst_reader))
+            return true;
+    }
+    size_t pos = level1.LowerBound(key.ToUint64Bswap());
+    if (pos < level1.Size() && PointQueryTable(level1.At(pos), key, key_hash, value_out, value_size, pst_reader))
+        return true;
+    return level2 && GetFromRun(*level2, key, key_hash, value_out, value_size, pst_reader);
+}
+
 bool Version::CheckSpaceForL0Tree()
 {
-    return (l0_tail_ + 1) % MAX_L0_TREE_NUM != l0_head_;
+    return (l0_tail_ + 1) % MAX_L0_TREE_NUM != l0_head_ && level0_trees_[l0_tail_] == nullptr;
 }
 
 int Version::AddLevel0Tree()
 {
-    if ((l0_tail_ + 1) % MAX_L0_TREE_NUM == l0_head_)
+    if (!CheckSpaceForL0Tree())
         return -1;
     auto ret = l0_tail_;
     l0_tail_ = (l0_tail_ + 1) % MAX_L0_TREE_NUM;
@@ -282,6 +389,18 @@ uint32_t Version::GenerateL1Seq()
 {
     return l1_seq_++;
 }
+void Version::SetL1Seq(uint32_t seq)
+{
+    l1_seq_ = seq;
+}
+uint32_t Version::GenerateL2Seq()
+{
+    return l2_seq_++;
+}
+void Version::SetL2Seq(uint32_t seq)
+{
+    l2_seq_ = seq;
+}
 
 bool Version::FreeLevel0Tree()
 {
@@ -292,41 +411,51 @@ bool Version::FreeLevel0Tree()
     }
     auto idx = l0_head_;
     l0_head_ = (l0_head_ + 1) % MAX_L0_TREE_NUM;
-    // printf("before FreeLevel0Tree\n");
-    // wait for reader leave the index (just sleep for > 1ms)
-    usleep(100);
-    delete level0_trees_[idx];
-    // printf("after FreeLevel0Tree\n");
-    level0_trees_[idx] = nullptr;
-    level0_tree_meta_[idx] = TreeMeta();
-    level0_table_lists_[idx].clear();
+    // a Get may still search the tree and its table list, the slot is reused only after level0_trees_[idx] is reset
+    epoch_->Retire([this, idx]()
+                   {
+                       delete level0_trees_[idx];
+                       level0_tree_meta_[idx] = TreeMeta();
+                       level0_table_lists_[idx].clear();
+                       level0_trees_[idx] = nullptr; });
     return true;
 }
 void Version::UpdateLevel0ReadTail()
 {
     l0_read_tail_ = l0_tail_;
 }
+void Version::PublishLevel0Tree(int tree_idx)
+{
+    l0_read_tail_ = (tree_idx + 1) % MAX_L0_TREE_NUM;
+}
 
-int Version::PickLevel0Trees(std::vector<std::vector<TaggedPstMeta>> &outputs, std::vector<TreeMeta> &tree_metas, int max_size)
+int Version::PickLevel0Trees(std::vector<std::vector<TaggedPstMeta>> &outputs, std::vector<TreeMeta> &tree_metas, std::vector<int> &tree_idxs, int *unpicked_num, int max_size)
 {
     int tail = l0_read_tail_;
     int head = l0_head_;
     DEBUG("pick level0 tree from %d to %d", head, tail);
     int tree_num = (tail + MAX_L0_TREE_NUM - head) % MAX_L0_TREE_NUM;
+    *unpicked_num = (tail + MAX_L0_TREE_NUM - l0_pick_tail_) % MAX_L0_TREE_NUM;
+    l0_pick_tail_ = tail;
     outputs.resize(tree_num);
     tree_metas.resize(tree_num);
+    tree_idxs.resize(tree_num);
     for (size_t i = 0; i < tree_num && i < max_size; i++)
     {
         int tree_id = (head + i) % MAX_L0_TREE_NUM;
         Index *tree_index = level0_trees_[tree_id];
         TreeMeta tree_meta = level0_tree_meta_[tree_id];
         tree_metas[tree_num - i - 1] = tree_meta;
+        tree_idxs[tree_num - i - 1] = tree_id;
         std::vector<uint64_t> value_out;
         tree_index->Scan(0, MAX_INT32, value_out);
         for (auto &idx : value_out)
         {
             // reverse output to prove less row_id -> newest row
             auto pst = level0_table_lists_[tree_id][idx];
+            // the partitions compacted before are in level1 already
+            if (tree_meta.IsCompacted(__bswap_64(pst.meta.min_key_)))
+                continue;
             outputs[tree_num - i - 1].emplace_back(pst);
         }
     }
@@ -349,67 +478,70 @@ int Version::PickLevel0Trees(std::vector<std::vector<TaggedPstMeta>> &outputs, s
     // }
     return tree_metas.size();
 }
-bool Version::PickOverlappedL1Tables(size_t min, size_t max, std::vector<TaggedPstMeta> &output)
+void Version::MarkLevel0TreeCompacted(int tree_idx, uint32_t compacted, const PartitionInfo *partitions)
 {
-    std::vector<uint64_t> key_out, value_out;
-    level1_tree_->ScanByRange(min, max, key_out, value_out);
-    size_t last_max = max;
-    for (auto &idx : value_out)
+    TreeMeta &tree_meta = level0_tree_meta_[tree_idx];
+    uint32_t old = tree_meta.compacted_partitions;
+    if (old == 0)
     {
-        output.emplace_back(level1_tables_[idx]);
-        last_max = level1_tables_[idx].meta.max_key_;
+        // readers look at the boundaries only once they see a compacted partition
+        for (int i = 0; i < RANGE_PARTITION_NUM; i++)
+            tree_meta.partition_min_keys[i] = __bswap_64(partitions[i].min_key);
     }
-    bool over_flag = false;
-    while (!over_flag)
+    __atomic_store_n(&tree_meta.compacted_partitions, old | compacted, __ATOMIC_RELEASE);
+}
+
+int Version::FreeCompactedLevel0Trees()
+{
+    int freed = 0;
+    while (l0_head_ != l0_read_tail_ && level0_tree_meta_[l0_head_].compacted_partitions == ALL_PARTITIONS)
     {
-        std::vector<uint64_t> value_out2;
-        level1_tree_->Scan(last_max, 9, value_out2);
-        for (auto &idx : value_out2)
-        {
-            auto &pst = level1_tables_[idx];
-        }
-        int i = 0;
-        if (value_out2.size() == 0)
-            break;
-        if (value_out2.size() < 9)
-            over_flag = true;
-        if (level1_tables_[value_out2[0]].meta.max_key_ == last_max)
-        {
-            if (value_out2.size() == 1)
-                break;
-            i = 1;
-        }
+        FreeLevel0Tree();
+        freed++;
+    }
+    return freed;
+}
+
+bool Version::HasCompactedLevel0Partitions()
+{
+    for (int tree_idx = l0_head_; tree_idx != l0_read_tail_; tree_idx = (tree_idx + 1) % MAX_L0_TREE_NUM)
+    {
+        if (level0_tree_meta_[tree_idx].compacted_partitions)
+            return true;
+    }
+    return false;
+}
 
-        for (; i < value_out2.size(); i++)
+bool Version::PickOverlappedL1Tables(size_t min, size_t max, std::vector<TaggedPstMeta> &output)
+{
+    // only compaction modifies level1, so the published index is up to date here
+    Level1Index *l1_index = level1_index_.load(std::memory_order_acquire);
+    uint64_t min_key = __bswap_64(min), max_key = __bswap_64(max);
+    // tables whose max key is in [min, max], then the table overlapping max
+    for (size_t pos = l1_index->LowerBound(min_key); pos < l1_index->Size(); pos++)
+    {
+        auto &pst = level1_tables_[l1_index->SlotAt(pos)];
+        if (l1_index->KeyAt(pos) > max_key)
         {
-            size_t idx = value_out2[i];
-            auto &pst = level1_tables_[idx];
-            if (__bswap_64(pst.meta.min_key_) <= __bswap_64(max))
-            {
-                LOG("additional table: %lu~%lu", __bswap_64(pst.meta.min_key_), __bswap_64(pst.meta.max_key_));
-                output.emplace_back(pst);
-                last_max = pst.meta.max_key_;
-            }
-            else
-            {
-                over_flag = true;
+            if (__bswap_64(pst.meta.min_key_) > max_key)
                 break;
-            }
+            LOG("additional table: %lu~%lu", __bswap_64(pst.meta.min_key_), __bswap_64(pst.meta.max_key_));
         }
+        output.emplace_back(pst);
     }
     return true;
 }
 
 bool Version::L1TreeConsistencyCheckAndFix(PSTDeleter *pst_deleter,Manifest* manifest)
 {
-    std::vector<uint64_t> key_out, value_out;
-    level1_tree_->ScanByRange(0, MAX_UINT64, key_out, value_out);
+    // recovery inserts psts into the delta, check them in key order
+    PublishLevel1Index();
+    Level1Index *l1_index = level1_index_.load(std::memory_order_acquire);
     TaggedPstMeta last_pst_meta, current_pst_meta;
-    uint64_t min_key, max_key;
-    DEBUG("L1 tree size=%lu",value_out.size());
-    for (auto &idx : value_out)
+    DEBUG("L1 tree size=%lu", l1_index->Size());
+    for (size_t pos = 0; pos < l1_index->Size(); pos++)
     {
-        current_pst_meta = level1_tables_[idx];
+        current_pst_meta = level1_tables_[l1_index->SlotAt(pos)];
         if (last_pst_meta.Valid())
         {
             if (__bswap_64(last_pst_meta.meta.max_key_) >= __bswap_64(current_pst_meta.meta.min_key_))
@@ -431,6 +563,304 @@ bool Version::L1TreeConsistencyCheckAndFix(PSTDeleter *pst_deleter,Manifest* man
         }
         last_pst_meta = current_pst_meta;
     }
+    PublishLevel1Index();
     pst_deleter->PersistCheckpoint();
     return true;
-}
\ No newline at end of file
+}
+void Version::InsertTableToL2(TaggedPstMeta table)
+{
+    level2_recovered_.push_back(table);
+}
+
+void Version::PickLevel1TablesForLevel2(uint64_t *cursor, size_t max_bytes, std::vector<TaggedPstMeta> &output)
+{
+    Level1Index *l1_index = level1_index_.load(std::memory_order_acquire);
+    size_t pos = l1_index->LowerBound(*cursor);
+    if (pos == l1_index->Size())
+        pos = 0;
+    size_t bytes = 0;
+    for (; pos < l1_index->Size() && bytes < max_bytes; pos++)
+    {
+        auto &pst = level1_tables_[l1_index->SlotAt(pos)];
+        if (!pst.meta.Valid())
+            continue;
+        output.emplace_back(pst);
+        bytes += PmBytesOf(pst);
+    }
+    if (pos == l1_index->Size() || output.empty() || __bswap_64(output.back().meta.max_key_) == MAX_UINT64)
+        *cursor = 0;
+    else
+        *cursor = __bswap_64(output.back().meta.max_key_) + 1;
+}
+
+void Version::PickLevel1TablesForMigration(size_t pm_target, size_t max_bytes, std::vector<TaggedPstMeta> &to_ssd, std::vector<TaggedPstMeta> &to_pm)
+{
+    // only the compaction thread modifies level1, so the published index is up to date here
+    Level1Index *l1_index = level1_index_.load(std::memory_order_acquire);
+    // {heat, slot} of the psts with datablocks on pm and on ssd
+    std::vector<std::pair<uint8_t, uint32_t>> on_pm, on_ssd;
+    for (size_t pos = 0; pos < l1_index->Size(); pos++)
+    {
+        uint32_t slot = l1_index->SlotAt(pos);
+        const TaggedPstMeta &pst = level1_tables_[slot];
+        if (slot >= L1_MAX_SLOTS || !pst.meta.Valid() || pst.meta.datablock_num_ == 0)
+            continue;
+        uint8_t heat = level1_heat_[slot].load(std::memory_order_relaxed);
+        (pst.data_on_ssd ? on_ssd : on_pm).emplace_back(heat, slot);
+        level1_heat_[slot].store(heat / 2, std::memory_order_relaxed);
+    }
+    // the coldest psts on pm and the hottest on ssd first
+    std::sort(on_pm.begin(), on_pm.end());
+    std::sort(on_ssd.begin(), on_ssd.end(), std::greater<std::pair<uint8_t, uint32_t>>());
+    size_t pm_bytes = GetLevel1Bytes(), moved = 0, cold = 0;
+    auto datablock_bytes = [this](uint32_t slot)
+    { return PmDataBytesOf(level1_tables_[slot]); };
+    auto move_coldest_to_ssd = [&]()
+    {
+        uint32_t slot = on_pm[cold++].second;
+        pm_bytes -= datablock_bytes(slot);
+        moved += datablock_bytes(slot);
+        to_ssd.push_back(level1_tables_[slot]);
+    };
+    for (auto &pst : on_ssd)
+    {
+        if (pst.first < PST_HEAT_HOT || moved >= max_bytes)
+            break;
+        size_t bytes = datablock_bytes(pst.second);
+        // make room with psts much colder than this one, so that two psts of similar heat do not swap back and forth
+        while (pm_bytes + bytes > pm_target && cold < on_pm.size() && on_pm[cold].first * 2 < pst.first && moved < max_bytes)
+            move_coldest_to_ssd();
+        if (pm_bytes + bytes > pm_target)
+            continue;
+        to_pm.push_back(level1_tables_[pst.second]);
+        pm_bytes += bytes;
+        moved += bytes;
+    }
+    while (pm_bytes > pm_target && cold < on_pm.size() && moved < max_bytes)
+        move_coldest_to_ssd();
+}
+
+void Version::PickOverlappedL2Tables(size_t min, size_t max, std::vector<TaggedPstMeta> &output)
+{
+    // only compaction modifies level2
+    const std::vector<TaggedPstMeta> &level2 = *level2_tables_.load(std::memory_order_acquire);
+    uint64_t min_key = __bswap_64(min), max_key = __bswap_64(max);
+    auto it = std::lower_bound(level2.begin(), level2.end(), min_key, [](const TaggedPstMeta &t, uint64_t k)
+                               { return __bswap_64(t.meta.max_key_) < k; });
+    for (; it != level2.end() && __bswap_64(it->meta.min_key_) <= max_key; it++)
+        output.emplace_back(*it);
+}
+
+void Version::ReplaceLevel2Tables(const std::vector<TaggedPstMeta> &deleted, const std::vector<TaggedPstMeta> &added)
+{
+    std::vector<TaggedPstMeta> *old_tables = level2_tables_.load(std::memory_order_relaxed);
+    std::vector<uint64_t> deleted_ptrs;
+    for (auto &pst : deleted)
+        deleted_ptrs.push_back(pst.meta.indexblock_ptr_);
+    std::sort(deleted_ptrs.begin(), deleted_ptrs.end());
+    auto *tables = new std::vector<TaggedPstMeta>();
+    tables->reserve(old_tables->size() + added.size());
+    for (auto &pst : *old_tables)
+    {
+        if (!std::binary_search(deleted_ptrs.begin(), deleted_ptrs.end(), pst.meta.indexblock_ptr_))
+            tables->push_back(pst);
+    }
+    tables->insert(tables->end(), added.begin(), added.end());
+    std::sort(tables->begin(), tables->end(), [](const TaggedPstMeta &a, const TaggedPstMeta &b)
+              { return __bswap_64(a.meta.max_key_) < __bswap_64(b.meta.max_key_); });
+    level2_tables_.store(tables, std::memory_order_release);
+    // super versions refer to it
+    epoch_->Retire([old_tables]()
+                   { delete old_tables; },
+                   true);
+}
+
+bool Version::L2TreeConsistencyCheckAndFix(PSTDeleter *pst_deleter, Manifest *manifest)
+{
+    std::sort(level2_recovered_.begin(), level2_recovered_.end(), [](const TaggedPstMeta &a, const TaggedPstMeta &b)
+              { return __bswap_64(a.meta.min_key_) < __bswap_64(b.meta.min_key_); });
+    std::vector<TaggedPstMeta> tables;
+    tables.reserve(level2_recovered_.size());
+    auto drop = [&](const TaggedPstMeta &pst)
+    {
+        DEBUG("drop overlapped L2 pst %lu~%lu, seq=%u", __bswap_64(pst.meta.min_key_), __bswap_64(pst.meta.max_key_), pst.meta.seq_no_);
+        manifest->DeleteTable(pst.manifest_position, 2);
+        pst_deleter->DeletePST(pst.meta);
+    };
+    for (auto &pst : level2_recovered_)
+    {
+        // overlapped! keep the newest, the outputs of the same compaction never overlap
+        while (!tables.empty() && __bswap_64(tables.back().meta.max_key_) >= __bswap_64(pst.meta.min_key_))
+        {
+            if (tables.back().meta.seq_no_ >= pst.meta.seq_no_)
+                break;
+            drop(tables.back());
+            tables.pop_back();
+        }
+        if (!tables.empty() && __bswap_64(tables.back().meta.max_key_) >= __bswap_64(pst.meta.min_key_))
+        {
+            drop(pst);
+            continue;
+        }
+        tables.push_back(pst);
+    }
+    std::vector<TaggedPstMeta>().swap(level2_recovered_);
+    ReplaceLevel2Tables({}, tables);
+    pst_deleter->PersistCheckpoint();
+    return true;
+}
+
+void Version::SetLevel0TreeFilter(int tree_idx, std::shared_ptr<BlockedBloomFilter> filter)
+{
+    level0_tree_meta_[tree_idx].filter = std::move(filter);
+}
+
+void Version::PublishLevel1Index()
+{
+    if (level1_delta_.empty())
+        return;
+    Level1Index *old_index = level1_index_.load(std::memory_order_relaxed);
+    std::vector<uint64_t> keys;
+    std::vector<uint32_t> slots;
+    keys.reserve(old_index->Size() + level1_delta_.size());
+    slots.reserve(old_index->Size() + level1_delta_.size());
+    // merge the old index and the delta, the delta wins on the same max key
+    size_t pos = 0;
+    auto it = level1_delta_.begin();
+    while (pos < old_index->Size() || it != level1_delta_.end())
+    {
+        if (it == level1_delta_.end() || (pos < old_index->Size() && old_index->KeyAt(pos) < it->first))
+        {
+            keys.push_back(old_index->KeyAt(pos));
+            slots.push_back(old_index->SlotAt(pos));
+            pos++;
+            continue;
+        }
+        if (pos < old_index->Size() && old_index->KeyAt(pos) == it->first)
+            pos++;
+        if (it->second != L1_DELETED_SLOT)
+        {
+            keys.push_back(it->first);
+            slots.push_back(it->second);
+        }
+        it++;
+    }
+    level1_delta_.clear();
+    level1_index_.store(new Level1Index(std::move(keys), std::move(slots)), std::memory_order_release);
+    retiring_.indexes.push_back(old_index);
+}
+
+int64_t Version::FindLevel1SlotForUpdate(uint64_t max_key)
+{
+    auto it = level1_delta_.find(max_key);
+    if (it != level1_delta_.end())
+        return it->second;
+    return level1_index_.load(std::memory_order_relaxed)->FindExact(max_key);
+}
+
+void Version::ReleaseRetired(bool all)
+{
+    if (!retiring_.indexes.empty() || !retiring_.slots.empty() || !retiring_.filters.empty())
+    {
+        retiring_.epoch = epoch_->Advance();
+        retired_.push_back(std::move(retiring_));
+        retiring_ = RetiredResources();
+    }
+    // super versions refer to the level1 index and slots
+    while (!retired_.empty() && (all || epoch_->Reclaimable(retired_.front().epoch, true)))
+    {
+        auto &retired = retired_.front();
+        for (auto index : retired.indexes)
+            delete index;
+        level1_free_list_.insert(level1_free_list_.end(), retired.slots.begin(), retired.slots.end());
+        retired_.pop_front();
+    }
+}
+
+void Version::RetireInputPSTs(std::vector<PSTMeta> &&psts)
+{
+    if (!psts.empty())
+    {
+        SegmentAllocator *seg_allocator = seg_allocator_;
+        epoch_->Retire([seg_allocator, psts = std::move(psts)]()
+                       {
+                           PSTDeleter pst_deleter(seg_allocator);
+                           for (auto &meta : psts)
+                               pst_deleter.DeletePST(meta); },
+                       true);
+    }
+    ReleaseRetired();
+}
+
+void Version::BuildFilters(SegmentAllocator *seg_allocator, int thread_num)
+{
+    if (bloom_bits_per_key_ == 0)
+        return;
+    // a task builds the filters of a level0 tree and its psts, or of a range of level1 or level2 psts
+    struct FilterTask
+    {
+        int tree_idx;
+        size_t begin;
+        size_t end;
+    };
+    std::vector<FilterTask> tasks;
+    for (int tree_idx = l0_head_; tree_idx != l0_read_tail_; tree_idx = (tree_idx + 1) % MAX_L0_TREE_NUM)
+    {
+        tasks.push_back({tree_idx, 0, level0_table_lists_[tree_idx].size()});
+    }
+    // level1 tasks cover ranges of positions in the level1 index
+    Level1Index *l1_index = level1_index_.load(std::memory_order_acquire);
+    const size_t l1_chunk = 64;
+    for (size_t i = 0; i < l1_index->Size(); i += l1_chunk)
+    {
+        tasks.push_back({-1, i, std::min(i + l1_chunk, l1_index->Size())});
+    }
+    std::vector<TaggedPstMeta> &level2 = *level2_tables_.load(std::memory_order_acquire);
+    for (size_t i = 0; i < level2.size(); i += l1_chunk)
+    {
+        tasks.push_back({-2, i, std::min(i + l1_chunk, level2.size())});
+    }
+
+    std::atomic<size_t> next_task(0);
+    auto worker = [&]()
+    {
+        PSTReader reader(seg_allocator);
+        std::vector<uint64_t> pst_hashes, tree_hashes;
+        size_t t;
+        while ((t = next_task.fetch_add(1)) < tasks.size())
+        {
+            auto &task = tasks[t];
+            auto &psts = task.tree_idx >= 0 ? level0_table_lists_[task.tree_idx] : task.tree_idx == -1 ? level1_tables_ : level2;
+            tree_hashes.clear();
+            for (size_t i = task.begin; i < task.end; i++)
+            {
+                auto &pst = psts[task.tree_idx == -1 ? l1_index->SlotAt(i) : i];
+                if (!pst.Valid())
+                    continue;
+                pst_hashes.clear();
+                PSTReader::Iterator iter(&reader, pst.meta.indexblock_ptr_);
+                if (iter.indexes_.empty() || iter.records_.empty())
+                    continue;
+                do
+                {
+                    pst_hashes.push_back(BlockedBloomFilter::Hash(iter.Key()));
+                } while (iter.Next());
+                pst.filter = BlockedBloomFilter::Build(pst_hashes, bloom_bits_per_key_);
+                if (task.tree_idx >= 0)
+                    tree_hashes.insert(tree_hashes.end(), pst_hashes.begin(), pst_hashes.end());
+            }
+            if (task.tree_idx >= 0)
+                level0_tree_meta_[task.tree_idx].filter = BlockedBloomFilter::Build(tree_hashes, bloom_bits_per_key_);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 1; i < thread_num; i++)
+    {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto &th : threads)
+    {
+        th.join();
+    }
+}
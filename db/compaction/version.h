@@ -13,10 +13,14 @@
 #include "db/pst_reader.h"
 #include "db/pst_builder.h"
 #include "db/pst_deleter.h"
+#include "level1_index.h"
+#include "db/super_version.h"
+#include "util/epoch.h"
 
 #include <algorithm>
 #include <queue>
 #include <map>
+#include <deque>
 #include <atomic>
 
 struct TreeMeta
@@ -25,6 +29,25 @@ struct TreeMeta
     uint64_t min_key = MAX_UINT64;
     uint64_t max_key = 0;
     uint64_t size = 0;
+    // filter of all keys in the tree, DRAM-only
+    std::shared_ptr<BlockedBloomFilter> filter;
+    // partitions merged into level1 by compactions, the tree is freed once it holds all of them.
+    // Written by the compaction thread with release, read by Get and GetSortedRuns with acquire
+    uint32_t compacted_partitions = 0;
+    // native min key of each partition, the boundaries compacted_partitions refers to
+    uint64_t partition_min_keys[RANGE_PARTITION_NUM] = {};
+
+    /**
+     * @brief the key lies in a compacted partition, its newest version in the tree is in level1 now
+     */
+    bool IsCompacted(uint64_t native_key) const
+    {
+        uint32_t compacted = __atomic_load_n(&compacted_partitions, __ATOMIC_ACQUIRE);
+        if (compacted == 0)
+            return false;
+        int partition = std::upper_bound(partition_min_keys, partition_min_keys + RANGE_PARTITION_NUM, native_key) - partition_min_keys - 1;
+        return compacted >> partition & 1;
+    }
 };
 
 class Manifest;
@@ -44,33 +67,112 @@ private:
     int l0_tail_ = 0;
     int l0_head_ = 0;
     int l0_read_tail_ = 0;
+    // l0_read_tail_ at the last PickLevel0Trees, trees after it were not compacted yet
+    int l0_pick_tail_ = 0;
 
     TreeMeta level0_tree_meta_[MAX_L0_TREE_NUM];
     // TODO: recover it when recovering db
     int l0_tree_seq_ = 0;
     int l1_seq_ = 0;
+    // 0 is the version of an empty level2, outputs of an unfinished first compaction must be newer
+    int l2_seq_ = 1;
 
-    // level1
+    // level1, slots are reserved so that readers never see the vector move
+    static constexpr size_t L1_MAX_SLOTS = 6553600;
     std::vector<TaggedPstMeta> level1_tables_;
-    Index *level1_tree_;
+    // heat of the pst in each slot: sampled lookups, halved by each migration pass
+    std::unique_ptr<std::atomic<uint8_t>[]> level1_heat_;
+    // index read by Get/Scan, replaced as a whole by PublishLevel1Index
+    std::atomic<Level1Index *> level1_index_;
+    // edits since the last publish: native-order max key -> slot, or L1_DELETED_SLOT
+    std::map<uint64_t, int64_t> level1_delta_;
     std::vector<size_t> level1_free_list_;
+    // pm bytes of the level1 psts, the trigger of L1->L2 compaction
+    std::atomic<size_t> level1_bytes_{0};
+
+    // level2, psts with datablocks on ssd sorted by max key. Replaced as a whole by ReplaceLevel2Tables
+    std::atomic<std::vector<TaggedPstMeta> *> level2_tables_;
+    // psts read from the manifest, published by L2TreeConsistencyCheckAndFix
+    std::vector<TaggedPstMeta> level2_recovered_;
     PSTReader pst_reader_;
+    SegmentAllocator *seg_allocator_;
+    EpochManager *epoch_;
+
+    size_t bloom_bits_per_key_ = 0;
+
+    /**
+     * @brief things a reader of an old level1 index may still touch.
+     * They are released once the operations running in epoch have finished.
+     */
+    struct RetiredResources
+    {
+        uint64_t epoch = 0;
+        std::vector<Level1Index *> indexes;
+        std::vector<size_t> slots;
+        std::vector<std::shared_ptr<BlockedBloomFilter>> filters;
+    };
+    // retired by the running clean step
+    RetiredResources retiring_;
+    std::deque<RetiredResources> retired_;
+    static constexpr int64_t L1_DELETED_SLOT = -1;
+
+    int64_t FindLevel1SlotForUpdate(uint64_t max_key);
+    static size_t PmBytesOf(const TaggedPstMeta &pst) { return sizeof(PIndexBlock) + (pst.data_on_ssd ? 0 : PmDataBytesOf(pst)); }
+    inline void SampleLevel1Access(int64_t slot);
 
 public:
-    Version(SegmentAllocator *seg_allocator);
+    /**
+     * @brief pm bytes of the datablocks of a pst, those it would take on pm if they are on ssd
+     */
+    static size_t PmDataBytesOf(const TaggedPstMeta &pst)
+    {
+        size_t blocks = pst.data_on_ssd ? (pst.meta.entry_num_ + PDataBlock::MAX_ENTRIES - 1) / PDataBlock::MAX_ENTRIES : pst.meta.datablock_num_;
+        return blocks * sizeof(PDataBlock);
+    }
+
+    Version(SegmentAllocator *seg_allocator, EpochManager *epoch);
     ~Version();
 
     int InsertTableToL0(TaggedPstMeta table, int tree_idx);
     int InsertTableToL1(TaggedPstMeta table);
     bool DeleteTableInL1(PSTMeta table);
+    /**
+     * @brief add a pst recorded in the manifest, used in recovery
+     */
+    void InsertTableToL2(TaggedPstMeta table);
     // bool DeleteTable(int idx, int level_id);
 
     bool Get(Slice key, const char *value_out, int *value_size, PSTReader *pst_reader);
+    /**
+     * @brief read the ssd datablocks that Gets of keys in level1 and level2 may read into pst_reader in one batch.
+     * The caller clears them before its epoch ends
+     */
+    void PrefetchSsdDataBlocks(const std::vector<Slice> &keys, PSTReader *pst_reader);
     RowIterator *GetLevel1Iter(Slice key, PSTReader *pst_reader,std::vector<TaggedPstMeta>& table_metas);
+    /**
+     * @brief copy the valid psts of each readable L0 tree (newest first),
+     * every run sorted by key and not overlapped inside
+     */
+    void GetSortedRuns(std::vector<std::vector<TaggedPstMeta>> &runs);
+    /**
+     * @brief the published level1 index over the level1 slots, without copying them.
+     * Valid until the operation or the iterator pinning the epoch finishes
+     */
+    PstRun GetLevel1Run() { return PstRun(level1_tables_, level1_index_.load(std::memory_order_acquire)); }
+    /**
+     * @brief psts of level2 sorted by key, valid until the operation pinning the epoch finishes
+     */
+    const std::vector<TaggedPstMeta> *GetLevel2Tables() { return level2_tables_.load(std::memory_order_acquire); }
+    /**
+     * @brief point query on runs collected by GetSortedRuns, then on level1 and level2, the first run holding the key wins
+     */
+    static bool GetFromSortedRuns(const std::vector<std::vector<TaggedPstMeta>> &runs, const PstRun &level1, const std::vector<TaggedPstMeta> *level2, Slice key, const char *value_out, int *value_size, PSTReader *pst_reader);
     int GetLevelSize(int level)
     {
         if (level == 1)
-            return level1_tables_.size() - level1_free_list_.size();
+            return level1_index_.load(std::memory_order_acquire)->Size();
+        if (level == 2)
+            return GetLevel2Tables()->size();
         int count = 0;
         if (level == 0)
         {
@@ -88,18 +190,121 @@ public:
      * @return int tree idx (determined by l0_tail_)
      */
     bool CheckSpaceForL0Tree();
+    /**
+     * @return -1 if the ring is full or the slot at l0_tail_ is not reclaimed yet
+     */
     int AddLevel0Tree();
     uint32_t GetCurrentL0TreeSeq();
     void SetCurrentL0TreeSeq(uint32_t seq);
     uint32_t GenerateL1Seq();
+    void SetL1Seq(uint32_t seq);
+    uint32_t GenerateL2Seq();
+    void SetL2Seq(uint32_t seq);
+    /**
+     * @brief make the oldest level0 tree unreadable, the tree and its slot are reclaimed by the epoch manager
+     * once the running operations have finished
+     */
     bool FreeLevel0Tree();
     void UpdateLevel0ReadTail();
+    /**
+     * @brief make the trees up to tree_idx readable, trees reserved by parallel flushes are published in reservation order
+     */
+    void PublishLevel0Tree(int tree_idx);
     int GetLevel0TreeNum()
     {
         return (l0_read_tail_ + MAX_L0_TREE_NUM - l0_head_) % MAX_L0_TREE_NUM;
     };
-    int PickLevel0Trees(std::vector<std::vector<TaggedPstMeta>> &outputs, std::vector<TreeMeta> &tree_metas, int max_size = MAX_L0_TREE_NUM);
+    /**
+     * @brief trees flushed since the last PickLevel0Trees
+     */
+    int GetUnpickedLevel0TreeNum()
+    {
+        return (l0_read_tail_ + MAX_L0_TREE_NUM - l0_pick_tail_) % MAX_L0_TREE_NUM;
+    };
+    /**
+     * @brief copy the psts of the readable trees not in their compacted partitions, the newest tree first
+     *
+     * @param tree_idxs slot of each picked tree
+     * @param unpicked_num the newest unpicked_num trees were not picked before
+     */
+    int PickLevel0Trees(std::vector<std::vector<TaggedPstMeta>> &outputs, std::vector<TreeMeta> &tree_metas, std::vector<int> &tree_idxs, int *unpicked_num, int max_size = MAX_L0_TREE_NUM);
+    /**
+     * @brief readers skip the tree for keys of the partitions, call it after their data is published in level1
+     *
+     * @param partitions boundaries of the job, the same for all partitions compacted in a tree
+     */
+    void MarkLevel0TreeCompacted(int tree_idx, uint32_t compacted, const PartitionInfo *partitions);
+    /**
+     * @brief free the oldest trees whose partitions are all compacted
+     *
+     * @return number of trees freed
+     */
+    int FreeCompactedLevel0Trees();
+    /**
+     * @brief some readable tree is partially compacted, its partitions must not change
+     */
+    bool HasCompactedLevel0Partitions();
     bool PickOverlappedL1Tables(size_t min, size_t max, std::vector<TaggedPstMeta> &output);
 
     bool L1TreeConsistencyCheckAndFix(PSTDeleter* pst_deleter,Manifest* manifest);
+
+    size_t GetLevel1Bytes() { return level1_bytes_.load(std::memory_order_relaxed); }
+    /**
+     * @brief pick consecutive level1 psts from the first one whose max key >= cursor, until they hold max_bytes
+     *
+     * @param cursor native key, moved after the picked psts, to 0 at the end of level1
+     */
+    void PickLevel1TablesForLevel2(uint64_t *cursor, size_t max_bytes, std::vector<TaggedPstMeta> &output);
+    /**
+     * @brief pick level1 psts whose datablocks change medium so that the hottest psts keep theirs on pm within pm_target bytes:
+     * hot psts on ssd move back if they fit, possibly in place of colder psts on pm, and the coldest psts on pm move to ssd
+     * while level1 is over the target. Then the heat of all psts is halved.
+     *
+     * @param max_bytes datablock bytes rewritten at most
+     * @param to_ssd,to_pm psts whose datablocks are to be rewritten on ssd and on pm
+     */
+    void PickLevel1TablesForMigration(size_t pm_target, size_t max_bytes, std::vector<TaggedPstMeta> &to_ssd, std::vector<TaggedPstMeta> &to_pm);
+    /**
+     * @param min,max big-endian key range
+     */
+    void PickOverlappedL2Tables(size_t min, size_t max, std::vector<TaggedPstMeta> &output);
+    /**
+     * @brief switch readers to a level2 without the deleted psts and with the added ones,
+     * the old one is released once no operation or iterator can read it
+     */
+    void ReplaceLevel2Tables(const std::vector<TaggedPstMeta> &deleted, const std::vector<TaggedPstMeta> &added);
+    /**
+     * @brief publish the recovered level2 psts, dropping the older of overlapped ones left by an unfinished L1->L2 compaction
+     */
+    bool L2TreeConsistencyCheckAndFix(PSTDeleter *pst_deleter, Manifest *manifest);
+
+    /**
+     * @brief apply the L1 inserts/deletes since the last publish by building a new level1 index,
+     * and switch readers to it atomically
+     */
+    void PublishLevel1Index();
+    size_t GetLevel1IndexMemoryUsage() { return level1_index_.load(std::memory_order_acquire)->MemoryUsage(); }
+
+    void SetBloomBitsPerKey(size_t bits_per_key) { bloom_bits_per_key_ = bits_per_key; }
+    size_t GetBloomBitsPerKey() { return bloom_bits_per_key_; }
+    /**
+     * @brief set the filter of a new level0 tree before it becomes readable
+     */
+    void SetLevel0TreeFilter(int tree_idx, std::shared_ptr<BlockedBloomFilter> filter);
+    /**
+     * @brief retire the level1 indexes, slots and filters replaced by this clean step,
+     * and release those no operation can reach any more. Call it at the end of each clean step.
+     *
+     * @param all release everything, only when there is no reader
+     */
+    void ReleaseRetired(bool all = false);
+    /**
+     * @brief end a clean step: the pages of the input psts it removed from the version are recycled once no
+     * running Get or open iterator can read them any more, then ReleaseRetired releases what the step replaced
+     */
+    void RetireInputPSTs(std::vector<PSTMeta> &&psts);
+    /**
+     * @brief build filters of all L0 trees and PSTs of all levels by reading the PSTs, used in recovery
+     */
+    void BuildFilters(SegmentAllocator *seg_allocator, int thread_num);
 };
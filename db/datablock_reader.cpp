@@ -1,9 +1,13 @@
 #include "datablock_reader.h"
-#include "util/binary_search.h"
+#include "block_cache.h"
+#include "ssd_io.h"
+#include "util/simd_search.h"
 #include <algorithm>
 
-DataBlockReader::DataBlockReader(SegmentAllocator *seg_allocator) : start_addr_(seg_allocator->GetStartAddr())
+DataBlockReader::DataBlockReader(SegmentAllocator *seg_allocator) : seg_allocator_(seg_allocator), start_addr_(seg_allocator->GetStartAddr())
 {
+    block_buf_ssd_.Alignment(sizeof(PSSDBlock));
+    block_buf_ssd_.AllocateNewBuffer(sizeof(PSSDBlock));
 }
 
 DataBlockReader::~DataBlockReader()
@@ -12,7 +16,9 @@ DataBlockReader::~DataBlockReader()
 
 DataBlockMeta DataBlockReader::TraverseDataBlock(uint64_t pm_offset, std::vector<std::pair<uint64_t, uint64_t>> *results)
 {
-    // TODO: check the type of the datablock. Currently the default is 512B pm block.
+    // level2 datablocks are 4KB blocks on ssd, the others are 512B pm blocks
+    if (FilePtr::IsFilePtr(pm_offset))
+        return TraverseDataBlock(FilePtr(pm_offset), results);
     // traverse
     PDataBlock *block = ReadPmDataBlock(pm_offset);
     int i;
@@ -50,6 +56,7 @@ DataBlockMeta DataBlockReader::TraverseDataBlock(FilePtr fptr, std::vector<std::
 {
     PSSDBlock *block = ReadSsdDataBlock(fptr);
     int i;
+    size_t last_key = INVALID_PTR;
     for (i = 0; i < PSSDBlock::MAX_ENTRIES; i++)
     {
         LOG("read entry %lu:%lu", block->entries[i].key, block->entries[i].value);
@@ -57,6 +64,12 @@ DataBlockMeta DataBlockReader::TraverseDataBlock(FilePtr fptr, std::vector<std::
         {
             break;
         }
+        // a partial block is padded with its last entry
+        if (block->entries[i].key == last_key)
+        {
+            break;
+        }
+        last_key = block->entries[i].key;
         if (results)
         {
             results->emplace_back(block->entries[i].key, block->entries[i].value);
@@ -67,7 +80,7 @@ DataBlockMeta DataBlockReader::TraverseDataBlock(FilePtr fptr, std::vector<std::
         ERROR_EXIT("datablock have no entries");
     }
     DataBlockMeta meta;
-    meta.block_start = block_buf_ssd_;
+    meta.block_start = (char *)block;
     meta.max_key = block->entries[i - 1].key;
     meta.min_key = block->entries[0].key;
     meta.size = i - 1;
@@ -78,33 +91,32 @@ DataBlockMeta DataBlockReader::TraverseDataBlock(FilePtr fptr, std::vector<std::
 bool DataBlockReader::BinarySearch(uint64_t pm_offset, Slice key, const char *value_out)
 {
     // TODO： currently, only support 8-byte string key.
-    PDataBlock *block = ReadPmDataBlock(pm_offset);
-    int index = binarysearch((char *)block->entries, PDataBlock::MAX_ENTRIES, key, sizeof(PDataBlock::Entry));
-    if (index >= 0)
+    if (FilePtr::IsFilePtr(pm_offset))
+        return BinarySearch(FilePtr(pm_offset), key, value_out);
+    PDataBlock *block = ReadPmDataBlock(pm_offset, true);
+    uint64_t int_key = key.ToUint64();
+    int index = simd_search::LowerBound((char *)block->entries, PDataBlock::MAX_ENTRIES, int_key);
+    if (index < PDataBlock::MAX_ENTRIES && block->entries[index].key == int_key)
     {
         memcpy((void *)value_out, &block->entries[index].value, 8);
         return true;
     }
-    else
-    {
-        index = -(index + 1);
-        return false;
-    }
+    return false;
 }
 
 bool DataBlockReader::BinarySearch(FilePtr fptr, Slice key, const char *value_out)
 {
     // TODO： currently, only support 8-byte string key.
-    PSSDBlock *block = ReadSsdDataBlock(fptr);
-    int index = binarysearch((char *)block->entries, PSSDBlock::MAX_ENTRIES, key, sizeof(PSSDBlock::Entry));
-    if (index >= 0)
+    PSSDBlock *block = ReadSsdDataBlock(fptr, true);
+    uint64_t int_key = key.ToUint64();
+    int index = simd_search::LowerBound((char *)block->entries, PSSDBlock::MAX_ENTRIES, int_key);
+    if (index < PSSDBlock::MAX_ENTRIES && block->entries[index].key == int_key)
     {
         memcpy((void *)value_out, &block->entries[index].value, 8);
         return true;
     }
     else
     {
-        index = -(index + 1);
         if (index < PSSDBlock::MAX_ENTRIES)
             memcpy((void *)value_out, &block->entries[index].value, 8);
         else
@@ -113,10 +125,61 @@ bool DataBlockReader::BinarySearch(FilePtr fptr, Slice key, const char *value_ou
     }
 }
 
+void DataBlockReader::PrefetchSsdDataBlocks(const std::vector<uint64_t> &ptrs, bool use_cache)
+{
+    BlockCache *cache = use_cache ? BlockCache::Ssd() : nullptr;
+    std::vector<IORequest> reqs;
+    // ptr and fill sequence of each request
+    std::vector<std::pair<uint64_t, uint64_t>> fills;
+    size_t taken = 0;
+    for (uint64_t ptr : ptrs)
+    {
+        if (taken == SSD_PREFETCH_BLOCKS)
+            break;
+        if (!FilePtr::IsFilePtr(ptr) || prefetched_.count(ptr))
+            continue;
+        // take the oldest buffer
+        size_t slot = prefetch_next_;
+        prefetch_next_ = (prefetch_next_ + 1) % SSD_PREFETCH_BLOCKS;
+        if (slot == prefetch_bufs_.size())
+        {
+            prefetch_bufs_.emplace_back(new SsdBlockBuf);
+            prefetch_ptrs_.push_back(INVALID_PTR);
+        }
+        if (prefetch_ptrs_[slot] != INVALID_PTR)
+            prefetched_.erase(prefetch_ptrs_[slot]);
+        prefetch_ptrs_[slot] = ptr;
+        prefetched_[ptr] = slot;
+        taken++;
+        uint64_t fill_seq = 0;
+        if (cache && cache->Lookup(ptr, CachedBlockType::SsdData, prefetch_bufs_[slot]->data, &fill_seq))
+            continue;
+        FilePtr fp(ptr);
+        reqs.emplace_back(seg_allocator_->GetSsdFd(fp.file_id), prefetch_bufs_[slot]->data, sizeof(PSSDBlock), fp.offset);
+        fills.emplace_back(ptr, fill_seq);
+    }
+    SsdIO::Submit(reqs.data(), reqs.size());
+    for (size_t i = 0; i < reqs.size(); i++)
+    {
+        if (reqs[i].res != (ssize_t)sizeof(PSSDBlock))
+            ERROR_EXIT("read ssd datablock at offset %ld failed: %zd", (long)reqs[i].offset, reqs[i].res);
+        if (cache)
+            cache->Insert(fills[i].first, reqs[i].buf, fills[i].second);
+    }
+}
+
+void DataBlockReader::ClearPrefetched()
+{
+    prefetched_.clear();
+    std::fill(prefetch_ptrs_.begin(), prefetch_ptrs_.end(), INVALID_PTR);
+}
+
 // private
-PDataBlock *DataBlockReader::ReadPmDataBlock(uint64_t pm_offset)
+PDataBlock *DataBlockReader::ReadPmDataBlock(uint64_t pm_offset, bool use_cache)
 {
-    if (pm_offset == block_pm_ptr_)
+    // the page of the buffered block may have been recycled since, the block cache is invalidated before that
+    BlockCache *global = BlockCache::Global();
+    if (pm_offset == block_pm_ptr_ && (global == nullptr || global->InvalidateSeq(pm_offset) == block_pm_seq_))
     {
         LOG("read datablock: cache hit %lu", pm_offset);
         return (PDataBlock *)block_buf_pm_;
@@ -128,6 +191,14 @@ PDataBlock *DataBlockReader::ReadPmDataBlock(uint64_t pm_offset)
     // direct access
     block = (PDataBlock *)addr;
 #else
+    BlockCache *cache = use_cache ? global : nullptr;
+    uint64_t fill_seq = global ? global->InvalidateSeq(pm_offset) : 0;
+    if (cache && cache->Lookup(pm_offset, CachedBlockType::PData, block_buf_pm_, &fill_seq))
+    {
+        block_pm_ptr_ = pm_offset;
+        block_pm_seq_ = fill_seq;
+        return (PDataBlock *)block_buf_pm_;
+    }
 // copy to buffer
 #ifdef ALIGNED_COPY_256
     for (size_t offset = 0; offset < sizeof(PDataBlock); offset += 256)
@@ -139,21 +210,41 @@ PDataBlock *DataBlockReader::ReadPmDataBlock(uint64_t pm_offset)
 #endif
     block = (PDataBlock *)block_buf_pm_;
     block_pm_ptr_ = pm_offset;
+    block_pm_seq_ = fill_seq;
+    if (cache)
+        cache->Insert(pm_offset, block_buf_pm_, fill_seq);
 #endif
     LOG("read datablock: cache miss, read %lu", (uint64_t)addr);
     return block;
 }
 
 // private
-PSSDBlock *DataBlockReader::ReadSsdDataBlock(FilePtr fp)
+PSSDBlock *DataBlockReader::ReadSsdDataBlock(FilePtr fp, bool use_cache)
 {
-    if (fp == block_ssd_ptr_)
+    char *buf = block_buf_ssd_.BufferStart();
+    BlockCache *global = BlockCache::Ssd();
+    if (fp == block_ssd_ptr_ && (global == nullptr || global->InvalidateSeq(fp.data()) == block_ssd_seq_))
     {
-        return (PSSDBlock *)block_buf_ssd_;
+        return (PSSDBlock *)buf;
     }
+    auto it = prefetched_.find(fp.data());
+    if (it != prefetched_.end())
+        return (PSSDBlock *)prefetch_bufs_[it->second]->data;
 
-    auto ret = pread(fp.fd, block_buf_ssd_, sizeof(PSSDBlock), fp.offset);
-    assert(ret != -1);
+    BlockCache *cache = use_cache ? global : nullptr;
+    uint64_t fill_seq = global ? global->InvalidateSeq(fp.data()) : 0;
+    if (cache && cache->Lookup(fp.data(), CachedBlockType::SsdData, buf, &fill_seq))
+    {
+        block_ssd_ptr_ = fp;
+        block_ssd_seq_ = fill_seq;
+        return (PSSDBlock *)buf;
+    }
+    auto ret = pread(seg_allocator_->GetSsdFd(fp.file_id), buf, sizeof(PSSDBlock), fp.offset);
+    if (ret != (ssize_t)sizeof(PSSDBlock))
+        ERROR_EXIT("read ssd datablock at offset %ld failed: %zd", (long)fp.offset, (ssize_t)ret);
     block_ssd_ptr_ = fp;
-    return (PSSDBlock *)block_buf_ssd_;
+    block_ssd_seq_ = fill_seq;
+    if (cache)
+        cache->Insert(fp.data(), buf, fill_seq);
+    return (PSSDBlock *)buf;
 }
\ No newline at end of file
@@ -2,7 +2,10 @@
 
 #include "blocks/fixed_size_block.h"
 #include "allocator/segment_allocator.h"
+#include "util/aligned_buffer.h"
 
+#include <memory>
+#include <unordered_map>
 #include <vector>
 struct DataBlockMeta
 {
@@ -17,22 +20,51 @@ class DataBlockReader
 {
 
 private:
+    SegmentAllocator *seg_allocator_;
     char* start_addr_;
     char block_buf_pm_[4096];
     uint64_t block_pm_ptr_=INVALID_PTR;
-    char block_buf_ssd_[16384];
+    // invalidation sequence of the block cache shard when the buffered blocks were read
+    uint64_t block_pm_seq_=0;
+    // page aligned for O_DIRECT reads
+    AlignedBuffer block_buf_ssd_;
     FilePtr block_ssd_ptr_=FilePtr::InvalidPtr();
+    uint64_t block_ssd_seq_=0;
+    // ssd datablocks of batched reads, up to SSD_PREFETCH_BLOCKS kept and replaced in FIFO order
+    struct alignas(4096) SsdBlockBuf
+    {
+        char data[sizeof(PSSDBlock)];
+    };
+    std::vector<std::unique_ptr<SsdBlockBuf>> prefetch_bufs_;
+    std::vector<uint64_t> prefetch_ptrs_;
+    std::unordered_map<uint64_t, size_t> prefetched_;
+    size_t prefetch_next_ = 0;
 
 public:
     DataBlockReader(SegmentAllocator *seg_allocator);
     ~DataBlockReader();
 
+    /**
+     * @param pm_offset a pm offset, or an encoded FilePtr of a datablock on ssd
+     */
     DataBlockMeta TraverseDataBlock(uint64_t pm_offset,std::vector<std::pair<uint64_t,uint64_t>>* results=nullptr);
     DataBlockMeta TraverseDataBlock(FilePtr fptr,std::vector<std::pair<uint64_t,uint64_t>>* results=nullptr);
     bool BinarySearch(uint64_t pm_offset,Slice key,const char* value_out);
     bool BinarySearch(FilePtr ftpr, Slice key,const char *value_out);
+    /**
+     * @brief read the datablocks on ssd among ptrs in one batch, later reads of them are served from DRAM.
+     * Pm offsets and blocks read before are skipped, at most SSD_PREFETCH_BLOCKS blocks are read.
+     * The caller keeps the psts of the blocks alive until ClearPrefetched, so that their pages are not reused
+     *
+     * @param use_cache serve blocks from the ssd page cache and fill it with the blocks read, only point queries do so
+     */
+    void PrefetchSsdDataBlocks(const std::vector<uint64_t> &ptrs, bool use_cache = false);
+    void ClearPrefetched();
 
 private:
-    PDataBlock *ReadPmDataBlock(uint64_t pm_offset);
-    PSSDBlock *ReadSsdDataBlock(FilePtr fp);
+    /**
+     * @param use_cache look up and fill the global block cache, only point queries do so
+     */
+    PDataBlock *ReadPmDataBlock(uint64_t pm_offset, bool use_cache = false);
+    PSSDBlock *ReadSsdDataBlock(FilePtr fp, bool use_cache = false);
 };
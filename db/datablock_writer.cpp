@@ -9,6 +9,8 @@ DataBlockWriterPm::DataBlockWriterPm(SegmentAllocator *allocator) : seg_allocato
 DataBlockWriterSsd::DataBlockWriterSsd(SegmentAllocator *allocator) : seg_allocator_(allocator), current_segment_(nullptr)
 {
     LOG("DataBlockWriterSsd init");
+    write_buf_.Alignment(sizeof(PSSDBlock));
+    write_buf_.AllocateNewBuffer(sizeof(PSSDBlock));
 }
 
 DataBlockWriterPm::~DataBlockWriterPm()
@@ -70,7 +72,7 @@ bool DataBlockWriterSsd::AddEntry(Slice key, Slice value)
 
             current_block->add_entry(*reinterpret_cast<const uint64_t *>(key.data()), *reinterpret_cast<const uint64_t *>(value.data()));
             LOG("add entry in datablock: size=%d,%lu:%lu", current_block->size, *reinterpret_cast<const uint64_t *>(key.data()), *reinterpret_cast<const uint64_t *>(value.data()));
-
+			num++;
             return true;
         }
     }
@@ -131,9 +133,12 @@ uint64_t DataBlockWriterSsd::Flush()
             {
                 blocks_buf_.add_entry(key, value);
             }
-            auto ret = pwrite(fptr.fd, &blocks_buf_.data_buf, sizeof(PSSDBlock), fptr.offset);
+            memcpy(write_buf_.BufferStart(), &blocks_buf_.data_buf, sizeof(PSSDBlock));
+            auto ret = pwrite(current_segment_->get_fd(), write_buf_.BufferStart(), sizeof(PSSDBlock), fptr.offset);
             assert(ret > 0);
         }
+        blocks_buf_.clear();
+		num = 0;
         return fptr.data();
     }
     return INVALID_PTR;
@@ -176,9 +181,11 @@ void DataBlockWriterSsd::allocate_block()
     FilePtr fptr = current_segment_->AllocatePage();
     if (!fptr.Valid()) // if current segment is full, alloc new segment
     {
-        seg_allocator_->CloseSegment(current_segment_);
-        seg_allocator_->AllocSortedSegmentOnSSD(sizeof(PSSDBlock));
+        // synced and closed with the others at the checkpoint
+        used_segments_.push_back(current_segment_);
+        current_segment_ = seg_allocator_->AllocSortedSegmentOnSSD(sizeof(PSSDBlock));
         fptr = current_segment_->AllocatePage();
+        assert(fptr.Valid());
     }
     blocks_buf_.clear();
     blocks_buf_.set_fptr(fptr);
@@ -201,4 +208,20 @@ int DataBlockWriterPm::PersistCheckpoint()
     return size;
 }
 int DataBlockWriterPm::Empty() { return num==0; }
-int DataBlockWriterSsd::PersistCheckpoint() { return 0; }
\ No newline at end of file
+int DataBlockWriterSsd::PersistCheckpoint()
+{
+    int size = used_segments_.size();
+    if (current_segment_)
+    {
+        seg_allocator_->CloseSegment(current_segment_);
+        current_segment_ = nullptr;
+        size++;
+    }
+    for (auto &seg : used_segments_)
+    {
+        seg_allocator_->CloseSegment(seg);
+    }
+    used_segments_.clear();
+    return size;
+}
+int DataBlockWriterSsd::Empty() { return num == 0; }
\ No newline at end of file
@@ -12,11 +12,13 @@
 #pragma once
 #include "blocks/fixed_size_block.h"
 #include "allocator/segment_allocator.h"
+#include "util/aligned_buffer.h"
 #include <vector>
 
 class DataBlockWriter
 {
 public:
+    virtual ~DataBlockWriter() {}
     virtual bool AddEntry(Slice key, Slice value)=0;
     virtual uint64_t GetCurrentMinKey()=0;
     virtual uint64_t GetCurrentMaxKey()=0;
@@ -60,7 +62,10 @@ private:
     SegmentAllocator *seg_allocator_;
     SortedSegmentOnSSD *current_segment_;
     PDataBlockSsdWrapper blocks_buf_;
+    // a page aligned copy of the block for O_DIRECT writes
+    AlignedBuffer write_buf_;
     std::vector<SortedSegmentOnSSD*> used_segments_;
+	int num = 0;
 
 public:
     DataBlockWriterSsd(SegmentAllocator *allocator);
@@ -70,7 +75,11 @@ public:
     virtual uint64_t GetCurrentMinKey() override;
     virtual uint64_t GetCurrentMaxKey() override;
     virtual uint64_t Flush() override;
+    /**
+     * @brief sync the written datablocks and the bitmaps of their segments, call it before the psts are recorded
+     */
     virtual int PersistCheckpoint() override;
+	virtual int Empty() override;
 
 private:
     virtual void allocate_block() override;
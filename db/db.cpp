@@ -1,13 +1,20 @@
 #include "db.h"
 #include "allocator/segment_allocator.h"
+#include "log_writer.h"
+#include "block_cache.h"
+#include "row_cache.h"
+#include "ssd_io.h"
 #include "compaction/version.h"
 #include "compaction/manifest.h"
 #include "compaction/flush.h"
 #include "compaction/compaction.h"
+#include "compaction/migration.h"
+#include "super_version.h"
 #include "lib/index_masstree.h"
 #include "util/stopwatch.hpp"
 #include "lib/ThreadPool/include/threadpool.h"
 #include "lib/ThreadPool/include/threadpool_imp.h"
+#include <algorithm>
 #ifdef HOT_MEMTABLE
 #include "lib/index_hot.h"
 #endif
@@ -17,20 +24,46 @@ void BGWorkTrigger(DB *db)
 	while (!db->stop_bgwork_)
 	{
 		bool ret = db->MayTriggerFlushOrCompaction();
-		usleep(100000);
+		// things retired while an iterator or a long operation was open
+		db->epoch_.Reclaim();
+		// woken by SignalBGWork, the timeout is only a watchdog
+		uint64_t signal_us;
+		{
+			std::unique_lock<std::mutex> lock(db->bg_work_mutex_);
+			db->bg_work_cv_.wait_for(lock, std::chrono::milliseconds(100), [db]()
+									 { return db->bg_work_signal_us_ != 0 || db->stop_bgwork_; });
+			signal_us = db->bg_work_signal_us_;
+			db->bg_work_signal_us_ = 0;
+		}
+		if (signal_us)
+			db->schedule_delay_hist_.Add(NowMicros() - signal_us);
 	}
 	printf("BGWorkTrigger stopped!\n");
 }
-DB::DB(DBConfig cfg) : db_path_(cfg.pm_pool_path), segment_allocator_(new SegmentAllocator(db_path_ + "/segments.pool", cfg.pm_pool_size, cfg.ssd_path, cfg.recover))
+void LogPersister(DB *db)
 {
-	current_memtable_idx_ = 0;
-#ifdef MASSTREE_MEMTABLE
-	mem_index_[current_memtable_idx_] = new MasstreeIndex();
-	mem_index_[1] = nullptr;
-#endif
-#ifdef HOT_MEMTABLE
-	mem_index_[current_memtable_idx_] = new HOTIndex(MAX_MEMTABLE_ENTRIES * 8);
+	while (!db->stop_bgwork_)
+	{
+		db->SyncAll();
+		usleep(db->log_persist_interval_us_);
+	}
+	db->SyncAll();
+}
+DB::DB(DBConfig cfg) : db_path_(cfg.pm_pool_path), segment_allocator_(new SegmentAllocator(db_path_ + "/segments.pool", cfg.pm_pool_size, cfg.ssd_path, cfg.recover, cfg.ssd_direct_io)),
+					   log_persist_policy_(cfg.log_persist_policy), log_persist_entries_(cfg.log_persist_entries), log_persist_interval_us_(cfg.log_persist_interval_us),
+					   write_controller_(cfg.delayed_write_rate, cfg.immutable_memtable_slowdown, cfg.l0_slowdown_trees), epoch_(MAX_USER_THREAD_NUM + 1),
+					   max_background_flushes_(std::max(cfg.max_background_flushes, 1)), partition_update_interval_(cfg.partition_update_interval),
+					   l1_pm_bytes_limit_(cfg.l1_pm_bytes_limit), l2_compaction_bytes_(std::max<size_t>(cfg.l2_compaction_bytes, 1)),
+					   l1_pm_target_bytes_(cfg.l1_pm_target_bytes), pst_migration_bytes_(std::max<size_t>(cfg.pst_migration_bytes, 1))
+{
+#ifdef INDEX_LOG_MEMTABLE
+	// values are read from the log, log entries must be persisted before the memtable update
+	log_persist_policy_ = PersistPerOp;
 #endif
+	current_memtable_idx_ = 0;
+	for (auto &index : mem_index_)
+		index = nullptr;
+	CreateMemtable(current_memtable_idx_);
 	for (int i = 0; i < MAX_USER_THREAD_NUM; i++)
 	{
 		client_list_[i] = nullptr;
@@ -42,15 +75,35 @@ DB::DB(DBConfig cfg) : db_path_(cfg.pm_pool_path), segment_allocator_(new Segmen
 	}
 	memtable_states_[current_memtable_idx_].state = MemTableStates::ACTIVE;
 	std::string manifest_path = db_path_ + "/manifest";
-	size_t mapped_len;
-	char *start_addr_ = (char *)pmem_map_file(manifest_path.c_str(), ManifestSize, PMEM_FILE_CREATE, 0666, &mapped_len, nullptr);
-	if (mapped_len != ManifestSize)
+	size_t mapped_len = 0;
+	size_t l2_slots = cfg.l1_pm_bytes_limit ? cfg.l2_ssd_bytes / L2MetaPstBytes : 0;
+	// an existing manifest is mapped with its own length, creating it would resize a manifest of another format
+	char *start_addr_ = cfg.recover ? (char *)pmem_map_file(manifest_path.c_str(), 0, 0, 0, &mapped_len, nullptr)
+									: (char *)pmem_map_file(manifest_path.c_str(), ManifestSize(l2_slots), PMEM_FILE_CREATE, 0666, &mapped_len, nullptr);
+	if (start_addr_ == nullptr)
 	{
 		ERROR_EXIT("Manifest file mapping error!");
 	}
 	DEBUG("manifest start = %lu, end = %lu", (uint64_t)start_addr_, (uint64_t)(start_addr_ + mapped_len));
-	current_version_ = new Version(segment_allocator_);
-	manifest_ = new Manifest(start_addr_, cfg.recover);
+	BlockCache::Open(cfg.block_cache_bytes);
+	BlockCache::OpenSsd(cfg.ssd_page_cache_bytes);
+	SsdIO::Open(cfg.ssd_io_queue_depth, cfg.ssd_io_threads, cfg.ssd_io_uring);
+	if (cfg.row_cache_bytes)
+		row_cache_ = new RowCache(cfg.row_cache_bytes, cfg.row_cache_admission);
+	current_version_ = new Version(segment_allocator_, &epoch_);
+	current_version_->SetBloomBitsPerKey(cfg.bloom_bits_per_key);
+	manifest_ = new Manifest(start_addr_, mapped_len, l2_slots, cfg.recover);
+
+	// Initialize partition info
+	size_t range=(1UL<<32)/RANGE_PARTITION_NUM << 32;
+	for(size_t i=0;i<RANGE_PARTITION_NUM;i++){
+		partition_info_[i].min_key=__bswap_64(range*i);
+		partition_info_[i].max_key=__bswap_64(range*i-1+range);
+	}
+	partition_info_[RANGE_PARTITION_NUM-1].max_key=MAX_UINT64;
+	if (cfg.recover && manifest_->GetPartitions(partition_info_))
+		INFO("recover range partitions from manifest");
+
 	if (cfg.recover)
 	{
 		stopwatch_t sw;
@@ -66,17 +119,11 @@ DB::DB(DBConfig cfg) : db_path_(cfg.pm_pool_path), segment_allocator_(new Segmen
 	}
 	//Thread pool init: flush threads + compaction threads + flush/compaction controller threads
 	thread_pool_ = new ThreadPoolImpl();
-	thread_pool_->SetBackgroundThreads(4);
+	thread_pool_->SetBackgroundThreads(max_background_flushes_ + 1);
 	compaction_thread_pool_ = new ThreadPoolImpl();
 	compaction_thread_pool_->SetBackgroundThreads(RANGE_PARTITION_NUM);
-
-	// Initialize partition info
-	size_t range=(1UL<<32)/RANGE_PARTITION_NUM << 32;
-	for(size_t i=0;i<RANGE_PARTITION_NUM;i++){
-		partition_info_[i].min_key=__bswap_64(range*i);
-		partition_info_[i].max_key=__bswap_64(range*i-1+range);
-	}
-	partition_info_[RANGE_PARTITION_NUM-1].max_key=MAX_UINT64;
+	flush_thread_pool_ = new ThreadPoolImpl();
+	flush_thread_pool_->SetBackgroundThreads(RANGE_PARTITION_NUM);
 
 #ifdef BUFFER_WAL_MEMTABLE
 	for (size_t i = 0; i < LSN_MAP_SIZE; i++)
@@ -85,15 +132,21 @@ DB::DB(DBConfig cfg) : db_path_(cfg.pm_pool_path), segment_allocator_(new Segmen
 	}
 #endif
 
+	InstallSuperVersion();
 	bgwork_trigger_ = new std::thread(BGWorkTrigger, this);
+	if (log_persist_policy_ == PersistAsync || log_persist_policy_ == PersistEveryMicros)
+		log_persister_ = new std::thread(LogPersister, this);
 }
 DB::~DB()
 {
 	WaitForFlushAndCompaction();
 	// segment_allocator_->PrintLogStats();
 	printf("closing DB,current idx=%d,L0 version=%u....\n", current_memtable_idx_, manifest_->GetL0Version());
+	LOG("flush/compaction schedule delay: %s", schedule_delay_hist_.ToString().c_str());
 	stop_bgwork_ = true;
+	SignalBGWork();
 	thread_pool_->JoinAllThreads();
+	flush_thread_pool_->JoinAllThreads();
 	PrintLogGroup(0);
 	PrintLogGroup(1);
 	if (bgwork_trigger_)
@@ -101,19 +154,196 @@ DB::~DB()
 		bgwork_trigger_->join();
 		delete bgwork_trigger_;
 	}
+	if (log_persister_)
+	{
+		log_persister_->join();
+		delete log_persister_;
+	}
+	// the deleters touch the version and the segments
+	super_version_.reset();
+	epoch_.Reclaim();
 
 	delete current_version_;
+	BlockCache::Close();
+	delete row_cache_;
 	delete segment_allocator_;
+	SsdIO::Close();
 	delete manifest_;
 	delete thread_pool_;
+	delete flush_thread_pool_;
 	for (int i = 0; i < MAX_MEMTABLE_NUM; i++)
 	{
-		if (mem_index_[i] != nullptr)
-			delete mem_index_[i];
+		ReleaseMemtable(i);
 		DEBUG("g,%lu\n", GetMemtableSize(i));
 	}
 }
 
+void DB::CreateMemtable(int idx)
+{
+#ifdef MASSTREE_MEMTABLE
+	Index *index = new MasstreeIndex();
+#endif
+#ifdef HOT_MEMTABLE
+	Index *index = new HOTIndex(MAX_MEMTABLE_ENTRIES * 8);
+#endif
+	std::lock_guard<SpinLock> lock(mem_index_lock_);
+	mem_index_owners_[idx].reset(index);
+	mem_index_[idx] = index;
+}
+
+void DB::ReleaseMemtable(int idx)
+{
+	std::shared_ptr<Index> owner;
+	{
+		std::lock_guard<SpinLock> lock(mem_index_lock_);
+		mem_index_[idx] = nullptr;
+		owner.swap(mem_index_owners_[idx]);
+	}
+	// a Get may still search it, freed with the deleter unless an iterator still holds it
+	epoch_.Retire([owner]() {});
+}
+
+std::shared_ptr<const SuperVersion> DB::GetSuperVersion()
+{
+	std::lock_guard<SpinLock> lock(super_version_lock_);
+	return super_version_;
+}
+
+void DB::InstallSuperVersion()
+{
+	std::lock_guard<std::mutex> lock(super_version_mutex_);
+	InstallSuperVersionLocked(current_memtable_idx_);
+}
+
+std::shared_ptr<const SuperVersion> DB::BuildSuperVersion(int newest_memtable_idx, bool include_newest)
+{
+	// background threads have no slot of their own, level0 trees freed meanwhile must wait for this one
+	EpochGuard guard(&epoch_, SUPER_VERSION_EPOCH_SLOT);
+	std::shared_ptr<SuperVersion> sv = std::make_shared<SuperVersion>(&epoch_);
+	{
+		std::lock_guard<SpinLock> lock(mem_index_lock_);
+		for (int i = 0; i < MAX_MEMTABLE_NUM; i++)
+		{
+			int memtable_id = (newest_memtable_idx - i + MAX_MEMTABLE_NUM) % MAX_MEMTABLE_NUM;
+			if (memtable_states_[memtable_id].state == MemTableStates::EMPTY)
+			{
+				break;
+			}
+			if (mem_index_owners_[memtable_id] && (i || include_newest))
+				sv->memtables.push_back(mem_index_owners_[memtable_id]);
+		}
+	}
+	current_version_->GetSortedRuns(sv->runs);
+	sv->level1 = current_version_->GetLevel1Run();
+	sv->level2 = current_version_->GetLevel2Tables();
+	sv->number = ++super_version_number_;
+	return sv;
+}
+
+void DB::InstallSuperVersionLocked(int newest_memtable_idx)
+{
+	std::shared_ptr<const SuperVersion> old = BuildSuperVersion(newest_memtable_idx);
+	{
+		std::lock_guard<SpinLock> lock(super_version_lock_);
+		super_version_.swap(old);
+	}
+	// the old view is freed here unless an iterator or a snapshot holds it
+}
+
+bool DB::SwitchMemtable(std::shared_ptr<const SuperVersion> *frozen_view)
+{
+	// iterators and snapshots see the new memtable before any write goes into it
+	std::lock_guard<std::mutex> lock(super_version_mutex_);
+	return SwitchMemtableLocked(frozen_view);
+}
+
+bool DB::SwitchMemtableLocked(std::shared_ptr<const SuperVersion> *frozen_view)
+{
+	int target_memtable_idx = current_memtable_idx_;
+	int next_memtable_idx = (target_memtable_idx + 1) % MAX_MEMTABLE_NUM;
+	if (memtable_states_[next_memtable_idx].state != MemTableStates::EMPTY)
+		return false;
+	// while the next slot is EMPTY, so that the view never wraps around to the new memtable
+	if (frozen_view)
+		*frozen_view = BuildSuperVersion(target_memtable_idx);
+	CreateMemtable(next_memtable_idx);
+	memtable_states_[next_memtable_idx].state = MemTableStates::ACTIVE;
+	memtable_states_[target_memtable_idx].state = MemTableStates::FREEZE;
+	InstallSuperVersionLocked(next_memtable_idx);
+	current_memtable_idx_ = next_memtable_idx; // change active memtable
+	return true;
+}
+
+bool DB::MemtableEmpty(int idx)
+{
+	std::shared_ptr<Index> memtable;
+	{
+		std::lock_guard<SpinLock> lock(mem_index_lock_);
+		memtable = mem_index_owners_[idx];
+	}
+	std::vector<uint64_t> keys, values;
+	memtable->Scan2(0, 1, keys, values);
+	return keys.empty();
+}
+
+int DB::OldestMemtable()
+{
+	int oldest = current_memtable_idx_;
+	for (int i = 1; i < MAX_MEMTABLE_NUM; i++)
+	{
+		int memtable_id = (current_memtable_idx_ - i + MAX_MEMTABLE_NUM) % MAX_MEMTABLE_NUM;
+		if (memtable_states_[memtable_id].state == MemTableStates::EMPTY)
+			break;
+		oldest = memtable_id;
+	}
+	return oldest;
+}
+
+void DB::SignalBGWork()
+{
+	std::lock_guard<std::mutex> lock(bg_work_mutex_);
+	if (bg_work_signal_us_ == 0)
+		bg_work_signal_us_ = NowMicros();
+	bg_work_cv_.notify_one();
+}
+
+void DB::UpdateWriteController()
+{
+	int immutable_memtables = (current_memtable_idx_ - OldestMemtable() + MAX_MEMTABLE_NUM) % MAX_MEMTABLE_NUM;
+	bool stop = immutable_memtables == MAX_MEMTABLE_NUM - 1 && GetMemtableSize(current_memtable_idx_) >= MAX_MEMTABLE_ENTRIES;
+	write_controller_.SetPressure(immutable_memtables, current_version_->GetLevel0TreeNum(), stop);
+}
+
+const Snapshot *DB::GetSnapshot()
+{
+	Snapshot *snapshot = new Snapshot();
+	bool frozen = false;
+	{
+		std::unique_lock<std::mutex> lock(super_version_mutex_);
+		// later writes go into the active memtable, it is only frozen if it holds writes the snapshot must see
+		while (!MemtableEmpty(current_memtable_idx_))
+		{
+			frozen = SwitchMemtableLocked(&snapshot->super_version_);
+			if (frozen)
+				break;
+			// all memtables are in use, the flush of the oldest one frees a slot
+			SignalBGWork();
+			memtable_free_cv_.wait(lock);
+		}
+		if (!frozen)
+			snapshot->super_version_ = BuildSuperVersion(current_memtable_idx_, false);
+	}
+	// writes into the frozen memtable finish before the snapshot is read
+	if (frozen)
+		epoch_.Synchronize();
+	return snapshot;
+}
+
+void DB::ReleaseSnapshot(const Snapshot *snapshot)
+{
+	delete snapshot;
+}
+
 bool DB::RecoverLogAndMemtable()
 {
 	std::vector<uint64_t> seg_id_list;
@@ -142,15 +372,18 @@ bool DB::RecoverLogAndMemtable()
 		for (int i = 0; i < entry_num; i++)
 		{
 			auto &entry = logbuffer[i];
+			// zero padding and write batch headers, the reader only returns batches that are wholly persisted
+			if (entry.key_sz == 0)
+				continue;
 			ValueHelper lh(0);
 #ifdef INDEX_LOG_MEMTABLE
-			ValuePtr vp{.detail_ = {.valid = 1,
-									.ptr = seg_id * SEGMENT_SIZE + sizeof(LogSegment::Header) + i * sizeof(LogEntry32) >> 6,
+			ValuePtr vp{.detail_ = {.valid = entry.valid,
+									.ptr = seg_id * SEGMENT_SIZE + i * sizeof(LogEntry32) >> 6,
 									.lsn = entry.lsn}};
 			lh.new_val = vp.data_;
 #endif
 #ifdef BUFFER_WAL_MEMTABLE
-			lh.new_val = entry.value_addr;
+			lh.new_val = entry.valid ? entry.value_addr : INVALID_PTR;
 #endif
 			mem_index_[0]->Put(entry.key, lh);
 		}
@@ -159,6 +392,24 @@ bool DB::RecoverLogAndMemtable()
 	return ret;
 }
 
+/**
+ * @brief block until the log entries of all clients written before this call are persistent.
+ * Only needed with PersistAsync and PersistEveryMicros, whose writers may be idle with unpersisted entries,
+ * use DBClient::WaitForDurable for other buffered policies.
+ *
+ */
+void DB::SyncAll()
+{
+	if (log_persist_policy_ != PersistAsync && log_persist_policy_ != PersistEveryMicros)
+		return;
+	std::lock_guard<SpinLock> lock(client_lock_);
+	for (auto &c : client_list_)
+	{
+		if (c != nullptr)
+			c->log_writer_->Persist();
+	}
+}
+
 std::unique_ptr<DBClient> DB::GetClient(int tid)
 {
 	std::lock_guard<SpinLock> lock(client_lock_);
@@ -275,28 +526,62 @@ bool DB::MayTriggerFlushOrCompaction()
 	// Flush
 	size_t memtablesize = GetMemtableSize(current_memtable_idx_);
 	size_t flush_threashold = read_only_mode_ ? 1 : MAX_MEMTABLE_ENTRIES;
+	// a full memtable is frozen and writes go on into the next one, it fails while all memtables are in use
 	if (memtablesize >= flush_threashold)
+		SwitchMemtable();
+	bool ret = ScheduleFlushes();
+	UpdateWriteController();
+	// Compaction
+	ret |= MayTriggerCompaction();
+	return ret;
+}
+
+bool DB::ScheduleFlushes()
+{
+	std::lock_guard<std::mutex> lock(flush_mutex_);
+	if (OldestMemtable() == current_memtable_idx_ || running_flushes_ >= max_background_flushes_)
+		return false;
+	// the slot for a new level0 tree may wait for readers of a freed tree
+	epoch_.Reclaim();
+	bool scheduled = false;
+	// trees are reserved oldest memtable first, so a newer tree is searched before an older one
+	for (int idx = OldestMemtable(); idx != current_memtable_idx_ && running_flushes_ < max_background_flushes_; idx = (idx + 1) % MAX_MEMTABLE_NUM)
 	{
-		// printf("memtablesize[%d]=%lu\n", current_memtable_idx_, memtablesize);
-		bool expect = false;
-		if (is_flushing_.compare_exchange_weak(expect, true))
+		if (memtable_states_[idx].state != MemTableStates::FREEZE)
+			continue;
+		if (!current_version_->CheckSpaceForL0Tree())
 		{
-			FlushArgs *fa = new FlushArgs(this);
-			thread_pool_->Schedule(&DB::TriggerBGFlush, fa, fa, nullptr);
-			return true;
+			INFO("flush stall due to full L0");
+			break;
+		}
+		uint32_t tree_seq_no = current_version_->GetCurrentL0TreeSeq();
+		int tree_idx = current_version_->AddLevel0Tree();
+		std::shared_ptr<Index> memtable;
+		{
+			std::lock_guard<SpinLock> lock(mem_index_lock_);
+			memtable = mem_index_owners_[idx];
 		}
+		{
+			std::lock_guard<std::mutex> lock(partition_mutex_);
+			flush_jobs_[idx] = new FlushJob(std::move(memtable), GetMemtableSize(idx), idx, tree_idx, tree_seq_no, segment_allocator_, current_version_, manifest_, partition_info_, flush_thread_pool_);
+		}
+		memtable_states_[idx].state = MemTableStates::FLUSHING;
+		running_flushes_++;
+		FlushArgs *fa = new FlushArgs(this, idx);
+		thread_pool_->Schedule(&DB::TriggerBGFlush, fa, fa, nullptr);
+		scheduled = true;
 	}
-	// Compaction
-	auto ret = false;
-	ret = MayTriggerCompaction();
-	return ret;
+	return scheduled;
 }
 
 bool DB::MayTriggerCompaction()
 {
 	size_t compaction_threashold = read_optimized_mode_ ? 1 : l0_compaction_tree_num_;
-	// Compaction
-	if (current_version_->GetLevel0TreeNum() >= compaction_threashold)
+	// Compaction, partitions are compacted on their own: trees flushed since the last compaction trigger the next one,
+	// and trees kept for their cold partitions trigger it once level0 holds too many of them
+	size_t tree_num = current_version_->GetLevel0TreeNum();
+	if (current_version_->GetUnpickedLevel0TreeNum() >= compaction_threashold || tree_num >= compaction_threashold * L0_FORCE_COMPACTION_FACTOR ||
+		(read_optimized_mode_ && tree_num) || NeedLevel2Compaction() || NeedPstMigration())
 	{
 		bool expect = false;
 		if (is_l0_compacting_.compare_exchange_weak(expect, true))
@@ -337,7 +622,7 @@ void DB::TriggerBGFlush(void *arg)
 	FlushArgs fa = *(reinterpret_cast<FlushArgs *>(arg));
 	delete (reinterpret_cast<FlushArgs *>(arg));
 	// printf("trigger flush\n");
-	static_cast<DB *>(fa.db_)->BGFlush();
+	static_cast<DB *>(fa.db_)->BGFlush(fa.memtable_idx_);
 }
 
 void DB::TriggerBGCompaction(void *arg)
@@ -348,93 +633,76 @@ void DB::TriggerBGCompaction(void *arg)
 	static_cast<DB *>(ca.db_)->BGCompaction();
 }
 
-bool DB::BGFlush()
+bool DB::BGFlush(int memtable_idx)
 {
-	if (!current_version_->CheckSpaceForL0Tree())
-	{
-		INFO("flush stall due to full L0");
-		is_flushing_ = false;
-		return false;
-	}
-	LOG("start flush active_memtable = %d, memtablesize=(%lu,%lu), level0treenum=%d,table=%d", current_memtable_idx_.load(), memtable_size_[0].load(), memtable_size_[1].load(), current_version_->GetLevel0TreeNum(), current_version_->GetLevelSize(0));
+	LOG("start flush memtable %d, active_memtable = %d, running flushes=%d, level0treenum=%d,table=%d", memtable_idx, current_memtable_idx_, running_flushes_.load(), current_version_->GetLevel0TreeNum(), current_version_->GetLevelSize(0));
 	stopwatch_t sw;
 	sw.start();
-	// 1. freeze memtable and modify the current_memtable_idx of DB
-	int target_memtable_idx = current_memtable_idx_;
-	int next_memtable_idx = (target_memtable_idx + 1) % MAX_MEMTABLE_NUM;
-/* if only enabling single-thread flush, this memtable state control is not neccessary
-	LOG("start flush,target idx=%d,kv=%lu", target_memtable_idx, memtable_size_[target_memtable_idx].load());
-	if (memtable_states_[target_memtable_idx].state != MemTableStates::ACTIVE)
+	// 1. wait for the clients that may still write into the frozen memtable
+	epoch_.Synchronize();
+	// 2. build the psts of the reserved level0 tree, in parallel with the flushes of other memtables
+	DEBUG("flush step 2");
+	flush_jobs_[memtable_idx]->run();
+	// 3. install the trees in memtable order, a newer tree stays unreadable until the older ones are installed
+	DEBUG("flush step 3");
 	{
-		DEBUG("memtable_states_[%d].state =%d, flush failed", target_memtable_idx, memtable_states_[target_memtable_idx].state);
-		return false;
+		std::lock_guard<std::mutex> lock(flush_mutex_);
+		memtable_states_[memtable_idx].state = MemTableStates::FLUSHED;
+		InstallFlushesLocked();
 	}
-	LOG("target memtable is active: ok!");
-	memtable_states_[target_memtable_idx].state = MemTableStates::FREEZE;
-	if (memtable_states_[next_memtable_idx].state != MemTableStates::EMPTY)
-		return false;
-*/
-#ifdef MASSTREE_MEMTABLE
-	mem_index_[next_memtable_idx] = new MasstreeIndex();
-#endif
-#ifdef HOT_MEMTABLE
-	mem_index_[next_memtable_idx] = new HOTIndex(MAX_MEMTABLE_ENTRIES * 8);
-#endif
-	memtable_states_[next_memtable_idx].state = MemTableStates::ACTIVE;
-	current_memtable_idx_ = next_memtable_idx; // change active memtable
-	LOG("change memtable. active_memtable = %d, memtablesize=(%lu,%lu), l0treenum=%d,table=%d", current_memtable_idx_.load(), memtable_size_[0].load(), memtable_size_[1].load(), current_version_->GetLevel0TreeNum(), current_version_->GetLevelSize(0));
-	// from this time, user thread can write into new memtable and other flush can be triggered on other memtable
-	// 2. wait all threads not busy
-	DEBUG("step 2");
-	// for (int i = 0; i < MAX_USER_THREAD_NUM; i++)
-	// {
-	//     while (memtable_states_[target_memtable_idx].thread_write_states[i] == true)
-	//     {
-	//         std::this_thread::yield();
-	//     }
-	// }
-	usleep(100); // just wait for all client put over, instead of checking client state with a shared value
-	// 3. core steps
-	DEBUG("flush step 3");
-	FlushJob fj(mem_index_[target_memtable_idx], target_memtable_idx, segment_allocator_, current_version_, manifest_, partition_info_);
-	auto ret = fj.run();
-	// 4. change memtable state to EMPTY
-	DEBUG("step 4");
-	memtable_states_[target_memtable_idx].state = MemTableStates::EMPTY;
-	int expect = 0;
-	DEBUG("before delete memtable");
-#ifdef MASSTREE_MEMTABLE
-	delete (MasstreeIndex *)mem_index_[target_memtable_idx];
-#endif
-	DEBUG("after delete memtable");
-#ifdef HOT_MEMTABLE
-	delete (HOTIndex *)mem_index_[target_memtable_idx];
-#endif
-	mem_index_[target_memtable_idx] = nullptr;
-	ClearMemtableSize(target_memtable_idx);
-	segment_allocator_->ClearLogGroup(target_memtable_idx);
+	UpdateWriteController();
+
+	epoch_.Reclaim();
 
-	// MayTriggerFlushOrCompaction(); // to trigger cascade compaction
-	is_flushing_ = false;
+	running_flushes_--;
+	SignalBGWork(); // for the next frozen memtable or a cascade compaction
 	auto ms = sw.elapsed<std::chrono::milliseconds>();
-	LOG("finish flush active_memtable = %d, memtablesize=(%lu,%lu), level0treenum=%d,table=%d,time=%f ms", current_memtable_idx_, GetMemtableSize(0), GetMemtableSize(1), current_version_->GetLevel0TreeNum(), current_version_->GetLevelSize(0), ms);
+	LOG("finish flush memtable %d, active_memtable = %d, level0treenum=%d,table=%d,time=%f ms", memtable_idx, current_memtable_idx_, current_version_->GetLevel0TreeNum(), current_version_->GetLevelSize(0), ms);
 	INFO("flush end, time=%f ms", ms);
 	return true;
 }
 
+void DB::InstallFlushesLocked()
+{
+	for (int idx = OldestMemtable(); memtable_states_[idx].state == MemTableStates::FLUSHED; idx = OldestMemtable())
+	{
+		flush_jobs_[idx]->Install();
+		delete flush_jobs_[idx];
+		flush_jobs_[idx] = nullptr;
+		ReleaseMemtable(idx);
+		ClearMemtableSize(idx);
+		segment_allocator_->ClearLogGroup(idx);
+		{
+			// SwitchMemtable reuses the slot once it is EMPTY, so only after its memtable and log group are cleared
+			std::lock_guard<std::mutex> lock(super_version_mutex_);
+			memtable_states_[idx].state = MemTableStates::EMPTY;
+			InstallSuperVersionLocked(current_memtable_idx_);
+		}
+		memtable_free_cv_.notify_all();
+	}
+}
+
 bool DB::BGCompaction()
 {
-	CompactionJob *c = new CompactionJob(segment_allocator_, current_version_, manifest_, partition_info_,compaction_thread_pool_);
+	CompactionJob *c;
+	{
+		std::lock_guard<std::mutex> lock(partition_mutex_);
+		c = new CompactionJob(segment_allocator_, current_version_, manifest_, partition_info_,compaction_thread_pool_);
+	}
 	// 1 PickCompaction (lock, freeze pst range)
 	stopwatch_t sw;
 	sw.start();
 	DEBUG("PickCompaction start");
-	auto num = c->PickCompaction();
+	// a rebalance waits for the partitions of all trees to be compacted
+	auto num = c->PickCompaction(read_optimized_mode_ || partition_rebalance_pending_, l0_compaction_tree_num_ * L0_FORCE_COMPACTION_FACTOR);
 	auto ms = sw.elapsed<std::chrono::milliseconds>();
 	auto total_ms = ms;
 	DEBUG("PickCompaction end, time: %f ms", ms);
 	if (num == 0)
 	{
+		delete c;
+		BGCompactLevel2();
+		BGMigratePsts();
 		is_l0_compacting_ = false;
 		return false;
 	}
@@ -467,25 +735,197 @@ bool DB::BGCompaction()
 	sw.start();
 	// c->CleanCompaction();
 	c->CleanCompactionWhenUsingSubCompaction();
+	InstallSuperVersion();
+	epoch_.Reclaim();
 	ms = sw.elapsed<std::chrono::milliseconds>();
 	DEBUG("CleanCompaction end, time: %f ms", ms);
 	total_ms += ms;
-	is_l0_compacting_ = false;
+	size_t merged_keys = c->GetMergedKeys();
+	uint64_t merge_us = std::max<uint64_t>(c->GetMergeMicros(), 1);
+	double partition_skew = c->GetPartitionSkew();
+	int partitions = c->GetCompactedPartitionNum();
+	int freed_trees = c->GetFreedTreeNum();
+	size_t reused_blocks = c->GetReusedDataBlocks();
 	DEBUG("before compaction end");
 	print_dram_consuption();
 	delete c;
 	print_dram_consuption();
-	INFO("comapction end, time=%f ms", total_ms);
-	MayTriggerFlushOrCompaction();
+	INFO("comapction end, time=%f ms, %d partitions of %lu level0 trees, freed %d trees, merged %lu keys, reused %lu datablocks, %.2f Mkeys/s per core, partition skew %.2f",
+		 total_ms, partitions, num, freed_trees, merged_keys, reused_blocks, (double)merged_keys / merge_us, partition_skew);
+	// before the next compaction may start, its job copies the partitions
+	MayUpdatePartitions();
+	BGCompactLevel2();
+	BGMigratePsts();
+	is_l0_compacting_ = false;
+	SignalBGWork();
 
 	return true;
 }
 
+bool DB::NeedLevel2Compaction()
+{
+	return l1_pm_bytes_limit_ && current_version_->GetLevel1Bytes() > l1_pm_bytes_limit_;
+}
+
+int DB::BGCompactLevel2()
+{
+	int jobs = 0;
+	while (NeedLevel2Compaction())
+	{
+		stopwatch_t sw;
+		sw.start();
+		CompactionJob *c;
+		{
+			std::lock_guard<std::mutex> lock(partition_mutex_);
+			c = new CompactionJob(segment_allocator_, current_version_, manifest_, partition_info_, compaction_thread_pool_, 2);
+		}
+		size_t level1_bytes = current_version_->GetLevel1Bytes();
+		size_t num = c->PickLevel2Compaction(l2_compaction_bytes_, &l2_compact_cursor_);
+		if (num && c->EstimateLevel2OutputNum() > manifest_->GetFreeL2Slots())
+		{
+			if (!l2_full_reported_)
+				INFO("level2 is full with %d psts, level1 stays above l1_pm_bytes_limit, raise DBConfig::l2_ssd_bytes", current_version_->GetLevelSize(2));
+			l2_full_reported_ = true;
+			num = 0;
+		}
+		if (num == 0)
+		{
+			delete c;
+			break;
+		}
+		c->RunSubCompactionParallel();
+		c->CleanLevel2Compaction();
+		InstallSuperVersion();
+		epoch_.Reclaim();
+		INFO("L1->L2 compaction end, time=%f ms, %lu level1 psts and %lu level2 psts into %lu level2 psts, level1 %lu -> %lu bytes, level2 %d psts",
+			 sw.elapsed<std::chrono::milliseconds>(), num, c->GetLevel2InputNum(), c->GetOutputNum(), level1_bytes, current_version_->GetLevel1Bytes(), current_version_->GetLevelSize(2));
+		delete c;
+		l2_full_reported_ = false;
+		jobs++;
+	}
+	return jobs;
+}
+
+bool DB::NeedPstMigration()
+{
+	return l1_pm_target_bytes_ && NowMicros() - last_migration_us_ >= PST_MIGRATION_INTERVAL_MS * 1000ul;
+}
+
+size_t DB::BGMigratePsts()
+{
+	if (!NeedPstMigration())
+		return 0;
+	last_migration_us_ = NowMicros();
+	stopwatch_t sw;
+	sw.start();
+	MigrationJob job(segment_allocator_, current_version_, manifest_);
+	size_t level1_bytes = current_version_->GetLevel1Bytes();
+	size_t num = job.PickMigration(l1_pm_target_bytes_, pst_migration_bytes_);
+	if (num == 0)
+		return 0;
+	job.Run();
+	job.Clean();
+	InstallSuperVersion();
+	epoch_.Reclaim();
+	INFO("pst migration end, time=%f ms, %lu psts to ssd, %lu psts to pm, %lu datablock bytes rewritten, level1 %lu -> %lu pm bytes",
+		 sw.elapsed<std::chrono::milliseconds>(), job.GetToSsdNum(), job.GetToPmNum(), job.GetMovedBytes(), level1_bytes, current_version_->GetLevel1Bytes());
+	return num;
+}
+
+void DB::MayUpdatePartitions()
+{
+	if (!partition_rebalance_pending_ && (partition_update_interval_ <= 0 || ++compactions_since_partition_update_ < partition_update_interval_))
+		return;
+	compactions_since_partition_update_ = 0;
+	partition_rebalance_pending_ = false;
+	// {native min key, entries} of each pst, the memtables are sampled once flushed to level0
+	std::vector<std::pair<uint64_t, uint64_t>> samples;
+	uint64_t total = 0;
+	auto super_version = GetSuperVersion();
+	auto add_sample = [&](const TaggedPstMeta &pst)
+	{
+		samples.emplace_back(__bswap_64(pst.meta.min_key_), pst.meta.entry_num_);
+		total += pst.meta.entry_num_;
+	};
+	for (auto &run : super_version->runs)
+	{
+		for (auto &pst : run)
+			add_sample(pst);
+	}
+	const PstRun &level1 = super_version->level1;
+	for (size_t pos = 0; pos < level1.Size(); pos++)
+		add_sample(level1.At(pos));
+	if (samples.size() < RANGE_PARTITION_NUM * PARTITION_MIN_SAMPLES || total == 0)
+		return;
+	std::sort(samples.begin(), samples.end());
+
+	// partition i starts at the first sample with i/N of the entries before it
+	PartitionInfo partitions[RANGE_PARTITION_NUM];
+	partitions[0].min_key = 0;
+	int next = 1;
+	uint64_t seen = 0;
+	for (auto &sample : samples)
+	{
+		if (next < RANGE_PARTITION_NUM && seen >= total * next / RANGE_PARTITION_NUM && sample.first > __bswap_64(partitions[next - 1].min_key))
+		{
+			partitions[next].min_key = __bswap_64(sample.first);
+			next++;
+		}
+		seen += sample.second;
+	}
+	if (next < RANGE_PARTITION_NUM)
+		return;
+	// a level1 pst is compacted with its partition, move each boundary inside a pst to the start of the pst
+	for (int i = 1; i < RANGE_PARTITION_NUM; i++)
+	{
+		uint64_t boundary = __bswap_64(partitions[i].min_key);
+		size_t pos = level1.LowerBound(boundary);
+		if (pos < level1.Size() && __bswap_64(level1.At(pos).meta.min_key_) < boundary)
+			boundary = __bswap_64(level1.At(pos).meta.min_key_);
+		if (boundary <= __bswap_64(partitions[i - 1].min_key))
+			return;
+		partitions[i].min_key = __bswap_64(boundary);
+	}
+	for (int i = 0; i < RANGE_PARTITION_NUM; i++)
+		partitions[i].max_key = i + 1 < RANGE_PARTITION_NUM ? __bswap_64(__bswap_64(partitions[i + 1].min_key) - 1) : MAX_UINT64;
+
+	// largest partition over the average one
+	auto skew = [&](const PartitionInfo *p)
+	{
+		uint64_t entries[RANGE_PARTITION_NUM] = {};
+		int i = 0;
+		for (auto &sample : samples)
+		{
+			while (i + 1 < RANGE_PARTITION_NUM && sample.first >= __bswap_64(p[i + 1].min_key))
+				i++;
+			entries[i] += sample.second;
+		}
+		return (double)*std::max_element(entries, entries + RANGE_PARTITION_NUM) * RANGE_PARTITION_NUM / total;
+	};
+	double old_skew = skew(partition_info_);
+	double new_skew = skew(partitions);
+	if (old_skew < PARTITION_REBALANCE_SKEW || new_skew >= old_skew)
+		return;
+	// partially compacted trees refer to the current boundaries, the next compaction takes all partitions first
+	if (current_version_->HasCompactedLevel0Partitions())
+	{
+		partition_rebalance_pending_ = true;
+		INFO("rebalance range partitions after compacting all of them, estimated skew %.2f -> %.2f", old_skew, new_skew);
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(partition_mutex_);
+		std::copy(partitions, partitions + RANGE_PARTITION_NUM, partition_info_);
+	}
+	manifest_->UpdatePartitions(partitions);
+	INFO("rebalance range partitions of %lu psts, estimated skew %.2f -> %.2f", samples.size(), old_skew, new_skew);
+}
+
 void DB::WaitForFlushAndCompaction()
 {
 	EnableReadOptimizedMode();
 	EnableReadOnlyMode();
-	while (is_flushing_.load() || is_l0_compacting_.load())
+	while (running_flushes_.load() || is_l0_compacting_.load())
 	{
 		sleep(1);
 	}
@@ -2,6 +2,9 @@
 #include "db/log_writer.h"
 #include "db/log_reader.h"
 #include "db/compaction/version.h"
+#include "db/row_cache.h"
+#include "db/merging_iterator.h"
+#include "db/super_version.h"
 #include <mutex>
 #include <algorithm>
 
@@ -9,6 +12,7 @@
 DBClient::DBClient(DB *db, int tid) : db_(db), thread_id_(tid), log_writer_(new LogWriter(db->segment_allocator_, db_->current_memtable_idx_)), log_reader_(new LogReader(db->segment_allocator_)), pst_reader_(new PSTReader(db->segment_allocator_))
 {
     current_memtable_idx_ = db_->current_memtable_idx_;
+    log_writer_->SetPersistPolicy(db_->log_persist_policy_, db_->log_persist_entries_, db_->log_persist_interval_us_);
     db_->mem_index_[current_memtable_idx_]->ThreadInit(tid);
     for (auto &num : put_num_in_current_memtable_)
     {
@@ -18,11 +22,14 @@ DBClient::DBClient(DB *db, int tid) : db_(db), thread_id_(tid), log_writer_(new
 DBClient::~DBClient()
 {
     db_->AddTempMemtableSize(current_memtable_idx_, put_num_in_current_memtable_[current_memtable_idx_]);
+    {
+        // unregister first so the log persister no longer touches log_writer_
+        std::lock_guard<SpinLock> lock(db_->client_lock_);
+        db_->client_list_[thread_id_] = nullptr;
+    }
     delete log_writer_;
     delete log_reader_;
     delete pst_reader_;
-    std::lock_guard<SpinLock> lock(db_->client_lock_);
-    db_->client_list_[thread_id_] = nullptr;
     DEBUG("close client %d", thread_id_);
 }
 
@@ -37,6 +44,8 @@ DBClient::~DBClient()
  */
 bool DBClient::Put(const Slice key, const Slice value, bool slow)
 {
+    db_->write_controller_.MayDelayWrite(1);
+    EpochGuard guard(&db_->epoch_, thread_id_);
     bool memtable_idx_changed = StartWrite();
     uint64_t int_key = key.ToUint64();
     // if active log_group is changed, first allocate new segment
@@ -52,7 +61,7 @@ bool DBClient::Put(const Slice key, const Slice value, bool slow)
 #ifdef BUFFER_WAL_MEMTABLE
     lsn = db_->LSN_lock(int_key);
 #endif
-    uint64_t log_ptr = log_writer_->WriteLogPut(key, value, lsn);
+    [[maybe_unused]] uint64_t log_ptr = log_writer_->WriteLogPut(key, value, lsn);
     LOG("put log_ptr = %lu", log_ptr);
 
     // index updade
@@ -68,14 +77,18 @@ bool DBClient::Put(const Slice key, const Slice value, bool slow)
     db_->mem_index_[current_memtable_idx_]->Put(int_key, lh);
     db_->LSN_unlock(lsn.epoch);
 #endif
+    if (db_->row_cache_)
+        db_->row_cache_->Invalidate(int_key);
     put_num_in_current_memtable_[current_memtable_idx_]++;
-    FinishWrite();
+    FinishWrite(1);
     total_writes_.fetch_add(1);
     return true;
 }
 
 bool DBClient::Delete(const Slice key)
 {
+    db_->write_controller_.MayDelayWrite(1);
+    EpochGuard guard(&db_->epoch_, thread_id_);
     bool changed = StartWrite();
     uint64_t int_key = key.ToUint64();
     // if active log_group is changed, first allocate new segment
@@ -90,7 +103,7 @@ bool DBClient::Delete(const Slice key)
 #ifdef BUFFER_WAL_MEMTABLE
     lsn = db_->LSN_lock(int_key);
 #endif
-    uint64_t log_ptr = log_writer_->WriteLogDelete(key, lsn);
+    [[maybe_unused]] uint64_t log_ptr = log_writer_->WriteLogDelete(key, lsn);
     LOG("put log_ptr = %lu", log_ptr);
 #ifdef INDEX_LOG_MEMTABLE
     ValuePtr vp{.detail_ = {.valid = 0,
@@ -104,25 +117,173 @@ bool DBClient::Delete(const Slice key)
     db_->mem_index_[current_memtable_idx_]->Put(int_key, lh);
     db_->LSN_unlock(lsn.epoch);
 #endif
-    FinishWrite();
+    if (db_->row_cache_)
+        db_->row_cache_->Invalidate(int_key);
+    FinishWrite(0);
     total_writes_.fetch_add(1);
     return true;
 }
 
+/**
+ * @brief Apply all records of a batch. The records are logged as one contiguous run with a single persist,
+ * then inserted into the memtable in order, so a later record overrides an earlier one with the same key.
+ *
+ * @return false if the batch is empty
+ */
+bool DBClient::Write(const WriteBatch &batch)
+{
+    auto &records = batch.Records();
+    size_t count = records.size();
+    if (count == 0)
+        return false;
+    db_->write_controller_.MayDelayWrite(count);
+    EpochGuard guard(&db_->epoch_, thread_id_);
+    bool changed = StartWrite();
+    // if active log_group is changed, first allocate new segment
+    if (unlikely(changed))
+    {
+        log_writer_->SwitchToNewSegment(current_memtable_idx_);
+    }
+    batch_lsns_.resize(count);
+    batch_log_ptrs_.resize(count);
+    size_t put_num = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        uint64_t int_key = records[i].key;
+#ifdef INDEX_LOG_MEMTABLE
+        batch_lsns_[i] = db_->GetLSN(int_key);
+#endif
+#ifdef BUFFER_WAL_MEMTABLE
+        batch_lsns_[i] = db_->LSN_lock(int_key);
+#endif
+    }
+    log_writer_->WriteLogBatch(batch, batch_lsns_.data(), batch_log_ptrs_.data());
+
+    // index update, the whole batch is durable now
+    for (size_t i = 0; i < count; i++)
+    {
+        auto &r = records[i];
+        uint64_t int_key = r.key;
+#ifdef INDEX_LOG_MEMTABLE
+        ValuePtr vp{.detail_ = {.valid = !r.is_delete,
+                                .ptr = batch_log_ptrs_[i] >> 6,
+                                .lsn = batch_lsns_[i].lsn}};
+        ValueHelper lh(vp.data_);
+        db_->mem_index_[current_memtable_idx_]->PutValidate(int_key, lh);
+#endif
+#ifdef BUFFER_WAL_MEMTABLE
+        ValueHelper lh(r.is_delete ? INVALID_PTR : r.value);
+        db_->mem_index_[current_memtable_idx_]->Put(int_key, lh);
+        db_->LSN_unlock(batch_lsns_[i].epoch);
+#endif
+        if (db_->row_cache_)
+            db_->row_cache_->Invalidate(int_key);
+        put_num += !r.is_delete;
+    }
+    put_num_in_current_memtable_[current_memtable_idx_] += put_num;
+    FinishWrite(put_num);
+    total_writes_.fetch_add(count);
+    return true;
+}
+
+uint64_t DBClient::LastLSN()
+{
+    return log_writer_->WrittenLSN();
+}
+
+void DBClient::WaitForDurable(uint64_t lsn)
+{
+    if (log_writer_->DurableLSN() < lsn)
+    {
+        log_writer_->Persist();
+    }
+}
+
 bool DBClient::Get(const Slice key, Slice &value_out)
 {
+    EpochGuard guard(&db_->epoch_, thread_id_);
     total_reads_.fetch_add(1);
-    if (GetFromMemtable(key, value_out))
+    RowCache *row_cache = db_->row_cache_;
+    size_t value_size = 0;
+    uint64_t fill_seq = 0;
+    if (row_cache && row_cache->Lookup(key.ToUint64(), (char *)value_out.data(), &value_size, &fill_seq))
     {
         return true;
     }
+    bool found = GetFromMemtable(key, value_out, &value_size) || GetFromVersion(key, value_out, &value_size);
+    if (found && row_cache)
+    {
+        row_cache->Insert(key.ToUint64(), value_out.data(), value_size, fill_seq);
+    }
+    return found;
+}
+
+size_t DBClient::MultiGet(const std::vector<Slice> &keys, std::vector<Slice> &values_out, std::vector<bool> &found)
+{
+    // a group fits in the blocks a pst reader keeps, a key reads at most one block of level1 and one of level2
+    static constexpr size_t GROUP_SIZE = SSD_PREFETCH_BLOCKS / 2;
+    EpochGuard guard(&db_->epoch_, thread_id_);
+    total_reads_.fetch_add(keys.size());
+    RowCache *row_cache = db_->row_cache_;
+    found.assign(keys.size(), false);
+    std::vector<uint64_t> fill_seqs(keys.size(), 0);
+    std::vector<size_t> misses;
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        size_t value_size = 0;
+        if (row_cache && row_cache->Lookup(keys[i].ToUint64(), (char *)values_out[i].data(), &value_size, &fill_seqs[i]))
+        {
+            found[i] = true;
+        }
+        else if (GetFromMemtable(keys[i], values_out[i], &value_size))
+        {
+            found[i] = true;
+            if (row_cache)
+                row_cache->Insert(keys[i].ToUint64(), values_out[i].data(), value_size, fill_seqs[i]);
+        }
+        else
+        {
+            misses.push_back(i);
+        }
+    }
+    std::vector<Slice> group;
+    for (size_t g = 0; g < misses.size(); g += GROUP_SIZE)
+    {
+        size_t end = std::min(g + GROUP_SIZE, misses.size());
+        group.clear();
+        for (size_t j = g; j < end; j++)
+            group.push_back(keys[misses[j]]);
+        db_->current_version_->PrefetchSsdDataBlocks(group, pst_reader_);
+        for (size_t j = g; j < end; j++)
+        {
+            size_t i = misses[j], value_size = 0;
+            found[i] = GetFromVersion(keys[i], values_out[i], &value_size);
+            if (found[i] && row_cache)
+                row_cache->Insert(keys[i].ToUint64(), values_out[i].data(), value_size, fill_seqs[i]);
+        }
+        // the pages of the blocks may be reused once the epoch ends
+        pst_reader_->ClearPrefetched();
+    }
+    return std::count(found.begin(), found.end(), true);
+}
+
+bool DBClient::Get(const Slice key, Slice &value_out, const Snapshot *snapshot)
+{
+    total_reads_.fetch_add(1);
+    const SuperVersion *sv = snapshot->super_version_.get();
+    size_t value_size = 0;
+    for (auto &memtable : sv->memtables)
+    {
+        int ret = SearchMemtable(memtable.get(), key, value_out, &value_size);
+        if (ret != 0)
+            return ret > 0;
+    }
     int size;
 #ifndef KV_SEPARATE
-    return db_->current_version_->Get(key, value_out.data(), &size, pst_reader_);
+    return Version::GetFromSortedRuns(sv->runs, sv->level1, sv->level2, key, value_out.data(), &size, pst_reader_);
 #else
     ValuePtr vptr;
-    bool ret = db_->current_version_->Get(key, (char *)&vptr.data_, &size, pst_reader_);
-    if (!ret)
+    if (!Version::GetFromSortedRuns(sv->runs, sv->level1, sv->level2, key, (char *)&vptr.data_, &size, pst_reader_))
         return false;
     Slice result = log_reader_->ReadLogForValue(key, vptr);
     memcpy((void *)value_out.data(), result.data(), result.size());
@@ -130,10 +291,9 @@ bool DBClient::Get(const Slice key, Slice &value_out)
 #endif
 }
 
-bool DBClient::GetFromMemtable(const Slice key, Slice &value_out)
+bool DBClient::GetFromMemtable(const Slice key, Slice &value_out, size_t *value_size)
 {
     LOG("Get %lu(%lu) from memtable", key.ToUint64(), key.ToUint64Bswap());
-    ValuePtr vptr;
     // NOTE:不同步到成员变量，成员变量current_memtable_idx只由写操作改变，避免出现bug
     int current_memtable_id = db_->current_memtable_idx_;
     // get from index
@@ -144,133 +304,88 @@ bool DBClient::GetFromMemtable(const Slice key, Slice &value_out)
         {
             break;
         }
-        vptr.data_ = db_->mem_index_[memtable_id]->Get(key.ToUint64());
+        Index *index = db_->mem_index_[memtable_id];
+        // released by a flush after the state check
+        if (index == nullptr)
+        {
+            break;
+        }
+        int ret = SearchMemtable(index, key, value_out, value_size);
+        if (ret != 0)
+            return ret > 0;
+    }
+    LOG("memtable over");
+    return false;
+}
 
+bool DBClient::GetFromVersion(const Slice key, Slice &value_out, size_t *value_size)
+{
+    int size;
+#ifndef KV_SEPARATE
+    if (!db_->current_version_->Get(key, value_out.data(), &size, pst_reader_))
+        return false;
+    *value_size = 8;
+#else
+    ValuePtr vptr;
+    if (!db_->current_version_->Get(key, (char *)&vptr.data_, &size, pst_reader_))
+        return false;
+    Slice result = log_reader_->ReadLogForValue(key, vptr);
+    memcpy((void *)value_out.data(), result.data(), result.size());
+    *value_size = result.size();
+#endif
+    return true;
+}
+
+int DBClient::SearchMemtable(Index *index, const Slice key, Slice &value_out, size_t *value_size)
+{
+    ValuePtr vptr;
+    vptr.data_ = index->Get(key.ToUint64());
 #ifdef INDEX_LOG_MEMTABLE
-        if (vptr.data_ == INVALID_PTR) // check tombstone
-            continue;
-        if (vptr.detail_.valid == 0)
-            return false;
-        // get from log
-        Slice v = log_reader_->ReadLogForValue(key, vptr);
-        memcpy((void *)value_out.data(), v.data(), v.size());
+    if (vptr.data_ == INVALID_PTR) // check tombstone
+        return 0;
+    if (vptr.detail_.valid == 0)
+        return -1;
+    // get from log
+    Slice v = log_reader_->ReadLogForValue(key, vptr);
+    memcpy((void *)value_out.data(), v.data(), v.size());
+    *value_size = v.size();
 #endif
 #ifdef BUFFER_WAL_MEMTABLE
-        if (vptr.data_ == INVALID_PTR) // check tombstone
-            continue;
-        memcpy((void *)value_out.data(), &(vptr.data_), 8);
+    if (vptr.data_ == INVALID_PTR) // check tombstone
+        return 0;
+    memcpy((void *)value_out.data(), &(vptr.data_), 8);
+    *value_size = 8;
 #endif
-        return true;
-    }
-    LOG("memtable over");
-    return false;
+    return 1;
 }
 
 int DBClient::Scan(const Slice start_key, int scan_sz, std::vector<uint64_t> &key_out)
 {
-    // TODO: Wait for flush/compaction over and no level0_tree
-    db_->WaitForFlushAndCompaction();
-    ValuePtr vptr;
-    std::vector<uint64_t> keys_mem[MAX_MEMTABLE_NUM], values_mem[MAX_MEMTABLE_NUM], keys_level, values_level;
-    // get from index
-    int cur = db_->current_memtable_idx_;
-    for (int i = 0; i < MAX_MEMTABLE_NUM; i++)
+    auto iter = NewIterator();
+    for (iter->Seek(start_key); iter->Valid() && scan_sz > 0; iter->Next(), scan_sz--)
     {
-        int memidx = (cur + i) % MAX_MEMTABLE_NUM;
-        if (db_->mem_index_[memidx] != nullptr)
-            db_->mem_index_[memidx]->Scan2(start_key.ToUint64(), scan_sz, keys_mem[i], values_mem[i]);
+        key_out.push_back(iter->key().ToUint64());
     }
-    std::vector<TaggedPstMeta> table_metas;
-    RowIterator *level_row = db_->current_version_->GetLevel1Iter(start_key, pst_reader_, table_metas);
-    LOG("level row.valid=%d, current_key=%lu\n", level_row->Valid(), __bswap_64(level_row->GetCurrentKey()));
-    // skip keys lower than start_key in the pst
-    while (level_row->Valid() && __bswap_64(level_row->GetCurrentKey()) < start_key.ToUint64Bswap())
-    {
-        // printf("skip %lu , %lu\n", __bswap_64(level_row->GetCurrentKey()),level_row->GetCurrentKey());
-        level_row->NextKey();
-        // TODO: if return false value, GetLevel1Iter maybe can't get enough KVs from 2 pst
-    }
-
-    struct KeyWithRowId
-    {
-        uint64_t key;
-        int row_id;
-    };
-    struct UintKeyComparator
-    {
-        bool operator()(const KeyWithRowId l, const KeyWithRowId r) const
-        {
-            if (unlikely(__bswap_64(l.key) == __bswap_64(r.key)))
-            {
-                return l.row_id < r.row_id;
-            }
-            return __bswap_64(l.key) > __bswap_64(r.key);
-        }
-    } scancmp;
+    return true;
+}
 
-    // merge iterator
-    KeyWithRowId ik;
-    std::priority_queue<KeyWithRowId, std::vector<KeyWithRowId>, UintKeyComparator> key_heap(scancmp);
-    int mem_idx[MAX_MEMTABLE_NUM];
-    for (int i = 0; i < MAX_MEMTABLE_NUM; i++)
-    {
-        if (!keys_mem[i].empty())
-        {
-            key_heap.push({keys_mem[i][0], i});
-            mem_idx[i] = 0;
-        }
-    }
-    if (level_row->Valid())
+std::unique_ptr<DBIterator> DBClient::NewIterator(const Snapshot *snapshot)
+{
+    std::shared_ptr<const SuperVersion> sv = snapshot ? snapshot->super_version_ : db_->GetSuperVersion();
+    std::vector<std::unique_ptr<RunIterator>> children;
+    for (auto &memtable : sv->memtables)
     {
-        LOG("push %lu\n", __bswap_64(level_row->GetCurrentKey()));
-        key_heap.push({level_row->GetCurrentKey(), 99});
+        children.emplace_back(new MemtableRunIterator(memtable));
     }
-
-    while (scan_sz-- && !key_heap.empty())
+    PSTReader *pst_reader = new PSTReader(db_->segment_allocator_);
+    for (auto &run : sv->runs)
     {
-        auto topkey = key_heap.top();
-        key_heap.pop();
-        while (!key_heap.empty() && key_heap.top().key == topkey.key)
-        {
-            // 如果出现重合key，旧key直接next
-            if (topkey.row_id == 99)
-            {
-                if (level_row->NextKey())
-                {
-                    key_heap.push(KeyWithRowId{level_row->GetCurrentKey(), 99});
-                }
-            }
-            else if (keys_mem[topkey.row_id].size() > ++mem_idx[topkey.row_id])
-            {
-                key_heap.push({keys_mem[topkey.row_id][mem_idx[topkey.row_id]], topkey.row_id});
-            }
-            topkey = key_heap.top();
-            key_heap.pop();
-        }
-        key_out.push_back(topkey.key);
-        // read the value of top_key
-        // TODO: If kv separate, read log.
-        size_t value;
-        if (topkey.row_id == 99)
-        {
-            value = level_row->GetCurrentValue();
-            if (level_row->NextKey())
-            {
-                key_heap.push({level_row->GetCurrentKey(), 99});
-            }
-        }
-        else
-        {
-            value = values_mem[topkey.row_id][mem_idx[topkey.row_id]];
-            mem_idx[topkey.row_id]++;
-            if (mem_idx[topkey.row_id] < keys_mem[topkey.row_id].size())
-            {
-                key_heap.push({keys_mem[topkey.row_id][mem_idx[topkey.row_id]], topkey.row_id});
-            }
-        }
+        children.emplace_back(new PstRunIterator(pst_reader, run));
     }
-    delete level_row;
-    return true;
+    children.emplace_back(new PstRunIterator(pst_reader, sv->level1));
+    if (sv->level2)
+        children.emplace_back(new PstRunIterator(pst_reader, *sv->level2));
+    return std::unique_ptr<DBIterator>(new MergingIterator(std::move(children), pst_reader, new LogReader(db_->segment_allocator_), std::move(sv)));
 }
 
 inline bool DBClient::StartWrite()
@@ -278,15 +393,7 @@ inline bool DBClient::StartWrite()
     // 1 get memtable idx
     int old = current_memtable_idx_;
     current_memtable_idx_ = db_->current_memtable_idx_;
-	// if memtable is half-full or full, slow down or stop
-    // if(put_num_in_current_memtable_[current_memtable_idx_] > MAX_MEMTABLE_ENTRIES/8){
-    //     usleep(10);
-    // }
-    // while (put_num_in_current_memtable_[current_memtable_idx_] > MAX_MEMTABLE_ENTRIES/4)
-    // {
-    //     std::this_thread::yield();
-    //     current_memtable_idx_ = db_->current_memtable_idx_;
-    // }
+    // slowing down and stopping is up to db_->write_controller_, before the epoch guard
 
     // 2 modify thread state
     if (old != current_memtable_idx_)
@@ -297,7 +404,9 @@ inline bool DBClient::StartWrite()
     return false;
 }
 
-inline void DBClient::FinishWrite()
+inline void DBClient::FinishWrite(size_t put_num)
 {
-
+    size_t num = put_num_in_current_memtable_[current_memtable_idx_];
+    if (num / BG_WORK_SIGNAL_INTERVAL != (num - put_num) / BG_WORK_SIGNAL_INTERVAL)
+        db_->SignalBGWork();
 }
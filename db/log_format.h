@@ -1,5 +1,6 @@
 #pragma once
 #include <cstdint>
+#include <cstddef>
 
 /**
  * @brief 64bit only-read log sequence number
@@ -53,6 +54,51 @@ struct LogEntry32
     };
 };
 // static constexpr size_t size = sizeof(LogEntry32);
+
+/**
+ * @brief checksum of a LogEntry32 with a value of up to 8 bytes, kept in the other 8 bytes of its value.
+ * It covers the entry and the seal of its log segment, so recovery can replay entries past the tail recorded
+ * in the segment header and stops at the first slot not written since the segment was opened.
+ *
+ */
+inline uint64_t &LogEntryChecksumOf(LogEntry32 *entry) { return *(uint64_t *)(entry->value + 8); }
+inline uint64_t LogEntryChecksum(const LogEntry32 *entry, uint64_t seal)
+{
+    const uint64_t *words = (const uint64_t *)entry;
+    uint64_t h = seal;
+    for (int i = 0; i < 3; i++)
+    {
+        h = (h ^ words[i]) * 0x9e3779b97f4a7c15ul;
+        h ^= h >> 32;
+    }
+    // a zeroed slot never validates
+    return h | 1;
+}
+
+/**
+ * @brief header of a write batch, followed by `count` LogEntry32 records.
+ * It occupies a LogEntry32 slot and is distinguished by key_sz = 0 and value_sz = LOG_BATCH_MAGIC.
+ * A batch starts at a LOG_BATCH_ALIGN boundary, the gap before it is zero-filled (key_sz = value_sz = 0).
+ * The checksum covers the records and is seeded with the seal of the segment, so a torn batch is dropped as a whole
+ * during recovery and a batch left by an earlier use of the segment does not validate.
+ *
+ */
+static constexpr uint16_t LOG_BATCH_MAGIC = 0xba7c;
+static constexpr size_t LOG_XPLINE_SIZE = 256; // internal write granularity of Optane PM
+static constexpr size_t LOG_BATCH_ALIGN = LOG_XPLINE_SIZE;
+static constexpr uint64_t LOG_BATCH_CHECKSUM_SEED = 0x5eed;
+struct LogBatchHeader
+{
+    uint32_t valid : 1;
+    uint32_t lsn : 31;
+    uint16_t key_sz = 0;
+    uint16_t value_sz = LOG_BATCH_MAGIC;
+    uint64_t checksum = 0;
+    uint64_t count = 0;
+    uint64_t reserved = 0;
+};
+static_assert(sizeof(LogBatchHeader) == sizeof(LogEntry32), "batch header must occupy one 32-byte log entry");
+
 struct LogEntry64
 {
     /* data */
@@ -1,4 +1,5 @@
 #include "log_reader.h"
+#include "lib/hash.h"
 
 LogReader::LogReader(SegmentAllocator *allocator) : seg_allocator_(allocator), start_addr_(allocator->GetStartAddr())
 {
@@ -29,6 +30,20 @@ Slice LogReader::ReadLogForValue(const Slice &key, ValuePtr valueptr)
     ERROR_EXIT("read log error");
 }
 
+/**
+ * @brief write batch starting at `entry` that validates against the seal, 0 if there is none
+ *
+ * @return size_t slots of the batch including its header
+ */
+static size_t ValidBatchSlots(const LogEntry32 *entry, size_t capacity, uint64_t seal)
+{
+    auto batch = (const LogBatchHeader *)entry;
+    if (entry->key_sz != 0 || entry->value_sz != LOG_BATCH_MAGIC || batch->count + 1 > capacity ||
+        xxhash(entry + 1, batch->count * sizeof(LogEntry32), LOG_BATCH_CHECKSUM_SEED ^ seal) != batch->checksum)
+        return 0;
+    return batch->count + 1;
+}
+
 int LogReader::ReadLogFromSegment(int segment_id, LogEntry32 *output)
 {
     // TODO: now we only support 32-byte log entry
@@ -36,7 +51,43 @@ int LogReader::ReadLogFromSegment(int segment_id, LogEntry32 *output)
     if (seg == nullptr)
         return 0;
     auto header = seg->GetHeader();
-    auto log_head = seg->GetStartAddr();
-    memcpy(output, log_head, header.objects_tail_offset);
-    return header.objects_tail_offset / sizeof(LogEntry32);
-}
\ No newline at end of file
+    auto log_head = (const LogEntry32 *)(seg->GetStartAddr() + sizeof(LogSegment::Header));
+    size_t capacity = (SEGMENT_SIZE - sizeof(LogSegment::Header)) / sizeof(LogEntry32);
+    // objects_tail_offset counts from the segment start and is only recorded when the segment is closed,
+    // the entries past it were written by a segment that was still open and must validate one by one
+    size_t tail = header.objects_tail_offset > sizeof(LogSegment::Header) ? (header.objects_tail_offset - sizeof(LogSegment::Header)) / sizeof(LogEntry32) : 0;
+    size_t num = 0;
+    while (num < capacity)
+    {
+        const LogEntry32 *entry = log_head + num;
+        size_t slots = 0;
+        if (entry->key_sz == 0 && entry->value_sz == LOG_BATCH_MAGIC)
+        {
+            slots = ValidBatchSlots(entry, capacity - num, header.seal);
+            if (slots == 0)
+            {
+                DEBUG("drop torn write batch at segment %d entry %lu", segment_id, num);
+            }
+        }
+        else if (num < tail)
+        {
+            slots = 1;
+        }
+        else if (entry->key_sz == 0 && entry->value_sz == 0)
+        {
+            // zero padding is only valid before an aligned write batch
+            size_t next = (roundup((size_t)(entry + 1), LOG_BATCH_ALIGN) - (size_t)log_head) / sizeof(LogEntry32);
+            if (next < capacity && ValidBatchSlots(log_head + next, capacity - next, header.seal))
+                slots = next - num;
+        }
+        else if (LogEntryChecksumOf((LogEntry32 *)entry) == LogEntryChecksum(entry, header.seal))
+        {
+            slots = 1;
+        }
+        if (slots == 0)
+            break;
+        num += slots;
+    }
+    memcpy(output, log_head, num * sizeof(LogEntry32));
+    return num;
+}
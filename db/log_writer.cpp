@@ -1,14 +1,89 @@
 #include "log_writer.h"
 #include "allocator/segment_allocator.h"
-LogWriter::LogWriter(SegmentAllocator *allocator, int log_segment_group_id) : allocator_(allocator), log_segment_group_id_(log_segment_group_id)
+#include "lib/hash.h"
+#include "util/timer.h"
+
+std::atomic_uint64_t LogWriter::total_bytes_written_{0};
+std::atomic_uint64_t LogWriter::total_bytes_flushed_{0};
+
+LogWriter::LogWriter(SegmentAllocator *allocator, int log_segment_group_id) : allocator_(allocator), current_segment_(nullptr), log_segment_group_id_(log_segment_group_id)
 {
-    current_segment_ = allocator_->AllocLogSegment(log_segment_group_id_);
+    open_segment();
 }
 
 LogWriter::~LogWriter()
 {
     if (current_segment_)
-        allocator_->CloseSegment(current_segment_);
+        close_segment();
+    total_bytes_written_.fetch_add(bytes_written_);
+    total_bytes_flushed_.fetch_add(bytes_flushed_);
+}
+
+void LogWriter::SetPersistPolicy(LogPersistPolicy policy, size_t entries, uint64_t interval_us)
+{
+#ifdef INDEX_LOG_MEMTABLE
+    policy = PersistPerOp;
+#endif
+    Persist();
+    persist_policy_ = policy;
+    persist_entries_ = entries ? entries : 1;
+    persist_interval_us_ = interval_us;
+    last_persist_us_ = NowMicros();
+}
+
+void LogWriter::Persist()
+{
+    std::lock_guard<SpinLock> lock(segment_lock_);
+    if (persist_policy_ == PersistAsync)
+        drain_async();
+    else
+        persist_stage();
+}
+
+/**
+ * @brief write the staged line and fence.
+ * With PersistEveryMicros segment_lock_ must be held, the log persister may flush this writer at the same time.
+ *
+ */
+void LogWriter::persist_stage()
+{
+    flush_stage();
+    pmem_drain();
+    unpersisted_entries_ = 0;
+    if (persist_policy_ == PersistEveryMicros)
+        last_persist_us_ = NowMicros();
+    durable_lsn_.store(written_lsn_.load(std::memory_order_relaxed), std::memory_order_release);
+}
+
+/**
+ * @brief lock out the log persister while appending, only PersistEveryMicros writers share their staged line with it
+ *
+ */
+std::unique_lock<SpinLock> LogWriter::lock_staging()
+{
+    std::unique_lock<SpinLock> lock(segment_lock_, std::defer_lock);
+    if (persist_policy_ == PersistEveryMicros)
+        lock.lock();
+    return lock;
+}
+
+/**
+ * @brief flush the entries written since the last drain. segment_lock_ must be held.
+ *
+ */
+void LogWriter::drain_async()
+{
+    uint64_t lsn = written_lsn_.load(std::memory_order_acquire);
+    // end is published before lsn, so it covers all entries up to lsn
+    char *end = async_end_.load(std::memory_order_acquire);
+    if (current_segment_ != nullptr && end > async_begin_)
+    {
+        pmem_flush(async_begin_, end - async_begin_);
+        pmem_drain();
+        bytes_flushed_ += roundup((size_t)end, 64) - (size_t)async_begin_ / 64 * 64;
+        async_begin_ = end;
+    }
+    durable_lsn_.store(lsn, std::memory_order_release);
 }
 
 // return log ptr
@@ -87,13 +162,209 @@ uint64_t LogWriter::WriteLogDelete(Slice key, LSN lsnumber)
     return ret;
 }
 
+void LogWriter::WriteLogBatch(const WriteBatch &batch, const LSN *lsns, uint64_t *log_ptrs)
+{
+    auto &records = batch.Records();
+    size_t count = records.size();
+    size_t body_size = (count + 1) * sizeof(LogEntry32);
+    // reserve the worst-case padding, the exact padding is decided after the target segment is known
+    batch_buffer_.resize(LOG_BATCH_ALIGN + body_size);
+    LogBatchHeader *header = (LogBatchHeader *)(batch_buffer_.data() + LOG_BATCH_ALIGN);
+    LogEntry32 *entries = (LogEntry32 *)(header + 1);
+    for (size_t i = 0; i < count; i++)
+    {
+        auto &r = records[i];
+        entries[i] = {
+            .valid = !r.is_delete,
+            .lsn = (uint32_t)lsns[i].lsn,
+            .key_sz = r.key_sz,
+            .value_sz = r.value_sz,
+            .key = r.key,
+            .value_addr = r.value};
+    }
+    *header = {
+        .valid = 1,
+        .lsn = (uint32_t)lsns[0].lsn,
+        .count = count};
+
+    if (current_segment_ == nullptr)
+        open_segment();
+    // staged entries are written first, a batch is persisted on return unless in async mode
+    bool async = persist_policy_ == PersistAsync;
+    if (!async)
+        Persist();
+    int segment_offset = -1;
+    size_t padding = 0;
+    std::unique_lock<SpinLock> lock;
+    for (int retry = 0; retry < 2 && segment_offset == -1; retry++)
+    {
+        if (retry)
+        {
+            // segment overflow, allocate another for this batch
+            if (lock.owns_lock())
+                lock.unlock();
+            close_segment();
+            open_segment();
+        }
+        lock = lock_staging();
+        header->checksum = xxhash(entries, count * sizeof(LogEntry32), LOG_BATCH_CHECKSUM_SEED ^ current_segment_->Seal());
+        padding = current_segment_->PaddingTo(LOG_BATCH_ALIGN);
+        char *run = (char *)header - padding;
+        memset(run, 0, padding);
+        segment_offset = async ? async_append(run, padding + body_size) : current_segment_->Append(run, padding + body_size);
+    }
+    if (segment_offset == -1)
+        ERROR_EXIT("write batch of %lu entries exceeds a log segment", count);
+    if (!async)
+        count_flush(current_segment_->GetStartAddr() + sizeof(LogSegment::Header) + segment_offset, padding + body_size);
+    finish_append(count);
+
+    uint64_t first_entry = current_segment_->segment_id_ * SEGMENT_SIZE + segment_offset + padding + sizeof(LogBatchHeader);
+    for (size_t i = 0; i < count; i++)
+    {
+        log_ptrs[i] = first_entry + i * sizeof(LogEntry32);
+    }
+}
+
 void LogWriter::SwitchToNewSegment(int id)
 {
     if (current_segment_)
-        allocator_->CloseSegment(current_segment_);
+        close_segment();
 
     log_segment_group_id_ = id;
+    open_segment();
+}
+
+void LogWriter::open_segment()
+{
+    std::lock_guard<SpinLock> lock(segment_lock_);
     current_segment_ = allocator_->AllocLogSegment(log_segment_group_id_);
+    async_begin_ = current_segment_->GetStartAddr() + sizeof(LogSegment::Header);
+    async_end_.store(async_begin_, std::memory_order_release);
+}
+
+void LogWriter::close_segment()
+{
+    std::lock_guard<SpinLock> lock(segment_lock_);
+    if (persist_policy_ == PersistAsync)
+        drain_async();
+    else
+        persist_stage();
+    stage_line_ = nullptr;
+    allocator_->CloseSegment(current_segment_);
+}
+
+/**
+ * @brief mark the latest `count` appended entries as written, and as durable if the policy persists each write.
+ * The segment header only records the tail when the segment is closed, entries past it are sealed with the
+ * segment and recovery replays them as long as they validate.
+ *
+ */
+inline void LogWriter::finish_append(size_t count)
+{
+    uint64_t lsn = written_lsn_.load(std::memory_order_relaxed) + count;
+    written_lsn_.store(lsn, std::memory_order_release);
+    if (persist_policy_ == PersistPerOp)
+        durable_lsn_.store(lsn, std::memory_order_release);
+}
+
+// store the checksum of a 32-byte entry, entries of other formats are only replayed up to the recorded tail
+static inline void SealEntry(LogEntry32 *entry, uint64_t seal)
+{
+    LogEntryChecksumOf(entry) = LogEntryChecksum(entry, seal);
+}
+template <typename T>
+static inline void SealEntry(T *, uint64_t)
+{
+}
+
+/**
+ * @brief write data to the reserved log space with regular stores, the log persister flushes it later
+ *
+ * @return int the offset in the segment, -1 represent overflow
+ */
+int LogWriter::async_append(const char *data, size_t size)
+{
+    int segment_offset = current_segment_->Reserve(size);
+    if (segment_offset == -1)
+        return -1;
+    char *addr = current_segment_->GetStartAddr() + sizeof(LogSegment::Header) + segment_offset;
+    memcpy(addr, data, size);
+    bytes_written_ += size;
+    async_end_.store(addr + size, std::memory_order_release);
+    return segment_offset;
+}
+
+// account the cachelines written back for [addr, addr+size)
+inline void LogWriter::count_flush(const char *addr, size_t size)
+{
+    bytes_written_ += size;
+    bytes_flushed_ += roundup((size_t)addr + size, 64) - (size_t)addr / 64 * 64;
+}
+
+/**
+ * @brief write the unwritten part of the staged line with non-temporal stores, without fence
+ *
+ */
+void LogWriter::flush_stage()
+{
+    if (stage_line_ == nullptr || stage_end_ == stage_begin_)
+        return;
+    size_t size = stage_end_ - stage_begin_;
+    pmem_memcpy(stage_line_ + stage_begin_, stage_ + stage_begin_, size, PMEM_F_MEM_NONTEMPORAL | PMEM_F_MEM_NODRAIN);
+    bytes_flushed_ += roundup(stage_end_, 64) - stage_begin_ / 64 * 64;
+    stage_begin_ = stage_end_;
+    if (stage_end_ == LOG_XPLINE_SIZE)
+        stage_line_ = nullptr;
+}
+
+/**
+ * @brief append a log entry through the write-combining buffer, full 256B lines are written immediately
+ * and a fence is issued according to the persist policy
+ *
+ * @return uint64_t the offset from the start of datapool
+ */
+uint64_t LogWriter::stage_log(const char *data, size_t size)
+{
+    auto lock = lock_staging();
+    int segment_offset = current_segment_->Reserve(size);
+    assert(segment_offset >= 0);
+    char *addr = current_segment_->GetStartAddr() + sizeof(LogSegment::Header) + segment_offset;
+    char *line = (char *)((size_t)addr / LOG_XPLINE_SIZE * LOG_XPLINE_SIZE);
+    size_t pos = addr - line;
+    if (line != stage_line_)
+    {
+        flush_stage();
+        stage_line_ = line;
+        stage_begin_ = stage_end_ = pos;
+    }
+    if (pos + size > LOG_XPLINE_SIZE)
+    {
+        // entry crosses a line, write it directly
+        flush_stage();
+        stage_line_ = nullptr;
+        pmem_memcpy(addr, data, size, PMEM_F_MEM_NONTEMPORAL | PMEM_F_MEM_NODRAIN);
+        count_flush(addr, size);
+    }
+    else
+    {
+        memcpy(stage_ + pos, data, size);
+        stage_end_ = pos + size;
+        bytes_written_ += size;
+        if (stage_end_ == LOG_XPLINE_SIZE)
+            flush_stage();
+    }
+
+    if (persist_policy_ == PersistEveryEntries)
+    {
+        if (++unpersisted_entries_ >= persist_entries_)
+            persist_stage();
+    }
+    else if (NowMicros() - last_persist_us_ >= persist_interval_us_)
+    {
+        persist_stage();
+    }
+    return current_segment_->segment_id_ * SEGMENT_SIZE + segment_offset;
 }
 
 // return the offset from the start of datapool
@@ -102,19 +373,33 @@ uint64_t LogWriter::append_log(T *data)
 {
     uint64_t log_offset;
     int segment_offset;
-    // init
+    // init, or allocate another segment up front on overflow, the entry is sealed with the segment it goes to
     if (current_segment_ == nullptr)
-        current_segment_ = allocator_->AllocLogSegment(log_segment_group_id_);
-
-    segment_offset = current_segment_->Append((char *)data, sizeof(T));
-    if (segment_offset == -1)
+        open_segment();
+    else if (!current_segment_->HasRoom(sizeof(T)))
     {
-        // segment overflow, allocate another for this logging
-        allocator_->CloseSegment(current_segment_);
-        current_segment_ = allocator_->AllocLogSegment(log_segment_group_id_);
-        segment_offset = current_segment_->Append((char *)data, sizeof(T));
+        close_segment();
+        open_segment();
+    }
+    SealEntry(data, current_segment_->Seal());
+    if (persist_policy_ == PersistAsync)
+    {
+        segment_offset = async_append((char *)data, sizeof(T));
+        assert(segment_offset >= 0);
+        finish_append(1);
+        return current_segment_->segment_id_ * SEGMENT_SIZE + segment_offset;
     }
+    if (persist_policy_ != PersistPerOp)
+    {
+        log_offset = stage_log((char *)data, sizeof(T));
+        finish_append(1);
+        return log_offset;
+    }
+
+    segment_offset = current_segment_->Append((char *)data, sizeof(T));
     assert(segment_offset >= 0);
+    count_flush(current_segment_->GetStartAddr() + sizeof(LogSegment::Header) + segment_offset, sizeof(T));
+    finish_append(1);
     return current_segment_->segment_id_ * SEGMENT_SIZE + segment_offset;
 }
 
@@ -122,21 +407,28 @@ uint64_t LogWriter::append_log(T *data)
 template <typename T>
 uint64_t LogWriter::append_log(T *data, size_t size)
 {
-    uint64_t log_offset;
     int segment_offset;
     // init
     if (current_segment_ == nullptr)
-        current_segment_ = allocator_->AllocLogSegment(log_segment_group_id_);
+        open_segment();
 
+    if (persist_policy_ != PersistPerOp)
+        Persist();
+    auto lock = lock_staging();
     current_segment_->AlignTailTo64B();
     segment_offset = current_segment_->Append((char *)data, size);
     if (segment_offset == -1)
     {
         // segment overflow, allocate another for this logging
-        allocator_->CloseSegment(current_segment_);
-        current_segment_ = allocator_->AllocLogSegment(log_segment_group_id_);
+        if (lock.owns_lock())
+            lock.unlock();
+        close_segment();
+        open_segment();
+        lock = lock_staging();
         segment_offset = current_segment_->Append((char *)data, size);
     }
     assert(segment_offset >= 0);
+    count_flush(current_segment_->GetStartAddr() + sizeof(LogSegment::Header) + segment_offset, size);
+    finish_append(1);
     return current_segment_->segment_id_ * SEGMENT_SIZE + segment_offset;
 }
\ No newline at end of file
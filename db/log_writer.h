@@ -2,6 +2,11 @@
 
 #include "log_format.h"
 #include "db_common.h"
+#include "write_batch.h"
+#include "util/lock.h"
+#include <vector>
+#include <atomic>
+#include <mutex>
 
 class SegmentAllocator;
 class LogSegment;
@@ -12,11 +17,68 @@ private:
     LogSegment *current_segment_;
     int log_segment_group_id_;
     char variable_entry_buffer_[4160];
+    std::vector<char> batch_buffer_;
+
+    // write-combining buffer for the 256B line at the log tail, used by buffered persist policies.
+    // bytes [stage_begin_, stage_end_) of the line are not written to PM yet.
+    alignas(LOG_XPLINE_SIZE) char stage_[LOG_XPLINE_SIZE];
+    char *stage_line_ = nullptr;
+    size_t stage_begin_ = 0;
+    size_t stage_end_ = 0;
+    LogPersistPolicy persist_policy_ = PersistPerOp;
+    size_t persist_entries_ = 1;
+    uint64_t persist_interval_us_ = 0;
+    size_t unpersisted_entries_ = 0;
+    uint64_t last_persist_us_ = 0;
+
+    // PersistAsync: entries are written with regular stores, [async_begin_, async_end_) is not flushed yet.
+    // segment_lock_ protects current_segment_ and async_begin_ against the log persister,
+    // and with PersistEveryMicros also the staged line, see lock_staging.
+    SpinLock segment_lock_;
+    char *async_begin_ = nullptr;
+    std::atomic<char *> async_end_{nullptr};
+    // number of entries appended / made persistent by this writer
+    std::atomic_uint64_t written_lsn_{0};
+    std::atomic_uint64_t durable_lsn_{0};
+
+    // bytes of log entries vs. bytes of cachelines written back to PM
+    uint64_t bytes_written_ = 0;
+    uint64_t bytes_flushed_ = 0;
+    static std::atomic_uint64_t total_bytes_written_;
+    static std::atomic_uint64_t total_bytes_flushed_;
+
 public:
     LogWriter(SegmentAllocator *allocator, int log_segment_group_id);
     ~LogWriter();
+    /**
+     * @brief buffered policies fall back to PersistPerOp with INDEX_LOG_MEMTABLE, whose reads go to the log
+     */
+    void SetPersistPolicy(LogPersistPolicy policy, size_t entries, uint64_t interval_us);
+    /**
+     * @brief make all staged log entries persistent.
+     * Thread-safe with PersistAsync and PersistEveryMicros, which the log persister calls it for,
+     * other policies must call it from the writing thread.
+     */
+    void Persist();
+    uint64_t WrittenLSN() { return written_lsn_.load(std::memory_order_acquire); }
+    uint64_t DurableLSN() { return durable_lsn_.load(std::memory_order_acquire); }
+    /**
+     * @brief log bytes written and PM bytes flushed by all closed LogWriters
+     */
+    static void GetStats(uint64_t &bytes_written, uint64_t &bytes_flushed)
+    {
+        bytes_written = total_bytes_written_.load();
+        bytes_flushed = total_bytes_flushed_.load();
+    }
     uint64_t WriteLogPut(Slice key, Slice value, LSN lsn);
     uint64_t WriteLogDelete(Slice key, LSN lsn);
+    /**
+     * @brief log all records of a batch as one 256B-aligned run persisted with a single fence
+     *
+     * @param lsns lsn of each record
+     * @param log_ptrs output, log ptr of each record
+     */
+    void WriteLogBatch(const WriteBatch &batch, const LSN *lsns, uint64_t *log_ptrs);
     void SwitchToNewSegment(int log_segment_group_id);
 
 private:
@@ -24,4 +86,14 @@ private:
     uint64_t append_log(T *data); // T denotes log entry type
     template <typename T>
     uint64_t append_log(T *data, size_t size); //For KV-separate log when value > 48 bytes
+    uint64_t stage_log(const char *data, size_t size);
+    void flush_stage();
+    void persist_stage();
+    std::unique_lock<SpinLock> lock_staging();
+    int async_append(const char *data, size_t size);
+    void drain_async();
+    void finish_append(size_t count);
+    void count_flush(const char *addr, size_t size);
+    void open_segment();
+    void close_segment();
 };
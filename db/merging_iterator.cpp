@@ -0,0 +1,340 @@
+#include "merging_iterator.h"
+#include "pst_reader.h"
+#include "log_reader.h"
+#include <algorithm>
+
+/*******************MemtableRunIterator***********************/
+void MemtableRunIterator::Seek(uint64_t key)
+{
+    keys_.clear();
+    values_.clear();
+    index_->Scan2(__builtin_bswap64(key), batch_size_, keys_, values_);
+    pos_ = 0;
+    forward_batch_ = true;
+}
+
+void MemtableRunIterator::SeekForPrev(uint64_t key)
+{
+    keys_.clear();
+    values_.clear();
+    index_->ReverseScan2(__builtin_bswap64(key), batch_size_, keys_, values_);
+    pos_ = 0;
+    forward_batch_ = false;
+}
+
+void MemtableRunIterator::Next()
+{
+    uint64_t key = Key();
+    if (forward_batch_ && pos_ + 1 < (int)keys_.size())
+    {
+        pos_++;
+        return;
+    }
+    // a short forward batch means the index had no more keys
+    if ((forward_batch_ && keys_.size() < batch_size_) || key == MAX_UINT64)
+    {
+        pos_ = keys_.size();
+        return;
+    }
+    Seek(key + 1);
+}
+
+void MemtableRunIterator::Prev()
+{
+    uint64_t key = Key();
+    if (!forward_batch_ && pos_ + 1 < (int)keys_.size())
+    {
+        pos_++;
+        return;
+    }
+    if ((!forward_batch_ && keys_.size() < batch_size_) || key == 0)
+    {
+        pos_ = keys_.size();
+        return;
+    }
+    SeekForPrev(key - 1);
+}
+
+/*******************PstRunIterator***********************/
+static inline uint64_t NativeKey(const std::pair<uint64_t, uint64_t> &entry)
+{
+    return __builtin_bswap64(entry.first);
+}
+
+void PstRunIterator::LoadTable(int t)
+{
+    table_idx_ = t;
+    pst_reader_->ReadIndexEntries(tables_.At(t).meta.indexblock_ptr_, blocks_);
+    // the first block of the next pst continues a forward scan
+    block_idx_ = -1;
+    prefetched_until_ = 0;
+}
+
+void PstRunIterator::LoadBlock(int b)
+{
+    if (FilePtr::IsFilePtr(blocks_[b].second))
+    {
+        readahead_ = (readahead_ && b == block_idx_ + 1) ? std::min(readahead_ * 2, SSD_READAHEAD_BLOCKS) : 1;
+        if (readahead_ > 1 && b >= prefetched_until_)
+        {
+            prefetched_until_ = std::min(b + readahead_, (int)blocks_.size());
+            std::vector<uint64_t> ptrs;
+            for (int i = b; i < prefetched_until_; i++)
+                ptrs.push_back(blocks_[i].second);
+            pst_reader_->PrefetchDataBlocks(ptrs);
+        }
+    }
+    block_idx_ = b;
+    pst_reader_->ReadDataBlockEntries(blocks_[b].second, entries_);
+}
+
+void PstRunIterator::ToFirstFrom(int t)
+{
+    for (; t < (int)tables_.Size(); t++)
+    {
+        LoadTable(t);
+        if (!blocks_.empty())
+        {
+            LoadBlock(0);
+            entry_idx_ = 0;
+            return;
+        }
+    }
+    table_idx_ = tables_.Size();
+}
+
+void PstRunIterator::ToLastFrom(int t)
+{
+    for (; t >= 0; t--)
+    {
+        LoadTable(t);
+        if (!blocks_.empty())
+        {
+            LoadBlock(blocks_.size() - 1);
+            entry_idx_ = entries_.size() - 1;
+            return;
+        }
+    }
+    table_idx_ = -1;
+}
+
+void PstRunIterator::Seek(uint64_t key)
+{
+    readahead_ = 0;
+    // the first pst whose max key >= key
+    int t = tables_.LowerBound(key);
+    if (t == (int)tables_.Size())
+    {
+        table_idx_ = t;
+        return;
+    }
+    LoadTable(t);
+    if (blocks_.empty())
+    {
+        ToFirstFrom(t + 1);
+        return;
+    }
+    // the last datablock whose min key <= key
+    int b = std::upper_bound(blocks_.begin(), blocks_.end(), key, [](uint64_t k, const std::pair<uint64_t, uint64_t> &block)
+                             { return k < NativeKey(block); }) -
+            blocks_.begin() - 1;
+    LoadBlock(std::max(b, 0));
+    entry_idx_ = std::lower_bound(entries_.begin(), entries_.end(), key, [](const std::pair<uint64_t, uint64_t> &entry, uint64_t k)
+                                  { return NativeKey(entry) < k; }) -
+                 entries_.begin();
+    if (entry_idx_ == (int)entries_.size())
+    {
+        entry_idx_--;
+        Next();
+    }
+}
+
+void PstRunIterator::SeekForPrev(uint64_t key)
+{
+    readahead_ = 0;
+    int t = tables_.LowerBound(key);
+    if (t == (int)tables_.Size())
+    {
+        ToLastFrom(t - 1);
+        return;
+    }
+    LoadTable(t);
+    int b = std::upper_bound(blocks_.begin(), blocks_.end(), key, [](uint64_t k, const std::pair<uint64_t, uint64_t> &block)
+                             { return k < NativeKey(block); }) -
+            blocks_.begin() - 1;
+    if (b < 0)
+    {
+        // key is smaller than all keys of this pst
+        ToLastFrom(t - 1);
+        return;
+    }
+    LoadBlock(b);
+    entry_idx_ = std::upper_bound(entries_.begin(), entries_.end(), key, [](uint64_t k, const std::pair<uint64_t, uint64_t> &entry)
+                                  { return k < NativeKey(entry); }) -
+                 entries_.begin() - 1;
+    if (entry_idx_ < 0)
+    {
+        entry_idx_ = 0;
+        Prev();
+    }
+}
+
+void PstRunIterator::Next()
+{
+    if (++entry_idx_ < (int)entries_.size())
+        return;
+    if (block_idx_ + 1 < (int)blocks_.size())
+    {
+        LoadBlock(block_idx_ + 1);
+        entry_idx_ = 0;
+        return;
+    }
+    ToFirstFrom(table_idx_ + 1);
+}
+
+void PstRunIterator::Prev()
+{
+    if (--entry_idx_ >= 0)
+        return;
+    if (block_idx_ > 0)
+    {
+        LoadBlock(block_idx_ - 1);
+        entry_idx_ = entries_.size() - 1;
+        return;
+    }
+    ToLastFrom(table_idx_ - 1);
+}
+
+/*******************MergingIterator***********************/
+MergingIterator::MergingIterator(std::vector<std::unique_ptr<RunIterator>> &&children, PSTReader *pst_reader, LogReader *log_reader,
+                                 std::shared_ptr<const SuperVersion> super_version)
+    : children_(std::move(children)), pst_reader_(pst_reader), log_reader_(log_reader), super_version_(std::move(super_version))
+{
+    heap_.reserve(children_.size());
+}
+
+MergingIterator::~MergingIterator()
+{
+    children_.clear();
+    delete pst_reader_;
+    delete log_reader_;
+}
+
+void MergingIterator::BuildHeap()
+{
+    heap_.clear();
+    for (int i = 0; i < (int)children_.size(); i++)
+    {
+        if (children_[i]->Valid())
+            heap_.push_back(i);
+    }
+    std::make_heap(heap_.begin(), heap_.end(), [this](int a, int b)
+                   { return Behind(a, b); });
+    FindCurrent();
+}
+
+void MergingIterator::SkipKey(uint64_t key)
+{
+    auto behind = [this](int a, int b)
+    { return Behind(a, b); };
+    while (!heap_.empty() && children_[heap_[0]]->Key() == key)
+    {
+        std::pop_heap(heap_.begin(), heap_.end(), behind);
+        RunIterator *child = children_[heap_.back()].get();
+        if (forward_)
+            child->Next();
+        else
+            child->Prev();
+        if (child->Valid())
+            std::push_heap(heap_.begin(), heap_.end(), behind);
+        else
+            heap_.pop_back();
+    }
+}
+
+void MergingIterator::FindCurrent()
+{
+    while (!heap_.empty() && IsTombstone(children_[heap_[0]]->Value()))
+    {
+        SkipKey(children_[heap_[0]]->Key());
+    }
+    if (!heap_.empty())
+        key_buf_ = __builtin_bswap64(children_[heap_[0]]->Key());
+}
+
+void MergingIterator::SeekNative(uint64_t key)
+{
+    forward_ = true;
+    for (auto &child : children_)
+        child->Seek(key);
+    BuildHeap();
+}
+
+void MergingIterator::SeekForPrevNative(uint64_t key)
+{
+    forward_ = false;
+    for (auto &child : children_)
+        child->SeekForPrev(key);
+    BuildHeap();
+}
+
+void MergingIterator::Next()
+{
+    uint64_t key = __builtin_bswap64(key_buf_);
+    if (!forward_)
+    {
+        // children are at keys <= key, move all of them after key
+        if (key == MAX_UINT64)
+        {
+            heap_.clear();
+            return;
+        }
+        SeekNative(key + 1);
+        return;
+    }
+    SkipKey(key);
+    FindCurrent();
+}
+
+void MergingIterator::Prev()
+{
+    uint64_t key = __builtin_bswap64(key_buf_);
+    if (forward_)
+    {
+        // children are at keys >= key, move all of them before key
+        if (key == 0)
+        {
+            heap_.clear();
+            return;
+        }
+        SeekForPrevNative(key - 1);
+        return;
+    }
+    SkipKey(key);
+    FindCurrent();
+}
+
+Slice MergingIterator::value()
+{
+    value_buf_ = children_[heap_[0]]->Value();
+#ifdef KV_SEPARATE
+    ValuePtr vptr;
+    vptr.data_ = value_buf_;
+    return log_reader_->ReadLogForValue(key(), vptr);
+#else
+    return Slice(&value_buf_);
+#endif
+}
+
+bool MergingIterator::IsTombstone(uint64_t value)
+{
+    if (value == INVALID_PTR)
+        return true;
+#ifdef KV_SEPARATE
+    ValuePtr vptr;
+    vptr.data_ = value;
+    return vptr.detail_.valid == 0;
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,180 @@
+/**
+ * @file merging_iterator.h
+ * @brief DBIterator implementation: one sorted run iterator per memtable, level 0 tree and level 1,
+ *        merged by a binary heap ordered by key and then by the age of the run
+ *
+ */
+#pragma once
+
+#include "db_iterator.h"
+#include "db_common.h"
+#include "db/table.h"
+#include "db/super_version.h"
+
+#include <memory>
+#include <vector>
+
+class PSTReader;
+class LogReader;
+
+/**
+ * @brief iterator over one sorted run without duplicated keys.
+ * Keys are byte-swapped (native order) so that they compare as integers.
+ *
+ */
+class RunIterator
+{
+public:
+    virtual ~RunIterator() {}
+    virtual bool Valid() const = 0;
+    /**
+     * @brief position at the first key >= key
+     */
+    virtual void Seek(uint64_t key) = 0;
+    /**
+     * @brief position at the last key <= key
+     */
+    virtual void SeekForPrev(uint64_t key) = 0;
+    virtual void Next() = 0;
+    virtual void Prev() = 0;
+    virtual uint64_t Key() const = 0;
+    virtual uint64_t Value() const = 0;
+};
+
+/**
+ * @brief iterates a memtable index in batches of entries copied by Scan2/ReverseScan2,
+ * so the index is touched only when a batch runs out. Also the streaming input of a flush.
+ *
+ */
+class MemtableRunIterator : public RunIterator
+{
+public:
+    static constexpr size_t BATCH_SIZE = 64;
+
+    MemtableRunIterator(std::shared_ptr<Index> index, size_t batch_size = BATCH_SIZE) : index_(std::move(index)), batch_size_(batch_size) {}
+
+    bool Valid() const override { return pos_ >= 0 && pos_ < (int)keys_.size(); }
+    void Seek(uint64_t key) override;
+    void SeekForPrev(uint64_t key) override;
+    void Next() override;
+    void Prev() override;
+    uint64_t Key() const override { return __builtin_bswap64(keys_[pos_]); }
+    uint64_t Value() const override { return values_[pos_]; }
+
+private:
+    // keeps a flushed memtable alive until the iterator is destroyed
+    std::shared_ptr<Index> index_;
+    const size_t batch_size_;
+    // big-endian keys of the batch, ascending if forward_batch_ else descending
+    std::vector<uint64_t> keys_;
+    std::vector<uint64_t> values_;
+    int pos_ = -1;
+    bool forward_batch_ = true;
+};
+
+/**
+ * @brief iterates a list of psts sorted by key and not overlapped, e.g. a level 0 tree or level 1.
+ * Only the index block of the current pst and its current datablock are read into DRAM,
+ * besides the datablocks on ssd read ahead in one batch by a forward scan.
+ *
+ */
+class PstRunIterator : public RunIterator
+{
+public:
+    /**
+     * @param tables a run of the SuperVersion held by the MergingIterator
+     */
+    PstRunIterator(PSTReader *pst_reader, PstRun tables) : pst_reader_(pst_reader), tables_(tables) {}
+
+    bool Valid() const override { return table_idx_ >= 0 && table_idx_ < (int)tables_.Size(); }
+    void Seek(uint64_t key) override;
+    void SeekForPrev(uint64_t key) override;
+    void Next() override;
+    void Prev() override;
+    uint64_t Key() const override { return __builtin_bswap64(entries_[entry_idx_].first); }
+    uint64_t Value() const override { return entries_[entry_idx_].second; }
+
+private:
+    PSTReader *pst_reader_;
+    const PstRun tables_;
+    int table_idx_ = -1;
+    // {min key, datablock ptr} of the current pst
+    std::vector<std::pair<uint64_t, uint64_t>> blocks_;
+    int block_idx_ = 0;
+    // {key, value} of the current datablock
+    std::vector<std::pair<uint64_t, uint64_t>> entries_;
+    int entry_idx_ = 0;
+    // datablocks on ssd read ahead while moving forward block by block, 0 after a seek
+    int readahead_ = 0;
+    // blocks of the current pst before it were read ahead
+    int prefetched_until_ = 0;
+
+    /**
+     * @brief move to the first entry of table t or the following ones, invalid if none
+     */
+    void ToFirstFrom(int t);
+    /**
+     * @brief move to the last entry of table t or the preceding ones, invalid if none
+     */
+    void ToLastFrom(int t);
+    void LoadTable(int t);
+    void LoadBlock(int b);
+};
+
+class MergingIterator : public DBIterator
+{
+public:
+    /**
+     * @param children runs from the newest to the oldest, a key of an earlier run overrides the later ones
+     * @param pst_reader owned, read by the pst runs
+     * @param log_reader owned, reads separated values
+     * @param super_version the view the children read, kept until the iterator is destroyed
+     */
+    MergingIterator(std::vector<std::unique_ptr<RunIterator>> &&children, PSTReader *pst_reader, LogReader *log_reader,
+                    std::shared_ptr<const SuperVersion> super_version);
+    ~MergingIterator();
+
+    bool Valid() const override { return !heap_.empty(); }
+    void SeekToFirst() override { SeekNative(0); }
+    void SeekToLast() override { SeekForPrevNative(MAX_UINT64); }
+    void Seek(const Slice target) override { SeekNative(target.ToUint64Bswap()); }
+    void SeekForPrev(const Slice target) override { SeekForPrevNative(target.ToUint64Bswap()); }
+    void Next() override;
+    void Prev() override;
+    Slice key() const override { return Slice(&key_buf_); }
+    Slice value() override;
+
+private:
+    std::vector<std::unique_ptr<RunIterator>> children_;
+    PSTReader *pst_reader_;
+    LogReader *log_reader_;
+    std::shared_ptr<const SuperVersion> super_version_;
+    // indexes of valid children, heap_[0] is the child holding the newest version of the current key
+    std::vector<int> heap_;
+    bool forward_ = true;
+    uint64_t key_buf_ = 0;
+    uint64_t value_buf_ = 0;
+
+    /**
+     * @brief heap order: whether child a is visited after child b in the current direction
+     */
+    bool Behind(int a, int b) const
+    {
+        uint64_t ka = children_[a]->Key(), kb = children_[b]->Key();
+        if (ka != kb)
+            return forward_ ? ka > kb : ka < kb;
+        return a > b;
+    }
+    void SeekNative(uint64_t key);
+    void SeekForPrevNative(uint64_t key);
+    void BuildHeap();
+    /**
+     * @brief move every child at key one step in the current direction
+     */
+    void SkipKey(uint64_t key);
+    /**
+     * @brief skip deleted keys until heap_[0] holds a live value
+     */
+    void FindCurrent();
+    static bool IsTombstone(uint64_t value);
+};
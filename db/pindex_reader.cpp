@@ -1,4 +1,6 @@
 #include "pindex_reader.h"
+#include "block_cache.h"
+#include "util/simd_search.h"
 
 PIndexReader::PIndexReader(SegmentAllocator *allocator) : start_addr_(allocator->GetStartAddr())
 {
@@ -28,7 +30,7 @@ size_t PIndexReader::ReadPIndexBlock(uint64_t pm_offset, std::vector<std::pair<u
     return i;
 }
 
-PIndexBlock *PIndexReader::ReadPIndexBlock512(uint64_t pm_offset)
+PIndexBlock *PIndexReader::ReadPIndexBlock512(uint64_t pm_offset, bool use_cache)
 {
     char *addr = start_addr_ + pm_offset;
 #ifdef DIRECT_PM_ACCESS
@@ -36,9 +38,18 @@ PIndexBlock *PIndexReader::ReadPIndexBlock512(uint64_t pm_offset)
     return (PIndexBlock *)addr;
 #endif
 
-    // copy to buffer
-    if (block512_buf_.pm_page_addr != addr)
+    // copy to buffer, again if the page was recycled since the buffer was read: the block cache is invalidated before that
+    BlockCache *global = BlockCache::Global();
+    if (block512_buf_.pm_page_addr != addr || (global && global->InvalidateSeq(pm_offset) != block512_seq_))
     {
+        BlockCache *cache = use_cache ? global : nullptr;
+        uint64_t fill_seq = global ? global->InvalidateSeq(pm_offset) : 0;
+        block512_seq_ = fill_seq;
+        if (cache && cache->Lookup(pm_offset, CachedBlockType::PIndex, &block512_buf_.data_buf, &fill_seq))
+        {
+            block512_buf_.set_page(addr);
+            return &block512_buf_.data_buf;
+        }
         //TODO: 引起compaction错误
 #ifdef ALIGNED_COPY_256
         for (size_t offset = 0; offset < sizeof(PIndexBlock); offset += 256)
@@ -49,6 +60,8 @@ PIndexBlock *PIndexReader::ReadPIndexBlock512(uint64_t pm_offset)
         memcpy(&block512_buf_.data_buf, addr, sizeof(PIndexBlock));
 #endif
         block512_buf_.set_page(addr);
+        if (cache)
+            cache->Insert(pm_offset, &block512_buf_.data_buf, fill_seq);
     }
 
     return &block512_buf_.data_buf;
@@ -56,31 +69,11 @@ PIndexBlock *PIndexReader::ReadPIndexBlock512(uint64_t pm_offset)
 
 size_t PIndexReader::PointQuery(uint64_t pm_offset, Slice key, int entry_num)
 {
-    auto block = ReadPIndexBlock512(pm_offset);
-
+    auto block = ReadPIndexBlock512(pm_offset, true);
 
-    // binary search
-    int left = 0, right = entry_num - 1;
-    int mid, ret;
-    while (left <= right)
-    {
-        mid = (left + right + 1) / 2;
-        ret = Slice(&(block->entries[mid].key)).compare(key);
-        if (ret == 0)
-        {
-            right = mid;
-            break;
-        }
-        else if (ret < 0)
-        {
-            left = mid + 1;
-        }
-        else
-        {
-            right = mid - 1;
-        }
-    }
-    if (right >= 0)
-        return block->entries[right].leafptr;
+    // the last datablock whose min key <= key
+    int index = simd_search::FloorIndex((char *)block->entries, entry_num, key.ToUint64());
+    if (index >= 0)
+        return block->entries[index].leafptr;
     return INVALID_PTR;
 }
\ No newline at end of file
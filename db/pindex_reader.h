@@ -9,6 +9,8 @@ class PIndexReader
 private:
     char* start_addr_;
     PIndexBlockWrapper block512_buf_;
+    // invalidation sequence of the block cache shard when block512_buf_ was read
+    uint64_t block512_seq_ = 0;
 
 public:
     PIndexReader(SegmentAllocator *allocator);
@@ -36,7 +38,8 @@ public:
      * @brief
      *
      * @param pm_offset
+     * @param use_cache look up and fill the global block cache, only point queries do so
      * @return PIndexBlock* shallow copy
      */
-    PIndexBlock *ReadPIndexBlock512(uint64_t pm_offset);
+    PIndexBlock *ReadPIndexBlock512(uint64_t pm_offset, bool use_cache = false);
 };
@@ -1,7 +1,7 @@
 #include "pst_builder.h"
 
-// TODO： this is only for pm pst. support SSD data_writer_
-PSTBuilder::PSTBuilder(SegmentAllocator *segment_allocator, bool use_ssd_for_data) : pindex_writer_(segment_allocator)
+// the index block is always on pm, datablocks are on pm or on ssd
+PSTBuilder::PSTBuilder(SegmentAllocator *segment_allocator, bool use_ssd_for_data) : seg_allocator_(segment_allocator), pindex_writer_(segment_allocator)
 {
     if (use_ssd_for_data)
     {
@@ -18,7 +18,7 @@ PSTBuilder::~PSTBuilder()
     PersistCheckpoint();
     if (data_writer_)
     {
-        delete (DataBlockWriterPm *)data_writer_;
+        delete data_writer_;
     }
 }
 
@@ -55,6 +55,8 @@ bool PSTBuilder::AddEntry(Slice key, Slice value)
             ERROR_EXIT("can't add entry to data block writer");
         }
     }
+    if (bloom_bits_per_key_)
+        key_hashes_.push_back(BlockedBloomFilter::Hash(key.ToUint64()));
     if (meta_.min_key_ == MAX_UINT64)
         meta_.min_key_ = key.ToUint64();
     meta_.max_key_ = key.ToUint64();
@@ -62,9 +64,39 @@ bool PSTBuilder::AddEntry(Slice key, Slice value)
     return true;
 }
 
+bool PSTBuilder::AddDataBlock(uint64_t datablock_addr, const std::vector<std::pair<uint64_t, uint64_t>> &entries)
+{
+    bool building = !data_writer_->Empty();
+    if (datablock_metas_.size() + building + 1 > max_datablock_num)
+    {
+        return false;
+    }
+    if (building)
+    {
+        uint64_t min_key_in_datablock = data_writer_->GetCurrentMinKey();
+        meta_.datablock_num_++;
+        datablock_metas_.push_back(std::make_pair(min_key_in_datablock, data_writer_->Flush()));
+    }
+    // the pst it was taken from keeps its reference until it is deleted
+    seg_allocator_->AddDataBlockRef(datablock_addr);
+    meta_.datablock_num_++;
+    datablock_metas_.push_back(std::make_pair(entries.front().first, datablock_addr));
+    if (bloom_bits_per_key_)
+    {
+        for (auto &entry : entries)
+            key_hashes_.push_back(BlockedBloomFilter::Hash(entry.first));
+    }
+    if (meta_.min_key_ == MAX_UINT64)
+        meta_.min_key_ = entries.front().first;
+    meta_.max_key_ = entries.back().first;
+    meta_.entry_num_ += entries.size();
+    return true;
+}
+
 // build a indexblock, then flush all of the datablocks and the indexblock
 PSTMeta PSTBuilder::Flush()
 {
+    filter_.reset();
 	if(datablock_metas_.empty() && data_writer_->Empty())return PSTMeta::InvalidTable();
     // flushed datablocks
     for (auto &datablock : datablock_metas_)
@@ -83,6 +115,8 @@ PSTMeta PSTBuilder::Flush()
     // flush pindex
     meta_.indexblock_ptr_ = pindex_writer_.Flush();
 
+    filter_ = BlockedBloomFilter::Build(key_hashes_, bloom_bits_per_key_);
+
     PSTMeta ret = meta_;
     Clear();
     return ret;
@@ -98,6 +132,7 @@ void PSTBuilder::Clear()
             .entry_num_ = 0,
             .datablock_num_ = 0};
     datablock_metas_.clear();
+    key_hashes_.clear();
 }
 
 /**
@@ -18,6 +18,7 @@ class PSTBuilder
     static constexpr size_t max_datablock_num = PIndexBlock::MAX_ENTRIES;
 
 private:
+    SegmentAllocator *seg_allocator_;
     PIndexWriter pindex_writer_;
     DataBlockWriter* data_writer_;
     PSTMeta meta_;
@@ -26,13 +27,30 @@ private:
      * 
      */
     std::vector<std::pair<uint64_t,uint64_t>> datablock_metas_;
+    // hashes of the keys in the building pst, 0 bits per key disables the filter
+    size_t bloom_bits_per_key_ = 0;
+    std::vector<uint64_t> key_hashes_;
+    std::shared_ptr<BlockedBloomFilter> filter_;
 
 public:
     PSTBuilder(SegmentAllocator *segment_allocator, bool use_ssd_for_data = false);
     ~PSTBuilder();
 
     bool AddEntry(Slice key, Slice value);
+    /**
+     * @brief reference a persisted datablock of another pst instead of rewriting its entries,
+     * which must follow the keys added before. The datablock being built is flushed first.
+     *
+     * @param entries the {key, value} entries of the datablock
+     * @return false if the pst has no room for the datablock, need flush PST
+     */
+    bool AddDataBlock(uint64_t datablock_addr, const std::vector<std::pair<uint64_t, uint64_t>> &entries);
     PSTMeta Flush();
+    /**
+     * @brief the bloom filter of the pst returned by the last Flush(), nullptr if disabled
+     */
+    std::shared_ptr<BlockedBloomFilter> TakeFilter() { return std::move(filter_); }
+    void SetBloomBitsPerKey(size_t bits_per_key) { bloom_bits_per_key_ = bits_per_key; }
     void Clear();
     void PersistCheckpoint();
 };
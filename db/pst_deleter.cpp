@@ -1,4 +1,6 @@
 #include "pst_deleter.h"
+#include "block_cache.h"
+#include <algorithm>
 
 PSTDeleter::PSTDeleter(SegmentAllocator *seg_allocator) : seg_allocator_(seg_allocator), index_reader_(seg_allocator) {}
 PSTDeleter::~PSTDeleter() { PersistCheckpoint(); }
@@ -22,6 +24,9 @@ bool PSTDeleter::DeletePST(PSTMeta meta)
         index_seg = seg_allocator_->GetSortedSegmentForDelete(seg_id,sizeof(PIndexBlock));
         used_index_segments_.push_back(index_seg);
     }
+    BlockCache *cache = BlockCache::Global();
+    if (cache)
+        cache->Invalidate(meta.indexblock_ptr_);
     auto ret = index_seg->RecyclePage(index_seg->TrasformOffsetToPageId(meta.indexblock_ptr_));
     assert(ret);
     std::vector<std::pair<uint64_t, uint64_t>> indexlist;
@@ -30,6 +35,20 @@ bool PSTDeleter::DeletePST(PSTMeta meta)
     for (auto &datablock : indexlist)
     {
         uint64_t datablock_offset = datablock.second;
+        // level2 datablocks live in ssd segments
+        if (FilePtr::IsFilePtr(datablock_offset))
+        {
+            FilePtr fptr(datablock_offset);
+            if (BlockCache::Ssd())
+                BlockCache::Ssd()->Invalidate(fptr.data());
+            seg_allocator_->RecycleSsdPage(fptr);
+            if (std::find(used_ssd_segments_.begin(), used_ssd_segments_.end(), fptr.file_id) == used_ssd_segments_.end())
+                used_ssd_segments_.push_back(fptr.file_id);
+            continue;
+        }
+        // the datablock was reused by a compaction output, which still references it
+        if (!seg_allocator_->ReleaseDataBlockRef(datablock_offset))
+            continue;
         size_t data_seg_id = seg_allocator_->TrasformOffsetToId(datablock_offset);
         SortedSegment *data_seg = nullptr;
         for (int i = used_data_segments_.size() - 1; i >= 0; i--)
@@ -45,6 +64,8 @@ bool PSTDeleter::DeletePST(PSTMeta meta)
             data_seg = seg_allocator_->GetSortedSegmentForDelete(data_seg_id,sizeof(PDataBlock));
             used_data_segments_.push_back(data_seg);
         }
+        if (cache)
+            cache->Invalidate(datablock_offset);
         data_seg->RecyclePage(data_seg->TrasformOffsetToPageId(datablock_offset));
         
     }
@@ -64,5 +85,7 @@ bool PSTDeleter::PersistCheckpoint()
         seg_allocator_->CloseSegmentForDelete(seg);
     }
     used_index_segments_.clear();
+    seg_allocator_->PersistSsdSegments(used_ssd_segments_);
+    used_ssd_segments_.clear();
     return true;
 }
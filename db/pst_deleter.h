@@ -12,7 +12,8 @@ private:
     // SortedSegment *current_datablock_ = nullptr;
     std::vector<SortedSegment *> used_index_segments_;
     std::vector<SortedSegment *> used_data_segments_;
-    // std::vector<SortedSegmentOnSSD *>used_data_segments_;
+    // file ids of ssd segments whose bitmaps changed since the last checkpoint
+    std::vector<int> used_ssd_segments_;
 
 public:
     PSTDeleter(SegmentAllocator *seg_allocator);
@@ -1,11 +1,18 @@
 #include "pst_reader.h"
 #include <algorithm>
+std::atomic_uint64_t PSTReader::total_filter_checks_{0};
+std::atomic_uint64_t PSTReader::total_filter_negatives_{0};
+std::atomic_uint64_t PSTReader::total_filter_false_positives_{0};
+
 PSTReader::PSTReader(SegmentAllocator *allocator) : pindex_reader_(allocator), datablock_reader_(allocator)
 {
 }
 
 PSTReader::~PSTReader()
 {
+    total_filter_checks_.fetch_add(filter_stats_.checks);
+    total_filter_negatives_.fetch_add(filter_stats_.negatives);
+    total_filter_false_positives_.fetch_add(filter_stats_.false_positives);
 }
 PSTMeta PSTReader::RecoverPSTMeta(uint64_t pindex_addr)
 {
@@ -47,6 +54,20 @@ bool PSTReader::PointQuery(uint64_t pindex_addr, Slice key, const char *value_ou
     *value_size = 8;
     return ret;
 }
+uint64_t PSTReader::FindDataBlock(uint64_t pindex_addr, Slice key, int datablock_num)
+{
+    return pindex_reader_.PointQuery(pindex_addr, key, datablock_num);
+}
+void PSTReader::ReadIndexEntries(uint64_t pindex_addr, std::vector<std::pair<uint64_t, uint64_t>> &entries)
+{
+    entries.clear();
+    pindex_reader_.ReadPIndexBlock(pindex_addr, entries);
+}
+void PSTReader::ReadDataBlockEntries(uint64_t datablock_ptr, std::vector<std::pair<uint64_t, uint64_t>> &entries)
+{
+    entries.clear();
+    datablock_reader_.TraverseDataBlock(datablock_ptr, &entries);
+}
 PSTReader::Iterator *PSTReader::GetIterator(uint64_t pindex_addr)
 {
     return new PSTReader::Iterator(this, pindex_addr);
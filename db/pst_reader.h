@@ -12,6 +12,8 @@
 #include "table.h"
 #include "pindex_reader.h"
 #include "datablock_reader.h"
+#include <algorithm>
+#include <atomic>
 
 class PSTReader
 {
@@ -19,29 +21,76 @@ private:
     PIndexReader pindex_reader_;
     DataBlockReader datablock_reader_;
     std::vector<std::pair<uint64_t, uint64_t>> indexlist_;
+    static std::atomic_uint64_t total_filter_checks_;
+    static std::atomic_uint64_t total_filter_negatives_;
+    static std::atomic_uint64_t total_filter_false_positives_;
 
 public:
+    /**
+     * @brief bloom filter effect of point queries issued through this reader.
+     * false positive rate = false_positives / (false_positives + negatives)
+     */
+    struct FilterStats
+    {
+        uint64_t checks = 0;
+        uint64_t negatives = 0;
+        uint64_t false_positives = 0;
+    } filter_stats_;
+
     PSTReader(SegmentAllocator *allocator);
     ~PSTReader();
+    /**
+     * @brief filter stats of all destroyed readers
+     */
+    static FilterStats GetTotalFilterStats()
+    {
+        FilterStats s;
+        s.checks = total_filter_checks_.load();
+        s.negatives = total_filter_negatives_.load();
+        s.false_positives = total_filter_false_positives_.load();
+        return s;
+    }
 
     PSTMeta RecoverPSTMeta(uint64_t pindex_addr);
     bool PointQuery(uint64_t pindex_addr, Slice key, const char *value_out, int *value_size, int datablock_num = PIndexBlock::MAX_ENTRIES);
+    /**
+     * @brief copy the {min key, datablock ptr} entries of a pst's index block into entries
+     */
+    void ReadIndexEntries(uint64_t pindex_addr, std::vector<std::pair<uint64_t, uint64_t>> &entries);
+    /**
+     * @brief copy the {key, value} entries of a datablock into entries
+     */
+    void ReadDataBlockEntries(uint64_t datablock_ptr, std::vector<std::pair<uint64_t, uint64_t>> &entries);
+    /**
+     * @return the datablock of a pst where key may exist, INVALID_PTR if none
+     */
+    uint64_t FindDataBlock(uint64_t pindex_addr, Slice key, int datablock_num = PIndexBlock::MAX_ENTRIES);
+    /**
+     * @brief read the datablocks on ssd among ptrs in one batch, see DataBlockReader::PrefetchSsdDataBlocks
+     */
+    void PrefetchDataBlocks(const std::vector<uint64_t> &ptrs, bool use_cache = false) { datablock_reader_.PrefetchSsdDataBlocks(ptrs, use_cache); }
+    void ClearPrefetched() { datablock_reader_.ClearPrefetched(); }
+    /**
+     * @brief walks the entries of a pst one datablock at a time, the keys of a datablock are byte swapped
+     * to native order once when it is loaded
+     */
     class Iterator
     {
     public:
         PSTReader *reader_;
         std::vector<std::pair<uint64_t, uint64_t>> indexes_;
         std::vector<std::pair<uint64_t, uint64_t>> records_;
+        std::vector<uint64_t> native_keys_;
         int current_datablock_index_ = 0;
         DataBlockMeta current_datablock_meta_;
         int current_record_index_ = 0;
+        // the datablocks from here to the end of the pst are read in one batch if they are on ssd
+        int prefetched_from_ = -1;
         Iterator(PSTReader *reader, uint64_t pm_offset) : reader_(reader)
         {
             reader_->pindex_reader_.ReadPIndexBlock(pm_offset, indexes_);
             if (!indexes_.empty())
-            {
-                current_datablock_meta_ = reader_->datablock_reader_.TraverseDataBlock(indexes_[current_datablock_index_].second, &records_);
-            }
+                LoadDataBlock(0);
         };
         ~Iterator()
         {
@@ -50,26 +99,78 @@ public:
         };
         bool Next()
         {
-            if (current_record_index_ >= records_.size() - 1)
+            if (current_record_index_ + 1 >= (int)records_.size())
             {
                 // read new datablock
-                if (current_datablock_index_ >= indexes_.size() - 1)
+                if (current_datablock_index_ + 1 >= (int)indexes_.size())
                     return false;
-                current_datablock_index_++;
-                size_t pm_offset = indexes_[current_datablock_index_].second;
-                current_datablock_meta_ = reader_->datablock_reader_.TraverseDataBlock(pm_offset, &records_);
+                LoadDataBlock(current_datablock_index_ + 1);
+                return true;
             }
             current_record_index_++;
             return true;
         };
+        /**
+         * @brief skip the rest of the current datablock
+         *
+         * @return false if it was the last one
+         */
+        bool NextDataBlock()
+        {
+            if (current_datablock_index_ + 1 >= (int)indexes_.size())
+                return false;
+            LoadDataBlock(current_datablock_index_ + 1);
+            return true;
+        }
+        /**
+         * @brief move to the first key >= key (native order) in the pst
+         *
+         * @return false if all keys are smaller
+         */
+        bool Seek(uint64_t key)
+        {
+            // the last datablock whose min key <= key
+            int b = std::upper_bound(indexes_.begin(), indexes_.end(), key, [](uint64_t k, const std::pair<uint64_t, uint64_t> &index)
+                                     { return k < __bswap_64(index.first); }) -
+                    indexes_.begin() - 1;
+            for (b = std::max(b, 0); b < (int)indexes_.size(); b++)
+            {
+                LoadDataBlock(b);
+                current_record_index_ = std::lower_bound(native_keys_.begin(), native_keys_.end(), key) - native_keys_.begin();
+                if (current_record_index_ < (int)records_.size())
+                    return true;
+            }
+            return false;
+        }
         uint64_t Key() { return records_[current_record_index_].first; }
+        uint64_t NativeKey() { return native_keys_[current_record_index_]; }
         uint64_t Value() { return records_[current_record_index_].second; }
         bool LastOne()
         {
-            if (current_datablock_index_ >= indexes_.size() - 1 && current_record_index_ >= records_.size() - 1)
+            if (current_datablock_index_ + 1 >= (int)indexes_.size() && current_record_index_ + 1 >= (int)records_.size())
                 return true;
             return false;
         }
+
+    private:
+        void LoadDataBlock(int datablock_index)
+        {
+            current_datablock_index_ = datablock_index;
+            if (FilePtr::IsFilePtr(indexes_[datablock_index].second) && (prefetched_from_ < 0 || datablock_index < prefetched_from_))
+            {
+                std::vector<uint64_t> ptrs;
+                for (size_t i = datablock_index; i < indexes_.size(); i++)
+                    ptrs.push_back(indexes_[i].second);
+                reader_->PrefetchDataBlocks(ptrs);
+                prefetched_from_ = datablock_index;
+            }
+            records_.clear();
+            current_datablock_meta_ = reader_->datablock_reader_.TraverseDataBlock(indexes_[datablock_index].second, &records_);
+            native_keys_.resize(records_.size());
+            for (size_t i = 0; i < records_.size(); i++)
+                native_keys_[i] = __bswap_64(records_[i].first);
+            current_record_index_ = 0;
+        }
     };
     Iterator *GetIterator(uint64_t pindex_addr);
 };
@@ -117,6 +218,18 @@ public:
         return GetPst().meta.min_key_;
     }
 
+    /**
+     * @brief the current key in native order, decoded when its datablock was loaded
+     */
+    uint64_t GetCurrentNativeKey()
+    {
+        if (pst_iter_)
+        {
+            return pst_iter_->NativeKey();
+        }
+        return __bswap_64(GetPst().meta.min_key_);
+    }
+
     uint64_t GetCurrentValue()
     {
         if (!pst_iter_)
@@ -139,6 +252,19 @@ public:
         pst_iter_ = nullptr;
         return NextPst();
     }
+    /**
+     * @brief skip the rest of the current datablock, moving to the next pst after the last one
+     */
+    bool NextDataBlock()
+    {
+        if (pst_iter_->NextDataBlock())
+        {
+            return true;
+        }
+        delete pst_iter_;
+        pst_iter_ = nullptr;
+        return NextPst();
+    }
     bool Valid()
     {
         return current_pst_idx_ < pst_list_.size();
@@ -153,12 +279,27 @@ public:
 	 */
 	bool MoveTo(size_t key){
 		if(current_pst_idx_ >= pst_list_.size())return false;
-		while (__bswap_64(pst_list_[current_pst_idx_].meta.max_key_) < __bswap_64(key))
-		{
-			current_pst_idx_++;
-			if(current_pst_idx_ >=  pst_list_.size())return false;
-		}
+		// psts of a row are sorted and disjoint: binary search the first one whose max key >= key
+		uint64_t native_key = __bswap_64(key);
+		auto it = std::lower_bound(pst_list_.begin() + current_pst_idx_, pst_list_.end(), native_key, [](const TaggedPstMeta &pst, uint64_t k)
+								   { return __bswap_64(pst.meta.max_key_) < k; });
+		current_pst_idx_ = it - pst_list_.begin();
 		// DEBUG2("key=%lx move to %lx",__bswap_64(key),__bswap_64(pst_list_[current_pst_idx_].meta.max_key_));
-		return true;
+		return current_pst_idx_ < pst_list_.size();
+	}
+
+	/**
+	 * @brief move to the first key >= key, reading into the pst when it starts before key.
+	 * psts may cross the range partition boundaries after they were rebalanced.
+	 */
+	bool SeekTo(size_t key){
+		if(!MoveTo(key))return false;
+		if(__bswap_64(GetPst().meta.min_key_) >= __bswap_64(key))return true;
+		if(pst_iter_)delete pst_iter_;
+		ResetPstIter();
+		if(pst_iter_->Seek(__bswap_64(key)))return true;
+		delete pst_iter_;
+		pst_iter_ = nullptr;
+		return NextPst();
 	}
 };
\ No newline at end of file
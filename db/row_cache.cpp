@@ -0,0 +1,188 @@
+#include "row_cache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+
+RowCache::RowCache(size_t capacity_bytes, RowCacheAdmission admission) : admission_(admission)
+{
+    shard_capacity_ = capacity_bytes / SHARD_NUM;
+    // size the sketch for the expected number of 8-byte rows in a shard
+    size_t expected_entries = shard_capacity_ / (ENTRY_OVERHEAD + 8) + 1;
+    sketch_width_ = 16;
+    while (sketch_width_ < expected_entries)
+        sketch_width_ <<= 1;
+    sketch_sample_ = expected_entries * 10;
+    shards_ = new Shard[SHARD_NUM];
+    for (size_t i = 0; i < SHARD_NUM; i++)
+    {
+        if (admission_ == RowCacheAdmitTinyLFU)
+            shards_[i].sketch.assign(sketch_width_ * SKETCH_DEPTH, 0);
+    }
+    LOG("row cache: %lu bytes, %lu bytes per shard, admission=%d", capacity_bytes, shard_capacity_, admission_);
+}
+
+RowCache::~RowCache()
+{
+    delete[] shards_;
+}
+
+bool RowCache::Lookup(uint64_t key, char *value_out, size_t *value_size, uint64_t *fill_seq)
+{
+    uint64_t hash = Hash(key);
+    Shard &shard = GetShard(hash);
+    std::lock_guard<SpinLock> lock(shard.lock);
+    if (admission_ == RowCacheAdmitTinyLFU)
+        RecordAccess(shard, hash);
+    auto it = shard.map.find(key);
+    if (it == shard.map.end())
+    {
+        *fill_seq = shard.fill_seq;
+        shard.stats.misses++;
+        return false;
+    }
+    Entry &e = shard.ring[it->second];
+    memcpy(value_out, e.value.data(), e.value.size());
+    *value_size = e.value.size();
+    e.referenced = true;
+    shard.stats.hits++;
+    return true;
+}
+
+void RowCache::Insert(uint64_t key, const char *value, size_t value_size, uint64_t fill_seq)
+{
+    size_t charge = value_size + ENTRY_OVERHEAD;
+    if (charge > shard_capacity_)
+        return;
+    uint64_t hash = Hash(key);
+    Shard &shard = GetShard(hash);
+    std::lock_guard<SpinLock> lock(shard.lock);
+    // a write or another fill happened since the lookup
+    if (shard.fill_seq != fill_seq || shard.map.count(key))
+        return;
+    while (shard.usage + charge > shard_capacity_)
+    {
+        int64_t victim = FindVictim(shard);
+        if (victim < 0)
+            return;
+        if (admission_ == RowCacheAdmitTinyLFU &&
+            EstimateFrequency(shard, hash) <= EstimateFrequency(shard, Hash(shard.ring[victim].key)))
+        {
+            shard.stats.rejects++;
+            return;
+        }
+        EraseSlot(shard, victim);
+    }
+    uint32_t slot;
+    if (!shard.free_slots.empty())
+    {
+        slot = shard.free_slots.back();
+        shard.free_slots.pop_back();
+    }
+    else
+    {
+        slot = shard.ring.size();
+        shard.ring.emplace_back();
+    }
+    Entry &e = shard.ring[slot];
+    e.key = key;
+    e.value.assign(value, value_size);
+    e.referenced = false;
+    e.valid = true;
+    shard.map[key] = slot;
+    shard.usage += charge;
+    shard.stats.inserts++;
+}
+
+void RowCache::Invalidate(uint64_t key)
+{
+    Shard &shard = GetShard(Hash(key));
+    std::lock_guard<SpinLock> lock(shard.lock);
+    shard.fill_seq++;
+    auto it = shard.map.find(key);
+    if (it != shard.map.end())
+    {
+        EraseSlot(shard, it->second);
+        shard.stats.invalidations++;
+    }
+}
+
+RowCache::Stats RowCache::GetStats()
+{
+    Stats stats;
+    for (size_t i = 0; i < SHARD_NUM; i++)
+    {
+        Shard &shard = shards_[i];
+        std::lock_guard<SpinLock> lock(shard.lock);
+        stats.hits += shard.stats.hits;
+        stats.misses += shard.stats.misses;
+        stats.inserts += shard.stats.inserts;
+        stats.rejects += shard.stats.rejects;
+        stats.invalidations += shard.stats.invalidations;
+        stats.usage += shard.usage;
+    }
+    return stats;
+}
+
+// private
+void RowCache::RecordAccess(Shard &shard, uint64_t hash)
+{
+    for (int i = 0; i < SKETCH_DEPTH; i++)
+    {
+        size_t idx = ((hash * SKETCH_SEEDS[i]) >> 32) & (sketch_width_ - 1);
+        uint8_t &counter = shard.sketch[i * sketch_width_ + idx];
+        if (counter < SKETCH_MAX_COUNT)
+            counter++;
+    }
+    // age the sketch so that frequency reflects recent accesses
+    if (++shard.sketch_increments >= sketch_sample_)
+    {
+        for (auto &counter : shard.sketch)
+            counter >>= 1;
+        shard.sketch_increments /= 2;
+    }
+}
+
+uint8_t RowCache::EstimateFrequency(Shard &shard, uint64_t hash)
+{
+    uint8_t freq = SKETCH_MAX_COUNT;
+    for (int i = 0; i < SKETCH_DEPTH; i++)
+    {
+        size_t idx = ((hash * SKETCH_SEEDS[i]) >> 32) & (sketch_width_ - 1);
+        freq = std::min(freq, shard.sketch[i * sketch_width_ + idx]);
+    }
+    return freq;
+}
+
+void RowCache::EraseSlot(Shard &shard, uint32_t slot)
+{
+    Entry &e = shard.ring[slot];
+    shard.map.erase(e.key);
+    shard.usage -= e.value.size() + ENTRY_OVERHEAD;
+    e.valid = false;
+    std::string().swap(e.value);
+    shard.free_slots.push_back(slot);
+}
+
+int64_t RowCache::FindVictim(Shard &shard)
+{
+    size_t n = shard.ring.size();
+    if (n == shard.free_slots.size())
+        return -1;
+    // at most two rounds: the first one clears reference bits
+    for (size_t i = 0; i < 2 * n; i++)
+    {
+        size_t slot = shard.hand;
+        shard.hand = (shard.hand + 1) % n;
+        Entry &e = shard.ring[slot];
+        if (!e.valid)
+            continue;
+        if (e.referenced)
+        {
+            e.referenced = false;
+            continue;
+        }
+        return slot;
+    }
+    return -1;
+}
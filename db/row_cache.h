@@ -0,0 +1,114 @@
+#pragma once
+
+#include "config.h"
+#include "util/lock.h"
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+/**
+ * @brief Key->value cache consulted before the memtables, L0 and L1.
+ * Split into shards by key hash, each with a spinlock, a CLOCK ring and a TinyLFU frequency sketch.
+ * Writes invalidate the key; a miss is filled only if no write hit the shard since the lookup,
+ * so a fill never reinstalls a value older than the latest write.
+ *
+ */
+class RowCache
+{
+public:
+    static constexpr size_t SHARD_NUM = 256;
+
+    struct Stats
+    {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t inserts = 0;
+        uint64_t rejects = 0;
+        uint64_t invalidations = 0;
+        size_t usage = 0;
+    };
+
+    RowCache(size_t capacity_bytes, RowCacheAdmission admission);
+    ~RowCache();
+
+    /**
+     * @brief copy the cached value into value_out
+     *
+     * @param value_size out: size of the copied value
+     * @param fill_seq out: on miss, the shard sequence to pass to Insert
+     * @return true if hit
+     */
+    bool Lookup(uint64_t key, char *value_out, size_t *value_size, uint64_t *fill_seq);
+
+    /**
+     * @brief insert a value found by the read path after a missed Lookup
+     */
+    void Insert(uint64_t key, const char *value, size_t value_size, uint64_t fill_seq);
+
+    /**
+     * @brief drop key and fail concurrent fills of its shard, called after a write is applied
+     */
+    void Invalidate(uint64_t key);
+
+    Stats GetStats();
+
+private:
+    // approximate DRAM cost of an entry besides the value bytes
+    static constexpr size_t ENTRY_OVERHEAD = 64;
+    static constexpr int SKETCH_DEPTH = 4;
+    static constexpr uint8_t SKETCH_MAX_COUNT = 15;
+    static constexpr uint64_t SKETCH_SEEDS[SKETCH_DEPTH] = {0x9e3779b97f4a7c15ULL, 0xbf58476d1ce4e5b9ULL, 0x94d049bb133111ebULL, 0xd6e8feb86659fd93ULL};
+
+    struct Entry
+    {
+        uint64_t key;
+        std::string value;
+        bool referenced;
+        bool valid;
+    };
+
+    struct alignas(64) Shard
+    {
+        SpinLock lock;
+        std::unordered_map<uint64_t, uint32_t> map; // key -> slot of ring
+        std::vector<Entry> ring;
+        std::vector<uint32_t> free_slots;
+        size_t hand = 0;
+        size_t usage = 0;
+        uint64_t fill_seq = 0;
+        // count-min sketch of access frequency, halved every sketch_sample_ increments
+        std::vector<uint8_t> sketch;
+        size_t sketch_increments = 0;
+        Stats stats;
+    };
+
+    Shard *shards_;
+    size_t shard_capacity_;
+    RowCacheAdmission admission_;
+    size_t sketch_width_;
+    size_t sketch_sample_;
+
+    static inline uint64_t Hash(uint64_t key)
+    {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        key *= 0xc4ceb9fe1a85ec53ULL;
+        key ^= key >> 33;
+        return key;
+    }
+    inline Shard &GetShard(uint64_t hash)
+    {
+        return shards_[hash % SHARD_NUM];
+    }
+    void RecordAccess(Shard &shard, uint64_t hash);
+    uint8_t EstimateFrequency(Shard &shard, uint64_t hash);
+    void EraseSlot(Shard &shard, uint32_t slot);
+    /**
+     * @brief choose a CLOCK victim, -1 if the ring is empty
+     */
+    int64_t FindVictim(Shard &shard);
+};
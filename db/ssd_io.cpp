@@ -0,0 +1,137 @@
+#include "ssd_io.h"
+#include "util/io_uring.h"
+#include "lib/ThreadPool/include/threadpool.h"
+#include "lib/ThreadPool/include/threadpool_imp.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
+std::atomic_bool SsdIO::opened_{false};
+bool SsdIO::use_io_uring_ = true;
+unsigned SsdIO::queue_depth_ = 64;
+int SsdIO::pool_threads_ = 0;
+ThreadPoolImpl *SsdIO::pool_ = nullptr;
+std::atomic_uint64_t SsdIO::batches_{0};
+std::atomic_uint64_t SsdIO::requests_{0};
+std::atomic_uint64_t SsdIO::uring_requests_{0};
+
+void SsdIO::Open(unsigned queue_depth, int pool_threads, bool use_io_uring)
+{
+    Close();
+    queue_depth_ = std::max(queue_depth, 1u);
+    pool_threads_ = std::max(pool_threads, 1);
+    use_io_uring_ = use_io_uring;
+    pool_ = new ThreadPoolImpl();
+    pool_->SetBackgroundThreads(pool_threads_);
+    opened_.store(true, std::memory_order_release);
+    LOG("ssd io: queue depth %u, io_uring %d, %d fallback threads", queue_depth_, use_io_uring_, pool_threads_);
+}
+
+void SsdIO::Close()
+{
+    if (!opened_.exchange(false))
+        return;
+    pool_->JoinAllThreads();
+    delete pool_;
+    pool_ = nullptr;
+}
+
+IoUring *SsdIO::LocalRing()
+{
+    // set up on the first batch of a thread, a thread where setup failed keeps the pool
+    static thread_local IoUring ring;
+    static thread_local bool tried = false;
+    if (!tried)
+    {
+        tried = true;
+        if (!ring.Init(queue_depth_))
+        {
+            // reported once, every thread fails the same way when the kernel filters io_uring
+            static std::atomic<bool> reported{false};
+            if (!reported.exchange(true, std::memory_order_relaxed))
+                INFO("ssd io: io_uring setup failed (queue depth %u), ssd batches fall back to the thread pool", queue_depth_);
+            else
+                DEBUG("ssd io: io_uring setup failed, batches of this thread go to the thread pool");
+        }
+    }
+    return ring.Valid() ? &ring : nullptr;
+}
+
+bool SsdIO::UsesIoUring()
+{
+    return opened_.load(std::memory_order_acquire) && use_io_uring_ && LocalRing() != nullptr;
+}
+
+void SsdIO::Submit(IORequest *reqs, size_t n)
+{
+    if (n == 0)
+        return;
+    batches_.fetch_add(1, std::memory_order_relaxed);
+    requests_.fetch_add(n, std::memory_order_relaxed);
+    if (n == 1 || !opened_.load(std::memory_order_acquire))
+    {
+        for (size_t i = 0; i < n; i++)
+            reqs[i].Run();
+        return;
+    }
+    if (use_io_uring_)
+    {
+        IoUring *ring = LocalRing();
+        if (ring)
+        {
+            ring->Submit(reqs, n);
+            uring_requests_.fetch_add(n, std::memory_order_relaxed);
+            return;
+        }
+    }
+    SubmitToPool(reqs, n);
+}
+
+void SsdIO::SubmitToPool(IORequest *reqs, size_t n)
+{
+    // shared with the pool jobs, a job that starts after the batch completed finds no request left
+    struct Batch
+    {
+        IORequest *reqs;
+        size_t n;
+        std::atomic<size_t> next{0};
+        std::atomic<size_t> done{0};
+        std::mutex mtx;
+        std::condition_variable cv;
+    };
+    auto batch = std::make_shared<Batch>();
+    batch->reqs = reqs;
+    batch->n = n;
+    auto work = [](Batch *b)
+    {
+        size_t i;
+        while ((i = b->next.fetch_add(1)) < b->n)
+        {
+            b->reqs[i].Run();
+            if (b->done.fetch_add(1) + 1 == b->n)
+            {
+                std::lock_guard<std::mutex> lock(b->mtx);
+                b->cv.notify_all();
+            }
+        }
+    };
+    size_t helpers = std::min(n - 1, (size_t)std::min(queue_depth_, (unsigned)pool_threads_));
+    for (size_t i = 0; i < helpers; i++)
+        pool_->SubmitJob([batch, work]()
+                         { work(batch.get()); });
+    work(batch.get());
+    std::unique_lock<std::mutex> lock(batch->mtx);
+    batch->cv.wait(lock, [&]()
+                   { return batch->done.load() == n; });
+}
+
+SsdIO::Stats SsdIO::GetStats()
+{
+    Stats s;
+    s.batches = batches_.load();
+    s.requests = requests_.load();
+    s.uring_requests = uring_requests_.load();
+    return s;
+}
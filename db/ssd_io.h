@@ -0,0 +1,58 @@
+#pragma once
+
+#include "util/io_request.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+class ThreadPoolImpl;
+class IoUring;
+
+/**
+ * @brief Process-wide I/O on ssd segment files.
+ * A batch keeps up to queue depth requests in flight through an io_uring of the calling thread, set up on its first batch.
+ * If io_uring is not available, the requests of a batch are spread over a small pool of threads issuing pread/pwrite
+ * and the caller works along. Before Open, or after Close, batches are issued one request after another.
+ *
+ */
+class SsdIO
+{
+public:
+    struct Stats
+    {
+        uint64_t batches = 0;
+        uint64_t requests = 0;
+        // requests that went through io_uring, the others were plain pread/pwrite
+        uint64_t uring_requests = 0;
+    };
+
+    /**
+     * @param queue_depth requests of a batch in flight at most
+     * @param pool_threads threads of the fallback pool
+     * @param use_io_uring false always takes the fallback pool
+     */
+    static void Open(unsigned queue_depth, int pool_threads, bool use_io_uring);
+    static void Close();
+
+    /**
+     * @brief issue the requests and wait for all of them, a batch of one is a plain pread/pwrite
+     */
+    static void Submit(IORequest *reqs, size_t n);
+    static Stats GetStats();
+    /**
+     * @return true if batches of the calling thread go through io_uring
+     */
+    static bool UsesIoUring();
+
+private:
+    static std::atomic_bool opened_;
+    static bool use_io_uring_;
+    static unsigned queue_depth_;
+    static int pool_threads_;
+    static ThreadPoolImpl *pool_;
+    static std::atomic_uint64_t batches_, requests_, uring_requests_;
+
+    static IoUring *LocalRing();
+    static void SubmitToPool(IORequest *reqs, size_t n);
+};
@@ -0,0 +1,81 @@
+/**
+ * @file super_version.h
+ * @brief immutable, reference-counted view of all sources of the db, replaced as a whole
+ *        whenever a flush or a compaction changes them
+ *
+ */
+#pragma once
+
+#include "db_common.h"
+#include "db/table.h"
+#include "db/compaction/level1_index.h"
+#include "util/epoch.h"
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+/**
+ * @brief psts sorted by key and not overlapped: a vector of metas, or level1 as the slots of a published Level1Index.
+ * It references them, the owner keeps them alive and unchanged while the run is read.
+ *
+ */
+struct PstRun
+{
+    const std::vector<TaggedPstMeta> *tables = nullptr;
+    // if set, the run is the slots of tables in index order
+    const Level1Index *index = nullptr;
+
+    PstRun() {}
+    PstRun(const std::vector<TaggedPstMeta> &run) : tables(&run) {}
+    PstRun(const std::vector<TaggedPstMeta> &slots, const Level1Index *l1_index) : tables(&slots), index(l1_index) {}
+
+    size_t Size() const { return index ? index->Size() : tables ? tables->size() : 0; }
+    const TaggedPstMeta &At(size_t pos) const { return index ? (*tables)[index->SlotAt(pos)] : (*tables)[pos]; }
+    /**
+     * @brief position of the first pst whose max key >= key (native order), Size() if none
+     */
+    size_t LowerBound(uint64_t key) const
+    {
+        if (index)
+            return index->LowerBound(key);
+        if (tables == nullptr)
+            return 0;
+        return std::lower_bound(tables->begin(), tables->end(), key, [](const TaggedPstMeta &t, uint64_t k)
+                                { return __builtin_bswap64(t.meta.max_key_) < k; }) -
+               tables->begin();
+    }
+};
+
+/**
+ * @brief memtables + level0 trees + level1 + level2 at one moment.
+ * DB keeps the current one, iterators and snapshots share it. The pst pages it references
+ * are not recycled before it is destroyed, so it never stalls flush or compaction.
+ *
+ */
+struct SuperVersion
+{
+    // newest first, a key of an earlier memtable overrides the later ones.
+    // the first one is the active memtable at install time and may still receive writes, unless it is a snapshot
+    std::vector<std::shared_ptr<Index>> memtables;
+    // valid psts of each readable level0 tree (newest first), see Version::GetSortedRuns
+    std::vector<std::vector<TaggedPstMeta>> runs;
+    // the level1 index and slots published at that moment, released by the version not before the pinned epoch
+    PstRun level1;
+    // psts of level2, released by the version not before the pinned epoch, see Version::GetLevel2Tables
+    const std::vector<TaggedPstMeta> *level2 = nullptr;
+    // increases with each install
+    uint64_t number = 0;
+
+    /**
+     * @brief pins the epoch before the runs are collected
+     */
+    explicit SuperVersion(EpochManager *epoch) : epoch_(epoch), pinned_epoch_(epoch->Pin()) {}
+    ~SuperVersion() { epoch_->Unpin(pinned_epoch_); }
+    SuperVersion(const SuperVersion &) = delete;
+    SuperVersion &operator=(const SuperVersion &) = delete;
+
+private:
+    EpochManager *epoch_;
+    const uint64_t pinned_epoch_;
+};
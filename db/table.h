@@ -1,5 +1,7 @@
 #pragma once
 #include "db_common.h"
+#include "util/blocked_bloom_filter.h"
+#include <memory>
 /**
  * @brief Contains the addresses of Indexblock and some metadata
  *
@@ -14,7 +16,7 @@ struct PSTMeta
     uint16_t datablock_num_ = 0;
 
     static PSTMeta InvalidTable() { return PSTMeta(); }
-    bool Valid()
+    bool Valid() const
     {
         // DEBUG("indexblock_ptr_=%lu,get_pure_indexblock_ptr=%lu",indexblock_ptr_,get_pure_indexblock_ptr());
         return indexblock_ptr_ != 0;
@@ -26,9 +28,13 @@ struct TaggedPstMeta
 {
     PSTMeta meta;
     // optional information. maybe lost after recovery
-    size_t level;
+    size_t level = 0;
     size_t manifest_position;
-    bool Valid()
+    // DRAM-only, rebuilt from the PST contents after recovery
+    std::shared_ptr<BlockedBloomFilter> filter;
+    // the datablocks are on ssd and only the index block on pm. DRAM-only, read from the index block after recovery
+    bool data_on_ssd = false;
+    bool Valid() const
     {
         return meta.Valid();
     }
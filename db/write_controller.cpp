@@ -0,0 +1,78 @@
+#include "write_controller.h"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+WriteController::WriteController(uint64_t delayed_write_rate, int immutable_memtable_slowdown, int l0_slowdown_trees)
+    : delayed_write_rate_(delayed_write_rate), immutable_memtable_slowdown_(immutable_memtable_slowdown), l0_slowdown_trees_(l0_slowdown_trees)
+{
+}
+
+void WriteController::SetPressure(int immutable_memtables, int l0_trees, bool stop)
+{
+    int level = std::max(0, immutable_memtables - immutable_memtable_slowdown_ + 1) + std::max(0, l0_trees - l0_slowdown_trees_ + 1);
+    uint64_t rate = (level && delayed_write_rate_) ? std::max<uint64_t>(delayed_write_rate_ / level, 1) : 0;
+    if (rate != write_rate_.load(std::memory_order_relaxed))
+    {
+        LOG("write rate %lu/s, immutable memtables=%d, level0 trees=%d", rate, immutable_memtables, l0_trees);
+        write_rate_.store(rate, std::memory_order_relaxed);
+    }
+    if (stop != stopped_.load(std::memory_order_relaxed))
+    {
+        INFO("%s writes, immutable memtables=%d, level0 trees=%d", stop ? "stop" : "resume", immutable_memtables, l0_trees);
+        // under the mutex so that a writer about to wait does not miss the wakeup
+        std::lock_guard<std::mutex> lock(stop_mutex_);
+        stopped_.store(stop, std::memory_order_release);
+        if (!stop)
+            stop_cv_.notify_all();
+    }
+}
+
+void WriteController::MayDelayWrite(size_t num)
+{
+    if (stopped_.load(std::memory_order_acquire))
+    {
+        uint64_t start = NowNanos();
+        std::unique_lock<std::mutex> lock(stop_mutex_);
+        stop_cv_.wait(lock, [this]()
+                      { return !stopped_.load(std::memory_order_relaxed); });
+        lock.unlock();
+        stopped_writes_.fetch_add(1, std::memory_order_relaxed);
+        stop_ns_.fetch_add(NowNanos() - start, std::memory_order_relaxed);
+    }
+    uint64_t rate = write_rate_.load(std::memory_order_relaxed);
+    if (rate == 0)
+        return;
+    uint64_t now = NowNanos();
+    uint64_t delay = 0;
+    {
+        std::lock_guard<SpinLock> lock(bucket_lock_);
+        if (next_write_ns_ + MAX_BURST_NS < now)
+            next_write_ns_ = now - MAX_BURST_NS;
+        next_write_ns_ += num * 1000000000ul / rate;
+        if (next_write_ns_ > now)
+            delay = next_write_ns_ - now;
+    }
+    if (delay < MIN_SLEEP_NS)
+        return;
+    std::this_thread::sleep_for(std::chrono::nanoseconds(delay));
+    delayed_writes_.fetch_add(1, std::memory_order_relaxed);
+    delay_ns_.fetch_add(NowNanos() - now, std::memory_order_relaxed);
+}
+
+WriteController::Stats WriteController::GetStats()
+{
+    Stats stats;
+    stats.delayed_writes = delayed_writes_.load(std::memory_order_relaxed);
+    stats.delay_us = delay_ns_.load(std::memory_order_relaxed) / 1000;
+    stats.stopped_writes = stopped_writes_.load(std::memory_order_relaxed);
+    stats.stop_us = stop_ns_.load(std::memory_order_relaxed) / 1000;
+    return stats;
+}
+
+// private
+uint64_t WriteController::NowNanos()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "util/lock.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+
+/**
+ * @brief Throttles user writes by the pressure of the background work.
+ * DB sets the pressure after memtable switches, flushes and compactions. Below the slowdown triggers writes pass freely;
+ * above them all clients share a token bucket whose rate is divided by the number of immutable memtables
+ * and level0 trees over the triggers, so the delay of a write grows with the backlog.
+ * Writes stop only when every memtable is immutable, until a flush frees one.
+ *
+ */
+class WriteController
+{
+public:
+    struct Stats
+    {
+        uint64_t delayed_writes = 0;
+        uint64_t delay_us = 0;
+        uint64_t stopped_writes = 0;
+        uint64_t stop_us = 0;
+    };
+
+    /**
+     * @param delayed_write_rate writes per second of all clients at the first slowdown level, 0 never delays writes
+     * @param immutable_memtable_slowdown immutable memtables from which writes are delayed
+     * @param l0_slowdown_trees level0 trees from which writes are delayed
+     */
+    WriteController(uint64_t delayed_write_rate, int immutable_memtable_slowdown, int l0_slowdown_trees);
+
+    /**
+     * @param stop whether all memtables are immutable and the active one is full
+     */
+    void SetPressure(int immutable_memtables, int l0_trees, bool stop);
+
+    /**
+     * @brief wait as long as the current state requires before writing num entries.
+     * Call it outside of an epoch guard, since a stopped writer waits for a flush.
+     */
+    void MayDelayWrite(size_t num);
+
+    bool IsStopped() const { return stopped_.load(std::memory_order_relaxed); }
+    /**
+     * @return writes per second allowed now, 0 if writes are not delayed
+     */
+    uint64_t GetWriteRate() const { return write_rate_.load(std::memory_order_relaxed); }
+    /**
+     * @brief cumulative since the db was opened
+     */
+    Stats GetStats();
+
+private:
+    // an idle bucket saves at most this much time for later writes
+    static constexpr uint64_t MAX_BURST_NS = 1000000;
+    // shorter delays are left to the next writers, sleeping is not that precise
+    static constexpr uint64_t MIN_SLEEP_NS = 100000;
+
+    const uint64_t delayed_write_rate_;
+    const int immutable_memtable_slowdown_;
+    const int l0_slowdown_trees_;
+
+    std::atomic<bool> stopped_{false};
+    std::atomic<uint64_t> write_rate_{0};
+    // token bucket: steady clock time at which the next write may start
+    SpinLock bucket_lock_;
+    uint64_t next_write_ns_ = 0;
+    std::mutex stop_mutex_;
+    std::condition_variable stop_cv_;
+
+    std::atomic<uint64_t> delayed_writes_{0};
+    std::atomic<uint64_t> delay_ns_{0};
+    std::atomic<uint64_t> stopped_writes_{0};
+    std::atomic<uint64_t> stop_ns_{0};
+
+    static uint64_t NowNanos();
+};
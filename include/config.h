@@ -8,6 +8,18 @@
 
 #define RANGE_PARTITION_NUM 8
 
+// one of 2^PST_HEAT_SAMPLE_SHIFT level1 lookups of a thread counts in the heat of the pst it reads
+#define PST_HEAT_SAMPLE_SHIFT 4
+// level1 psts with datablocks on ssd reaching this heat are moved back to pm, new psts on pm start with it
+#define PST_HEAT_HOT 8
+// minimum interval between two passes of the pst migrator, each pass halves the heat of all psts
+#define PST_MIGRATION_INTERVAL_MS 1000
+
+// ssd datablocks a pst reader keeps from its batched reads, a MultiGet looks up SSD_PREFETCH_BLOCKS / 2 keys at a time
+#define SSD_PREFETCH_BLOCKS 64
+// largest read ahead window of an iterator over datablocks on ssd, it doubles from one block while reading sequentially
+#define SSD_READAHEAD_BLOCKS 8
+
 
 #define MASSTREE_MEMTABLE
 #define MASSTREE_L1
@@ -21,6 +33,20 @@
 #define KV_SEPARATE
 #endif
 
+enum LogPersistPolicy
+{
+    PersistPerOp = 0,        // each log entry is persisted before the write returns
+    PersistEveryEntries = 1, // persist once every log_persist_entries entries
+    PersistEveryMicros = 2,  // persist once log_persist_interval_us elapsed since the last persist, a background thread persists idle writers
+    PersistAsync = 3         // writes return before persisting, a background thread persists logs every log_persist_interval_us
+};
+
+enum RowCacheAdmission
+{
+    RowCacheAdmitAll = 0,    // every missed row is inserted, evicting by CLOCK
+    RowCacheAdmitTinyLFU = 1 // a missed row replaces the CLOCK victim only if it is accessed more frequently
+};
+
 class DBConfig
 {
 public:
@@ -31,4 +57,46 @@ public:
     std::string ssd_path = "/mnt/optane-ssd/helidb/";
     size_t pm_pool_size = 80ul << 30;
     bool recover = false;
+    // buffered policies stage log entries in DRAM and write full 256B lines to PM,
+    // only available with BUFFER_WAL_MEMTABLE since INDEX_LOG_MEMTABLE reads values from the log
+    LogPersistPolicy log_persist_policy = PersistPerOp;
+    size_t log_persist_entries = 8;
+    uint64_t log_persist_interval_us = 100;
+    // bloom filter bits per key of each pst and level0 tree, 0 disables filters
+    size_t bloom_bits_per_key = 10;
+    // DRAM budget in bytes of the process-wide pm index/data block cache, 0 disables it
+    size_t block_cache_bytes = 64ul << 20;
+    // DRAM budget in bytes of the key->value row cache in front of the read path, 0 disables it
+    size_t row_cache_bytes = 0;
+    RowCacheAdmission row_cache_admission = RowCacheAdmitTinyLFU;
+    // writes per second of all clients once a slowdown trigger is reached, divided by the number of immutable
+    // memtables and level0 trees over the triggers. 0 disables the delay, writes still stop when all memtables are immutable
+    uint64_t delayed_write_rate = 1000000;
+    int immutable_memtable_slowdown = MAX_MEMTABLE_NUM - 2;
+    int l0_slowdown_trees = MAX_L0_TREE_NUM * 3 / 4;
+    // frozen memtables flushed at the same time, the background pool gets one more thread for compaction
+    int max_background_flushes = MAX_MEMTABLE_NUM - 1;
+    // compactions between two recomputations of the range partition boundaries from the data,
+    // so that sub compactions and sub flushes carry equal work. 0 keeps equal slices of the key space
+    int partition_update_interval = 8;
+    // once the level1 psts take more pm bytes than this, their oldest ranges are compacted into level2 with datablocks
+    // on ssd_path, l2_compaction_bytes of level1 at a time. 0 keeps all data on pm
+    size_t l1_pm_bytes_limit = 0;
+    size_t l2_compaction_bytes = 64ul << 20;
+    // level2 data on ssd_path the manifest has room for, it is sized when the db is created. Once the room is used up,
+    // L1->L2 compactions are skipped and level1 grows beyond l1_pm_bytes_limit
+    size_t l2_ssd_bytes = 64ul << 30;
+    // the migrator moves the datablocks of the coldest level1 psts to ssd_path until the level1 psts take at most this many pm bytes,
+    // and moves them back once they are hot and fit. At most pst_migration_bytes are rewritten per pass. 0 keeps level1 on pm
+    size_t l1_pm_target_bytes = 0;
+    size_t pst_migration_bytes = 16ul << 20;
+    // reads and writes of a batch on ssd_path in flight at most. A batch goes through an io_uring of the calling thread,
+    // or through ssd_io_threads threads issuing pread/pwrite if io_uring is not available or ssd_io_uring is false
+    unsigned ssd_io_queue_depth = 64;
+    int ssd_io_threads = 4;
+    bool ssd_io_uring = true;
+    // open the segment files on ssd_path with O_DIRECT, falls back to buffered I/O where the file system rejects it.
+    // ssd datablocks read by point queries are then kept in a DRAM page cache of ssd_page_cache_bytes, 0 disables it
+    bool ssd_direct_io = true;
+    size_t ssd_page_cache_bytes = 64ul << 20;
 };
@@ -4,11 +4,18 @@
 #include <atomic>
 #include <string>
 #include <array>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
 #include <thread>
 #include "slice.h"
 #include "db_common.h"
+#include "write_batch.h"
+#include "db_iterator.h"
 #include "db/log_format.h"
+#include "db/write_controller.h"
+#include "util/epoch.h"
+#include "util/histogram.h"
 
 
 class DBClient;
@@ -18,7 +25,21 @@ class LogReader;
 class PSTReader;
 class Version;
 class Manifest;
+class FlushJob;
 class ThreadPoolImpl;
+class RowCache;
+struct SuperVersion;
+
+/**
+ * @brief handle of a point-in-time view from DB::GetSnapshot, read through DBClient::Get and NewIterator
+ *
+ */
+class Snapshot
+{
+    friend class DB;
+    friend class DBClient;
+    std::shared_ptr<const SuperVersion> super_version_;
+};
 
 struct MemTableStates
 {
@@ -26,6 +47,8 @@ struct MemTableStates
     {
         ACTIVE,
         FREEZE,
+        FLUSHING, // its flush job is running
+        FLUSHED,  // its level0 tree waits for the flushes of older memtables
         EMPTY
     } state = EMPTY;
     bool thread_write_states[MAX_USER_THREAD_NUM];
@@ -35,6 +58,8 @@ class DB
 {
 private:
     friend class DBClient;
+    friend void LogPersister(DB *db);
+    friend void BGWorkTrigger(DB *db);
     // global
     std::string db_path_;
 
@@ -49,11 +74,30 @@ private:
     SpinLock wal_lock_[LSN_MAP_SIZE];
 #endif
     SegmentAllocator *segment_allocator_;
+    LogPersistPolicy log_persist_policy_;
+    size_t log_persist_entries_;
+    uint64_t log_persist_interval_us_;
+    RowCache *row_cache_ = nullptr;
+    WriteController write_controller_;
     DBClient *client_list_[MAX_USER_THREAD_NUM];
     SpinLock client_lock_;
 
     // FastWriteStore
     Index *mem_index_[MAX_MEMTABLE_NUM];
+    // owners of mem_index_, shared with open iterators so that a flushed memtable lives until they are destroyed
+    std::shared_ptr<Index> mem_index_owners_[MAX_MEMTABLE_NUM];
+    SpinLock mem_index_lock_;
+    // one slot per client and SUPER_VERSION_EPOCH_SLOT, defers freeing memtables, level0 trees and pst pages until their readers leave
+    EpochManager epoch_;
+    static constexpr int SUPER_VERSION_EPOCH_SLOT = MAX_USER_THREAD_NUM;
+    // current view for iterators and snapshots, read under super_version_lock_
+    std::shared_ptr<const SuperVersion> super_version_;
+    SpinLock super_version_lock_;
+    // serializes installs
+    std::mutex super_version_mutex_;
+    // with super_version_mutex_, notified when a flushed memtable slot becomes EMPTY
+    std::condition_variable memtable_free_cv_;
+    uint64_t super_version_number_ = 0;
     // std::atomic<uint64_t> memtable_size_[MAX_MEMTABLE_NUM];
     MemTableStates memtable_states_[MAX_MEMTABLE_NUM];
     std::atomic_uint64_t temp_memtable_size_[MAX_MEMTABLE_NUM];
@@ -62,15 +106,53 @@ private:
     // control variables
     ThreadPoolImpl *thread_pool_ = nullptr;
 	ThreadPoolImpl *compaction_thread_pool_ = nullptr;
+	// range partitions of a flush are built in parallel, shared by the running flushes
+	ThreadPoolImpl *flush_thread_pool_ = nullptr;
     std::thread *bgwork_trigger_ = nullptr;
+    std::thread *log_persister_ = nullptr;
     bool read_optimized_mode_ = false;
     bool read_only_mode_ = false;
     size_t l0_compaction_tree_num_ = 4;
 
-    std::atomic<bool> is_flushing_ = false;
+    // frozen memtables are flushed in parallel, each job on its own thread of thread_pool_
+    const int max_background_flushes_;
+    std::atomic<int> running_flushes_{0};
+    // guards flush_jobs_ and the FREEZE -> FLUSHING -> FLUSHED -> EMPTY steps
+    std::mutex flush_mutex_;
+    FlushJob *flush_jobs_[MAX_MEMTABLE_NUM] = {};
     std::atomic<bool> is_l0_compacting_ = false;
 
     int workload_detect_sample_ = 0;
+    // wakes BGWorkTrigger: writers crossing a memtable size step and finished flushes and compactions
+    std::mutex bg_work_mutex_;
+    std::condition_variable bg_work_cv_;
+    // time of the oldest signal not handled yet, 0 if none
+    uint64_t bg_work_signal_us_ = 0;
+    // us from a signal to the MayTriggerFlushOrCompaction handling it
+    Histogram schedule_delay_hist_;
+
+    // range partitions are rebalanced every partition_update_interval_ compactions if their estimated skew is over
+    // PARTITION_REBALANCE_SKEW, given at least PARTITION_MIN_SAMPLES psts per partition
+    static constexpr double PARTITION_REBALANCE_SKEW = 1.25;
+    static constexpr int PARTITION_MIN_SAMPLES = 4;
+    const int partition_update_interval_;
+    int compactions_since_partition_update_ = 0;
+    // new boundaries wait for a compaction of all partitions, trees compacted in part refer to the current ones
+    bool partition_rebalance_pending_ = false;
+    // level0 trees kept for their cold partitions force a compaction of the oldest tree at
+    // l0_compaction_tree_num_ * L0_FORCE_COMPACTION_FACTOR trees
+    static constexpr int L0_FORCE_COMPACTION_FACTOR = 2;
+    // level1 is compacted into level2 on ssd beyond l1_pm_bytes_limit_, 0 disables level2
+    const size_t l1_pm_bytes_limit_;
+    const size_t l2_compaction_bytes_;
+    // native key where the next L1->L2 compaction starts
+    uint64_t l2_compact_cursor_ = 0;
+    // reported once, the level2 area of the manifest cannot take the outputs of a L1->L2 compaction
+    bool l2_full_reported_ = false;
+    // the datablocks of cold level1 psts are moved to ssd beyond l1_pm_target_bytes_, 0 disables the migration
+    const size_t l1_pm_target_bytes_;
+    const size_t pst_migration_bytes_;
+    uint64_t last_migration_us_ = 0;
 
 public: // TODO: change to private
     // BufferStore (level 0) + LeveledStore (Level 1 and level 2)
@@ -78,6 +160,8 @@ public: // TODO: change to private
     Manifest *manifest_;
     bool stop_bgwork_ = false;
 	PartitionInfo partition_info_[RANGE_PARTITION_NUM];
+	// guards partition_info_, flush and compaction jobs copy it when they are created
+	std::mutex partition_mutex_;
 
 
 
@@ -85,6 +169,28 @@ public:
     DB(DBConfig cfg = DBConfig());
     ~DB();
     std::unique_ptr<DBClient> GetClient(int tid = -1);
+    void SyncAll();
+    /**
+     * @brief the row cache in front of the read path, nullptr if disabled
+     */
+    RowCache *GetRowCache() { return row_cache_; }
+    /**
+     * @brief the throttle of user writes, see WriteController::GetStats for the stall time
+     */
+    WriteController *GetWriteController() { return &write_controller_; }
+    /**
+     * @brief delay between a write or a finished background job asking for scheduling and the scheduler handling it
+     */
+    const Histogram &GetScheduleDelayHistogram() const { return schedule_delay_hist_; }
+    /**
+     * @brief pin the current memtables, level0 trees and level1 for reads through DBClient::Get and NewIterator.
+     * The active memtable is left out of the view while it is empty and frozen otherwise,
+     * so the snapshot sees exactly the writes finished before this call.
+     * Freezing waits for a flush if all memtables are in use.
+     * Flush and compaction go on, the psts they replace are recycled after ReleaseSnapshot.
+     */
+    const Snapshot *GetSnapshot();
+    void ReleaseSnapshot(const Snapshot *snapshot);
     // static bool initDB();
     // static bool openDB();
 private:
@@ -96,6 +202,53 @@ private:
     LSN LSN_lock(uint64_t i_key);
     void LSN_unlock(size_t epoch);
 #endif
+    void CreateMemtable(int idx);
+    void ReleaseMemtable(int idx);
+    std::shared_ptr<const SuperVersion> GetSuperVersion();
+    /**
+     * @brief build a view of the memtables, the readable level0 trees and level1, and make it current.
+     * Called whenever a flush or a compaction changes them.
+     */
+    void InstallSuperVersion();
+    /**
+     * @brief with super_version_mutex_ held, the view takes memtables from newest_memtable_idx back to the first empty one
+     *
+     * @param include_newest false to leave out newest_memtable_idx itself
+     */
+    std::shared_ptr<const SuperVersion> BuildSuperVersion(int newest_memtable_idx, bool include_newest = true);
+    void InstallSuperVersionLocked(int newest_memtable_idx);
+    /**
+     * @brief freeze the active memtable and direct writes to the next one, the caller waits for
+     * the writes into the frozen one with epoch_.Synchronize()
+     *
+     * @param frozen_view if not null, set to a view without the new memtable
+     * @return false if the next memtable is still in use
+     */
+    bool SwitchMemtable(std::shared_ptr<const SuperVersion> *frozen_view = nullptr);
+    bool SwitchMemtableLocked(std::shared_ptr<const SuperVersion> *frozen_view);
+    /**
+     * @return true if no write has reached memtable idx
+     */
+    bool MemtableEmpty(int idx);
+    /**
+     * @return the oldest memtable not flushed yet, the active one if no memtable is frozen
+     */
+    int OldestMemtable();
+    /**
+     * @brief set the pressure of write_controller_ from the memtables and level0 trees
+     */
+    void UpdateWriteController();
+    /**
+     * @brief wake BGWorkTrigger to check for flush and compaction now instead of at its next watchdog round
+     */
+    void SignalBGWork();
+    /**
+     * @brief every partition_update_interval_ compactions, split the key space into partitions holding equal entries,
+     * sampled from the psts of level0 and level1, and persist the boundaries in the manifest.
+     * Boundaries never cut a level1 pst, and change only when no level0 tree is compacted in part.
+     * Called by the compaction thread after a compaction.
+     */
+    void MayUpdatePartitions();
     size_t GetMemtableSize(int idx);
     void ClearMemtableSize(int idx);
     void AddTempMemtableSize(int idx, size_t size)
@@ -107,8 +260,32 @@ private:
 public: // TODO: change to private
     bool MayTriggerFlushOrCompaction();
     bool MayTriggerCompaction();
-    bool BGFlush();
+    /**
+     * @brief reserve level0 trees for the frozen memtables, oldest first, and schedule their flush jobs
+     *
+     * @return true if a job was scheduled
+     */
+    bool ScheduleFlushes();
+    bool BGFlush(int memtable_idx);
+    /**
+     * @brief install the finished flushes from the oldest memtable on, until one still running
+     */
+    void InstallFlushesLocked();
     bool BGCompaction();
+    bool NeedLevel2Compaction();
+    /**
+     * @brief move level1 psts into level2 until level1 fits in l1_pm_bytes_limit_, on the compaction thread
+     *
+     * @return number of L1->L2 compactions
+     */
+    int BGCompactLevel2();
+    bool NeedPstMigration();
+    /**
+     * @brief a pass of the pst migrator by the heat of level1 psts, on the compaction thread
+     *
+     * @return number of psts whose datablocks moved
+     */
+    size_t BGMigratePsts();
     void WaitForFlushAndCompaction();
     void PrintLogGroup(int id);
 	void PrintPMUsage();
@@ -123,7 +300,8 @@ public: // TODO: change to private
     struct FlushArgs
     {
         DB *db_;
-        FlushArgs(DB *db) : db_(db) {}
+        int memtable_idx_;
+        FlushArgs(DB *db, int memtable_idx) : db_(db), memtable_idx_(memtable_idx) {}
     };
     static void TriggerBGFlush(void *arg);
     struct CompactionArgs
@@ -182,11 +360,42 @@ public:
 
     bool Put(const Slice key, const Slice value, bool slow = false);
     bool Get(const Slice key, Slice &value_out);
+    /**
+     * @brief read key as of snapshot, bypassing the row cache
+     */
+    bool Get(const Slice key, Slice &value_out, const Snapshot *snapshot);
+    /**
+     * @brief Get of each key into the buffer of values_out[i]. Keys missing the row cache and the memtables are looked up
+     * a group at a time, and the ssd datablocks of a group are read in one batch
+     *
+     * @param found out: whether each key was found
+     * @return number of keys found
+     */
+    size_t MultiGet(const std::vector<Slice> &keys, std::vector<Slice> &values_out, std::vector<bool> &found);
     bool Delete(const Slice key);
+    bool Write(const WriteBatch &batch);
+    /**
+     * @brief lsn of the latest write of this client, writes are durable once it is persisted
+     */
+    uint64_t LastLSN();
+    /**
+     * @brief block until the writes of this client up to lsn are durable
+     */
+    void WaitForDurable(uint64_t lsn);
+    /**
+     * @brief collect up to scan_sz keys >= start_key with an iterator
+     */
     int Scan(const Slice start_key, int scan_sz, std::vector<uint64_t> &key_out);
+    /**
+     * @brief iterator over memtables, level 0 trees and level 1 as of now or of snapshot, see DBIterator
+     */
+    std::unique_ptr<DBIterator> NewIterator(const Snapshot *snapshot = nullptr);
     const int thread_id_;
 
 private:
+    // a client wakes the background scheduler each time it adds this many entries to the memtable
+    static constexpr size_t BG_WORK_SIGNAL_INTERVAL = MAX_MEMTABLE_ENTRIES / 4096 + 1;
+
     DB *db_;
     LogWriter *log_writer_;
     LogReader *log_reader_;
@@ -195,8 +404,20 @@ private:
     size_t put_num_in_current_memtable_[MAX_MEMTABLE_NUM];
     std::atomic_uint64_t total_writes_ = 0;
     std::atomic_uint64_t total_reads_ = 0;
+    std::vector<LSN> batch_lsns_;
+    std::vector<uint64_t> batch_log_ptrs_;
 
-    bool GetFromMemtable(const Slice key, Slice &value_out);
+    bool GetFromMemtable(const Slice key, Slice &value_out, size_t *value_size);
+    /**
+     * @brief look key up in the sorted runs of the current version, reading a separated value from the log
+     */
+    bool GetFromVersion(const Slice key, Slice &value_out, size_t *value_size);
+    /**
+     * @brief look key up in one memtable
+     *
+     * @return 1 if found, 0 if older sources should be searched, -1 if deleted
+     */
+    int SearchMemtable(Index *index, const Slice key, Slice &value_out, size_t *value_size);
 
     /**
      * @brief Update current_memtable_idx_ by db_->current_memtable_idx_
@@ -205,7 +426,10 @@ private:
      * @return false
      */
     inline bool StartWrite();
-    inline void FinishWrite();
+    /**
+     * @param put_num entries this write added to the memtable
+     */
+    inline void FinishWrite(size_t put_num);
 
     size_t GetMemtablePutCount(int memtable_id)
     {
@@ -65,6 +65,12 @@ public:
     virtual void Put(const KeyType key, ValueHelper &le_helper) = 0;
     virtual void PutValidate(const KeyType key, ValueHelper &le_helper) = 0;
     virtual void Delete(const KeyType key) = 0;
+    /**
+     * @brief find the first entry whose key >= key without any heap allocation
+     *
+     * @return false if there is no such entry
+     */
+    virtual bool Seek(const KeyType key, KeyType &key_out, ValueType &value_out) = 0;
     virtual void Scan(const KeyType key, int cnt, std::vector<ValueType> &vec)
     {
         ERROR_EXIT("not supported in this class");
@@ -73,46 +79,64 @@ public:
     {
         ERROR_EXIT("not supported in this class");
     }
+    /**
+     * @brief the first cnt entries whose key <= key, in descending order
+     */
+    virtual void ReverseScan2(const KeyType key, int cnt, std::vector<uint64_t> &kvec, std::vector<ValueType> &vvec)
+    {
+        ERROR_EXIT("not supported in this class");
+    }
     virtual void ScanByRange(const KeyType start, const KeyType end, std::vector<uint64_t> &kvec, std::vector<ValueType> &vvec)
     {
         ERROR_EXIT("not supported in this class");
     }
 };
 
+/**
+ * @brief a page in a sorted segment file on ssd. It is persisted in index blocks, so it names the file by its id
+ * instead of a descriptor. Encoded with the highest bit set to tell it from a pm offset.
+ */
 struct FilePtr
 {
 #define mask63 ((1UL << 63) - 1)
 #define mask32 ((1UL << 32) - 1)
-    int fd;
+    int file_id;
     int offset;
 
     uint64_t data()
     {
-        return (1UL << 63) | ((uint64_t)(fd) << 32) | offset;
+        return (1UL << 63) | ((uint64_t)(file_id) << 32) | offset;
     }
 
-    FilePtr(int _fd, int _offset)
+    FilePtr(int _file_id, int _offset)
     {
-        fd = _fd;
-        offset = _fd;
+        file_id = _file_id;
+        offset = _offset;
     }
     FilePtr(uint64_t data)
     {
-        fd = (mask63 & data) >> 32;
+        file_id = (mask63 & data) >> 32;
         offset = (mask32 & data);
     }
     static FilePtr InvalidPtr()
     {
         return FilePtr{-1, -1};
     }
+    /**
+     * @brief the encoded pointer refers to ssd, not to pm
+     */
+    static bool IsFilePtr(uint64_t data)
+    {
+        return data != INVALID_PTR && (data >> 63);
+    }
     bool Valid()
     {
-        return fd >= 0 && offset > 0;
+        return file_id >= 0 && offset > 0;
     }
 
     bool operator==(FilePtr b)
     {
-        return fd == b.fd && offset == b.offset;
+        return file_id == b.file_id && offset == b.offset;
     }
 };
 
@@ -120,4 +144,7 @@ struct PartitionInfo
 {
 	size_t min_key;
 	size_t max_key;
-};
\ No newline at end of file
+};
+// a set of range partitions, bit i is partition i
+static_assert(RANGE_PARTITION_NUM <= 32, "partition sets are 32-bit masks");
+#define ALL_PARTITIONS ((uint32_t)((1ull << RANGE_PARTITION_NUM) - 1))
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "slice.h"
+
+/**
+ * @brief Ordered view over all keys of the db: memtables, level 0 trees and level 1.
+ * Keys are 8-byte big-endian strings as passed to Put, a key shows its newest value and deleted keys are hidden.
+ * Created by DBClient::NewIterator and used only by the thread of that client.
+ * It reads the SuperVersion current at its creation (or of a snapshot): flush and compaction are not blocked
+ * while it is open, but the psts they replace are recycled only after it is destroyed.
+ *
+ */
+class DBIterator
+{
+public:
+    virtual ~DBIterator() {}
+
+    virtual bool Valid() const = 0;
+    virtual void SeekToFirst() = 0;
+    virtual void SeekToLast() = 0;
+    /**
+     * @brief position at the first key >= target
+     */
+    virtual void Seek(const Slice target) = 0;
+    /**
+     * @brief position at the last key <= target
+     */
+    virtual void SeekForPrev(const Slice target) = 0;
+    virtual void Next() = 0;
+    virtual void Prev() = 0;
+    /**
+     * @brief valid until the iterator moves
+     */
+    virtual Slice key() const = 0;
+    virtual Slice value() = 0;
+};
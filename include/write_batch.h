@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <cstring>
+#include "slice.h"
+
+/**
+ * @brief A group of updates which is logged as one contiguous run and applied atomically.
+ * All records of a batch are persisted with a single fence, then inserted into the memtable.
+ * Currently only support the 32-byte log entry format, i.e. up to 8-byte key and 8-byte value.
+ *
+ */
+class WriteBatch
+{
+public:
+    // a batch must fit in a single log segment together with its header and alignment padding
+    static constexpr size_t MAX_ENTRIES = 65536;
+
+    struct Record
+    {
+        uint64_t key = 0;
+        uint64_t value = 0;
+        uint16_t key_sz = 0;
+        uint16_t value_sz = 0;
+        bool is_delete = false;
+    };
+
+    WriteBatch() {}
+    ~WriteBatch() {}
+
+    /**
+     * @return false if the key/value size is not supported or the batch is full
+     */
+    bool Put(const Slice key, const Slice value)
+    {
+        if (key.size() > 8 || value.size() > 8 || records_.size() >= MAX_ENTRIES)
+            return false;
+        Record r;
+        memcpy(&r.key, key.data(), key.size());
+        memcpy(&r.value, value.data(), value.size());
+        r.key_sz = key.size();
+        r.value_sz = value.size();
+        records_.push_back(r);
+        return true;
+    }
+
+    bool Delete(const Slice key)
+    {
+        if (key.size() > 8 || records_.size() >= MAX_ENTRIES)
+            return false;
+        Record r;
+        memcpy(&r.key, key.data(), key.size());
+        r.key_sz = key.size();
+        r.is_delete = true;
+        records_.push_back(r);
+        return true;
+    }
+
+    void Clear() { records_.clear(); }
+    size_t Count() const { return records_.size(); }
+    const std::vector<Record> &Records() const { return records_; }
+
+private:
+    std::vector<Record> records_;
+};
@@ -151,6 +151,17 @@ public:
         }
     }
 
+    virtual bool Seek(const KeyType key, KeyType &key_out, ValueType &value_out) override
+    {
+        // the iterator keeps its node stack inline
+        auto iter = Seek(__bswap_64(key));
+        if (!iter.Valid())
+            return false;
+        key_out = __bswap_64(iter.Key());
+        value_out = iter.Value();
+        return true;
+    }
+
     HOTIterator Seek(const KeyType key)
     {
         return HOTIterator(mTrie.lower_bound(key));
@@ -46,6 +46,11 @@ public:
         mt_->remove(key);
     }
 
+    virtual bool Seek(const KeyType key, KeyType &key_out, ValueType &value_out) override
+    {
+        return mt_->seek(key, key_out, value_out);
+    }
+
     virtual void Scan(const KeyType key, int cnt,
                       std::vector<ValueType> &vec) override
     {
@@ -55,6 +60,10 @@ public:
     {
         mt_->scan(key, cnt, kvec, vvec);
     }
+    virtual void ReverseScan2(const KeyType key, int cnt, std::vector<uint64_t> &kvec, std::vector<ValueType> &vvec) override
+    {
+        mt_->rscan(key, cnt, kvec, vvec);
+    }
     virtual void ScanByRange(const KeyType start, const KeyType end, std::vector<uint64_t> &kvec, std::vector<ValueType> &vvec) override
     {
         mt_->scan(start, end, kvec, vvec);
@@ -168,6 +168,28 @@ public:
         }
     };
 
+    /**
+     * @brief stops at the first entry of the scan, keeps it in place of pushing into vectors
+     *
+     */
+    struct SeekScanner
+    {
+        bool found = false;
+        uint64_t key = 0;
+        table_params::value_type value = 0;
+
+        template <typename SS, typename K>
+        void visit_leaf(const SS &, const K &, threadinfo &) {}
+
+        bool visit_value(Str k, table_params::value_type val, threadinfo &)
+        {
+            found = true;
+            key = *(uint64_t *)k.data();
+            value = val;
+            return false;
+        }
+    };
+
     // static thread_local typename table_params::threadinfo_type *ti;
     static thread_local int thread_id;
     typename table_params::threadinfo_type *tis[65];
@@ -295,6 +317,27 @@ public:
         table_.scan(key, true, scanner, *ti);
     }
 
+    void rscan(uint64_t int_key, int cnt, std::vector<uint64_t> &kvec, std::vector<uint64_t> &vvec)
+    {
+        table_params::threadinfo_type *ti = get_ti();
+        uint64_t key_buf;
+        Str key = make_key(int_key, key_buf);
+        Scanner2 scanner(cnt, kvec, vvec);
+        table_.rscan(key, true, scanner, *ti);
+    }
+
+    bool seek(uint64_t int_key, uint64_t &key_out, uint64_t &value_out)
+    {
+        table_params::threadinfo_type *ti = get_ti();
+        uint64_t key_buf;
+        Str key = make_key(int_key, key_buf);
+        SeekScanner scanner;
+        table_.scan(key, true, scanner, *ti);
+        key_out = scanner.key;
+        value_out = scanner.value;
+        return scanner.found;
+    }
+
     void scan(uint64_t start, uint64_t end, std::vector<uint64_t> &kvec, std::vector<uint64_t> &vvec)
     {
         table_params::threadinfo_type *ti = get_ti();
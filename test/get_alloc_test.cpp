@@ -0,0 +1,114 @@
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <random>
+#include <vector>
+
+#include "util/alloc_counter.h"
+#include "db.h"
+#include "lib/index_masstree.h"
+
+/**
+ * @brief point reads must not allocate: Index::Get and Index::Seek of the memtable index,
+ * and DBClient::Get over memtables, level0 trees and level1 once the per-thread state is warm.
+ * Heap allocations of the reading thread are counted through the global operator new.
+ *
+ * usage: get_alloc_test [db directory], the directory is recreated
+ */
+DEFINE_ALLOC_COUNTING_OPERATORS
+
+static constexpr size_t NUM_KEYS = 400000;
+static constexpr int ROUNDS = 8;
+
+static int Check(const char *what, uint64_t allocs, size_t ops)
+{
+    printf("%s: %lu heap allocations in %lu ops\n", what, allocs, ops);
+    return allocs != 0;
+}
+
+static int CheckIndex(const std::vector<uint64_t> &keys)
+{
+    MasstreeIndex index;
+    index.ThreadInit(1);
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        ValueHelper helper(i);
+        index.Put(keys[i], helper);
+    }
+    KeyType key_out;
+    ValueType value_out;
+    // the first reads set up the thread state of masstree
+    index.Get(keys[0]);
+    index.Seek(keys[0], key_out, value_out);
+
+    uint64_t before = alloc_counter::ThreadAllocations();
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        if (index.Get(keys[i]) != i)
+            ERROR_EXIT("index get of key %lu failed", i);
+    }
+    int failures = Check("Index::Get", alloc_counter::ThreadAllocations() - before, keys.size());
+
+    before = alloc_counter::ThreadAllocations();
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        if (!index.Seek(keys[i], key_out, value_out) || key_out != keys[i])
+            ERROR_EXIT("index seek of key %lu failed", i);
+    }
+    return failures + Check("Index::Seek", alloc_counter::ThreadAllocations() - before, keys.size());
+}
+
+static int CheckDB(const std::string &path, const std::vector<uint64_t> &keys)
+{
+    std::filesystem::remove_all(path);
+    std::filesystem::create_directories(path);
+    DBConfig cfg;
+    cfg.pm_pool_path = path;
+    cfg.pm_pool_size = 4ul << 30;
+    DB *db = new DB(cfg);
+    int failures = 0;
+    {
+        auto client = db->GetClient();
+        // each round but the last is frozen into a level0 tree, compactions merge them into level1
+        size_t per_round = keys.size() / ROUNDS;
+        for (int round = 0; round < ROUNDS; round++)
+        {
+            for (size_t i = round * per_round; i < (round + 1) * per_round; i++)
+            {
+                uint64_t value = i;
+                client->Put(Slice(&keys[i]), Slice(&value));
+            }
+            if (round + 1 < ROUNDS)
+                db->ReleaseSnapshot(db->GetSnapshot());
+        }
+        size_t num = per_round * ROUNDS;
+        uint64_t value;
+        Slice value_out((char *)&value, sizeof(value));
+        // the first pass fills the per-client reader buffers
+        for (size_t i = 0; i < num; i++)
+            client->Get(Slice(&keys[i]), value_out);
+
+        uint64_t before = alloc_counter::ThreadAllocations();
+        for (size_t i = 0; i < num; i++)
+        {
+            if (!client->Get(Slice(&keys[i]), value_out) || value != i)
+                ERROR_EXIT("get of key %lu failed", i);
+        }
+        failures += Check("DBClient::Get", alloc_counter::ThreadAllocations() - before, num);
+    }
+    delete db;
+    std::filesystem::remove_all(path);
+    return failures;
+}
+
+int main(int argc, char **argv)
+{
+    std::string path = argc > 1 ? argv[1] : "/mnt/pmem/fluidkv_test/";
+    std::mt19937_64 rng(1);
+    std::vector<uint64_t> keys(NUM_KEYS);
+    for (auto &key : keys)
+        key = rng();
+    int failures = CheckIndex(keys);
+    failures += CheckDB(path, keys);
+    return failures != 0;
+}
@@ -0,0 +1,100 @@
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <filesystem>
+#include <mutex>
+#include <random>
+#include <thread>
+
+#include "db.h"
+#include "db/compaction/version.h"
+
+/**
+ * @brief skewed writes make DB::MayUpdatePartitions rebalance the range partitions, which must start at level1 pst min keys
+ * so that no level1 pst crosses a boundary.
+ * All keys fall into the first of the equal slices, each round is frozen into a level0 tree by a snapshot.
+ *
+ * usage: partition_test [db directory], the directory is recreated
+ */
+static constexpr int MAX_ROUNDS = 64;
+static constexpr size_t KEYS_PER_ROUND = 200000;
+
+static void CopyPartitions(DB *db, PartitionInfo *partitions)
+{
+    std::lock_guard<std::mutex> lock(db->partition_mutex_);
+    std::copy(db->partition_info_, db->partition_info_ + RANGE_PARTITION_NUM, partitions);
+}
+
+static bool Rebalanced(const PartitionInfo *partitions)
+{
+    // the fixed partitions are equal slices of the top 32 bits of the key space
+    return __builtin_bswap64(partitions[1].min_key) != ((1ul << 32) / RANGE_PARTITION_NUM << 32);
+}
+
+int main(int argc, char **argv)
+{
+    std::string path = argc > 1 ? argv[1] : "/mnt/pmem/fluidkv_test/";
+    std::filesystem::remove_all(path);
+    std::filesystem::create_directories(path);
+    DBConfig cfg;
+    cfg.pm_pool_path = path;
+    cfg.pm_pool_size = 4ul << 30;
+    cfg.partition_update_interval = 1;
+    DB *db = new DB(cfg);
+    PartitionInfo partitions[RANGE_PARTITION_NUM];
+    {
+        auto client = db->GetClient();
+        std::mt19937_64 rng(1);
+        uint64_t first_slice = (1ul << 32) / RANGE_PARTITION_NUM << 32;
+        for (int round = 0; round < MAX_ROUNDS; round++)
+        {
+            for (size_t i = 0; i < KEYS_PER_ROUND; i++)
+            {
+                uint64_t key = __builtin_bswap64(rng() % first_slice), value = i;
+                client->Put(Slice(&key), Slice(&value));
+            }
+            db->ReleaseSnapshot(db->GetSnapshot());
+            CopyPartitions(db, partitions);
+            if (Rebalanced(partitions))
+                break;
+        }
+    }
+    if (!Rebalanced(partitions))
+    {
+        fprintf(stderr, "partitions were not rebalanced after %d rounds\n", MAX_ROUNDS);
+        return 1;
+    }
+    // the work queued by the last rounds may still compact, read level1 and the partitions of one moment
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    PartitionInfo check[RANGE_PARTITION_NUM];
+    int failures = 0, on_min_keys = 0;
+    const Snapshot *snapshot = db->GetSnapshot();
+    do
+    {
+        CopyPartitions(db, partitions);
+        PstRun level1 = db->current_version_->GetLevel1Run();
+        failures = on_min_keys = 0;
+        for (int i = 1; i < RANGE_PARTITION_NUM; i++)
+        {
+            uint64_t boundary = __builtin_bswap64(partitions[i].min_key);
+            size_t pos = level1.LowerBound(boundary);
+            if (pos == level1.Size())
+                continue;
+            uint64_t min_key = __builtin_bswap64(level1.At(pos).meta.min_key_);
+            if (min_key == boundary)
+                on_min_keys++;
+            else if (min_key < boundary)
+            {
+                fprintf(stderr, "boundary %d at %lu is inside the level1 pst starting at %lu\n", i, boundary, min_key);
+                failures++;
+            }
+        }
+        CopyPartitions(db, check);
+    } while (!std::equal(partitions, partitions + RANGE_PARTITION_NUM, check, [](const PartitionInfo &a, const PartitionInfo &b)
+                         { return a.min_key == b.min_key; }));
+    db->ReleaseSnapshot(snapshot);
+    printf("%d of %d boundaries at level1 pst min keys, %d inside a pst\n", on_min_keys, RANGE_PARTITION_NUM - 1, failures);
+    delete db;
+    std::filesystem::remove_all(path);
+    return failures || on_min_keys == 0;
+}
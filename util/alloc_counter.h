@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+/**
+ * @brief Per-thread count of heap allocations made through operator new.
+ * The counting operators replace the global ones, so a binary opts in by putting
+ * DEFINE_ALLOC_COUNTING_OPERATORS in exactly one of its translation units;
+ * without it ThreadAllocations() stays 0.
+ * Used to check that hot paths such as DBClient::Get never allocate.
+ *
+ */
+namespace alloc_counter
+{
+    inline thread_local uint64_t thread_allocations = 0;
+
+    inline uint64_t ThreadAllocations()
+    {
+        return thread_allocations;
+    }
+
+    inline void *CountedAlloc(size_t size)
+    {
+        thread_allocations++;
+        void *p = malloc(size ? size : 1);
+        if (p == nullptr)
+            throw std::bad_alloc();
+        return p;
+    }
+} // namespace alloc_counter
+
+#define DEFINE_ALLOC_COUNTING_OPERATORS                                                \
+    void *operator new(size_t size) { return alloc_counter::CountedAlloc(size); }     \
+    void *operator new[](size_t size) { return alloc_counter::CountedAlloc(size); }   \
+    void operator delete(void *p) noexcept { free(p); }                               \
+    void operator delete[](void *p) noexcept { free(p); }                             \
+    void operator delete(void *p, size_t) noexcept { free(p); }                       \
+    void operator delete[](void *p, size_t) noexcept { free(p); }
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <cstring>
+
+/**
+ * @brief Cache-line-blocked Bloom filter for DRAM-resident PST and L0 tree filters.
+ * All probes of a key fall into one 64-byte block, so a lookup costs a single cache miss.
+ * Each filter keeps its own bits-per-key and probe number.
+ *
+ */
+class BlockedBloomFilter
+{
+public:
+    static constexpr size_t BLOCK_BITS = 512;
+
+    BlockedBloomFilter(size_t num_keys, size_t bits_per_key) : bits_per_key_(bits_per_key)
+    {
+        size_t total_bits = (num_keys ? num_keys : 1) * bits_per_key;
+        num_blocks_ = (total_bits + BLOCK_BITS - 1) / BLOCK_BITS;
+        if (num_blocks_ == 0)
+            num_blocks_ = 1;
+        // k = ln2 * bits_per_key, fewer probes are enough since they share a block
+        num_probes_ = (uint32_t)(bits_per_key * 69 / 100);
+        if (num_probes_ < 1)
+            num_probes_ = 1;
+        if (num_probes_ > 12)
+            num_probes_ = 12;
+        blocks_.reset(new Block[num_blocks_]);
+        memset(blocks_.get(), 0, num_blocks_ * sizeof(Block));
+    }
+
+    /**
+     * @brief mix a raw 8-byte key into the hash used by Add/MayContain
+     */
+    static inline uint64_t Hash(uint64_t key)
+    {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        key *= 0xc4ceb9fe1a85ec53ULL;
+        key ^= key >> 33;
+        return key;
+    }
+
+    /**
+     * @brief build a filter from key hashes, nullptr if bits_per_key is 0 or no key
+     */
+    template <typename HashList>
+    static std::shared_ptr<BlockedBloomFilter> Build(const HashList &hashes, size_t bits_per_key)
+    {
+        if (bits_per_key == 0 || hashes.empty())
+            return nullptr;
+        auto filter = std::make_shared<BlockedBloomFilter>(hashes.size(), bits_per_key);
+        for (auto h : hashes)
+            filter->Add(h);
+        return filter;
+    }
+
+    inline void Add(uint64_t hash)
+    {
+        uint64_t *words = blocks_[BlockIndex(hash)].words;
+        uint32_t h = (uint32_t)hash;
+        const uint32_t delta = (h >> 17) | (h << 15);
+        for (uint32_t i = 0; i < num_probes_; i++)
+        {
+            uint32_t bit = h & (BLOCK_BITS - 1);
+            words[bit >> 6] |= 1ULL << (bit & 63);
+            h += delta;
+        }
+    }
+
+    /**
+     * @brief Add for a filter filled by several threads at once
+     */
+    inline void AddConcurrently(uint64_t hash)
+    {
+        uint64_t *words = blocks_[BlockIndex(hash)].words;
+        uint32_t h = (uint32_t)hash;
+        const uint32_t delta = (h >> 17) | (h << 15);
+        for (uint32_t i = 0; i < num_probes_; i++)
+        {
+            uint32_t bit = h & (BLOCK_BITS - 1);
+            __atomic_fetch_or(&words[bit >> 6], 1ULL << (bit & 63), __ATOMIC_RELAXED);
+            h += delta;
+        }
+    }
+    inline bool MayContain(uint64_t hash) const
+    {
+        const uint64_t *words = blocks_[BlockIndex(hash)].words;
+        uint32_t h = (uint32_t)hash;
+        const uint32_t delta = (h >> 17) | (h << 15);
+        for (uint32_t i = 0; i < num_probes_; i++)
+        {
+            uint32_t bit = h & (BLOCK_BITS - 1);
+            if ((words[bit >> 6] & (1ULL << (bit & 63))) == 0)
+                return false;
+            h += delta;
+        }
+        return true;
+    }
+
+    size_t SizeInBytes() const { return num_blocks_ * sizeof(Block); }
+    size_t BitsPerKey() const { return bits_per_key_; }
+    uint32_t NumProbes() const { return num_probes_; }
+
+private:
+    struct alignas(64) Block
+    {
+        uint64_t words[BLOCK_BITS / 64];
+    };
+    std::unique_ptr<Block[]> blocks_;
+    size_t num_blocks_;
+    size_t bits_per_key_;
+    uint32_t num_probes_;
+
+    // map the high 32 bits to [0, num_blocks_) without division
+    inline size_t BlockIndex(uint64_t hash) const
+    {
+        return (size_t)(((hash >> 32) * (uint64_t)num_blocks_) >> 32);
+    }
+};
@@ -0,0 +1,190 @@
+#pragma once
+
+#include "util/lock.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Epoch based reclamation of things that readers reach without locks.
+ * Each DBClient owns a slot and marks it with the global epoch during every operation (EpochGuard),
+ * an iterator pins the epoch it was created in until it is destroyed.
+ * A background thread first unlinks an object, then retires it; the deleter runs in a later Reclaim,
+ * once every operation that was running at retire time has finished
+ * (and every iterator created before, if the object is still read by iterators).
+ *
+ */
+class EpochManager
+{
+public:
+    static constexpr uint64_t QUIESCENT = UINT64_MAX;
+
+    explicit EpochManager(int slot_num) : slots_(new Slot[slot_num]), slot_num_(slot_num) {}
+    /**
+     * @brief deleters still waiting are dropped without running, call Reclaim before destroying
+     * what they touch
+     */
+    ~EpochManager() {}
+
+    /**
+     * @brief start an operation of the client owning slot
+     */
+    void Enter(int slot)
+    {
+        // a seq_cst store: the slot is visible before the operation reads any shared pointer
+        slots_[slot].epoch.store(global_epoch_.load(std::memory_order_relaxed));
+    }
+    void Exit(int slot)
+    {
+        slots_[slot].epoch.store(QUIESCENT, std::memory_order_release);
+    }
+
+    /**
+     * @brief keep objects retired from now on with wait_for_iterators until Unpin
+     *
+     * @return the pinned epoch, passed to Unpin
+     */
+    uint64_t Pin()
+    {
+        std::lock_guard<SpinLock> lock(pin_lock_);
+        uint64_t epoch = global_epoch_.load();
+        pins_.insert(epoch);
+        return epoch;
+    }
+    void Unpin(uint64_t epoch)
+    {
+        std::lock_guard<SpinLock> lock(pin_lock_);
+        pins_.erase(pins_.find(epoch));
+    }
+
+    /**
+     * @brief close the current epoch, call it after unlinking objects
+     *
+     * @return the closed epoch, the objects can be freed once Reclaimable(epoch)
+     */
+    uint64_t Advance()
+    {
+        return global_epoch_.fetch_add(1);
+    }
+    /**
+     * @brief whether no operation (and no iterator if wait_for_iterators) started in epoch or before
+     */
+    bool Reclaimable(uint64_t epoch, bool wait_for_iterators = false)
+    {
+        return epoch < MinActiveEpoch(wait_for_iterators);
+    }
+
+    /**
+     * @brief run deleter in a later Reclaim once the readers of the unlinked object have left
+     *
+     * @param wait_for_iterators also wait for the iterators, for pst pages
+     */
+    void Retire(std::function<void()> deleter, bool wait_for_iterators = false)
+    {
+        uint64_t epoch = Advance();
+        std::lock_guard<SpinLock> lock(retire_lock_);
+        retired_.push_back({epoch, wait_for_iterators, std::move(deleter)});
+    }
+
+    /**
+     * @brief run the deleters whose readers have left, in retire order. Background threads call it,
+     * deleters never run concurrently.
+     *
+     * @return number of deleters run
+     */
+    size_t Reclaim()
+    {
+        std::lock_guard<std::mutex> reclaim_lock(reclaim_lock_);
+        std::vector<Retired> ready;
+        {
+            uint64_t min_operation = MinActiveEpoch(false);
+            uint64_t min_iterator = MinActiveEpoch(true);
+            std::lock_guard<SpinLock> lock(retire_lock_);
+            size_t kept = 0;
+            for (auto &r : retired_)
+            {
+                if (r.epoch < (r.wait_for_iterators ? min_iterator : min_operation))
+                    ready.push_back(std::move(r));
+                else
+                    retired_[kept++] = std::move(r);
+            }
+            retired_.resize(kept);
+        }
+        for (auto &r : ready)
+            r.deleter();
+        return ready.size();
+    }
+
+    /**
+     * @brief wait until every operation running at the call has finished, iterators are not waited for
+     */
+    void Synchronize()
+    {
+        uint64_t epoch = Advance();
+        for (int i = 0; i < slot_num_; i++)
+        {
+            while (slots_[i].epoch.load() <= epoch)
+                std::this_thread::yield();
+        }
+    }
+
+private:
+    struct alignas(64) Slot
+    {
+        std::atomic<uint64_t> epoch{QUIESCENT};
+    };
+    struct Retired
+    {
+        uint64_t epoch;
+        bool wait_for_iterators;
+        std::function<void()> deleter;
+    };
+
+    std::atomic<uint64_t> global_epoch_{0};
+    std::unique_ptr<Slot[]> slots_;
+    const int slot_num_;
+    SpinLock pin_lock_;
+    std::multiset<uint64_t> pins_;
+    SpinLock retire_lock_;
+    std::vector<Retired> retired_;
+    std::mutex reclaim_lock_;
+
+    /**
+     * @brief bounded by the current epoch, so that an object retired after the scan is never reclaimable
+     */
+    uint64_t MinActiveEpoch(bool with_iterators)
+    {
+        uint64_t min_epoch = global_epoch_.load();
+        for (int i = 0; i < slot_num_; i++)
+            min_epoch = std::min(min_epoch, slots_[i].epoch.load());
+        if (with_iterators)
+        {
+            std::lock_guard<SpinLock> lock(pin_lock_);
+            if (!pins_.empty())
+                min_epoch = std::min(min_epoch, *pins_.begin());
+        }
+        return min_epoch;
+    }
+};
+
+/**
+ * @brief marks the slot of a client busy for the scope of an operation
+ *
+ */
+class EpochGuard
+{
+public:
+    EpochGuard(EpochManager *epoch, int slot) : epoch_(epoch), slot_(slot) { epoch_->Enter(slot_); }
+    ~EpochGuard() { epoch_->Exit(slot_); }
+
+private:
+    EpochManager *epoch_;
+    const int slot_;
+};
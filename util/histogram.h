@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+/**
+ * @brief Lock-free histogram of microsecond latencies in power-of-two buckets:
+ * bucket 0 holds 0 us, bucket i holds [2^(i-1), 2^i) us.
+ * Percentiles are reported as the upper bound of the bucket they fall in.
+ *
+ */
+class Histogram
+{
+public:
+    static constexpr int BUCKET_NUM = 40;
+
+    void Add(uint64_t us)
+    {
+        int bucket = us ? 64 - __builtin_clzll(us) : 0;
+        if (bucket >= BUCKET_NUM)
+            bucket = BUCKET_NUM - 1;
+        buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(us, std::memory_order_relaxed);
+        uint64_t max = max_.load(std::memory_order_relaxed);
+        while (us > max && !max_.compare_exchange_weak(max, us, std::memory_order_relaxed))
+            ;
+    }
+
+    uint64_t Count() const { return count_.load(std::memory_order_relaxed); }
+    uint64_t Max() const { return max_.load(std::memory_order_relaxed); }
+    double Average() const
+    {
+        uint64_t count = Count();
+        return count ? (double)sum_.load(std::memory_order_relaxed) / count : 0;
+    }
+    /**
+     * @param p in [0, 100]
+     * @return upper bound in us of the bucket holding the p-th percentile
+     */
+    uint64_t Percentile(double p) const
+    {
+        uint64_t count = Count();
+        if (count == 0)
+            return 0;
+        uint64_t rank = (uint64_t)(count * p / 100);
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKET_NUM; i++)
+        {
+            seen += buckets_[i].load(std::memory_order_relaxed);
+            if (seen > rank)
+                return i ? (1ul << i) - 1 : 0;
+        }
+        return Max();
+    }
+    std::string ToString() const
+    {
+        char buf[160];
+        snprintf(buf, sizeof(buf), "count=%lu avg=%.1f p50<=%lu p99<=%lu p999<=%lu max=%lu us",
+                 Count(), Average(), Percentile(50), Percentile(99), Percentile(99.9), Max());
+        return buf;
+    }
+
+private:
+    std::atomic<uint64_t> buckets_[BUCKET_NUM] = {};
+    std::atomic<uint64_t> count_{0};
+    std::atomic<uint64_t> sum_{0};
+    std::atomic<uint64_t> max_{0};
+};
@@ -0,0 +1,36 @@
+/**
+ * @file io_request.h
+ * @brief a file read or write issued in a batch, see IoUring
+ */
+#pragma once
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstddef>
+
+/**
+ * @brief a read or write of a batch, res gets what pread/pwrite would return, or -errno
+ */
+struct IORequest
+{
+    int fd = -1;
+    void *buf = nullptr;
+    size_t len = 0;
+    off_t offset = 0;
+    bool write = false;
+    ssize_t res = 0;
+
+    IORequest() {}
+    IORequest(int fd, void *buf, size_t len, off_t offset, bool write = false) : fd(fd), buf(buf), len(len), offset(offset), write(write) {}
+
+    /**
+     * @brief issue the request with pread/pwrite
+     */
+    void Run()
+    {
+        res = write ? pwrite(fd, buf, len, offset) : pread(fd, buf, len, offset);
+        if (res < 0)
+            res = -errno;
+    }
+};
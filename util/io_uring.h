@@ -0,0 +1,158 @@
+/**
+ * @file io_uring.h
+ * @brief a minimal io_uring over the raw syscalls, so that liburing is not required
+ */
+#pragma once
+
+#include "util/debug_helper.h"
+#include "util/io_request.h"
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+/**
+ * @brief an io_uring owned by one thread. Submit keeps up to queue depth requests of a batch in flight
+ * and returns once all of them completed. Needs IORING_OP_READ/WRITE (linux 5.6).
+ *
+ */
+class IoUring
+{
+public:
+    IoUring() {}
+    ~IoUring() { Destroy(); }
+    IoUring(const IoUring &) = delete;
+    IoUring &operator=(const IoUring &) = delete;
+
+    /**
+     * @return false if the kernel does not provide io_uring or its read/write ops, e.g. it is filtered by seccomp
+     */
+    bool Init(unsigned queue_depth)
+    {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        int fd = syscall(__NR_io_uring_setup, queue_depth, &p);
+        if (fd < 0)
+            return false;
+        ring_fd_ = fd;
+        sq_len_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_len_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        sqes_len_ = p.sq_entries * sizeof(io_uring_sqe);
+        sq_ptr_ = mmap(nullptr, sq_len_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        cq_ptr_ = mmap(nullptr, cq_len_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        void *sqes = mmap(nullptr, sqes_len_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        sqes_ = sqes == MAP_FAILED ? nullptr : (io_uring_sqe *)sqes;
+        if (sq_ptr_ == MAP_FAILED || cq_ptr_ == MAP_FAILED || sqes_ == nullptr || !SupportsReadWrite())
+        {
+            Destroy();
+            return false;
+        }
+        char *sq = (char *)sq_ptr_, *cq = (char *)cq_ptr_;
+        sq_tail_ = (unsigned *)(sq + p.sq_off.tail);
+        sq_mask_ = *(unsigned *)(sq + p.sq_off.ring_mask);
+        sq_array_ = (unsigned *)(sq + p.sq_off.array);
+        cq_head_ = (unsigned *)(cq + p.cq_off.head);
+        cq_tail_ = (unsigned *)(cq + p.cq_off.tail);
+        cq_mask_ = *(unsigned *)(cq + p.cq_off.ring_mask);
+        cqes_ = (io_uring_cqe *)(cq + p.cq_off.cqes);
+        entries_ = p.sq_entries;
+        return true;
+    }
+    bool Valid() const { return ring_fd_ >= 0; }
+
+    /**
+     * @brief issue all requests and wait for them, at most queue depth are in flight
+     */
+    void Submit(IORequest *reqs, size_t n)
+    {
+        size_t next = 0, inflight = 0;
+        // prepared in the sq but not consumed by the kernel yet
+        unsigned unsubmitted = 0;
+        while (next < n || inflight > 0)
+        {
+            unsigned tail = *sq_tail_;
+            while (next < n && inflight < entries_)
+            {
+                unsigned idx = tail & sq_mask_;
+                io_uring_sqe *sqe = &sqes_[idx];
+                memset(sqe, 0, sizeof(*sqe));
+                sqe->opcode = reqs[next].write ? IORING_OP_WRITE : IORING_OP_READ;
+                sqe->fd = reqs[next].fd;
+                sqe->addr = (uint64_t)reqs[next].buf;
+                sqe->len = reqs[next].len;
+                sqe->off = reqs[next].offset;
+                sqe->user_data = next;
+                sq_array_[idx] = idx;
+                tail++;
+                next++;
+                inflight++;
+                unsubmitted++;
+            }
+            __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+            int ret = syscall(__NR_io_uring_enter, ring_fd_, unsubmitted, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (ret < 0)
+            {
+                if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                    ERROR_EXIT("io_uring_enter failed: %s", strerror(errno));
+            }
+            else
+            {
+                unsubmitted -= ret;
+            }
+            // reap completions
+            unsigned head = *cq_head_;
+            unsigned cq_tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+            for (; head != cq_tail; head++)
+            {
+                io_uring_cqe *cqe = &cqes_[head & cq_mask_];
+                reqs[cqe->user_data].res = cqe->res;
+                inflight--;
+            }
+            __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+        }
+    }
+
+private:
+    int ring_fd_ = -1;
+    unsigned entries_ = 0;
+    void *sq_ptr_ = MAP_FAILED, *cq_ptr_ = MAP_FAILED;
+    size_t sq_len_ = 0, cq_len_ = 0, sqes_len_ = 0;
+    unsigned *sq_tail_ = nullptr, *sq_array_ = nullptr;
+    unsigned sq_mask_ = 0;
+    io_uring_sqe *sqes_ = nullptr;
+    unsigned *cq_head_ = nullptr, *cq_tail_ = nullptr;
+    unsigned cq_mask_ = 0;
+    io_uring_cqe *cqes_ = nullptr;
+
+    bool SupportsReadWrite()
+    {
+        const unsigned ops = 256;
+        char buf[sizeof(io_uring_probe) + ops * sizeof(io_uring_probe_op)];
+        memset(buf, 0, sizeof(buf));
+        io_uring_probe *probe = (io_uring_probe *)buf;
+        if (syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_PROBE, probe, ops) < 0)
+            return false;
+        auto supported = [&](unsigned op)
+        { return op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED); };
+        return supported(IORING_OP_READ) && supported(IORING_OP_WRITE);
+    }
+
+    void Destroy()
+    {
+        if (sqes_)
+            munmap(sqes_, sqes_len_);
+        if (cq_ptr_ != MAP_FAILED)
+            munmap(cq_ptr_, cq_len_);
+        if (sq_ptr_ != MAP_FAILED)
+            munmap(sq_ptr_, sq_len_);
+        if (ring_fd_ >= 0)
+            close(ring_fd_);
+        sqes_ = nullptr;
+        sq_ptr_ = cq_ptr_ = MAP_FAILED;
+        ring_fd_ = -1;
+    }
+};
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Tournament tree of losers merging k sorted runs of native-order (already byte swapped) keys.
+ * Each internal node keeps the run that lost the match played there, so replacing the key of the winner
+ * replays only the log2(k) matches on its path to the root instead of a pop and a push of a binary heap.
+ * Equal keys are ordered by run id, the smaller run comes first. Exhausted runs lose against all others.
+ *
+ */
+class LoserTree
+{
+public:
+    explicit LoserTree(int k) : k_(k), keys_(k), exhausted_(k, 1), tree_(k > 0 ? k : 1, 0) {}
+
+    /**
+     * @brief set the first key of a run, call Build after setting all non-empty runs
+     */
+    void Set(int run, uint64_t key)
+    {
+        keys_[run] = key;
+        exhausted_[run] = 0;
+    }
+    void Build()
+    {
+        if (k_ == 0)
+            return;
+        // winners of the subtrees, leaves are k..2k-1
+        std::vector<int> winners(2 * k_);
+        for (int i = 0; i < k_; i++)
+            winners[k_ + i] = i;
+        for (int n = k_ - 1; n > 0; n--)
+        {
+            int a = winners[2 * n], b = winners[2 * n + 1];
+            bool a_first = Before(a, b);
+            winners[n] = a_first ? a : b;
+            tree_[n] = a_first ? b : a;
+        }
+        tree_[0] = k_ > 1 ? winners[1] : 0;
+    }
+
+    bool Empty() const { return k_ == 0 || exhausted_[tree_[0]]; }
+    int Top() const { return tree_[0]; }
+    uint64_t TopKey() const { return keys_[tree_[0]]; }
+
+    /**
+     * @brief the winner moved to its next key
+     */
+    void Replace(uint64_t key)
+    {
+        keys_[tree_[0]] = key;
+        Adjust(tree_[0]);
+    }
+    /**
+     * @brief the winner has no more keys
+     */
+    void Pop()
+    {
+        exhausted_[tree_[0]] = 1;
+        Adjust(tree_[0]);
+    }
+
+    /**
+     * @brief the run that would win if the current winner was removed, -1 if no other run has keys.
+     * Every other run lost once, and the best of them lost to the winner, so it lies on the path of the winner.
+     * The winner can take keys before the returned run's without replaying the tree.
+     */
+    int RunnerUp() const
+    {
+        int best = -1;
+        for (int n = (tree_[0] + k_) / 2; n > 0; n /= 2)
+        {
+            int run = tree_[n];
+            if (!exhausted_[run] && (best < 0 || Before(run, best)))
+                best = run;
+        }
+        return best;
+    }
+    uint64_t Key(int run) const { return keys_[run]; }
+
+private:
+    const int k_;
+    std::vector<uint64_t> keys_;
+    std::vector<uint8_t> exhausted_;
+    // tree_[0] is the winner, tree_[1..k-1] the losers of the internal nodes
+    std::vector<int> tree_;
+
+    bool Before(int a, int b) const
+    {
+        if (exhausted_[a] | exhausted_[b])
+            return exhausted_[b] && (!exhausted_[a] || a < b);
+        return keys_[a] < keys_[b] || (keys_[a] == keys_[b] && a < b);
+    }
+    void Adjust(int run)
+    {
+        int winner = run;
+        for (int n = (run + k_) / 2; n > 0; n /= 2)
+        {
+            if (Before(tree_[n], winner))
+                std::swap(tree_[n], winner);
+        }
+        tree_[0] = winner;
+    }
+};
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cstdint>
+#include <immintrin.h>
+
+/**
+ * @brief Branch-free search kernels over blocks of 16-byte {big-endian key, 8-byte value} entries,
+ * i.e. PDataBlock, PIndexBlock and PSSDBlock.
+ * Keys are compared as memcmp does, so they are byte-swapped and compared unsigned.
+ * Since the entries are sorted, the lower bound is the number of keys smaller than the target,
+ * which the SIMD kernels count with compare + movemask without any data-dependent branch.
+ * The kernel is chosen once at runtime by CPUID: AVX-512BW, AVX2, or the scalar fallback.
+ *
+ */
+namespace simd_search
+{
+    static constexpr int ENTRY_SIZE = 16;
+
+    enum KernelType
+    {
+        Scalar = 0,
+        AVX2 = 1,
+        AVX512 = 2
+    };
+
+    /**
+     * @brief count keys < target (INCLUSIVE=false) or <= target (INCLUSIVE=true) in the first n entries
+     */
+    template <bool INCLUSIVE>
+    inline int CountScalar(const char *entries, int n, uint64_t be_key)
+    {
+        uint64_t target = __builtin_bswap64(be_key);
+        int count = 0;
+        for (int i = 0; i < n; i++)
+        {
+            uint64_t k = __builtin_bswap64(*(const uint64_t *)(entries + i * ENTRY_SIZE));
+            count += INCLUSIVE ? (k <= target) : (k < target);
+        }
+        return count;
+    }
+
+    template <bool INCLUSIVE>
+    __attribute__((target("avx2"))) inline int CountAVX2(const char *entries, int n, uint64_t be_key)
+    {
+        const __m256i bswap = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                               7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+        // AVX2 only has a signed 64-bit compare, flip the sign bits to compare unsigned
+        const __m256i sign = _mm256_set1_epi64x((int64_t)0x8000000000000000ULL);
+        const __m256i target = _mm256_set1_epi64x((int64_t)(__builtin_bswap64(be_key) ^ 0x8000000000000000ULL));
+        int count = 0;
+        int i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            __m256i a = _mm256_loadu_si256((const __m256i *)(entries + i * ENTRY_SIZE));
+            __m256i b = _mm256_loadu_si256((const __m256i *)(entries + (i + 2) * ENTRY_SIZE));
+            // keys of entry i, i+2, i+1, i+3; the order does not matter for counting
+            __m256i keys = _mm256_xor_si256(_mm256_shuffle_epi8(_mm256_unpacklo_epi64(a, b), bswap), sign);
+            int mask;
+            if (INCLUSIVE)
+                mask = 0xf & ~_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(keys, target)));
+            else
+                mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(target, keys)));
+            count += __builtin_popcount(mask);
+        }
+        return count + CountScalar<INCLUSIVE>(entries + i * ENTRY_SIZE, n - i, be_key);
+    }
+
+    template <bool INCLUSIVE>
+    __attribute__((target("avx512f,avx512bw"))) inline int CountAVX512(const char *entries, int n, uint64_t be_key)
+    {
+        const __m512i bswap = _mm512_set4_epi32(0x08090a0b, 0x0c0d0e0f, 0x00010203, 0x04050607);
+        const __m512i target = _mm512_set1_epi64((int64_t)__builtin_bswap64(be_key));
+        int count = 0;
+        int i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            __m512i a = _mm512_loadu_si512((const void *)(entries + i * ENTRY_SIZE));
+            __m512i b = _mm512_loadu_si512((const void *)(entries + (i + 4) * ENTRY_SIZE));
+            __m512i keys = _mm512_shuffle_epi8(_mm512_unpacklo_epi64(a, b), bswap);
+            __mmask8 mask = INCLUSIVE ? _mm512_cmple_epu64_mask(keys, target) : _mm512_cmplt_epu64_mask(keys, target);
+            count += __builtin_popcount(mask);
+        }
+        return count + CountAVX2<INCLUSIVE>(entries + i * ENTRY_SIZE, n - i, be_key);
+    }
+
+    inline KernelType DetectKernel()
+    {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+            return AVX512;
+        if (__builtin_cpu_supports("avx2"))
+            return AVX2;
+        return Scalar;
+    }
+
+    inline KernelType kernel = DetectKernel();
+
+    template <bool INCLUSIVE>
+    inline int Count(const char *entries, int n, uint64_t be_key)
+    {
+        switch (kernel)
+        {
+        case AVX512:
+            return CountAVX512<INCLUSIVE>(entries, n, be_key);
+        case AVX2:
+            return CountAVX2<INCLUSIVE>(entries, n, be_key);
+        default:
+            return CountScalar<INCLUSIVE>(entries, n, be_key);
+        }
+    }
+
+    /**
+     * @brief index of the first entry whose key >= key, n if none
+     */
+    inline int LowerBound(const char *entries, int n, uint64_t be_key)
+    {
+        return Count<false>(entries, n, be_key);
+    }
+
+    /**
+     * @brief index of the last entry whose key <= key, -1 if none
+     */
+    inline int FloorIndex(const char *entries, int n, uint64_t be_key)
+    {
+        return Count<true>(entries, n, be_key) - 1;
+    }
+} // namespace simd_search